@@ -924,6 +924,10 @@ ngx_init_zone_pool(ngx_cycle_t *cycle, ngx_shm_zone_t *zn)
         return NGX_ERROR;
     }
 
+#if (NGX_HAVE_ATOMIC_OPS)
+    sp->mutex.contended = &sp->contended;
+#endif
+
     ngx_slab_init(sp);
 
     return NGX_OK;
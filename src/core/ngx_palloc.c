@@ -11,6 +11,22 @@
 
 static ngx_inline void *ngx_palloc_small(ngx_pool_t *pool, size_t size,
     ngx_uint_t align);
+static ngx_uint_t ngx_pool_free_slot(size_t size, size_t *csize);
+static void *ngx_pool_block_alloc(size_t size, ngx_log_t *log);
+static void ngx_pool_block_free(void *p, size_t size);
+
+
+typedef struct {
+    size_t                size;
+    void                 *free;
+    ngx_uint_t            nfree;
+} ngx_pool_cache_slot_t;
+
+
+static ngx_pool_cache_slot_t  ngx_pool_cache[NGX_POOL_CACHE_SLOTS];
+
+ngx_pool_reuse_stat_t  ngx_pool_reuse_stat;
+ngx_pool_cache_stat_t  ngx_pool_cache_stat;
 static void *ngx_palloc_block(ngx_pool_t *pool, size_t size);
 static void *ngx_palloc_large(ngx_pool_t *pool, size_t size);
 
@@ -20,7 +36,7 @@ ngx_create_pool(size_t size, ngx_log_t *log)
 {
     ngx_pool_t  *p;
 
-    p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    p = ngx_pool_block_alloc(size, log);
     if (p == NULL) {
         return NULL;
     }
@@ -38,6 +54,8 @@ ngx_create_pool(size_t size, ngx_log_t *log)
     p->large = NULL;
     p->cleanup = NULL;
     p->log = log;
+    p->free = NULL;
+    p->wasted = 0;
 
     return p;
 }
@@ -78,6 +96,14 @@ ngx_destroy_pool(ngx_pool_t *pool)
         }
     }
 
+    if (pool->free || pool->wasted) {
+        ngx_log_debug3(NGX_LOG_DEBUG_ALLOC, pool->log, 0,
+                       "pool reuse: %ui reused, %uz held, %uz wasted",
+                       pool->free ? pool->free->reused : 0,
+                       pool->free ? pool->free->held : 0,
+                       pool->wasted);
+    }
+
 #endif
 
     for (l = pool->large; l; l = l->next) {
@@ -87,7 +113,7 @@ ngx_destroy_pool(ngx_pool_t *pool)
     }
 
     for (p = pool, n = pool->d.next; /* void */; p = n, n = n->d.next) {
-        ngx_free(p);
+        ngx_pool_block_free(p, p->d.end - (u_char *) p);
 
         if (n == NULL) {
             break;
@@ -116,6 +142,8 @@ ngx_reset_pool(ngx_pool_t *pool)
     pool->current = pool;
     pool->chain = NULL;
     pool->large = NULL;
+    pool->free = NULL;
+    pool->wasted = 0;
 }
 
 
@@ -183,7 +211,7 @@ ngx_palloc_block(ngx_pool_t *pool, size_t size)
 
     psize = (size_t) (pool->d.end - (u_char *) pool);
 
-    m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+    m = ngx_pool_block_alloc(psize, pool->log);
     if (m == NULL) {
         return NULL;
     }
@@ -274,6 +302,135 @@ ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
 }
 
 
+/*
+ * ngx_palloc_reuse() rounds a small allocation up to a size class and
+ * takes it from the free list of the class if there is one.  Blocks
+ * allocated this way can be put to the free lists with ngx_pfree_size()
+ * when they are no longer used.  This keeps the memory of long-lived
+ * pools bounded when the same objects are allocated and freed over and
+ * over, without rounding the rest of the allocations of the pool.
+ */
+
+void *
+ngx_palloc_reuse(ngx_pool_t *pool, size_t size)
+{
+#if !(NGX_DEBUG_PALLOC)
+    void        *p;
+    size_t       csize;
+    ngx_uint_t   n;
+
+    if (size <= pool->max) {
+
+        n = ngx_pool_free_slot(size, &csize);
+
+        if (n >= NGX_POOL_FREE_SLOTS || csize > pool->max) {
+            return ngx_palloc_small(pool, size, 1);
+        }
+
+        pool->wasted += csize - size;
+        ngx_pool_reuse_stat.wasted += csize - size;
+
+        if (pool->free == NULL || pool->free->slots[n] == NULL) {
+            return ngx_palloc_small(pool, csize, 1);
+        }
+
+        p = pool->free->slots[n];
+        pool->free->slots[n] = *(void **) p;
+        pool->free->held -= csize;
+        pool->free->reused++;
+        ngx_pool_reuse_stat.reused++;
+
+        return p;
+    }
+#endif
+
+    return ngx_palloc_large(pool, size);
+}
+
+
+/* only the blocks allocated by ngx_palloc_reuse() may be freed here */
+
+ngx_int_t
+ngx_pfree_size(ngx_pool_t *pool, void *p, size_t size)
+{
+#if !(NGX_DEBUG_PALLOC)
+    size_t            csize;
+    ngx_uint_t        n;
+    ngx_pool_free_t  *free;
+
+    if (size <= pool->max) {
+
+        n = ngx_pool_free_slot(size, &csize);
+
+        if (n >= NGX_POOL_FREE_SLOTS || csize > pool->max) {
+            return NGX_DECLINED;
+        }
+
+        free = pool->free;
+
+        if (free == NULL) {
+            free = ngx_palloc_small(pool, sizeof(ngx_pool_free_t), 1);
+            if (free == NULL) {
+                return NGX_DECLINED;
+            }
+
+            ngx_memzero(free, sizeof(ngx_pool_free_t));
+
+            pool->free = free;
+        }
+
+        *(void **) p = free->slots[n];
+        free->slots[n] = p;
+        free->held += csize;
+
+        return NGX_OK;
+    }
+#endif
+
+    return ngx_pfree(pool, p);
+}
+
+
+/* a worker logs the counts of the process and its cache when it exits */
+
+void
+ngx_pool_log_stat(ngx_log_t *log)
+{
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "pool reuse: %ui reused, %uz wasted",
+                  ngx_pool_reuse_stat.reused, ngx_pool_reuse_stat.wasted);
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "pool cache: %ui hits, %ui misses, %ui cached, "
+                  "%ui dropped, %uz bytes",
+                  ngx_pool_cache_stat.hits, ngx_pool_cache_stat.misses,
+                  ngx_pool_cache_stat.cached, ngx_pool_cache_stat.dropped,
+                  ngx_pool_cache_stat.size);
+}
+
+
+static ngx_uint_t
+ngx_pool_free_slot(size_t size, size_t *csize)
+{
+    ngx_uint_t  n;
+
+    if (size <= 128) {
+        n = (size + 15) / 16;
+        n = n ? n : 1;
+
+        *csize = n * 16;
+
+        return n - 1;
+    }
+
+    for (n = 8, *csize = 256; *csize < size; n++) {
+        *csize <<= 1;
+    }
+
+    return n;
+}
+
+
 ngx_int_t
 ngx_pfree(ngx_pool_t *pool, void *p)
 {
@@ -401,30 +558,83 @@ ngx_pool_delete_file(void *data)
 }
 
 
-#if 0
+/*
+ * Pool blocks are taken from and returned to a per-process cache, so
+ * that creating and destroying a request pool does not reach the system
+ * allocator in a steady state.  The cache is not locked, pools are only
+ * created and destroyed in the main thread of a process.
+ */
 
 static void *
-ngx_get_cached_block(size_t size)
+ngx_pool_block_alloc(size_t size, ngx_log_t *log)
 {
-    void                     *p;
-    ngx_cached_block_slot_t  *slot;
+#if !(NGX_DEBUG_PALLOC)
+    void                   *p;
+    ngx_uint_t              i;
+    ngx_pool_cache_slot_t  *slot;
 
-    if (ngx_cycle->cache == NULL) {
-        return NULL;
-    }
+    slot = ngx_pool_cache;
 
-    slot = &ngx_cycle->cache[(size + ngx_pagesize - 1) / ngx_pagesize];
+    for (i = 0; i < NGX_POOL_CACHE_SLOTS; i++) {
+        if (slot[i].size == size && slot[i].free) {
+            p = slot[i].free;
+            slot[i].free = *(void **) p;
+            slot[i].nfree--;
 
-    slot->tries++;
+            ngx_pool_cache_stat.size -= size;
+            ngx_pool_cache_stat.hits++;
 
-    if (slot->number) {
-        p = slot->block;
-        slot->block = slot->block->next;
-        slot->number--;
-        return p;
+            return p;
+        }
     }
 
-    return NULL;
+    ngx_pool_cache_stat.misses++;
+#endif
+
+    return ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
 }
 
+
+static void
+ngx_pool_block_free(void *p, size_t size)
+{
+#if !(NGX_DEBUG_PALLOC)
+    ngx_uint_t              i;
+    ngx_pool_cache_slot_t  *slot, *empty;
+
+    if (ngx_pool_cache_stat.size + size <= NGX_POOL_CACHE_SIZE) {
+
+        slot = ngx_pool_cache;
+        empty = NULL;
+
+        for (i = 0; i < NGX_POOL_CACHE_SLOTS; i++) {
+            if (slot[i].size == size) {
+                break;
+            }
+
+            if (empty == NULL && slot[i].nfree == 0) {
+                empty = &slot[i];
+            }
+        }
+
+        if (i < NGX_POOL_CACHE_SLOTS || empty) {
+            slot = (i < NGX_POOL_CACHE_SLOTS) ? &slot[i] : empty;
+
+            slot->size = size;
+
+            *(void **) p = slot->free;
+            slot->free = p;
+            slot->nfree++;
+
+            ngx_pool_cache_stat.size += size;
+            ngx_pool_cache_stat.cached++;
+
+            return;
+        }
+    }
+
+    ngx_pool_cache_stat.dropped++;
 #endif
+
+    ngx_free(p);
+}
@@ -54,6 +54,30 @@ typedef struct {
 } ngx_pool_data_t;
 
 
+/*
+ * The size classes of the free lists: 16 to 128 bytes in steps of 16,
+ * and then powers of two up to 4096 bytes.  Larger blocks, which are
+ * small allocations with pages bigger than 4K, are not reused.
+ */
+
+#define NGX_POOL_FREE_SLOTS      13
+
+
+typedef struct {
+    void                 *slots[NGX_POOL_FREE_SLOTS];
+    size_t                held;
+    ngx_uint_t            reused;
+} ngx_pool_free_t;
+
+
+/* the reuse counts of all the pools of the process */
+
+typedef struct {
+    ngx_uint_t            reused;
+    size_t                wasted;       /* bytes lost to rounding */
+} ngx_pool_reuse_stat_t;
+
+
 struct ngx_pool_s {
     ngx_pool_data_t       d;
     size_t                max;
@@ -62,6 +86,8 @@ struct ngx_pool_s {
     ngx_pool_large_t     *large;
     ngx_pool_cleanup_t   *cleanup;
     ngx_log_t            *log;
+    ngx_pool_free_t      *free;
+    size_t                wasted;
 };
 
 
@@ -72,6 +98,29 @@ typedef struct {
 } ngx_pool_cleanup_file_t;
 
 
+/*
+ * Freed pool blocks are kept per process for pools created later,
+ * up to NGX_POOL_CACHE_SIZE bytes in blocks of NGX_POOL_CACHE_SLOTS
+ * different sizes.
+ */
+
+#define NGX_POOL_CACHE_SLOTS     4
+#define NGX_POOL_CACHE_SIZE      (1024 * 1024)
+
+
+typedef struct {
+    ngx_uint_t            hits;
+    ngx_uint_t            misses;
+    ngx_uint_t            cached;       /* blocks kept on free */
+    ngx_uint_t            dropped;      /* blocks freed, the cache is full */
+    size_t                size;         /* bytes in the cache */
+} ngx_pool_cache_stat_t;
+
+
+extern ngx_pool_reuse_stat_t  ngx_pool_reuse_stat;
+extern ngx_pool_cache_stat_t  ngx_pool_cache_stat;
+
+
 ngx_pool_t *ngx_create_pool(size_t size, ngx_log_t *log);
 void ngx_destroy_pool(ngx_pool_t *pool);
 void ngx_reset_pool(ngx_pool_t *pool);
@@ -81,6 +130,9 @@ void *ngx_pnalloc(ngx_pool_t *pool, size_t size);
 void *ngx_pcalloc(ngx_pool_t *pool, size_t size);
 void *ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment);
 ngx_int_t ngx_pfree(ngx_pool_t *pool, void *p);
+void *ngx_palloc_reuse(ngx_pool_t *pool, size_t size);
+ngx_int_t ngx_pfree_size(ngx_pool_t *pool, void *p, size_t size);
+void ngx_pool_log_stat(ngx_log_t *log);
 
 
 ngx_pool_cleanup_t *ngx_pool_cleanup_add(ngx_pool_t *p, size_t size);
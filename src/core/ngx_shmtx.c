@@ -73,6 +73,14 @@ ngx_shmtx_lock(ngx_shmtx_t *mtx)
 
     ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0, "shmtx lock");
 
+    if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
+        return;
+    }
+
+    if (mtx->contended) {
+        (void) ngx_atomic_fetch_add(mtx->contended, 1);
+    }
+
     for ( ;; ) {
 
         if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
@@ -69,6 +69,8 @@
 
 #endif
 
+static void *ngx_slab_alloc_chunk(ngx_slab_pool_t *pool, size_t size);
+static void ngx_slab_free_chunk(ngx_slab_pool_t *pool, void *p);
 static ngx_slab_page_t *ngx_slab_alloc_pages(ngx_slab_pool_t *pool,
     ngx_uint_t pages);
 static void ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
@@ -77,6 +79,56 @@ static void ngx_slab_error(ngx_slab_pool_t *pool, ngx_uint_t level,
     char *text);
 
 
+/*
+ * A worker process keeps magazines of free chunks of each size for each
+ * zone it allocates from, so that ngx_slab_alloc() and ngx_slab_free()
+ * take the zone mutex once per NGX_SLAB_MAGAZINE_BATCH chunks.  The
+ * *_locked variants, called with the mutex held, use the magazines too,
+ * which shortens the critical sections of the modules calling them.
+ * Chunks in magazines are accounted as used by the zone.  The magazines
+ * are returned to their zones when the worker exits, so a worker which
+ * crashes leaks them until the zone is recreated.
+ *
+ * To keep this small, the magazines of a worker hold no more than 1/256
+ * of a zone, and zones where this is less than a page have none.
+ */
+
+#if !(NGX_DEBUG_MALLOC)
+
+#define NGX_SLAB_MAGAZINE_SIZE   16
+#define NGX_SLAB_MAGAZINE_BATCH  8
+#define NGX_SLAB_MAGAZINE_SHARE  8
+
+
+typedef struct {
+    ngx_uint_t             n;
+    void                  *chunks[NGX_SLAB_MAGAZINE_SIZE];
+} ngx_slab_magazine_t;
+
+
+typedef struct ngx_slab_magazines_s  ngx_slab_magazines_t;
+
+struct ngx_slab_magazines_s {
+    ngx_slab_pool_t       *pool;
+    ngx_slab_magazines_t  *next;
+    size_t                 held;
+    size_t                 max;
+    ngx_slab_magazine_t    slots[1];
+};
+
+
+static ngx_slab_magazines_t *ngx_slab_magazines_get(ngx_slab_pool_t *pool);
+static ngx_int_t ngx_slab_magazine_alloc(ngx_slab_pool_t *pool, size_t size,
+    ngx_uint_t locked, void **chunk);
+static ngx_int_t ngx_slab_magazine_free(ngx_slab_pool_t *pool, void *p,
+    ngx_uint_t locked);
+
+
+static ngx_slab_magazines_t  *ngx_slab_magazines;
+
+#endif
+
+
 static ngx_uint_t  ngx_slab_max_size;
 static ngx_uint_t  ngx_slab_exact_size;
 static ngx_uint_t  ngx_slab_exact_shift;
@@ -170,9 +222,15 @@ ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size)
 {
     void  *p;
 
+#if !(NGX_DEBUG_MALLOC)
+    if (ngx_slab_magazine_alloc(pool, size, 0, &p) == NGX_OK) {
+        return p;
+    }
+#endif
+
     ngx_shmtx_lock(&pool->mutex);
 
-    p = ngx_slab_alloc_locked(pool, size);
+    p = ngx_slab_alloc_chunk(pool, size);
 
     ngx_shmtx_unlock(&pool->mutex);
 
@@ -182,6 +240,23 @@ ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size)
 
 void *
 ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
+{
+#if !(NGX_DEBUG_MALLOC)
+    void  *p;
+
+    if (ngx_slab_magazine_alloc(pool, size, 1, &p) == NGX_OK) {
+        return p;
+    }
+#endif
+
+    return ngx_slab_alloc_chunk(pool, size);
+}
+
+
+/* allocates from the slab pages, with the mutex held */
+
+static void *
+ngx_slab_alloc_chunk(ngx_slab_pool_t *pool, size_t size)
 {
     size_t            s;
     uintptr_t         p, m, mask, *bitmap;
@@ -422,11 +497,10 @@ ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size)
 {
     void  *p;
 
-    ngx_shmtx_lock(&pool->mutex);
-
-    p = ngx_slab_calloc_locked(pool, size);
-
-    ngx_shmtx_unlock(&pool->mutex);
+    p = ngx_slab_alloc(pool, size);
+    if (p) {
+        ngx_memzero(p, size);
+    }
 
     return p;
 }
@@ -449,9 +523,15 @@ ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size)
 void
 ngx_slab_free(ngx_slab_pool_t *pool, void *p)
 {
+#if !(NGX_DEBUG_MALLOC)
+    if (ngx_slab_magazine_free(pool, p, 0) == NGX_OK) {
+        return;
+    }
+#endif
+
     ngx_shmtx_lock(&pool->mutex);
 
-    ngx_slab_free_locked(pool, p);
+    ngx_slab_free_chunk(pool, p);
 
     ngx_shmtx_unlock(&pool->mutex);
 }
@@ -459,6 +539,21 @@ ngx_slab_free(ngx_slab_pool_t *pool, void *p)
 
 void
 ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
+{
+#if !(NGX_DEBUG_MALLOC)
+    if (ngx_slab_magazine_free(pool, p, 1) == NGX_OK) {
+        return;
+    }
+#endif
+
+    ngx_slab_free_chunk(pool, p);
+}
+
+
+/* returns the chunk to the slab pages, with the mutex held */
+
+static void
+ngx_slab_free_chunk(ngx_slab_pool_t *pool, void *p)
 {
     size_t            size;
     uintptr_t         slab, m, *bitmap;
@@ -675,6 +770,279 @@ fail:
 }
 
 
+#if !(NGX_DEBUG_MALLOC)
+
+static ngx_slab_magazines_t *
+ngx_slab_magazines_get(ngx_slab_pool_t *pool)
+{
+    size_t                 size, max;
+    ngx_uint_t             n;
+    ngx_slab_magazines_t  *mags;
+
+    /* zones are never remapped in a worker, so chunks stay valid */
+
+    if (ngx_process != NGX_PROCESS_WORKER) {
+        return NULL;
+    }
+
+    max = (size_t) (pool->end - pool->start) >> NGX_SLAB_MAGAZINE_SHARE;
+
+    if (max < ngx_pagesize) {
+        return NULL;
+    }
+
+    for (mags = ngx_slab_magazines; mags; mags = mags->next) {
+        if (mags->pool == pool) {
+            return mags;
+        }
+    }
+
+    n = ngx_pagesize_shift - pool->min_shift;
+
+    size = offsetof(ngx_slab_magazines_t, slots)
+           + n * sizeof(ngx_slab_magazine_t);
+
+    mags = ngx_alloc(size, ngx_cycle->log);
+    if (mags == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(mags, size);
+
+    mags->pool = pool;
+    mags->max = max;
+    mags->next = ngx_slab_magazines;
+    ngx_slab_magazines = mags;
+
+    return mags;
+}
+
+
+static ngx_int_t
+ngx_slab_magazine_alloc(ngx_slab_pool_t *pool, size_t size, ngx_uint_t locked,
+    void **chunk)
+{
+    void                  *p;
+    size_t                 s;
+    ngx_uint_t             shift, log_nomem;
+    ngx_slab_magazine_t   *mag;
+    ngx_slab_magazines_t  *mags;
+
+    if (size > ngx_slab_max_size) {
+        return NGX_DECLINED;
+    }
+
+    mags = ngx_slab_magazines_get(pool);
+    if (mags == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if (size > pool->min_size) {
+        shift = 1;
+        for (s = size - 1; s >>= 1; shift++) { /* void */ }
+
+    } else {
+        shift = pool->min_shift;
+    }
+
+    mag = &mags->slots[shift - pool->min_shift];
+    size = (size_t) 1 << shift;
+
+    if (mag->n == 0) {
+
+        if (!locked) {
+            ngx_shmtx_lock(&pool->mutex);
+        }
+
+        log_nomem = pool->log_nomem;
+
+        while (mag->n < NGX_SLAB_MAGAZINE_BATCH) {
+
+            /* the first chunk is returned right away */
+
+            if (mag->n && mags->held + mag->n * size > mags->max) {
+                break;
+            }
+
+            p = ngx_slab_alloc_chunk(pool, size);
+            if (p == NULL) {
+                break;
+            }
+
+            mag->chunks[mag->n++] = p;
+
+            /* a partial batch is not an error */
+            pool->log_nomem = 0;
+        }
+
+        pool->log_nomem = log_nomem;
+
+        if (!locked) {
+            ngx_shmtx_unlock(&pool->mutex);
+        }
+
+        if (mag->n == 0) {
+            *chunk = NULL;
+            return NGX_OK;
+        }
+
+        mags->held += mag->n * size;
+    }
+
+    mags->held -= size;
+
+    *chunk = mag->chunks[--mag->n];
+
+    return NGX_OK;
+}
+
+
+/*
+ * A chunk is cached only if it is allocated; the errors are reported
+ * by ngx_slab_free_chunk().
+ */
+
+static ngx_int_t
+ngx_slab_magazine_free(ngx_slab_pool_t *pool, void *p, ngx_uint_t locked)
+{
+    size_t                 size;
+    uintptr_t              m, busy, *bitmap;
+    ngx_uint_t             n, shift;
+    ngx_slab_page_t       *page;
+    ngx_slab_magazine_t   *mag;
+    ngx_slab_magazines_t  *mags;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        || (u_char *) p < pool->start
+        || (u_char *) p >= pool->end)
+    {
+        return NGX_DECLINED;
+    }
+
+    /* the chunk size does not change while the chunk is allocated */
+
+    n = ((u_char *) p - pool->start) >> ngx_pagesize_shift;
+    page = &pool->pages[n];
+
+    switch (ngx_slab_page_type(page)) {
+
+    case NGX_SLAB_SMALL:
+        shift = page->slab & NGX_SLAB_SHIFT_MASK;
+
+        n = ((uintptr_t) p & (ngx_pagesize - 1)) >> shift;
+        m = (uintptr_t) 1 << (n % (8 * sizeof(uintptr_t)));
+        n /= 8 * sizeof(uintptr_t);
+        bitmap = (uintptr_t *)
+                             ((uintptr_t) p & ~((uintptr_t) ngx_pagesize - 1));
+
+        busy = bitmap[n] & m;
+        break;
+
+    case NGX_SLAB_EXACT:
+        shift = ngx_slab_exact_shift;
+
+        m = (uintptr_t) 1 << (((uintptr_t) p & (ngx_pagesize - 1)) >> shift);
+
+        busy = page->slab & m;
+        break;
+
+    case NGX_SLAB_BIG:
+        shift = page->slab & NGX_SLAB_SHIFT_MASK;
+
+        m = (uintptr_t) 1 << ((((uintptr_t) p & (ngx_pagesize - 1)) >> shift)
+                              + NGX_SLAB_MAP_SHIFT);
+
+        busy = page->slab & m;
+        break;
+
+    default: /* NGX_SLAB_PAGE */
+        return NGX_DECLINED;
+    }
+
+    if (((uintptr_t) p & (((uintptr_t) 1 << shift) - 1)) || !busy) {
+        return NGX_DECLINED;
+    }
+
+    mags = ngx_slab_magazines_get(pool);
+    if (mags == NULL) {
+        return NGX_DECLINED;
+    }
+
+    mag = &mags->slots[shift - pool->min_shift];
+    size = (size_t) 1 << shift;
+
+    /* a chunk freed to the magazine is still allocated in the pages */
+
+    for (n = 0; n < mag->n; n++) {
+        if (mag->chunks[n] == p) {
+            ngx_slab_error(pool, NGX_LOG_ALERT,
+                           "ngx_slab_free(): chunk is already free");
+            return NGX_OK;
+        }
+    }
+
+    if (mag->n == NGX_SLAB_MAGAZINE_SIZE) {
+
+        if (!locked) {
+            ngx_shmtx_lock(&pool->mutex);
+        }
+
+        while (mag->n > NGX_SLAB_MAGAZINE_SIZE - NGX_SLAB_MAGAZINE_BATCH) {
+            ngx_slab_free_chunk(pool, mag->chunks[--mag->n]);
+            mags->held -= size;
+        }
+
+        if (!locked) {
+            ngx_shmtx_unlock(&pool->mutex);
+        }
+    }
+
+    if (mags->held + size > mags->max) {
+        return NGX_DECLINED;
+    }
+
+    mag->chunks[mag->n++] = p;
+    mags->held += size;
+
+    return NGX_OK;
+}
+
+#endif
+
+
+void
+ngx_slab_flush_magazines(void)
+{
+#if !(NGX_DEBUG_MALLOC)
+    ngx_uint_t             i, n;
+    ngx_slab_pool_t       *pool;
+    ngx_slab_magazines_t  *mags, *next;
+
+    for (mags = ngx_slab_magazines; mags; mags = next) {
+        next = mags->next;
+        pool = mags->pool;
+
+        n = ngx_pagesize_shift - pool->min_shift;
+
+        ngx_shmtx_lock(&pool->mutex);
+
+        for (i = 0; i < n; i++) {
+            while (mags->slots[i].n) {
+                ngx_slab_free_chunk(pool,
+                                    mags->slots[i].chunks[--mags->slots[i].n]);
+            }
+        }
+
+        ngx_shmtx_unlock(&pool->mutex);
+
+        ngx_free(mags);
+    }
+
+    ngx_slab_magazines = NULL;
+#endif
+}
+
+
 static ngx_slab_page_t *
 ngx_slab_alloc_pages(ngx_slab_pool_t *pool, ngx_uint_t pages)
 {
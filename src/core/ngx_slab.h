@@ -56,6 +56,8 @@ typedef struct {
 
     void             *data;
     void             *addr;
+
+    ngx_atomic_t      contended;    /* locks that had to wait */
 } ngx_slab_pool_t;
 
 
@@ -67,6 +69,7 @@ void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size);
 void *ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size);
 void ngx_slab_free(ngx_slab_pool_t *pool, void *p);
 void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p);
+void ngx_slab_flush_magazines(void);
 
 
 #endif /* _NGX_SLAB_H_INCLUDED_ */
@@ -59,6 +59,9 @@ struct ngx_event_s {
     unsigned         timedout:1;
     unsigned         timer_set:1;
 
+    /* the timer is kept in the timing wheel rather than in the rbtree */
+    unsigned         timer_wheel:1;
+
     unsigned         delayed:1;
 
     unsigned         deferred_accept:1;
@@ -120,6 +123,9 @@ struct ngx_event_s {
 
     ngx_rbtree_node_t   timer;
 
+    /* may be later than timer.key if the timer was postponed */
+    ngx_msec_t       deadline;
+
     /* the posted queue */
     ngx_queue_t      queue;
 
@@ -446,6 +452,9 @@ typedef struct {
 
     ngx_msec_t    accept_mutex_delay;
 
+    ngx_flag_t    timer_wheel;
+    ngx_flag_t    lazy_timers;
+
     u_char       *name;
 
 #if (NGX_DEBUG)
@@ -10,9 +10,48 @@
 #include <ngx_event.h>
 
 
+/*
+ * A timer in the wheel is linked into the list of its slot through the
+ * left (previous) and right (next) pointers of its rbtree node, and the
+ * parent pointer refers to the list head.  A level 0 slot keeps timers
+ * of a single tick, a slot of an upper level keeps the timers of as many
+ * ticks as the whole level below and is cascaded down when the lower
+ * levels wrap around.
+ */
+
+typedef struct {
+    ngx_msec_t                current;  /* the start of the last tick run */
+    ngx_uint_t                count[NGX_TIMER_WHEEL_LEVELS];
+    ngx_rbtree_node_t         slots[NGX_TIMER_WHEEL_LEVELS]
+                                   [NGX_TIMER_WHEEL_SLOTS];
+} ngx_event_timer_wheel_t;
+
+
+#define NGX_TIMER_WHEEL_TICK   ((ngx_msec_t) 1 << NGX_TIMER_WHEEL_SHIFT)
+#define NGX_TIMER_WHEEL_MASK   (NGX_TIMER_WHEEL_SLOTS - 1)
+
+#define ngx_event_timer_wheel_level(node)                                     \
+    (((node)->parent - &ngx_timer_wheel.slots[0][0])              \
+     >> NGX_TIMER_WHEEL_BITS)
+
+
+static ngx_msec_t ngx_event_timer_wheel_find(void);
+static void ngx_event_timer_wheel_run(void);
+static void ngx_event_timer_wheel_cascade(ngx_uint_t level, ngx_msec_t tick);
+static ngx_int_t ngx_event_timer_postponed(ngx_event_t *ev);
+static void ngx_event_timer_wheel_link(ngx_uint_t level,
+    ngx_rbtree_node_t *head, ngx_rbtree_node_t *node);
+static void ngx_event_timer_wheel_take(ngx_rbtree_node_t *head,
+    ngx_rbtree_node_t *list);
+
+
 ngx_rbtree_t              ngx_event_timer_rbtree;
 static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 
+ngx_uint_t                       ngx_event_timer_wheel;
+ngx_uint_t                       ngx_event_timer_lazy;
+static ngx_event_timer_wheel_t   ngx_timer_wheel;
+
 /*
  * the event timer rbtree may contain the duplicate keys, however,
  * it should not be a problem, because we use the rbtree to find
@@ -22,9 +61,27 @@ static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 ngx_int_t
 ngx_event_timer_init(ngx_log_t *log)
 {
+    ngx_uint_t               i, n;
+    ngx_rbtree_node_t       *head;
+    ngx_event_timer_wheel_t  *tw;
+
     ngx_rbtree_init(&ngx_event_timer_rbtree, &ngx_event_timer_sentinel,
                     ngx_rbtree_insert_timer_value);
 
+    tw = &ngx_timer_wheel;
+
+    tw->current = ngx_current_msec & ~(NGX_TIMER_WHEEL_TICK - 1);
+
+    for (i = 0; i < NGX_TIMER_WHEEL_LEVELS; i++) {
+        tw->count[i] = 0;
+
+        for (n = 0; n < NGX_TIMER_WHEEL_SLOTS; n++) {
+            head = &tw->slots[i][n];
+            head->left = head;
+            head->right = head;
+        }
+    }
+
     return NGX_OK;
 }
 
@@ -32,11 +89,14 @@ ngx_event_timer_init(ngx_log_t *log)
 ngx_msec_t
 ngx_event_find_timer(void)
 {
+    ngx_msec_t          wheel;
     ngx_msec_int_t      timer;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    wheel = ngx_event_timer_wheel_find();
+
     if (ngx_event_timer_rbtree.root == &ngx_event_timer_sentinel) {
-        return NGX_TIMER_INFINITE;
+        return wheel;
     }
 
     root = ngx_event_timer_rbtree.root;
@@ -46,7 +106,11 @@ ngx_event_find_timer(void)
 
     timer = (ngx_msec_int_t) (node->key - ngx_current_msec);
 
-    return (ngx_msec_t) (timer > 0 ? timer : 0);
+    if (timer <= 0) {
+        return 0;
+    }
+
+    return ngx_min((ngx_msec_t) timer, wheel);
 }
 
 
@@ -56,6 +120,8 @@ ngx_event_expire_timers(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    ngx_event_timer_wheel_run();
+
     sentinel = ngx_event_timer_rbtree.sentinel;
 
     for ( ;; ) {
@@ -89,6 +155,10 @@ ngx_event_expire_timers(void)
 
         ev->timer_set = 0;
 
+        if (ngx_event_timer_postponed(ev)) {
+            continue;
+        }
+
         ev->timedout = 1;
 
         ev->handler(ev);
@@ -99,8 +169,29 @@ ngx_event_expire_timers(void)
 ngx_int_t
 ngx_event_no_timers_left(void)
 {
+    ngx_uint_t          i, n;
     ngx_event_t        *ev;
-    ngx_rbtree_node_t  *node, *root, *sentinel;
+    ngx_rbtree_node_t  *node, *root, *sentinel, *head;
+
+    for (i = 0; i < NGX_TIMER_WHEEL_LEVELS; i++) {
+
+        if (ngx_timer_wheel.count[i] == 0) {
+            continue;
+        }
+
+        for (n = 0; n < NGX_TIMER_WHEEL_SLOTS; n++) {
+            head = &ngx_timer_wheel.slots[i][n];
+
+            for (node = head->right; node != head; node = node->right) {
+                ev = (ngx_event_t *)
+                         ((char *) node - offsetof(ngx_event_t, timer));
+
+                if (!ev->cancelable) {
+                    return NGX_AGAIN;
+                }
+            }
+        }
+    }
 
     sentinel = ngx_event_timer_rbtree.sentinel;
     root = ngx_event_timer_rbtree.root;
@@ -124,3 +215,287 @@ ngx_event_no_timers_left(void)
 
     return NGX_OK;
 }
+
+
+/* rearms the expired timer if its deadline was postponed meanwhile */
+
+static ngx_int_t
+ngx_event_timer_postponed(ngx_event_t *ev)
+{
+    ngx_msec_int_t  timer;
+
+    timer = (ngx_msec_int_t) (ev->deadline - ngx_current_msec);
+
+    if (timer <= 0) {
+        return 0;
+    }
+
+    ngx_event_add_timer(ev, (ngx_msec_t) timer);
+
+    return 1;
+}
+
+
+/*
+ * Links the timer into the wheel in O(1), or returns NGX_DECLINED if it
+ * expires beyond the last level.
+ */
+
+ngx_int_t
+ngx_event_timer_wheel_add(ngx_event_t *ev)
+{
+    ngx_msec_t                ticks, tick;
+    ngx_uint_t                level;
+    ngx_msec_int_t            diff;
+    ngx_rbtree_node_t        *node, *head;
+    ngx_event_timer_wheel_t  *tw;
+
+    tw = &ngx_timer_wheel;
+    node = &ev->timer;
+
+    /* rounded up, so the timer never expires early */
+
+    diff = (ngx_msec_int_t) (node->key - tw->current);
+
+    if (diff <= 0) {
+        ticks = 1;
+
+    } else {
+        ticks = ((ngx_msec_t) diff + NGX_TIMER_WHEEL_TICK - 1)
+                >> NGX_TIMER_WHEEL_SHIFT;
+    }
+
+    for (level = 0; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+        if (ticks < (ngx_msec_t) 1 << (NGX_TIMER_WHEEL_BITS * (level + 1))) {
+            break;
+        }
+    }
+
+    if (level == NGX_TIMER_WHEEL_LEVELS) {
+        return NGX_DECLINED;
+    }
+
+    tick = (tw->current >> NGX_TIMER_WHEEL_SHIFT) + ticks;
+
+    head = &tw->slots[level][(tick >> (NGX_TIMER_WHEEL_BITS * level))
+                             & NGX_TIMER_WHEEL_MASK];
+
+    ngx_event_timer_wheel_link(level, head, node);
+
+    return NGX_OK;
+}
+
+
+void
+ngx_event_timer_wheel_del(ngx_event_t *ev)
+{
+    ngx_rbtree_node_t  *node;
+
+    node = &ev->timer;
+
+    node->left->right = node->right;
+    node->right->left = node->left;
+
+    ngx_timer_wheel.count[ngx_event_timer_wheel_level(node)]--;
+
+    ev->timer_wheel = 0;
+}
+
+
+/*
+ * Returns the time until the first non-empty level 0 slot or the first
+ * cascade of a non-empty upper slot, whichever is earlier.
+ */
+
+static ngx_msec_t
+ngx_event_timer_wheel_find(void)
+{
+    ngx_msec_t                tick, base, min, next, expire;
+    ngx_uint_t                level, n, shift;
+    ngx_msec_int_t            timer;
+    ngx_rbtree_node_t        *head;
+    ngx_event_timer_wheel_t  *tw;
+
+    tw = &ngx_timer_wheel;
+    tick = tw->current >> NGX_TIMER_WHEEL_SHIFT;
+    min = NGX_TIMER_INFINITE;
+
+    for (level = 0; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+
+        if (tw->count[level] == 0) {
+            continue;
+        }
+
+        shift = NGX_TIMER_WHEEL_BITS * level;
+        base = tick >> shift;
+
+        /* the earliest time a slot of the level may be due */
+
+        if (((base + 1) << shift) - tick >= min) {
+            break;
+        }
+
+        for (n = 1; n <= NGX_TIMER_WHEEL_SLOTS; n++) {
+            head = &tw->slots[level][(base + n) & NGX_TIMER_WHEEL_MASK];
+
+            if (head->right != head) {
+                break;
+            }
+        }
+
+        next = ((base + n) << shift) - tick;
+
+        if (next < min) {
+            min = next;
+        }
+    }
+
+    if (min == NGX_TIMER_INFINITE) {
+        return NGX_TIMER_INFINITE;
+    }
+
+    expire = tw->current + (min << NGX_TIMER_WHEEL_SHIFT);
+    timer = (ngx_msec_int_t) (expire - ngx_current_msec);
+
+    return (ngx_msec_t) (timer > 0 ? timer : 0);
+}
+
+
+static void
+ngx_event_timer_wheel_run(void)
+{
+    ngx_msec_t                now, tick;
+    ngx_uint_t                level;
+    ngx_event_t              *ev;
+    ngx_rbtree_node_t        *node, list;
+    ngx_event_timer_wheel_t  *tw;
+
+    tw = &ngx_timer_wheel;
+    now = ngx_current_msec & ~(NGX_TIMER_WHEEL_TICK - 1);
+
+    while ((ngx_msec_int_t) (now - tw->current) > 0) {
+
+        if (tw->count[0] + tw->count[1] + tw->count[2] + tw->count[3] == 0) {
+            tw->current = now;
+            return;
+        }
+
+        tw->current += NGX_TIMER_WHEEL_TICK;
+        tick = tw->current >> NGX_TIMER_WHEEL_SHIFT;
+
+        for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+
+            if (tick & (((ngx_msec_t) 1 << (NGX_TIMER_WHEEL_BITS * level)) - 1))
+            {
+                break;
+            }
+
+            ngx_event_timer_wheel_cascade(level, tick);
+        }
+
+        ngx_event_timer_wheel_take(&tw->slots[0][tick & NGX_TIMER_WHEEL_MASK],
+                                   &list);
+
+        /* the handlers may delete the timers left in the list */
+
+        while (list.right != &list) {
+            node = list.right;
+
+            ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "event timer del: %d: %M",
+                           ngx_event_ident(ev->data), ev->timer.key);
+
+            ngx_event_timer_wheel_del(ev);
+
+#if (NGX_DEBUG)
+            ev->timer.left = NULL;
+            ev->timer.right = NULL;
+            ev->timer.parent = NULL;
+#endif
+
+            ev->timer_set = 0;
+
+            if (ngx_event_timer_postponed(ev)) {
+                continue;
+            }
+
+            ev->timedout = 1;
+
+            ev->handler(ev);
+        }
+    }
+}
+
+
+static void
+ngx_event_timer_wheel_cascade(ngx_uint_t level, ngx_msec_t tick)
+{
+    ngx_uint_t                n;
+    ngx_event_t              *ev;
+    ngx_rbtree_node_t        *node, *due, list;
+    ngx_event_timer_wheel_t  *tw;
+
+    tw = &ngx_timer_wheel;
+    due = &tw->slots[0][tick & NGX_TIMER_WHEEL_MASK];
+    n = (tick >> (NGX_TIMER_WHEEL_BITS * level)) & NGX_TIMER_WHEEL_MASK;
+
+    ngx_event_timer_wheel_take(&tw->slots[level][n], &list);
+
+    while (list.right != &list) {
+        node = list.right;
+
+        ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+        ngx_event_timer_wheel_del(ev);
+
+        /* due in the tick being run, its slot is taken next */
+
+        if ((ngx_msec_int_t) (node->key - tw->current) <= 0) {
+            ngx_event_timer_wheel_link(0, due, node);
+            ev->timer_wheel = 1;
+
+        } else if (ngx_event_timer_wheel_add(ev) == NGX_OK) {
+            ev->timer_wheel = 1;
+
+        } else {
+            ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+        }
+    }
+}
+
+
+static void
+ngx_event_timer_wheel_link(ngx_uint_t level, ngx_rbtree_node_t *head,
+    ngx_rbtree_node_t *node)
+{
+    node->parent = head;
+    node->right = head;
+    node->left = head->left;
+    head->left->right = node;
+    head->left = node;
+
+    ngx_timer_wheel.count[level]++;
+}
+
+
+/* moves the timers of the slot to the list, they keep counting as its */
+
+static void
+ngx_event_timer_wheel_take(ngx_rbtree_node_t *head, ngx_rbtree_node_t *list)
+{
+    if (head->right == head) {
+        list->left = list;
+        list->right = list;
+        return;
+    }
+
+    list->left = head->left;
+    list->right = head->right;
+    list->left->right = list;
+    list->right->left = list;
+
+    head->left = head;
+    head->right = head;
+}
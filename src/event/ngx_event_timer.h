@@ -18,14 +18,32 @@
 
 #define NGX_TIMER_LAZY_DELAY  300
 
+/*
+ * The timing wheel keeps timers of at least NGX_TIMER_WHEEL_MIN
+ * milliseconds, they expire up to a tick of 1 << NGX_TIMER_WHEEL_SHIFT
+ * milliseconds late.  Each of the levels spans NGX_TIMER_WHEEL_SLOTS
+ * times the previous one, so with 16ms ticks the wheel covers 74 hours.
+ */
+
+#define NGX_TIMER_WHEEL_MIN     1000
+#define NGX_TIMER_WHEEL_SHIFT   4
+#define NGX_TIMER_WHEEL_BITS    6
+#define NGX_TIMER_WHEEL_SLOTS   (1 << NGX_TIMER_WHEEL_BITS)
+#define NGX_TIMER_WHEEL_LEVELS  4
+
 
 ngx_int_t ngx_event_timer_init(ngx_log_t *log);
 ngx_msec_t ngx_event_find_timer(void);
 void ngx_event_expire_timers(void);
 ngx_int_t ngx_event_no_timers_left(void);
 
+ngx_int_t ngx_event_timer_wheel_add(ngx_event_t *ev);
+void ngx_event_timer_wheel_del(ngx_event_t *ev);
+
 
 extern ngx_rbtree_t  ngx_event_timer_rbtree;
+extern ngx_uint_t    ngx_event_timer_wheel;
+extern ngx_uint_t    ngx_event_timer_lazy;
 
 
 static ngx_inline void
@@ -35,7 +53,12 @@ ngx_event_del_timer(ngx_event_t *ev)
                    "event timer del: %d: %M",
                     ngx_event_ident(ev->data), ev->timer.key);
 
-    ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
+    if (ev->timer_wheel) {
+        ngx_event_timer_wheel_del(ev);
+
+    } else {
+        ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
+    }
 
 #if (NGX_DEBUG)
     ev->timer.left = NULL;
@@ -63,12 +86,26 @@ ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer)
          * to minimize the rbtree operations for fast connections.
          */
 
-        diff = (ngx_msec_int_t) (key - ev->timer.key);
+        diff = (ngx_msec_int_t) (key - ev->deadline);
 
         if (ngx_abs(diff) < NGX_TIMER_LAZY_DELAY) {
             ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                            "event timer: %d, old: %M, new: %M",
-                            ngx_event_ident(ev->data), ev->timer.key, key);
+                            ngx_event_ident(ev->data), ev->deadline, key);
+            return;
+        }
+
+        /*
+         * With lazy timers a later deadline is only recorded, the timer
+         * is rearmed to it when the current one expires.
+         */
+
+        if (ngx_event_timer_lazy && diff > 0) {
+            ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "event timer postponed: %d, old: %M, new: %M",
+                            ngx_event_ident(ev->data), ev->deadline, key);
+
+            ev->deadline = key;
             return;
         }
 
@@ -76,12 +113,22 @@ ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer)
     }
 
     ev->timer.key = key;
+    ev->deadline = key;
 
     ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                    "event timer add: %d: %M:%M",
                     ngx_event_ident(ev->data), timer, ev->timer.key);
 
-    ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+    if (ngx_event_timer_wheel
+        && timer >= NGX_TIMER_WHEEL_MIN
+        && ngx_event_timer_wheel_add(ev) == NGX_OK)
+    {
+        ev->timer_wheel = 1;
+
+    } else {
+        ev->timer_wheel = 0;
+        ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+    }
 
     ev->timer_set = 1;
 }
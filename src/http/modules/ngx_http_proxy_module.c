@@ -86,6 +86,7 @@ typedef struct {
     ngx_flag_t                     redirect;
 
     ngx_uint_t                     http_version;
+    ngx_msec_t                     http2_idle_timeout;
 
     ngx_uint_t                     headers_hash_max_size;
     ngx_uint_t                     headers_hash_bucket_size;
@@ -141,6 +142,9 @@ static ngx_int_t ngx_http_proxy_non_buffered_chunked_filter(void *data,
 static void ngx_http_proxy_abort_request(ngx_http_request_t *r);
 static void ngx_http_proxy_finalize_request(ngx_http_request_t *r,
     ngx_int_t rc);
+#if (NGX_HTTP_V2)
+static ngx_int_t ngx_http_proxy_init_peer(ngx_http_request_t *r);
+#endif
 
 static ngx_int_t ngx_http_proxy_host_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
@@ -245,6 +249,9 @@ static ngx_conf_bitmask_t  ngx_http_proxy_ssl_protocols[] = {
 static ngx_conf_enum_t  ngx_http_proxy_http_version[] = {
     { ngx_string("1.0"), NGX_HTTP_VERSION_10 },
     { ngx_string("1.1"), NGX_HTTP_VERSION_11 },
+#if (NGX_HTTP_V2)
+    { ngx_string("2"), NGX_HTTP_VERSION_20 },
+#endif
     { ngx_null_string, 0 }
 };
 
@@ -629,6 +636,17 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, http_version),
       &ngx_http_proxy_http_version },
 
+#if (NGX_HTTP_V2)
+
+    { ngx_string("proxy_http2_idle_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, http2_idle_timeout),
+      NULL },
+
+#endif
+
 #if (NGX_HTTP_SSL)
 
     { ngx_string("proxy_ssl_session_reuse"),
@@ -754,6 +772,9 @@ ngx_module_t  ngx_http_proxy_module = {
 
 static char  ngx_http_proxy_version[] = " HTTP/1.0" CRLF;
 static char  ngx_http_proxy_version_11[] = " HTTP/1.1" CRLF;
+#if (NGX_HTTP_V2)
+static char  ngx_http_proxy_version_20[] = " HTTP/2.0" CRLF;
+#endif
 
 
 static ngx_keyval_t  ngx_http_proxy_headers[] = {
@@ -919,10 +940,16 @@ ngx_http_proxy_handler(ngx_http_request_t *r)
 
     u->accel = 1;
 
+#if (NGX_HTTP_V2)
+    if (plcf->http_version == NGX_HTTP_VERSION_20) {
+        u->init_peer = ngx_http_proxy_init_peer;
+    }
+#endif
+
     if (!plcf->upstream.request_buffering
         && plcf->body_values == NULL && plcf->upstream.pass_request_body
         && (!r->headers_in.chunked
-            || plcf->http_version == NGX_HTTP_VERSION_11))
+            || plcf->http_version != NGX_HTTP_VERSION_10))
     {
         r->request_body_no_buffering = 1;
     }
@@ -1248,7 +1275,12 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
 
     } else if (r->headers_in.chunked && r->reading_body) {
         ctx->internal_body_length = -1;
-        ctx->internal_chunked = 1;
+
+        /* HTTP/2 frames the body itself */
+
+        if (plcf->http_version != NGX_HTTP_VERSION_20) {
+            ctx->internal_chunked = 1;
+        }
 
     } else {
         ctx->internal_body_length = r->headers_in.content_length_n;
@@ -1357,6 +1389,12 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
         b->last = ngx_cpymem(b->last, ngx_http_proxy_version_11,
                              sizeof(ngx_http_proxy_version_11) - 1);
 
+#if (NGX_HTTP_V2)
+    } else if (plcf->http_version == NGX_HTTP_VERSION_20) {
+        b->last = ngx_cpymem(b->last, ngx_http_proxy_version_20,
+                             sizeof(ngx_http_proxy_version_20) - 1);
+#endif
+
     } else {
         b->last = ngx_cpymem(b->last, ngx_http_proxy_version,
                              sizeof(ngx_http_proxy_version) - 1);
@@ -1510,6 +1548,21 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
     b->flush = 1;
     cl->next = NULL;
 
+#if (NGX_HTTP_V2)
+
+    /* HTTP/2 ends the request stream on the last buffer */
+
+    if (plcf->http_version == NGX_HTTP_VERSION_20
+        && (!r->request_body_no_buffering
+            || (!r->reading_body
+                && (r->request_body == NULL
+                    || r->request_body->bufs == NULL))))
+    {
+        b->last_buf = 1;
+    }
+
+#endif
+
     return NGX_OK;
 }
 
@@ -1763,6 +1816,14 @@ ngx_http_proxy_process_status_line(ngx_http_request_t *r)
     u->headers_in.status_n = ctx->status.code;
 
     len = ctx->status.end - ctx->status.start;
+
+    if (ctx->status.http_version >= NGX_HTTP_VERSION_20) {
+
+        /* HTTP/2 has no reason phrase, the standard one is used */
+
+        len = 0;
+    }
+
     u->headers_in.status_line.len = len;
 
     u->headers_in.status_line.data = ngx_pnalloc(r->pool, len);
@@ -2377,6 +2438,21 @@ ngx_http_proxy_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
 }
 
 
+#if (NGX_HTTP_V2)
+
+static ngx_int_t
+ngx_http_proxy_init_peer(ngx_http_request_t *r)
+{
+    ngx_http_proxy_loc_conf_t  *plcf;
+
+    plcf = ngx_http_get_module_loc_conf(r, ngx_http_proxy_module);
+
+    return ngx_http_v2_upstream_init_peer(r, plcf->http2_idle_timeout);
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_proxy_host_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
@@ -2920,6 +2996,7 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
     conf->cookie_paths = NGX_CONF_UNSET_PTR;
 
     conf->http_version = NGX_CONF_UNSET_UINT;
+    conf->http2_idle_timeout = NGX_CONF_UNSET_MSEC;
 
     conf->headers_hash_max_size = NGX_CONF_UNSET_UINT;
     conf->headers_hash_bucket_size = NGX_CONF_UNSET_UINT;
@@ -3313,6 +3390,9 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_uint_value(conf->http_version, prev->http_version,
                               NGX_HTTP_VERSION_10);
 
+    ngx_conf_merge_msec_value(conf->http2_idle_timeout,
+                              prev->http2_idle_timeout, 60000);
+
     ngx_conf_merge_uint_value(conf->headers_hash_max_size,
                               prev->headers_hash_max_size, 512);
 
@@ -3350,6 +3430,15 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 #endif
     }
 
+#if (NGX_HTTP_SSL && NGX_HTTP_V2)
+    if (conf->http_version == NGX_HTTP_VERSION_20 && conf->upstream.ssl) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"proxy_http_version 2\" is not supported "
+                           "with https");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
     if (clcf->lmt_excpt && clcf->handler == NULL
         && (conf->upstream.upstream || conf->proxy_lengths))
     {
@@ -86,7 +86,11 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
     size_t             size;
     ngx_int_t          rc;
     ngx_buf_t         *b;
+    ngx_uint_t         i;
     ngx_chain_t        out;
+    ngx_list_part_t   *part;
+    ngx_shm_zone_t    *shm_zone;
+    ngx_slab_pool_t   *sp;
     ngx_atomic_int_t   ap, hn, ac, rq, rd, wr, wa;
 
     if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
@@ -118,6 +122,27 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
            + 6 + 3 * NGX_ATOMIC_T_LEN
            + sizeof("Reading:  Writing:  Waiting:  \n") + 3 * NGX_ATOMIC_T_LEN;
 
+    /* the lock waits of each shared memory zone, counted by all workers */
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        size += sizeof("Zone  lock waits:  \n") - 1
+                + shm_zone[i].shm.name.len + NGX_ATOMIC_T_LEN;
+    }
+
     b = ngx_create_temp_buf(r->pool, size);
     if (b == NULL) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
@@ -144,6 +169,27 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
     b->last = ngx_sprintf(b->last, "Reading: %uA Writing: %uA Waiting: %uA \n",
                           rd, wr, wa);
 
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        sp = (ngx_slab_pool_t *) shm_zone[i].shm.addr;
+
+        b->last = ngx_sprintf(b->last, "Zone %V lock waits: %uA \n",
+                              &shm_zone[i].shm.name, sp->contended);
+    }
+
     r->headers_out.status = NGX_HTTP_OK;
     r->headers_out.content_length_n = b->last - b->pos;
 
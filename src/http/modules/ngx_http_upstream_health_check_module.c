@@ -0,0 +1,681 @@
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_HEALTH_CHECK_HTTP  0
+#define NGX_HTTP_HEALTH_CHECK_TCP   1
+
+#define NGX_HTTP_HEALTH_CHECK_BUFFER_SIZE  1024
+
+
+typedef struct {
+    ngx_msec_t                          interval;
+    ngx_msec_t                          timeout;
+    ngx_uint_t                          fails;
+    ngx_uint_t                          passes;
+    ngx_uint_t                          type;
+    ngx_str_t                           uri;
+    ngx_str_t                           request;
+    ngx_str_t                          *upstream;
+} ngx_http_upstream_health_check_srv_conf_t;
+
+
+/*
+ * Each server is probed by its own timer, the first probes are spread
+ * randomly over the interval.  Probes are only sent by the first worker
+ * process, the results are kept in the upstream zone as the
+ * NGX_HTTP_UPSTREAM_PEER_UNHEALTHY bit of peer->down, so that all
+ * workers skip the server.
+ */
+
+typedef struct {
+    ngx_event_t                         event;
+    ngx_peer_connection_t               pc;
+    u_char                             *buffer;
+    size_t                              sent;
+    size_t                              received;
+
+    ngx_uint_t                          fails;
+    ngx_uint_t                          passes;
+
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_health_check_srv_conf_t  *conf;
+} ngx_http_upstream_health_check_peer_t;
+
+
+static void ngx_http_upstream_health_check_handler(ngx_event_t *ev);
+static void ngx_http_upstream_health_check_write_handler(ngx_event_t *wev);
+static void ngx_http_upstream_health_check_read_handler(ngx_event_t *rev);
+static ngx_int_t ngx_http_upstream_health_check_test_connect(
+    ngx_connection_t *c);
+static void ngx_http_upstream_health_check_done(
+    ngx_http_upstream_health_check_peer_t *hp, ngx_uint_t ok);
+static void *ngx_http_upstream_health_check_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_health_check(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_upstream_health_check_init_module(
+    ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_upstream_health_check_init_process(
+    ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_upstream_health_check_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_health_check,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_health_check_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_health_check_create_conf, /* create server config */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_health_check_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_health_check_module_ctx, /* module context */
+    ngx_http_upstream_health_check_commands, /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    ngx_http_upstream_health_check_init_module, /* init module */
+    ngx_http_upstream_health_check_init_process, /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void
+ngx_http_upstream_health_check_handler(ngx_event_t *ev)
+{
+    ngx_int_t                               rc;
+    ngx_connection_t                       *c;
+    ngx_http_upstream_health_check_peer_t  *hp;
+
+    hp = ev->data;
+
+    if (ngx_exiting || ngx_terminate) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "health check %V", &hp->peer->name);
+
+    hp->pc.sockaddr = hp->peer->sockaddr;
+    hp->pc.socklen = hp->peer->socklen;
+    hp->pc.name = &hp->peer->name;
+    hp->pc.get = ngx_event_get_peer;
+    hp->pc.log = ev->log;
+    hp->pc.log_error = NGX_ERROR_INFO;
+
+    rc = ngx_event_connect_peer(&hp->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        hp->pc.connection = NULL;
+        ngx_http_upstream_health_check_done(hp, 0);
+        return;
+    }
+
+    c = hp->pc.connection;
+
+    c->data = hp;
+    c->sendfile = 0;
+    c->read->handler = ngx_http_upstream_health_check_read_handler;
+    c->write->handler = ngx_http_upstream_health_check_write_handler;
+
+    hp->sent = 0;
+    hp->received = 0;
+
+    /* the timer covers the whole probe */
+
+    ngx_add_timer(c->read, hp->conf->timeout);
+
+    if (rc == NGX_OK) {
+        ngx_http_upstream_health_check_write_handler(c->write);
+    }
+}
+
+
+static void
+ngx_http_upstream_health_check_write_handler(ngx_event_t *wev)
+{
+    ssize_t                                 n;
+    ngx_str_t                              *request;
+    ngx_connection_t                       *c;
+    ngx_http_upstream_health_check_peer_t  *hp;
+
+    c = wev->data;
+    hp = c->data;
+
+    if (hp->sent == 0
+        && ngx_http_upstream_health_check_test_connect(c) != NGX_OK)
+    {
+        ngx_http_upstream_health_check_done(hp, 0);
+        return;
+    }
+
+    if (hp->conf->type == NGX_HTTP_HEALTH_CHECK_TCP) {
+        ngx_http_upstream_health_check_done(hp, 1);
+        return;
+    }
+
+    request = &hp->conf->request;
+
+    while (hp->sent < request->len) {
+        n = c->send(c, request->data + hp->sent, request->len - hp->sent);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_http_upstream_health_check_done(hp, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_health_check_done(hp, 0);
+            return;
+        }
+
+        hp->sent += n;
+    }
+
+    wev->handler = ngx_http_empty_handler;
+
+    if (c->read->ready) {
+        ngx_http_upstream_health_check_read_handler(c->read);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_upstream_health_check_done(hp, 0);
+    }
+}
+
+
+static void
+ngx_http_upstream_health_check_read_handler(ngx_event_t *rev)
+{
+    u_char                                 *p;
+    ssize_t                                 n;
+    ngx_uint_t                              status;
+    ngx_connection_t                       *c;
+    ngx_http_upstream_health_check_peer_t  *hp;
+
+    c = rev->data;
+    hp = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "health check of %V timed out", &hp->peer->name);
+        ngx_http_upstream_health_check_done(hp, 0);
+        return;
+    }
+
+    if (hp->conf->type == NGX_HTTP_HEALTH_CHECK_TCP
+        || hp->sent < hp->conf->request.len)
+    {
+        /* the request is not sent yet, probably a connect error */
+
+        if (ngx_http_upstream_health_check_test_connect(c) != NGX_OK) {
+            ngx_http_upstream_health_check_done(hp, 0);
+        }
+
+        return;
+    }
+
+    for ( ;; ) {
+        n = c->recv(c, hp->buffer + hp->received,
+                    NGX_HTTP_HEALTH_CHECK_BUFFER_SIZE - hp->received);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_http_upstream_health_check_done(hp, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_http_upstream_health_check_done(hp, 0);
+            return;
+        }
+
+        hp->received += n;
+
+        /* "HTTP/1.x NNN" */
+
+        if (hp->received >= sizeof("HTTP/1.x NNN") - 1) {
+            break;
+        }
+    }
+
+    p = hp->buffer;
+
+    if (ngx_strncmp(p, "HTTP/1.", sizeof("HTTP/1.") - 1) != 0
+        || p[8] != ' '
+        || p[9] < '1' || p[9] > '5'
+        || p[10] < '0' || p[10] > '9'
+        || p[11] < '0' || p[11] > '9')
+    {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "health check of %V got invalid response",
+                      &hp->peer->name);
+        ngx_http_upstream_health_check_done(hp, 0);
+        return;
+    }
+
+    status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + p[11] - '0';
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "health check %V status %ui", &hp->peer->name, status);
+
+    if (status >= 400) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "health check of %V returned status %ui",
+                      &hp->peer->name, status);
+    }
+
+    ngx_http_upstream_health_check_done(hp, status < 400);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_health_check_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
+
+            } else {
+                err = c->read->kq_errno;
+            }
+
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_health_check_done(ngx_http_upstream_health_check_peer_t *hp,
+    ngx_uint_t ok)
+{
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    if (hp->pc.connection) {
+        ngx_close_connection(hp->pc.connection);
+        hp->pc.connection = NULL;
+    }
+
+    peer = hp->peer;
+    peers = hp->peers;
+
+    if (ok) {
+        hp->fails = 0;
+        hp->passes++;
+
+    } else {
+        hp->passes = 0;
+        hp->fails++;
+    }
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    if (peer->down & NGX_HTTP_UPSTREAM_PEER_UNHEALTHY) {
+
+        if (hp->passes >= hp->conf->passes) {
+            peer->down &= ~NGX_HTTP_UPSTREAM_PEER_UNHEALTHY;
+
+            ngx_log_error(NGX_LOG_NOTICE, hp->event.log, 0,
+                          "upstream server %V in \"%V\" is healthy",
+                          &peer->name, hp->conf->upstream);
+        }
+
+    } else if (hp->fails >= hp->conf->fails) {
+        peer->down |= NGX_HTTP_UPSTREAM_PEER_UNHEALTHY;
+
+        ngx_log_error(NGX_LOG_WARN, hp->event.log, 0,
+                      "upstream server %V in \"%V\" is unhealthy",
+                      &peer->name, hp->conf->upstream);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if (!ngx_exiting && !ngx_terminate) {
+        ngx_add_timer(&hp->event, hp->conf->interval);
+    }
+}
+
+
+static void *
+ngx_http_upstream_health_check_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_health_check_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_http_upstream_health_check_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->type = NGX_HTTP_HEALTH_CHECK_HTTP;
+     *     conf->uri = { 0, NULL };
+     *     conf->request = { 0, NULL };
+     *     conf->upstream = NULL;
+     */
+
+    conf->interval = NGX_CONF_UNSET_MSEC;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+    conf->fails = NGX_CONF_UNSET_UINT;
+    conf->passes = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_health_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_health_check_srv_conf_t  *hcf = conf;
+
+    u_char                        *p;
+    ngx_int_t                      n;
+    ngx_str_t                     *value, s;
+    ngx_uint_t                     i;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (hcf->upstream) {
+        return "is duplicate";
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    hcf->upstream = &uscf->host;
+    ngx_str_set(&hcf->uri, "/");
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hcf->interval = ngx_parse_time(&s, 0);
+            if (hcf->interval == (ngx_msec_t) NGX_ERROR || hcf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hcf->timeout = ngx_parse_time(&s, 0);
+            if (hcf->timeout == (ngx_msec_t) NGX_ERROR || hcf->timeout == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->fails = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->passes = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "uri=", 4) == 0) {
+            hcf->uri.len = value[i].len - 4;
+            hcf->uri.data = &value[i].data[4];
+
+            if (hcf->uri.len == 0 || hcf->uri.data[0] != '/') {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=http") == 0) {
+            hcf->type = NGX_HTTP_HEALTH_CHECK_HTTP;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=tcp") == 0) {
+            hcf->type = NGX_HTTP_HEALTH_CHECK_TCP;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    ngx_conf_init_msec_value(hcf->interval, 5000);
+    ngx_conf_init_msec_value(hcf->timeout, 1000);
+    ngx_conf_init_uint_value(hcf->fails, 1);
+    ngx_conf_init_uint_value(hcf->passes, 1);
+
+    if (hcf->type == NGX_HTTP_HEALTH_CHECK_TCP) {
+        return NGX_CONF_OK;
+    }
+
+    hcf->request.len = sizeof("GET  HTTP/1.0" CRLF) - 1 + hcf->uri.len
+                       + sizeof("Host: " CRLF) - 1 + uscf->host.len
+                       + sizeof("User-Agent: nginx health check" CRLF) - 1
+                       + sizeof("Connection: close" CRLF CRLF) - 1;
+
+    p = ngx_pnalloc(cf->pool, hcf->request.len);
+    if (p == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    hcf->request.data = p;
+
+    p = ngx_cpymem(p, "GET ", sizeof("GET ") - 1);
+    p = ngx_cpymem(p, hcf->uri.data, hcf->uri.len);
+    p = ngx_cpymem(p, " HTTP/1.0" CRLF "Host: ",
+                   sizeof(" HTTP/1.0" CRLF "Host: ") - 1);
+    p = ngx_cpymem(p, uscf->host.data, uscf->host.len);
+    p = ngx_cpymem(p, CRLF "User-Agent: nginx health check" CRLF
+                   "Connection: close" CRLF CRLF,
+                   sizeof(CRLF "User-Agent: nginx health check" CRLF
+                          "Connection: close" CRLF CRLF) - 1);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_health_check_init_module(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                                  i;
+    ngx_http_upstream_srv_conf_t              **uscfp;
+    ngx_http_upstream_main_conf_t              *umcf;
+    ngx_http_upstream_health_check_srv_conf_t  *hcf;
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                        ngx_http_upstream_health_check_module);
+
+        if (hcf->upstream && uscfp[i]->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                          "health checks require a shared memory zone "
+                          "in upstream \"%V\" in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_health_check_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                                  i;
+    ngx_event_t                                *ev;
+    ngx_http_upstream_rr_peer_t                *peer;
+    ngx_http_upstream_rr_peers_t               *peers;
+    ngx_http_upstream_srv_conf_t              **uscfp;
+    ngx_http_upstream_main_conf_t              *umcf;
+    ngx_http_upstream_health_check_peer_t      *hp;
+    ngx_http_upstream_health_check_srv_conf_t  *hcf;
+
+    if ((ngx_process != NGX_PROCESS_WORKER || ngx_worker != 0)
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                        ngx_http_upstream_health_check_module);
+
+        if (hcf->upstream == NULL) {
+            continue;
+        }
+
+        /* the primary and the backup servers */
+
+        for (peers = uscfp[i]->peer.data; peers; peers = peers->next) {
+
+            for (peer = peers->peer; peer; peer = peer->next) {
+
+                hp = ngx_pcalloc(cycle->pool,
+                             sizeof(ngx_http_upstream_health_check_peer_t));
+                if (hp == NULL) {
+                    return NGX_ERROR;
+                }
+
+                hp->buffer = ngx_pnalloc(cycle->pool,
+                                         NGX_HTTP_HEALTH_CHECK_BUFFER_SIZE);
+                if (hp->buffer == NULL) {
+                    return NGX_ERROR;
+                }
+
+                hp->peers = peers;
+                hp->peer = peer;
+                hp->conf = hcf;
+
+                ev = &hp->event;
+
+                ev->handler = ngx_http_upstream_health_check_handler;
+                ev->data = hp;
+                ev->log = cycle->log;
+                ev->cancelable = 1;
+
+                ngx_add_timer(ev, ngx_random() % hcf->interval + 1);
+            }
+        }
+    }
+
+    return NGX_OK;
+}
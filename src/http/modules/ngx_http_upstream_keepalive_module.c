@@ -16,20 +16,43 @@ typedef struct {
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
 
+    ngx_queue_t                       *peers;
+    ngx_uint_t                         peers_mask;
+    ngx_queue_t                        free_peers;
+
     ngx_http_upstream_init_pt          original_init_upstream;
     ngx_http_upstream_init_peer_pt     original_init_peer;
 
 } ngx_http_upstream_keepalive_srv_conf_t;
 
 
+/*
+ * Cached connections are kept both in the LRU queue of the upstream,
+ * which selects a connection to close when the cache is full, and in
+ * the queue of their peer.  Peers with cached connections are found in
+ * a hash table by the address, so a connection is found or saved in
+ * a constant time regardless of the number of servers.
+ */
+
+typedef struct {
+    ngx_queue_t                        queue;   /* hash bucket or free */
+    ngx_queue_t                        cache;
+    ngx_uint_t                         idle;
+
+    socklen_t                          socklen;
+    ngx_sockaddr_t                     sockaddr;
+
+} ngx_http_upstream_keepalive_peer_t;
+
+
 typedef struct {
     ngx_http_upstream_keepalive_srv_conf_t  *conf;
 
     ngx_queue_t                        queue;
     ngx_connection_t                  *connection;
 
-    socklen_t                          socklen;
-    ngx_sockaddr_t                     sockaddr;
+    ngx_queue_t                        peer_queue;
+    ngx_http_upstream_keepalive_peer_t  *peer;
 
 } ngx_http_upstream_keepalive_cache_t;
 
@@ -49,6 +72,8 @@ typedef struct {
     ngx_event_save_peer_session_pt     original_save_session;
 #endif
 
+    ngx_uint_t                         idle;
+
 } ngx_http_upstream_keepalive_peer_data_t;
 
 
@@ -59,6 +84,12 @@ static ngx_int_t ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc,
 static void ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
 
+static ngx_http_upstream_keepalive_peer_t *ngx_http_upstream_keepalive_peer(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_peer_connection_t *pc,
+    ngx_uint_t create);
+static void ngx_http_upstream_keepalive_remove(
+    ngx_http_upstream_keepalive_cache_t *item);
+
 static void ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close(ngx_connection_t *c);
@@ -70,6 +101,9 @@ static void ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
     void *data);
 #endif
 
+static ngx_int_t ngx_http_upstream_keepalive_add_variables(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_keepalive_idle_variable(
+    ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
 static void *ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -89,7 +123,7 @@ static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
 
 
 static ngx_http_module_t  ngx_http_upstream_keepalive_module_ctx = {
-    NULL,                                  /* preconfiguration */
+    ngx_http_upstream_keepalive_add_variables, /* preconfiguration */
     NULL,                                  /* postconfiguration */
 
     NULL,                                  /* create main configuration */
@@ -119,13 +153,24 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
 };
 
 
+static ngx_http_variable_t  ngx_http_upstream_keepalive_vars[] = {
+
+    { ngx_string("upstream_keepalive_idle"), NULL,
+      ngx_http_upstream_keepalive_idle_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+      ngx_http_null_variable
+};
+
+
 static ngx_int_t
 ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us)
 {
-    ngx_uint_t                               i;
+    ngx_uint_t                               i, n;
     ngx_http_upstream_keepalive_srv_conf_t  *kcf;
     ngx_http_upstream_keepalive_cache_t     *cached;
+    ngx_http_upstream_keepalive_peer_t      *peers;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0,
                    "init keepalive");
@@ -157,6 +202,33 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
         cached[i].conf = kcf;
     }
 
+    /* each peer in the table has a cached connection */
+
+    peers = ngx_pcalloc(cf->pool,
+                 sizeof(ngx_http_upstream_keepalive_peer_t) * kcf->max_cached);
+    if (peers == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_queue_init(&kcf->free_peers);
+
+    for (i = 0; i < kcf->max_cached; i++) {
+        ngx_queue_insert_head(&kcf->free_peers, &peers[i].queue);
+    }
+
+    for (n = 1; n < kcf->max_cached; n <<= 1) { /* void */ }
+
+    kcf->peers = ngx_palloc(cf->pool, sizeof(ngx_queue_t) * n);
+    if (kcf->peers == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        ngx_queue_init(&kcf->peers[i]);
+    }
+
+    kcf->peers_mask = n - 1;
+
     return NGX_OK;
 }
 
@@ -184,6 +256,7 @@ ngx_http_upstream_init_keepalive_peer(ngx_http_request_t *r,
     }
 
     kp->conf = kcf;
+    kp->idle = 0;
     kp->upstream = r->upstream;
     kp->data = r->upstream->peer.data;
     kp->original_get_peer = r->upstream->peer.get;
@@ -210,9 +283,10 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_int_t          rc;
-    ngx_queue_t       *q, *cache;
-    ngx_connection_t  *c;
+    ngx_int_t                            rc;
+    ngx_queue_t                         *q;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_keepalive_peer_t  *peer;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer");
@@ -225,34 +299,26 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
         return rc;
     }
 
-    /* search cache for suitable connection */
+    /* use the most recently cached connection to the peer */
 
-    cache = &kp->conf->cache;
+    peer = ngx_http_upstream_keepalive_peer(kp->conf, pc, 0);
 
-    for (q = ngx_queue_head(cache);
-         q != ngx_queue_sentinel(cache);
-         q = ngx_queue_next(q))
-    {
-        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
-        c = item->connection;
-
-        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) pc->sockaddr,
-                         item->socklen, pc->socklen)
-            == 0)
-        {
-            ngx_queue_remove(q);
-            ngx_queue_insert_head(&kp->conf->free, q);
-
-            goto found;
-        }
+    if (peer == NULL) {
+        kp->idle = 0;
+        return NGX_OK;
     }
 
-    return NGX_OK;
+    q = ngx_queue_head(&peer->cache);
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, peer_queue);
+    c = item->connection;
 
-found:
+    kp->idle = peer->idle - 1;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                   "get keepalive peer: using connection %p", c);
+    ngx_http_upstream_keepalive_remove(item);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get keepalive peer: using connection %p, %ui left",
+                   c, kp->idle);
 
     c->idle = 0;
     c->sent = 0;
@@ -275,9 +341,10 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_queue_t          *q;
-    ngx_connection_t     *c;
-    ngx_http_upstream_t  *u;
+    ngx_queue_t                         *q;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_t                 *u;
+    ngx_http_upstream_keepalive_peer_t  *peer;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer");
@@ -320,22 +387,29 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     if (ngx_queue_empty(&kp->conf->free)) {
 
         q = ngx_queue_last(&kp->conf->cache);
-        ngx_queue_remove(q);
-
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
 
         ngx_http_upstream_keepalive_close(item->connection);
+        ngx_http_upstream_keepalive_remove(item);
+    }
 
-    } else {
-        q = ngx_queue_head(&kp->conf->free);
-        ngx_queue_remove(q);
+    /* a free peer is there, as the cache has a free item now */
 
-        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
-    }
+    peer = ngx_http_upstream_keepalive_peer(kp->conf, pc, 1);
+
+    q = ngx_queue_head(&kp->conf->free);
+    ngx_queue_remove(q);
+
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
 
     ngx_queue_insert_head(&kp->conf->cache, q);
+    ngx_queue_insert_head(&peer->cache, &item->peer_queue);
+    peer->idle++;
+
+    kp->idle = peer->idle;
 
     item->connection = c;
+    item->peer = peer;
 
     pc->connection = NULL;
 
@@ -356,9 +430,6 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     c->write->log = ngx_cycle->log;
     c->pool->log = ngx_cycle->log;
 
-    item->socklen = pc->socklen;
-    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
-
     if (c->read->ready) {
         ngx_http_upstream_keepalive_close_handler(c->read);
     }
@@ -369,6 +440,72 @@ invalid:
 }
 
 
+static ngx_http_upstream_keepalive_peer_t *
+ngx_http_upstream_keepalive_peer(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_peer_connection_t *pc, ngx_uint_t create)
+{
+    uint32_t                             hash;
+    ngx_queue_t                         *q, *bucket;
+    ngx_http_upstream_keepalive_peer_t  *peer;
+
+    hash = ngx_crc32_short((u_char *) pc->sockaddr, pc->socklen);
+    bucket = &kcf->peers[hash & kcf->peers_mask];
+
+    for (q = ngx_queue_head(bucket);
+         q != ngx_queue_sentinel(bucket);
+         q = ngx_queue_next(q))
+    {
+        peer = ngx_queue_data(q, ngx_http_upstream_keepalive_peer_t, queue);
+
+        if (ngx_memn2cmp((u_char *) &peer->sockaddr, (u_char *) pc->sockaddr,
+                         peer->socklen, pc->socklen)
+            == 0)
+        {
+            return peer;
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    q = ngx_queue_head(&kcf->free_peers);
+    ngx_queue_remove(q);
+    ngx_queue_insert_head(bucket, q);
+
+    peer = ngx_queue_data(q, ngx_http_upstream_keepalive_peer_t, queue);
+
+    ngx_queue_init(&peer->cache);
+    peer->idle = 0;
+
+    peer->socklen = pc->socklen;
+    ngx_memcpy(&peer->sockaddr, pc->sockaddr, pc->socklen);
+
+    return peer;
+}
+
+
+static void
+ngx_http_upstream_keepalive_remove(ngx_http_upstream_keepalive_cache_t *item)
+{
+    ngx_http_upstream_keepalive_peer_t      *peer;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    kcf = item->conf;
+    peer = item->peer;
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&kcf->free, &item->queue);
+
+    ngx_queue_remove(&item->peer_queue);
+
+    if (--peer->idle == 0) {
+        ngx_queue_remove(&peer->queue);
+        ngx_queue_insert_head(&kcf->free_peers, &peer->queue);
+    }
+}
+
+
 static void
 ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev)
 {
@@ -380,8 +517,7 @@ ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev)
 static void
 ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev)
 {
-    ngx_http_upstream_keepalive_srv_conf_t  *conf;
-    ngx_http_upstream_keepalive_cache_t     *item;
+    ngx_http_upstream_keepalive_cache_t  *item;
 
     int                n;
     char               buf[1];
@@ -411,12 +547,9 @@ ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev)
 close:
 
     item = c->data;
-    conf = item->conf;
 
     ngx_http_upstream_keepalive_close(c);
-
-    ngx_queue_remove(&item->queue);
-    ngx_queue_insert_head(&conf->free, &item->queue);
+    ngx_http_upstream_keepalive_remove(item);
 }
 
 
@@ -466,6 +599,57 @@ ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc, void *data)
 #endif
 
 
+static ngx_int_t
+ngx_http_upstream_keepalive_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_upstream_keepalive_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_idle_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                                   *p;
+    ngx_http_upstream_t                      *u;
+    ngx_http_upstream_keepalive_peer_data_t  *kp;
+
+    u = r->upstream;
+
+    if (u == NULL || u->peer.get != ngx_http_upstream_get_keepalive_peer) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    kp = u->peer.data;
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui", kp->idle) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
 {
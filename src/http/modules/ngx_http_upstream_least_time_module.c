@@ -0,0 +1,520 @@
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_LEAST_TIME_HEADER     0
+#define NGX_HTTP_UPSTREAM_LEAST_TIME_LAST_BYTE  1
+
+/*
+ * The response time average is kept in 1/16 of a millisecond, a new
+ * sample has the weight of 1/8, and the average halves every decay
+ * period without samples, so that a slow server is retried eventually.
+ */
+
+#define NGX_HTTP_UPSTREAM_EWMA_SHIFT            4
+#define NGX_HTTP_UPSTREAM_EWMA_WEIGHT           3
+#define NGX_HTTP_UPSTREAM_EWMA_DECAY            10000
+
+
+typedef struct {
+    ngx_uint_t                          mode;
+} ngx_http_upstream_least_time_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_http_upstream_rr_peer_data_t    rrp;
+
+    ngx_http_upstream_least_time_srv_conf_t  *conf;
+    ngx_http_request_t                 *request;
+    ngx_uint_t                          state;      /* of the attempt */
+    ngx_msec_t                          start;
+} ngx_http_upstream_least_time_peer_data_t;
+
+
+static ngx_int_t ngx_http_upstream_init_least_time_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_least_time_peer(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_http_upstream_free_least_time_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static uint64_t ngx_http_upstream_least_time_score(
+    ngx_http_upstream_rr_peer_t *peer, ngx_msec_t now);
+static ngx_msec_t ngx_http_upstream_least_time_ewma(
+    ngx_http_upstream_rr_peer_t *peer, ngx_msec_t now);
+static void *ngx_http_upstream_least_time_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_least_time(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_least_time_commands[] = {
+
+    { ngx_string("least_time"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstream_least_time,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_least_time_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_least_time_create_conf, /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_least_time_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_least_time_module_ctx, /* module context */
+    ngx_http_upstream_least_time_commands, /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_least_time(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "init least time");
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_least_time_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_least_time_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_least_time_peer_data_t  *ltp;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init least time peer");
+
+    ltp = ngx_palloc(r->pool, sizeof(ngx_http_upstream_least_time_peer_data_t));
+    if (ltp == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &ltp->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ltp->conf = ngx_http_conf_upstream_srv_conf(us,
+                                          ngx_http_upstream_least_time_module);
+    ltp->request = r;
+    ltp->state = 0;
+    ltp->start = ngx_current_msec;
+
+    r->upstream->peer.get = ngx_http_upstream_get_least_time_peer;
+    r->upstream->peer.free = ngx_http_upstream_free_least_time_peer;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Two random servers are compared and the one with the lower product
+ * of the response time average and the number of active connections,
+ * relative to its weight, is selected.  Unlike comparing all servers,
+ * this does not send every new request to the same server until the
+ * average catches up.
+ */
+
+static ngx_int_t
+ngx_http_upstream_get_least_time_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_least_time_peer_data_t  *ltp = data;
+
+    time_t                             now;
+    ngx_http_request_t                *r;
+    uint64_t                           sa, sb;
+    uintptr_t                          m;
+    ngx_int_t                          rc;
+    ngx_uint_t                         i, n, p, pb, count;
+    ngx_http_upstream_rr_peer_t       *peer, *best, *other;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_peer_data_t  *rrp;
+
+    rrp = &ltp->rrp;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get least time peer, try: %ui", pc->tries);
+
+    /*
+     * the timing of the attempt is kept here, as a hedge makes another
+     * attempt current while this one goes on
+     */
+
+    r = ltp->request;
+
+    ltp->state = r->upstream->state
+                 - (ngx_http_upstream_state_t *) r->upstream_states->elts;
+    ltp->start = ngx_current_msec;
+
+    if (rrp->peers->single) {
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    peers = rrp->peers;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    best = NULL;
+    other = NULL;
+    count = 0;
+
+#if (NGX_SUPPRESS_WARN)
+    p = 0;
+    pb = 0;
+#endif
+
+    /* two distinct servers sampled uniformly in a single pass */
+
+    for (peer = peers->peer, i = 0;
+         peer;
+         peer = peer->next, i++)
+    {
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if (rrp->tried[n] & m) {
+            continue;
+        }
+
+        if (peer->down) {
+            continue;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            continue;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            continue;
+        }
+
+        count++;
+
+        if (count == 1) {
+            best = peer;
+            p = i;
+            continue;
+        }
+
+        if (count == 2) {
+            other = peer;
+            pb = i;
+            continue;
+        }
+
+        switch (ngx_random() % count) {
+
+        case 0:
+            best = peer;
+            p = i;
+            break;
+
+        case 1:
+            other = peer;
+            pb = i;
+            break;
+        }
+    }
+
+    if (best == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get least time peer, no peer found");
+
+        goto failed;
+    }
+
+    if (other) {
+        sa = ngx_http_upstream_least_time_score(best, ngx_current_msec)
+             * other->weight;
+        sb = ngx_http_upstream_least_time_score(other, ngx_current_msec)
+             * best->weight;
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get least time peer, %V:%uL %V:%uL",
+                       &best->name, sa, &other->name, sb);
+
+        if (sb < sa) {
+            best = other;
+            p = pb;
+        }
+    }
+
+    if (now - best->checked > best->fail_timeout) {
+        best->checked = now;
+    }
+
+    pc->sockaddr = best->sockaddr;
+    pc->socklen = best->socklen;
+    pc->name = &best->name;
+
+    best->conns++;
+
+    rrp->current = best;
+
+    n = p / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+    rrp->tried[n] |= m;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return NGX_OK;
+
+failed:
+
+    if (peers->next) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get least time peer, backup servers");
+
+        rrp->peers = peers->next;
+
+        n = (rrp->peers->number + (8 * sizeof(uintptr_t) - 1))
+                / (8 * sizeof(uintptr_t));
+
+        for (i = 0; i < n; i++) {
+            rrp->tried[i] = 0;
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        rc = ngx_http_upstream_get_least_time_peer(pc, ltp);
+
+        if (rc != NGX_BUSY) {
+            return rc;
+        }
+
+        ngx_http_upstream_rr_peers_wlock(peers);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    pc->name = peers->name;
+
+    return NGX_BUSY;
+}
+
+
+static void
+ngx_http_upstream_free_least_time_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_least_time_peer_data_t  *ltp = data;
+
+    ngx_uint_t                     bound;
+    ngx_msec_t                     sample, ewma;
+    ngx_msec_int_t                 diff;
+    ngx_http_upstream_state_t     *us;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    peer = ltp->rrp.current;
+    peers = ltp->rrp.peers;
+
+    if (peer == NULL || peers->single) {
+        goto done;
+    }
+
+    us = (ngx_http_upstream_state_t *) ltp->request->upstream_states->elts
+         + ltp->state;
+
+    /*
+     * the header time is not known if the server failed before sending
+     * the header, the time to the failure is used then
+     */
+
+    sample = ngx_current_msec - ltp->start;
+
+    /*
+     * an attempt left without a header and without a failure lost
+     * a hedge or was cancelled: the server took at least this long,
+     * and the average is only raised
+     */
+
+    bound = !(state & NGX_PEER_FAILED)
+            && us->header_time == (ngx_msec_t) -1;
+
+    if (ltp->conf->mode == NGX_HTTP_UPSTREAM_LEAST_TIME_HEADER
+        && !(state & NGX_PEER_FAILED)
+        && us->header_time != (ngx_msec_t) -1)
+    {
+        sample = us->header_time;
+    }
+
+    sample <<= NGX_HTTP_UPSTREAM_EWMA_SHIFT;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+    ngx_http_upstream_rr_peer_lock(peers, peer);
+
+    ewma = ngx_http_upstream_least_time_ewma(peer, ngx_current_msec);
+
+    if (ewma == 0) {
+        peer->ewma = sample;
+
+    } else if (bound && sample <= ewma) {
+        goto unlock;
+
+    } else {
+        diff = (ngx_msec_int_t) (sample - ewma);
+        peer->ewma = ewma + diff / (1 << NGX_HTTP_UPSTREAM_EWMA_WEIGHT);
+    }
+
+    peer->ewma_time = ngx_current_msec;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free least time peer %V, sample: %M, average: %M",
+                   &peer->name, sample >> NGX_HTTP_UPSTREAM_EWMA_SHIFT,
+                   peer->ewma >> NGX_HTTP_UPSTREAM_EWMA_SHIFT);
+
+unlock:
+
+    ngx_http_upstream_rr_peer_unlock(peers, peer);
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+done:
+
+    ngx_http_upstream_free_round_robin_peer(pc, &ltp->rrp, state);
+}
+
+
+static uint64_t
+ngx_http_upstream_least_time_score(ngx_http_upstream_rr_peer_t *peer,
+    ngx_msec_t now)
+{
+    ngx_msec_t  ewma;
+
+    /* a millisecond is added, so that the connections count with no data */
+
+    ewma = ngx_http_upstream_least_time_ewma(peer, now)
+           + ((ngx_msec_t) 1 << NGX_HTTP_UPSTREAM_EWMA_SHIFT);
+
+    return (uint64_t) ewma * (peer->conns + 1);
+}
+
+
+static ngx_msec_t
+ngx_http_upstream_least_time_ewma(ngx_http_upstream_rr_peer_t *peer,
+    ngx_msec_t now)
+{
+    ngx_msec_t  periods;
+
+    periods = (now - peer->ewma_time) / NGX_HTTP_UPSTREAM_EWMA_DECAY;
+
+    if (periods >= 8 * sizeof(ngx_msec_t)) {
+        return 0;
+    }
+
+    return peer->ewma >> periods;
+}
+
+
+static void *
+ngx_http_upstream_least_time_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_least_time_srv_conf_t  *conf;
+
+    conf = ngx_palloc(cf->pool,
+                      sizeof(ngx_http_upstream_least_time_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->mode = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_least_time(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_least_time_srv_conf_t  *ltcf = conf;
+
+    ngx_str_t                     *value;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (ltcf->mode != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "header") == 0) {
+        ltcf->mode = NGX_HTTP_UPSTREAM_LEAST_TIME_HEADER;
+
+    } else if (ngx_strcmp(value[1].data, "last_byte") == 0) {
+        ltcf->mode = NGX_HTTP_UPSTREAM_LEAST_TIME_LAST_BYTE;
+
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\" in \"%V\" directive",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_least_time;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN
+                  |NGX_HTTP_UPSTREAM_BACKUP;
+
+    return NGX_CONF_OK;
+}
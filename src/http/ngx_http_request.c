@@ -1500,12 +1500,29 @@ ngx_http_alloc_large_header_buffer(ngx_http_request_t *r,
 
     } else if (hc->nbusy < cscf->large_client_header_buffers.num) {
 
-        b = ngx_create_temp_buf(r->connection->pool,
-                                cscf->large_client_header_buffers.size);
+        /*
+         * ngx_http_set_keepalive() frees the buffers and their ngx_buf_t's
+         * with ngx_pfree_size(), so they are allocated to be reused
+         */
+
+        b = ngx_palloc_reuse(r->connection->pool, sizeof(ngx_buf_t));
         if (b == NULL) {
             return NGX_ERROR;
         }
 
+        ngx_memzero(b, sizeof(ngx_buf_t));
+
+        b->start = ngx_palloc_reuse(r->connection->pool,
+                                    cscf->large_client_header_buffers.size);
+        if (b->start == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->pos = b->start;
+        b->last = b->start;
+        b->end = b->last + cscf->large_client_header_buffers.size;
+        b->temporary = 1;
+
         cl = ngx_alloc_chain_link(r->connection->pool);
         if (cl == NULL) {
             return NGX_ERROR;
@@ -3019,11 +3036,19 @@ ngx_http_set_keepalive(ngx_http_request_t *r)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "hc free: %p",
                    hc->free);
 
+    /*
+     * The large header buffers are allocated anew by the next request,
+     * so their memory and their ngx_buf_t's are returned to the c->pool
+     * free lists to not grow the pool with every request.
+     */
+
     if (hc->free) {
         for (cl = hc->free; cl; /* void */) {
             ln = cl;
             cl = cl->next;
-            ngx_pfree(c->pool, ln->buf->start);
+            ngx_pfree_size(c->pool, ln->buf->start,
+                           ln->buf->end - ln->buf->start);
+            ngx_pfree_size(c->pool, ln->buf, sizeof(ngx_buf_t));
             ngx_free_chain(c->pool, ln);
         }
 
@@ -3037,7 +3062,9 @@ ngx_http_set_keepalive(ngx_http_request_t *r)
         for (cl = hc->busy; cl; /* void */) {
             ln = cl;
             cl = cl->next;
-            ngx_pfree(c->pool, ln->buf->start);
+            ngx_pfree_size(c->pool, ln->buf->start,
+                           ln->buf->end - ln->buf->start);
+            ngx_pfree_size(c->pool, ln->buf, sizeof(ngx_buf_t));
             ngx_free_chain(c->pool, ln);
         }
 
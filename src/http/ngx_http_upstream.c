@@ -98,6 +98,20 @@ static void ngx_http_upstream_dummy_handler(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_next(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_uint_t ft_type);
+static void ngx_http_upstream_hedge_init(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_timer_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hedge_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_upstream_hedge_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_upstream_hedge_resume(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_cancel(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_uint_t status);
+static void ngx_http_upstream_hedge_close(ngx_connection_t *c);
+static ngx_uint_t ngx_http_upstream_hedge_bucket(ngx_msec_t time);
+static void ngx_http_upstream_hedge_sample(
+    ngx_http_upstream_hedge_conf_t *hcf, ngx_msec_t time);
 static void ngx_http_upstream_cleanup(void *data);
 static void ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_int_t rc);
@@ -172,6 +186,8 @@ static ngx_int_t ngx_http_upstream_cookie_variable(ngx_http_request_t *r,
 static char *ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy);
 static char *ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_upstream_hedge(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 static ngx_int_t ngx_http_upstream_set_local(ngx_http_request_t *r,
   ngx_http_upstream_t *u, ngx_http_upstream_local_t *local);
@@ -340,6 +356,13 @@ static ngx_command_t  ngx_http_upstream_commands[] = {
       0,
       NULL },
 
+    { ngx_string("hedge"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      ngx_http_upstream_hedge,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -712,6 +735,12 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
                 return;
             }
 
+            if (u->init_peer && u->init_peer(r) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+                return;
+            }
+
             ngx_http_upstream_connect(r, u);
 
             return;
@@ -781,6 +810,12 @@ found:
         return;
     }
 
+    if (u->init_peer && u->init_peer(r) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
     u->peer.start_time = ngx_current_msec;
 
     if (u->conf->next_upstream_tries
@@ -1205,6 +1240,12 @@ ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx)
         goto failed;
     }
 
+    if (u->init_peer && u->init_peer(r) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        goto failed;
+    }
+
     ngx_resolve_name_done(ctx);
     ur->ctx = NULL;
 
@@ -2009,6 +2050,10 @@ ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u,
 
     ngx_add_timer(c->read, u->conf->read_timeout);
 
+    if (u->upstream && u->upstream->hedge) {
+        ngx_http_upstream_hedge_init(r, u);
+    }
+
     if (c->read->ready) {
         ngx_http_upstream_process_header(r, u);
         return;
@@ -2264,6 +2309,13 @@ ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
             return;
         }
 
+        if (u->hedge && u->hedge->peer.connection) {
+
+            /* the hedge answered first */
+
+            ngx_http_upstream_hedge_cancel(r, u, 0);
+        }
+
         u->state->bytes_received += n;
 
         u->buffer.last += n;
@@ -2308,6 +2360,11 @@ ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     u->state->header_time = ngx_current_msec - u->state->response_time;
 
+    if (u->upstream && u->upstream->hedge) {
+        ngx_http_upstream_hedge_sample(u->upstream->hedge,
+                                       u->state->header_time);
+    }
+
     if (u->headers_in.status_n >= NGX_HTTP_SPECIAL_RESPONSE) {
 
         if (ngx_http_upstream_test_next(r, u) == NGX_OK) {
@@ -2546,6 +2603,13 @@ ngx_http_upstream_test_connect(ngx_connection_t *c)
     int        err;
     socklen_t  len;
 
+    if (c->fd == (ngx_socket_t) -1) {
+
+        /* a stream of a multiplexed connection, which is tested by itself */
+
+        return NGX_OK;
+    }
+
 #if (NGX_HAVE_KQUEUE)
 
     if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
@@ -4043,6 +4107,10 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http next upstream, %xi", ft_type);
 
+    if (u->hedge && u->hedge->event.timer_set) {
+        ngx_del_timer(&u->hedge->event);
+    }
+
     if (u->peer.sockaddr) {
 
         if (ft_type == NGX_HTTP_UPSTREAM_FT_HTTP_403
@@ -4107,6 +4175,14 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
 
     u->state->status = status;
 
+    if (u->hedge && u->hedge->peer.connection) {
+
+        /* the hedge failed, the outrun attempt goes on */
+
+        ngx_http_upstream_hedge_resume(r, u);
+        return;
+    }
+
     timeout = u->conf->next_upstream_timeout;
 
     if (u->request_sent
@@ -4169,6 +4245,457 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
 }
 
 
+/*
+ * A request which got no response header from its upstream within
+ * the hedge delay is sent to another server as well.  The attempt which
+ * is outrun keeps its connection while the hedge goes through the usual
+ * states, and whichever starts to respond first is kept.  The outrun
+ * attempt keeps its peer until its connection is closed, and the hedge
+ * gets a peer from a balancer state of its own, which is never the
+ * server it outruns.
+ */
+
+static void
+ngx_http_upstream_hedge_init(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_msec_t                       delay, elapsed;
+    ngx_http_upstream_hedge_t       *h;
+    ngx_http_upstream_hedge_conf_t  *hcf;
+
+    hcf = u->upstream->hedge;
+
+    /* the streams of multiplexed connections cannot be detached */
+
+    if (u->init_peer
+        || (r->method & (NGX_HTTP_POST|NGX_HTTP_LOCK|NGX_HTTP_PATCH))
+        || r->request_body_no_buffering
+        || u->peer.tries < 2)
+    {
+        return;
+    }
+
+    h = u->hedge;
+
+    if (h == NULL) {
+        h = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_hedge_t));
+        if (h == NULL) {
+            return;
+        }
+
+        h->event.handler = ngx_http_upstream_hedge_timer_handler;
+        h->event.data = r;
+        h->event.log = r->connection->log;
+
+        u->hedge = h;
+
+        /* each request earns a share of a hedge, up to ten hedges */
+
+        hcf->tokens += hcf->budget;
+
+        if (hcf->tokens > 10 * 100) {
+            hcf->tokens = 10 * 100;
+        }
+
+    } else if (h->hedged) {
+        return;
+    }
+
+    delay = hcf->delay;
+
+    if (delay == 0) {
+
+        /* not enough header times are known yet */
+
+        return;
+    }
+
+    elapsed = ngx_current_msec - u->state->response_time;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge delay: %M, elapsed: %M",
+                   delay, elapsed);
+
+    ngx_add_timer(&h->event, delay > elapsed ? delay - elapsed : 1);
+}
+
+
+static void
+ngx_http_upstream_hedge_timer_handler(ngx_event_t *ev)
+{
+    ngx_msec_t                       timeout;
+    ngx_connection_t                *c, *pc;
+    ngx_http_request_t              *r;
+    ngx_http_upstream_t             *u;
+    ngx_http_upstream_hedge_t       *h;
+    ngx_http_upstream_hedge_conf_t  *hcf;
+
+    r = ev->data;
+    c = r->connection;
+    u = r->upstream;
+    h = u->hedge;
+    hcf = u->upstream->hedge;
+
+    ngx_http_set_log_request(c->log, r);
+
+    pc = u->peer.connection;
+    timeout = u->conf->next_upstream_timeout;
+
+    if (pc == NULL
+        || u->read_event_handler != ngx_http_upstream_process_header
+        || u->write_event_handler != ngx_http_upstream_dummy_handler
+        || (u->buffer.start && u->buffer.last != u->buffer.pos)
+        || u->peer.tries < 2
+        || (timeout && ngx_current_msec - u->peer.start_time >= timeout))
+    {
+        return;
+    }
+
+    if (hcf->tokens < 100) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http upstream hedge budget exhausted");
+        return;
+    }
+
+    hcf->tokens -= 100;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream hedge, outrun: %V", u->peer.name);
+
+    h->hedged = 1;
+    h->peer = u->peer;
+
+    u->peer.connection = NULL;
+    u->peer.sockaddr = NULL;
+    u->peer.data = NULL;
+
+    if (u->upstream->peer.init(r, u->upstream) != NGX_OK) {
+        u->peer = h->peer;
+        h->peer.connection = NULL;
+        return;
+    }
+
+    u->peer.tries = h->peer.tries - 1;
+
+    h->get = u->peer.get;
+    u->peer.get = ngx_http_upstream_hedge_get_peer;
+
+    h->state = u->state
+               - (ngx_http_upstream_state_t *) r->upstream_states->elts;
+    h->start = u->state->response_time;
+
+    pc->read->handler = ngx_http_upstream_hedge_handler;
+    pc->write->handler = ngx_http_upstream_hedge_handler;
+
+    ngx_http_upstream_connect(r, u);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_upstream_hedge_handler(ngx_event_t *ev)
+{
+    int                         n;
+    char                        buf[1];
+    ngx_err_t                   err;
+    ngx_uint_t                  status;
+    ngx_connection_t           *c;
+    ngx_http_request_t         *r;
+    ngx_http_upstream_t        *u;
+    ngx_http_upstream_hedge_t  *h;
+
+    c = ev->data;
+    r = c->data;
+    u = r->upstream;
+    h = u->hedge;
+
+    if (ev->write) {
+        return;
+    }
+
+    ngx_http_set_log_request(r->connection->log, r);
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream \"%V\" timed out after hedging",
+                      h->peer.name);
+        status = NGX_HTTP_GATEWAY_TIME_OUT;
+        goto failed;
+    }
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    err = ngx_socket_errno;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, err,
+                   "http upstream hedge outrun recv(): %d", n);
+
+    if (n > 0) {
+
+        /* the outrun attempt answered first */
+
+        ngx_http_upstream_hedge_resume(r, u);
+        goto done;
+    }
+
+    if (n == -1 && err == NGX_EAGAIN) {
+        if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+            status = NGX_HTTP_BAD_GATEWAY;
+            goto failed;
+        }
+
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, c->log, n == 0 ? 0 : err,
+                  "upstream \"%V\" prematurely closed connection "
+                  "after hedging", h->peer.name);
+
+    status = NGX_HTTP_BAD_GATEWAY;
+
+failed:
+
+    ngx_http_upstream_hedge_cancel(r, u, status);
+
+done:
+
+    ngx_http_run_posted_requests(r->connection);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hedge_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_int_t                   rc;
+    ngx_uint_t                  n;
+    ngx_connection_t           *c;
+    ngx_http_upstream_t        *u;
+    ngx_http_upstream_hedge_t  *h;
+
+    u = (ngx_http_upstream_t *)
+            ((u_char *) pc - offsetof(ngx_http_upstream_t, peer));
+    h = u->hedge;
+
+    pc->get = h->get;
+
+    /* the server is marked as tried, so the next one differs */
+
+    for (n = 0; n < 2; n++) {
+        rc = pc->get(pc, data);
+
+        if ((rc != NGX_OK && rc != NGX_DONE)
+            || ngx_cmp_sockaddr(pc->sockaddr, pc->socklen,
+                                h->peer.sockaddr, h->peer.socklen, 1)
+               != NGX_OK)
+        {
+            return rc;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "http upstream hedge skips outrun: %V", pc->name);
+
+        c = pc->connection;
+
+        if (c) {
+            pc->connection = NULL;
+            ngx_http_upstream_hedge_close(c);
+        }
+
+        pc->free(pc, data, NGX_PEER_NEXT);
+        pc->sockaddr = NULL;
+        pc->tries++;
+    }
+
+    pc->name = &u->upstream->host;
+
+    return NGX_BUSY;
+}
+
+
+static void
+ngx_http_upstream_hedge_resume(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_connection_t           *c;
+    ngx_http_upstream_hedge_t  *h;
+
+    h = u->hedge;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge cancelled, back to: %V",
+                   h->peer.name);
+
+    if (u->peer.sockaddr) {
+        u->peer.free(&u->peer, u->peer.data, NGX_PEER_NEXT);
+        u->peer.sockaddr = NULL;
+    }
+
+    if (u->peer.connection) {
+        ngx_http_upstream_hedge_close(u->peer.connection);
+    }
+
+    if (u->state->response_time) {
+        u->state->response_time = ngx_current_msec - u->state->response_time;
+    }
+
+    /* the outrun attempt goes on with its own peer */
+
+    u->peer = h->peer;
+
+    h->peer.connection = NULL;
+    h->peer.sockaddr = NULL;
+
+    c = u->peer.connection;
+
+    u->state = (ngx_http_upstream_state_t *) r->upstream_states->elts
+               + h->state;
+    u->state->response_time = h->start;
+
+    c->read->handler = ngx_http_upstream_handler;
+    c->write->handler = ngx_http_upstream_handler;
+
+    u->writer.connection = c;
+
+    u->read_event_handler = ngx_http_upstream_process_header;
+    u->write_event_handler = ngx_http_upstream_dummy_handler;
+
+    u->request_sent = 1;
+    u->request_body_sent = 1;
+
+    if (c->read->ready) {
+        ngx_http_upstream_process_header(r, u);
+    }
+}
+
+
+static void
+ngx_http_upstream_hedge_cancel(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_uint_t status)
+{
+    ngx_connection_t           *c;
+    ngx_http_upstream_state_t  *state;
+    ngx_http_upstream_hedge_t  *h;
+
+    h = u->hedge;
+    c = h->peer.connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "close outrun http upstream connection: %d", c->fd);
+
+    state = (ngx_http_upstream_state_t *) r->upstream_states->elts + h->state;
+    state->status = status;
+
+    h->peer.connection = NULL;
+
+    ngx_http_upstream_hedge_close(c);
+
+    /* an outrun attempt which timed out or broke counts as failed */
+
+    if (h->peer.sockaddr) {
+        h->peer.free(&h->peer, h->peer.data,
+                     status ? NGX_PEER_FAILED : NGX_PEER_NEXT);
+        h->peer.sockaddr = NULL;
+    }
+}
+
+
+static void
+ngx_http_upstream_hedge_close(ngx_connection_t *c)
+{
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        c->ssl->no_wait_shutdown = 1;
+        c->ssl->no_send_shutdown = 1;
+
+        (void) ngx_ssl_shutdown(c);
+    }
+#endif
+
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
+    }
+
+    ngx_close_connection(c);
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_hedge_bucket(ngx_msec_t time)
+{
+    ngx_uint_t  bits;
+
+    if (time < 8) {
+        return time;
+    }
+
+    for (bits = 3; time >> (bits + 1); bits++) { /* void */ }
+
+    bits = 8 + (bits - 3) * 4 + ((time >> (bits - 2)) & 3);
+
+    return ngx_min(bits, NGX_HTTP_UPSTREAM_HEDGE_BUCKETS - 1);
+}
+
+
+static void
+ngx_http_upstream_hedge_sample(ngx_http_upstream_hedge_conf_t *hcf,
+    ngx_msec_t time)
+{
+    ngx_uint_t  i, n, sum;
+
+    if (hcf->percentile == 0) {
+        return;
+    }
+
+    hcf->buckets[ngx_http_upstream_hedge_bucket(time)]++;
+    hcf->samples++;
+
+    if (hcf->samples % 16) {
+        return;
+    }
+
+    /* the delay is the upper bound of the bucket with the percentile */
+
+    n = (hcf->samples * hcf->percentile + 999) / 1000;
+    sum = 0;
+
+    for (i = 0; i < NGX_HTTP_UPSTREAM_HEDGE_BUCKETS - 1; i++) {
+        sum += hcf->buckets[i];
+
+        if (sum >= n) {
+            break;
+        }
+    }
+
+    if (i < 8) {
+        hcf->delay = i + 1;
+
+    } else {
+        hcf->delay = (ngx_msec_t) (5 + (i - 8) % 4) << ((i - 8) / 4 + 1);
+    }
+
+    if (hcf->samples < 64) {
+        hcf->delay = 0;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http upstream hedge samples: %ui, delay: %M",
+                   hcf->samples, hcf->delay);
+
+    if (hcf->samples < 2048) {
+        return;
+    }
+
+    /* older times count less */
+
+    hcf->samples = 0;
+
+    for (i = 0; i < NGX_HTTP_UPSTREAM_HEDGE_BUCKETS; i++) {
+        hcf->buckets[i] /= 2;
+        hcf->samples += hcf->buckets[i];
+    }
+}
+
+
 static void
 ngx_http_upstream_cleanup(void *data)
 {
@@ -4214,6 +4741,16 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
         }
     }
 
+    if (u->hedge) {
+        if (u->hedge->event.timer_set) {
+            ngx_del_timer(&u->hedge->event);
+        }
+
+        if (u->hedge->peer.connection) {
+            ngx_http_upstream_hedge_cancel(r, u, 0);
+        }
+    }
+
     u->finalize_request(r, rc);
 
     if (u->peer.free && u->peer.sockaddr) {
@@ -6032,6 +6569,106 @@ ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
 }
 
 
+static char *
+ngx_http_upstream_hedge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t  *uscf = conf;
+
+    u_char                          *p, *last;
+    ngx_str_t                       *value, s;
+    ngx_int_t                        n;
+    ngx_uint_t                       i;
+    ngx_http_upstream_hedge_conf_t  *hcf;
+
+    if (uscf->hedge) {
+        return "is duplicate";
+    }
+
+    hcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hedge_conf_t));
+    if (hcf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    i = 1;
+
+    if (value[1].data[0] == 'p') {
+
+        /* "p95", "p99.9" */
+
+        p = value[1].data + 1;
+        last = value[1].data + value[1].len;
+
+        for (n = 0; p < last && *p >= '0' && *p <= '9'; p++) {
+            n = n * 10 + *p - '0';
+
+            if (n > 99) {
+                goto invalid;
+            }
+        }
+
+        n *= 10;
+
+        if (p + 2 == last && p[0] == '.' && p[1] >= '0' && p[1] <= '9') {
+            n += p[1] - '0';
+            p = last;
+        }
+
+        if (p != last || n == 0 || p == value[1].data + 1) {
+            goto invalid;
+        }
+
+        hcf->percentile = n;
+
+    } else {
+        hcf->delay = ngx_parse_time(&value[1], 0);
+
+        if (hcf->delay == (ngx_msec_t) NGX_ERROR || hcf->delay == 0) {
+            goto invalid;
+        }
+    }
+
+    hcf->budget = 10;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "budget=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            if (s.len == 0 || s.data[s.len - 1] != '%') {
+                goto invalid;
+            }
+
+            n = ngx_atoi(s.data, s.len - 1);
+
+            if (n == NGX_ERROR || n == 0 || n > 100) {
+                goto invalid;
+            }
+
+            hcf->budget = n;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    uscf->hedge = hcf;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
 static ngx_int_t
 ngx_http_upstream_set_local(ngx_http_request_t *r, ngx_http_upstream_t *u,
     ngx_http_upstream_local_t *local)
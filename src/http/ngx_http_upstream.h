@@ -116,12 +116,33 @@ typedef struct {
 #define NGX_HTTP_UPSTREAM_MAX_CONNS     0x0100
 
 
+#define NGX_HTTP_UPSTREAM_HEDGE_BUCKETS  64
+
+
+/*
+ * The header times are kept per worker in a histogram with four buckets
+ * per power of two, so that a percentile is known within 25%.
+ */
+
+typedef struct {
+    ngx_msec_t                       delay;
+    ngx_uint_t                       percentile;   /* in permille */
+    ngx_uint_t                       budget;       /* in percents */
+
+    ngx_uint_t                       tokens;
+    ngx_uint_t                       samples;
+    ngx_uint_t                       buckets[NGX_HTTP_UPSTREAM_HEDGE_BUCKETS];
+} ngx_http_upstream_hedge_conf_t;
+
+
 struct ngx_http_upstream_srv_conf_s {
     ngx_http_upstream_peer_t         peer;
     void                           **srv_conf;
 
     ngx_array_t                     *servers;  /* ngx_http_upstream_server_t */
 
+    ngx_http_upstream_hedge_conf_t  *hedge;
+
     ngx_uint_t                       flags;
     ngx_str_t                        host;
     u_char                          *file_name;
@@ -306,6 +327,16 @@ typedef struct {
 } ngx_http_upstream_resolved_t;
 
 
+typedef struct {
+    ngx_event_t                      event;
+    ngx_peer_connection_t            peer;         /* the outrun attempt */
+    ngx_event_get_peer_pt            get;
+    ngx_uint_t                       state;
+    ngx_msec_t                       start;
+    unsigned                         hedged:1;
+} ngx_http_upstream_hedge_t;
+
+
 typedef void (*ngx_http_upstream_handler_pt)(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 
@@ -349,6 +380,7 @@ struct ngx_http_upstream_s {
 #if (NGX_HTTP_CACHE)
     ngx_int_t                      (*create_key)(ngx_http_request_t *r);
 #endif
+    ngx_int_t                      (*init_peer)(ngx_http_request_t *r);
     ngx_int_t                      (*create_request)(ngx_http_request_t *r);
     ngx_int_t                      (*reinit_request)(ngx_http_request_t *r);
     ngx_int_t                      (*process_header)(ngx_http_request_t *r);
@@ -363,6 +395,7 @@ struct ngx_http_upstream_s {
     ngx_msec_t                       timeout;
 
     ngx_http_upstream_state_t       *state;
+    ngx_http_upstream_hedge_t       *hedge;
 
     ngx_str_t                        method;
     ngx_str_t                        schema;
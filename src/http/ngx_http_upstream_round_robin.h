@@ -16,6 +16,11 @@
 
 typedef struct ngx_http_upstream_rr_peer_s   ngx_http_upstream_rr_peer_t;
 
+
+/* set in peer->down by health checks, in addition to the "down" flag */
+#define NGX_HTTP_UPSTREAM_PEER_UNHEALTHY  0x02
+
+
 struct ngx_http_upstream_rr_peer_s {
     struct sockaddr                *sockaddr;
     socklen_t                       socklen;
@@ -38,6 +43,9 @@ struct ngx_http_upstream_rr_peer_s {
     ngx_msec_t                      slow_start;
     ngx_msec_t                      start_time;
 
+    ngx_msec_t                      ewma;       /* response time average */
+    ngx_msec_t                      ewma_time;
+
     ngx_uint_t                      down;
 
 #if (NGX_HTTP_SSL || NGX_COMPAT)
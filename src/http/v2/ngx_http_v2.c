@@ -142,6 +142,7 @@ static ngx_int_t ngx_http_v2_send_goaway(ngx_http_v2_connection_t *h2c,
 static ngx_http_v2_out_frame_t *ngx_http_v2_get_frame(
     ngx_http_v2_connection_t *h2c, size_t length, ngx_uint_t type,
     u_char flags, ngx_uint_t sid);
+static ngx_buf_t *ngx_http_v2_alloc_frame_buf(ngx_pool_t *pool, size_t size);
 static ngx_int_t ngx_http_v2_frame_handler(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame);
 
@@ -2495,7 +2496,12 @@ ngx_http_v2_send_settings(ngx_http_v2_connection_t *h2c)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
                    "http2 send SETTINGS frame");
 
-    frame = ngx_palloc(h2c->pool, sizeof(ngx_http_v2_out_frame_t));
+    /*
+     * the frame is freed once sent, so that the control frames allocated
+     * later by ngx_http_v2_get_frame() reuse its memory
+     */
+
+    frame = ngx_palloc_reuse(h2c->pool, sizeof(ngx_http_v2_out_frame_t));
     if (frame == NULL) {
         return NGX_ERROR;
     }
@@ -2507,13 +2513,12 @@ ngx_http_v2_send_settings(ngx_http_v2_connection_t *h2c)
 
     len = NGX_HTTP_V2_SETTINGS_PARAM_SIZE * 3;
 
-    buf = ngx_create_temp_buf(h2c->pool, NGX_HTTP_V2_FRAME_HEADER_SIZE + len);
+    buf = ngx_http_v2_alloc_frame_buf(h2c->pool,
+                                      NGX_HTTP_V2_FRAME_HEADER_SIZE + len);
     if (buf == NULL) {
         return NGX_ERROR;
     }
 
-    buf->last_buf = 1;
-
     cl->buf = buf;
     cl->next = NULL;
 
@@ -2570,6 +2575,10 @@ ngx_http_v2_settings_frame_handler(ngx_http_v2_connection_t *h2c,
 
     ngx_free_chain(h2c->pool, frame->first);
 
+    ngx_pfree_size(h2c->pool, buf->start, buf->end - buf->start);
+    ngx_pfree_size(h2c->pool, buf, sizeof(ngx_buf_t));
+    ngx_pfree_size(h2c->pool, frame, sizeof(ngx_http_v2_out_frame_t));
+
     return NGX_OK;
 }
 
@@ -2679,23 +2688,23 @@ ngx_http_v2_get_frame(ngx_http_v2_connection_t *h2c, size_t length,
     } else {
         pool = h2c->pool ? h2c->pool : h2c->connection->pool;
 
-        frame = ngx_pcalloc(pool, sizeof(ngx_http_v2_out_frame_t));
+        frame = ngx_palloc_reuse(pool, sizeof(ngx_http_v2_out_frame_t));
         if (frame == NULL) {
             return NULL;
         }
 
+        ngx_memzero(frame, sizeof(ngx_http_v2_out_frame_t));
+
         frame->first = ngx_alloc_chain_link(pool);
         if (frame->first == NULL) {
             return NULL;
         }
 
-        buf = ngx_create_temp_buf(pool, NGX_HTTP_V2_FRAME_BUFFER_SIZE);
+        buf = ngx_http_v2_alloc_frame_buf(pool, NGX_HTTP_V2_FRAME_BUFFER_SIZE);
         if (buf == NULL) {
             return NULL;
         }
 
-        buf->last_buf = 1;
-
         frame->first->buf = buf;
         frame->last = frame->first;
 
@@ -2723,6 +2732,33 @@ ngx_http_v2_get_frame(ngx_http_v2_connection_t *h2c, size_t length,
 }
 
 
+static ngx_buf_t *
+ngx_http_v2_alloc_frame_buf(ngx_pool_t *pool, size_t size)
+{
+    ngx_buf_t  *buf;
+
+    buf = ngx_palloc_reuse(pool, sizeof(ngx_buf_t));
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(buf, sizeof(ngx_buf_t));
+
+    buf->start = ngx_palloc_reuse(pool, size);
+    if (buf->start == NULL) {
+        return NULL;
+    }
+
+    buf->pos = buf->start;
+    buf->last = buf->start;
+    buf->end = buf->start + size;
+    buf->temporary = 1;
+    buf->last_buf = 1;
+
+    return buf;
+}
+
+
 static ngx_int_t
 ngx_http_v2_frame_handler(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame)
@@ -293,10 +293,27 @@ ngx_int_t ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len,
 size_t ngx_http_v2_huff_encode(u_char *src, size_t len, u_char *dst,
     ngx_uint_t lower);
 
+u_char *ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len,
+    u_char *tmp, ngx_uint_t lower);
+u_char *ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix,
+    ngx_uint_t value);
+
+ngx_int_t ngx_http_v2_upstream_init_peer(ngx_http_request_t *r,
+    ngx_msec_t idle_timeout);
+
 
 #define ngx_http_v2_prefix(bits)  ((1 << (bits)) - 1)
 
 
+#define ngx_http_v2_indexed(i)      (128 + (i))
+#define ngx_http_v2_inc_indexed(i)  (64 + (i))
+
+#define ngx_http_v2_write_name(dst, src, len, tmp)                            \
+    ngx_http_v2_string_encode(dst, src, len, tmp, 1)
+#define ngx_http_v2_write_value(dst, src, len, tmp)                           \
+    ngx_http_v2_string_encode(dst, src, len, tmp, 0)
+
+
 #if (NGX_HAVE_NONALIGNED)
 
 #define ngx_http_v2_parse_uint16(p)  ntohs(*(uint16_t *) (p))
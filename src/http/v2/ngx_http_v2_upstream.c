@@ -0,0 +1,2635 @@
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/*
+ * HTTP/2 connections to upstream servers ("proxy_http_version 2").
+ *
+ * Each worker keeps its connections to upstream servers in a list, and
+ * a request takes a stream on a connection to the peer chosen by the
+ * balancer, opening a new connection only if the existing ones are at
+ * their concurrent streams limit.  The stream is seen by the upstream
+ * module as a fake connection, like the streams of client connections
+ * in ngx_http_v2.c are seen by the rest of the http modules: the request
+ * header created by the proxy module is translated into a HEADERS frame
+ * and the response header back into HTTP/1.x text, so the proxy module
+ * parses the response as usual.
+ *
+ * Only cleartext connections with prior knowledge are supported.
+ */
+
+
+#define NGX_HTTP_V2_UPSTREAM_FRAME_SIZE      (1 << 14)
+#define NGX_HTTP_V2_UPSTREAM_WINDOW          NGX_HTTP_V2_DEFAULT_WINDOW
+#define NGX_HTTP_V2_UPSTREAM_MAX_STREAMS     128
+#define NGX_HTTP_V2_UPSTREAM_MAX_SID         0x7fffffff
+#define NGX_HTTP_V2_UPSTREAM_OUTPUT_LIMIT    (64 * 1024)
+#define NGX_HTTP_V2_UPSTREAM_HEADER_LIMIT    (64 * 1024)
+#define NGX_HTTP_V2_UPSTREAM_INDEX_SIZE      32
+#define NGX_HTTP_V2_UPSTREAM_POOL_SIZE       1024
+#define NGX_HTTP_V2_UPSTREAM_STREAM_POOL     128
+
+#define NGX_HTTP_V2_NO_ERROR                 0x0
+#define NGX_HTTP_V2_PROTOCOL_ERROR           0x1
+#define NGX_HTTP_V2_FLOW_CTRL_ERROR          0x3
+#define NGX_HTTP_V2_CANCEL                   0x8
+
+#define NGX_HTTP_V2_ENABLE_PUSH_SETTING      0x2
+#define NGX_HTTP_V2_MAX_STREAMS_SETTING      0x3
+#define NGX_HTTP_V2_INIT_WINDOW_SIZE_SETTING 0x4
+#define NGX_HTTP_V2_MAX_FRAME_SIZE_SETTING   0x5
+
+#define NGX_HTTP_V2_SETTINGS_PARAM_SIZE      6
+
+#define NGX_HTTP_V2_UPSTREAM_PREFACE  "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+#define ngx_http_v2_upstream_index(sid)                                       \
+    (((sid) >> 1) % NGX_HTTP_V2_UPSTREAM_INDEX_SIZE)
+
+
+typedef struct ngx_http_v2_upstream_s         ngx_http_v2_upstream_t;
+typedef struct ngx_http_v2_upstream_stream_s  ngx_http_v2_upstream_stream_t;
+
+
+struct ngx_http_v2_upstream_s {
+    ngx_connection_t                *connection;
+    ngx_http_v2_connection_t        *hpack;     /* the decoder state only */
+
+    ngx_queue_t                      queue;
+    ngx_queue_t                      streams;
+
+    struct sockaddr                 *sockaddr;
+    socklen_t                        socklen;
+    ngx_str_t                        name;
+
+    ngx_uint_t                       nstreams;
+    ngx_uint_t                       max_streams;
+    ngx_uint_t                       next_sid;
+
+    ngx_msec_t                       idle_timeout;  /* of the last stream */
+
+    size_t                           send_window;
+    size_t                           recv_window;
+    size_t                           init_window;
+
+    ngx_buf_t                       *in;
+    ngx_buf_t                       *out;
+
+    ngx_uint_t                       header_sid;    /* awaits CONTINUATION */
+    ngx_uint_t                       header_fin;
+    u_char                          *header_block;
+    size_t                           header_len;
+    size_t                           header_size;
+
+    ngx_http_v2_upstream_stream_t   *index[NGX_HTTP_V2_UPSTREAM_INDEX_SIZE];
+    ngx_http_v2_upstream_stream_t   *free_streams;
+
+    ngx_pool_t                      *pool;
+    ngx_log_t                        log;
+
+    unsigned                         connected:1;
+    unsigned                         goaway:1;
+};
+
+
+struct ngx_http_v2_upstream_stream_s {
+    ngx_connection_t                 connection;    /* must be first */
+    ngx_event_t                      read;
+    ngx_event_t                      write;
+
+    ngx_http_v2_upstream_t          *upstream;
+    ngx_http_request_t              *request;
+
+    ngx_uint_t                       id;
+    ngx_http_v2_upstream_stream_t   *next;          /* index or free list */
+    ngx_queue_t                      queue;
+
+    ssize_t                          send_window;
+    size_t                           recv_window;
+
+    ngx_buf_t                       *header;        /* as HTTP/1.x text */
+    ngx_buf_t                        data;
+
+    unsigned                         headers_sent:1;
+    unsigned                         out_closed:1;
+    unsigned                         header_received:1;
+    unsigned                         in_closed:1;
+    unsigned                         blocked:1;
+    unsigned                         reset:1;
+    unsigned                         error:1;
+};
+
+
+typedef struct {
+    ngx_http_request_t              *request;
+    ngx_http_v2_upstream_stream_t   *stream;
+    ngx_msec_t                       idle_timeout;
+
+    void                            *data;
+    ngx_event_get_peer_pt            original_get_peer;
+    ngx_event_free_peer_pt           original_free_peer;
+} ngx_http_v2_upstream_peer_data_t;
+
+
+static ngx_int_t ngx_http_v2_upstream_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_v2_upstream_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+
+static ngx_int_t ngx_http_v2_upstream_connect(ngx_peer_connection_t *pc,
+    ngx_http_request_t *r, ngx_http_v2_upstream_t **h2up);
+static ngx_int_t ngx_http_v2_upstream_connected(ngx_http_v2_upstream_t *h2u);
+static void ngx_http_v2_upstream_read_handler(ngx_event_t *rev);
+static void ngx_http_v2_upstream_write_handler(ngx_event_t *wev);
+static ngx_int_t ngx_http_v2_upstream_send(ngx_http_v2_upstream_t *h2u);
+static void ngx_http_v2_upstream_close(ngx_http_v2_upstream_t *h2u,
+    ngx_uint_t timedout);
+static u_char *ngx_http_v2_upstream_log_error(ngx_log_t *log, u_char *buf,
+    size_t len);
+
+static ngx_http_v2_upstream_stream_t *ngx_http_v2_upstream_create_stream(
+    ngx_http_v2_upstream_t *h2u, ngx_http_request_t *r);
+static void ngx_http_v2_upstream_close_stream(
+    ngx_http_v2_upstream_stream_t *h2s);
+static ngx_http_v2_upstream_stream_t *ngx_http_v2_upstream_find_stream(
+    ngx_http_v2_upstream_t *h2u, ngx_uint_t sid);
+static void ngx_http_v2_upstream_stream_error(
+    ngx_http_v2_upstream_stream_t *h2s, ngx_uint_t status);
+static void ngx_http_v2_upstream_unblock(ngx_http_v2_upstream_t *h2u);
+static void ngx_http_v2_upstream_post(ngx_event_t *ev);
+
+static ngx_int_t ngx_http_v2_upstream_process(ngx_http_v2_upstream_t *h2u);
+static ngx_int_t ngx_http_v2_upstream_data(ngx_http_v2_upstream_t *h2u,
+    u_char *pos, size_t len, ngx_uint_t flags, ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_upstream_headers(ngx_http_v2_upstream_t *h2u,
+    u_char *pos, size_t len, ngx_uint_t flags, ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_upstream_continuation(
+    ngx_http_v2_upstream_t *h2u, u_char *pos, size_t len, ngx_uint_t flags,
+    ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_upstream_rst_stream(ngx_http_v2_upstream_t *h2u,
+    u_char *pos, size_t len, ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_upstream_settings(ngx_http_v2_upstream_t *h2u,
+    u_char *pos, size_t len, ngx_uint_t flags, ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_upstream_ping(ngx_http_v2_upstream_t *h2u,
+    u_char *pos, size_t len, ngx_uint_t flags, ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_upstream_goaway(ngx_http_v2_upstream_t *h2u,
+    u_char *pos, size_t len, ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_upstream_window_update(
+    ngx_http_v2_upstream_t *h2u, u_char *pos, size_t len, ngx_uint_t sid);
+
+static ngx_int_t ngx_http_v2_upstream_header_block(
+    ngx_http_v2_upstream_t *h2u, ngx_uint_t sid, u_char *pos, u_char *end,
+    ngx_uint_t fin);
+static ngx_int_t ngx_http_v2_upstream_parse_int(u_char **pos, u_char *end,
+    ngx_uint_t prefix);
+static ngx_int_t ngx_http_v2_upstream_parse_string(
+    ngx_http_v2_upstream_t *h2u, ngx_str_t *s, u_char **pos, u_char *end);
+static ngx_int_t ngx_http_v2_upstream_response_header(
+    ngx_http_v2_upstream_stream_t *h2s, ngx_array_t *headers,
+    ngx_uint_t fin);
+static ngx_uint_t ngx_http_v2_upstream_hop_header(ngx_str_t *name);
+
+static u_char *ngx_http_v2_upstream_frame(ngx_http_v2_upstream_t *h2u,
+    size_t len, ngx_uint_t type, ngx_uint_t flags, ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_upstream_send_window_update(
+    ngx_http_v2_upstream_t *h2u, ngx_uint_t sid, size_t window);
+static ngx_int_t ngx_http_v2_upstream_send_rst_stream(
+    ngx_http_v2_upstream_t *h2u, ngx_uint_t sid, ngx_uint_t status);
+static ngx_int_t ngx_http_v2_upstream_request_header(
+    ngx_http_v2_upstream_stream_t *h2s, ngx_buf_t *b);
+static u_char *ngx_http_v2_upstream_parse_line(u_char *p, u_char *end,
+    ngx_str_t *name, ngx_str_t *value);
+
+static ssize_t ngx_http_v2_upstream_recv(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ssize_t ngx_http_v2_upstream_recv_chain(ngx_connection_t *c,
+    ngx_chain_t *cl, off_t limit);
+static ngx_chain_t *ngx_http_v2_upstream_send_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+static size_t ngx_http_v2_upstream_read_data(
+    ngx_http_v2_upstream_stream_t *h2s, u_char *buf, size_t size);
+static ssize_t ngx_http_v2_upstream_read_end(
+    ngx_http_v2_upstream_stream_t *h2s);
+
+
+static ngx_queue_t  ngx_http_v2_upstream_connections;
+
+
+static ngx_str_t  ngx_http_v2_upstream_hop_headers[] = {
+    ngx_string("connection"),
+    ngx_string("keep-alive"),
+    ngx_string("proxy-connection"),
+    ngx_string("transfer-encoding"),
+    ngx_string("upgrade"),
+    ngx_null_string
+};
+
+
+ngx_int_t
+ngx_http_v2_upstream_init_peer(ngx_http_request_t *r, ngx_msec_t idle_timeout)
+{
+    ngx_http_upstream_t               *u;
+    ngx_http_v2_upstream_peer_data_t  *pd;
+
+    u = r->upstream;
+
+#if (NGX_HTTP_SSL)
+    if (u->ssl) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "HTTP/2 over SSL is not supported for upstreams");
+        return NGX_ERROR;
+    }
+#endif
+
+    pd = ngx_palloc(r->pool, sizeof(ngx_http_v2_upstream_peer_data_t));
+    if (pd == NULL) {
+        return NGX_ERROR;
+    }
+
+    pd->request = r;
+    pd->stream = NULL;
+    pd->idle_timeout = idle_timeout;
+
+    pd->data = u->peer.data;
+    pd->original_get_peer = u->peer.get;
+    pd->original_free_peer = u->peer.free;
+
+    u->peer.data = pd;
+    u->peer.get = ngx_http_v2_upstream_get_peer;
+    u->peer.free = ngx_http_v2_upstream_free_peer;
+
+    if (ngx_http_v2_upstream_connections.next == NULL) {
+        ngx_queue_init(&ngx_http_v2_upstream_connections);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_v2_upstream_peer_data_t  *pd = data;
+
+    ngx_int_t                       rc;
+    ngx_queue_t                    *q;
+    ngx_http_v2_upstream_t         *h2u;
+    ngx_http_v2_upstream_stream_t  *h2s;
+
+    rc = pd->original_get_peer(pc, pd->data);
+
+    if (rc == NGX_DONE) {
+
+        /* an HTTP/1.x connection cached by keepalive cannot be used */
+
+        ngx_close_connection(pc->connection);
+        pc->connection = NULL;
+
+    } else if (rc != NGX_OK) {
+        return rc;
+    }
+
+    for (q = ngx_queue_head(&ngx_http_v2_upstream_connections);
+         q != ngx_queue_sentinel(&ngx_http_v2_upstream_connections);
+         q = ngx_queue_next(q))
+    {
+        h2u = ngx_queue_data(q, ngx_http_v2_upstream_t, queue);
+
+        if (h2u->goaway || h2u->nstreams >= h2u->max_streams) {
+            continue;
+        }
+
+        if (ngx_cmp_sockaddr(h2u->sockaddr, h2u->socklen,
+                             pc->sockaddr, pc->socklen, 1)
+            == NGX_OK)
+        {
+            goto found;
+        }
+    }
+
+    rc = ngx_http_v2_upstream_connect(pc, pd->request, &h2u);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+found:
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "http2 upstream get peer: %p streams:%ui connected:%d",
+                   h2u, h2u->nstreams, h2u->connected);
+
+    h2s = ngx_http_v2_upstream_create_stream(h2u, pd->request);
+    if (h2s == NULL) {
+        return NGX_ERROR;
+    }
+
+    pd->stream = h2s;
+
+    h2u->idle_timeout = pd->idle_timeout;
+
+    pc->connection = &h2s->connection;
+    pc->cached = h2u->connected;
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_v2_upstream_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_v2_upstream_peer_data_t  *pd = data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "http2 upstream free peer: %p", pd->stream);
+
+    if (pd->stream) {
+        ngx_http_v2_upstream_close_stream(pd->stream);
+        pd->stream = NULL;
+    }
+
+    pc->connection = NULL;
+
+    pd->original_free_peer(pc, pd->data, state);
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_connect(ngx_peer_connection_t *pc,
+    ngx_http_request_t *r, ngx_http_v2_upstream_t **h2up)
+{
+    u_char                  *p;
+    ngx_int_t                rc;
+    ngx_pool_t              *pool;
+    ngx_connection_t        *c;
+    ngx_peer_connection_t    peer;
+    ngx_http_v2_upstream_t  *h2u;
+
+    pool = ngx_create_pool(NGX_HTTP_V2_UPSTREAM_POOL_SIZE, pc->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    h2u = ngx_pcalloc(pool, sizeof(ngx_http_v2_upstream_t));
+    if (h2u == NULL) {
+        goto failed;
+    }
+
+    h2u->pool = pool;
+
+    h2u->log = *r->connection->log;
+    h2u->log.handler = ngx_http_v2_upstream_log_error;
+    h2u->log.data = h2u;
+    h2u->log.action = "connecting to upstream";
+
+    pool->log = &h2u->log;
+
+    h2u->sockaddr = ngx_palloc(pool, pc->socklen);
+    if (h2u->sockaddr == NULL) {
+        goto failed;
+    }
+
+    ngx_memcpy(h2u->sockaddr, pc->sockaddr, pc->socklen);
+    h2u->socklen = pc->socklen;
+
+    h2u->name.data = ngx_pstrdup(pool, pc->name);
+    if (h2u->name.data == NULL) {
+        goto failed;
+    }
+
+    h2u->name.len = pc->name->len;
+
+    h2u->hpack = ngx_pcalloc(pool, sizeof(ngx_http_v2_connection_t));
+    if (h2u->hpack == NULL) {
+        goto failed;
+    }
+
+    h2u->in = ngx_create_temp_buf(pool, NGX_HTTP_V2_FRAME_HEADER_SIZE
+                                        + NGX_HTTP_V2_UPSTREAM_FRAME_SIZE);
+    if (h2u->in == NULL) {
+        goto failed;
+    }
+
+    h2u->out = ngx_create_temp_buf(pool, NGX_HTTP_V2_UPSTREAM_OUTPUT_LIMIT
+                                         + NGX_HTTP_V2_FRAME_HEADER_SIZE
+                                         + NGX_HTTP_V2_UPSTREAM_FRAME_SIZE);
+    if (h2u->out == NULL) {
+        goto failed;
+    }
+
+    ngx_queue_init(&h2u->streams);
+
+    h2u->max_streams = NGX_HTTP_V2_UPSTREAM_MAX_STREAMS;
+    h2u->next_sid = 1;
+    h2u->send_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    h2u->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+    h2u->init_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+
+    ngx_memzero(&peer, sizeof(ngx_peer_connection_t));
+
+    peer.sockaddr = h2u->sockaddr;
+    peer.socklen = h2u->socklen;
+    peer.name = &h2u->name;
+    peer.get = ngx_event_get_peer;
+    peer.log = &h2u->log;
+    peer.log_error = pc->log_error;
+    peer.local = pc->local;
+    peer.type = pc->type;
+    peer.rcvbuf = pc->rcvbuf;
+#if (NGX_HAVE_TRANSPARENT_PROXY)
+    peer.transparent = pc->transparent;
+#endif
+
+    rc = ngx_event_connect_peer(&peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_destroy_pool(pool);
+        return (rc == NGX_DECLINED) ? NGX_DECLINED : NGX_ERROR;
+    }
+
+    c = peer.connection;
+
+    c->data = h2u;
+    c->pool = pool;
+    c->log = &h2u->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+    c->read->handler = ngx_http_v2_upstream_read_handler;
+    c->write->handler = ngx_http_v2_upstream_write_handler;
+
+    h2u->connection = c;
+    h2u->hpack->connection = c;
+    h2u->log.connection = c->number;
+
+    ngx_queue_insert_tail(&ngx_http_v2_upstream_connections, &h2u->queue);
+
+    /* the connection preface, push is disabled */
+
+    h2u->out->last = ngx_cpymem(h2u->out->last, NGX_HTTP_V2_UPSTREAM_PREFACE,
+                                sizeof(NGX_HTTP_V2_UPSTREAM_PREFACE) - 1);
+
+    p = ngx_http_v2_upstream_frame(h2u, NGX_HTTP_V2_SETTINGS_PARAM_SIZE,
+                                   NGX_HTTP_V2_SETTINGS_FRAME,
+                                   NGX_HTTP_V2_NO_FLAG, 0);
+    if (p == NULL) {
+        ngx_http_v2_upstream_close(h2u, 0);
+        return NGX_ERROR;
+    }
+
+    p = ngx_http_v2_write_uint16(p, NGX_HTTP_V2_ENABLE_PUSH_SETTING);
+    p = ngx_http_v2_write_uint32(p, 0);
+
+    if (ngx_http_v2_upstream_send_window_update(h2u, 0,
+                                                NGX_HTTP_V2_MAX_WINDOW
+                                                - NGX_HTTP_V2_DEFAULT_WINDOW)
+        != NGX_OK)
+    {
+        ngx_http_v2_upstream_close(h2u, 0);
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, r->upstream->conf->connect_timeout);
+
+    } else if (ngx_http_v2_upstream_connected(h2u) != NGX_OK) {
+        ngx_http_v2_upstream_close(h2u, 0);
+        return NGX_DECLINED;
+    }
+
+    *h2up = h2u;
+
+    return NGX_OK;
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_connected(ngx_http_v2_upstream_t *h2u)
+{
+    int                err;
+    socklen_t          len;
+    ngx_connection_t  *c;
+
+    c = h2u->connection;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
+        err = c->write->kq_errno ? c->write->kq_errno : c->read->kq_errno;
+
+        if (err) {
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        /*
+         * BSDs and Linux return 0 and set a pending error in err
+         * Solaris returns -1 and sets errno
+         */
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (ngx_tcp_nodelay(c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    h2u->connected = 1;
+    h2u->log.action = "proxying HTTP/2 connection";
+
+    ngx_post_event(c->write, &ngx_posted_events);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v2_upstream_read_handler(ngx_event_t *rev)
+{
+    ssize_t                  n;
+    ngx_buf_t               *b;
+    ngx_connection_t        *c;
+    ngx_http_v2_upstream_t  *h2u;
+
+    c = rev->data;
+    h2u = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http2 upstream read");
+
+    if (rev->timedout || c->close) {
+        ngx_http_v2_upstream_close(h2u, 0);
+        return;
+    }
+
+    if (!h2u->connected && ngx_http_v2_upstream_connected(h2u) != NGX_OK) {
+        ngx_http_v2_upstream_close(h2u, 0);
+        return;
+    }
+
+    b = h2u->in;
+
+    for ( ;; ) {
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == 0 || n == NGX_ERROR) {
+            if (n == 0 && h2u->nstreams) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream prematurely closed HTTP/2 connection");
+            }
+
+            ngx_http_v2_upstream_close(h2u, 0);
+            return;
+        }
+
+        b->last += n;
+
+        if (ngx_http_v2_upstream_process(h2u) != NGX_OK) {
+            ngx_http_v2_upstream_close(h2u, 0);
+            return;
+        }
+    }
+
+    if (h2u->goaway && h2u->nstreams == 0) {
+        ngx_http_v2_upstream_close(h2u, 0);
+        return;
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_v2_upstream_close(h2u, 0);
+    }
+}
+
+
+static void
+ngx_http_v2_upstream_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t        *c;
+    ngx_http_v2_upstream_t  *h2u;
+
+    c = wev->data;
+    h2u = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http2 upstream write");
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out");
+        ngx_http_v2_upstream_close(h2u, 1);
+        return;
+    }
+
+    if (!h2u->connected) {
+        if (ngx_http_v2_upstream_connected(h2u) != NGX_OK) {
+            ngx_http_v2_upstream_close(h2u, 0);
+        }
+
+        /* the write event is posted */
+
+        return;
+    }
+
+    if (ngx_http_v2_upstream_send(h2u) == NGX_ERROR) {
+        ngx_http_v2_upstream_close(h2u, 0);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_send(ngx_http_v2_upstream_t *h2u)
+{
+    ssize_t            n;
+    ngx_buf_t         *b;
+    ngx_connection_t  *c;
+
+    c = h2u->connection;
+    b = h2u->out;
+
+    while (b->pos < b->last) {
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            return NGX_AGAIN;
+        }
+
+        b->pos += n;
+    }
+
+    b->pos = b->start;
+    b->last = b->start;
+
+    ngx_http_v2_upstream_unblock(h2u);
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v2_upstream_close(ngx_http_v2_upstream_t *h2u, ngx_uint_t timedout)
+{
+    ngx_queue_t                    *q;
+    ngx_connection_t               *c;
+    ngx_http_v2_upstream_stream_t  *h2s;
+
+    c = h2u->connection;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream close: %p streams:%ui",
+                   h2u, h2u->nstreams);
+
+    ngx_queue_remove(&h2u->queue);
+
+    /* the streams are released by the requests, the memory is kept */
+
+    for (q = ngx_queue_head(&h2u->streams);
+         q != ngx_queue_sentinel(&h2u->streams);
+         q = ngx_queue_next(q))
+    {
+        h2s = ngx_queue_data(q, ngx_http_v2_upstream_stream_t, queue);
+
+        h2s->reset = 1;
+        h2s->read.timedout = timedout;
+
+        ngx_http_v2_upstream_stream_error(h2s, 0);
+    }
+
+    ngx_close_connection(c);
+
+    h2u->connection = NULL;
+
+    if (h2u->nstreams == 0) {
+        ngx_destroy_pool(h2u->pool);
+    }
+}
+
+
+static u_char *
+ngx_http_v2_upstream_log_error(ngx_log_t *log, u_char *buf, size_t len)
+{
+    u_char                  *p;
+    ngx_http_v2_upstream_t  *h2u;
+
+    p = buf;
+
+    if (log->action) {
+        p = ngx_snprintf(buf, len, " while %s", log->action);
+        len -= p - buf;
+        buf = p;
+    }
+
+    h2u = log->data;
+
+    p = ngx_snprintf(buf, len, ", upstream: \"%V\"", &h2u->name);
+
+    return p;
+}
+
+
+static ngx_http_v2_upstream_stream_t *
+ngx_http_v2_upstream_create_stream(ngx_http_v2_upstream_t *h2u,
+    ngx_http_request_t *r)
+{
+    ngx_buf_t                       data;
+    ngx_pool_t                     *pool;
+    ngx_event_t                    *rev, *wev;
+    ngx_connection_t               *c;
+    ngx_http_v2_upstream_stream_t  *h2s;
+
+    pool = ngx_create_pool(NGX_HTTP_V2_UPSTREAM_STREAM_POOL,
+                           r->connection->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    h2s = h2u->free_streams;
+
+    if (h2s) {
+        h2u->free_streams = h2s->next;
+
+        /* the receive buffer is reused */
+
+        data = h2s->data;
+
+    } else {
+        h2s = ngx_palloc(h2u->pool, sizeof(ngx_http_v2_upstream_stream_t));
+        if (h2s == NULL) {
+            ngx_destroy_pool(pool);
+            return NULL;
+        }
+
+        ngx_memzero(&data, sizeof(ngx_buf_t));
+    }
+
+    ngx_memzero(h2s, sizeof(ngx_http_v2_upstream_stream_t));
+
+    h2s->data = data;
+    h2s->data.pos = data.start;
+    h2s->data.last = data.start;
+
+    h2s->upstream = h2u;
+    h2s->request = r;
+    h2s->send_window = h2u->init_window;
+    h2s->recv_window = NGX_HTTP_V2_UPSTREAM_WINDOW;
+
+    rev = &h2s->read;
+    wev = &h2s->write;
+    c = &h2s->connection;
+
+    ngx_memcpy(c, h2u->connection, sizeof(ngx_connection_t));
+
+    rev->data = c;
+    rev->handler = ngx_http_empty_handler;
+    rev->log = r->connection->log;
+
+    /* nothing to read yet */
+
+    rev->active = 1;
+
+    wev->data = c;
+    wev->write = 1;
+    wev->ready = 1;
+    wev->handler = ngx_http_empty_handler;
+    wev->log = r->connection->log;
+
+    /* the socket is the session's, the stream must not touch it */
+
+    c->fd = (ngx_socket_t) -1;
+    c->data = r;
+    c->read = rev;
+    c->write = wev;
+    c->pool = pool;
+    c->log = r->connection->log;
+    c->recv = ngx_http_v2_upstream_recv;
+    c->recv_chain = ngx_http_v2_upstream_recv_chain;
+    c->send_chain = ngx_http_v2_upstream_send_chain;
+    c->sent = 0;
+    c->requests = 0;
+    c->idle = 0;
+    c->sendfile = 0;
+    c->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
+    c->tcp_nopush = NGX_TCP_NOPUSH_DISABLED;
+    c->sndlowat = 1;
+
+    /* keeps ngx_chain_writer() calling until the stream is half-closed */
+
+    c->buffered = NGX_HTTP_V2_BUFFERED;
+
+    ngx_queue_insert_tail(&h2u->streams, &h2s->queue);
+    h2u->nstreams++;
+
+    c = h2u->connection;
+
+    if (c->idle) {
+        c->idle = 0;
+
+        if (c->read->timer_set) {
+            ngx_del_timer(c->read);
+        }
+    }
+
+    return h2s;
+}
+
+
+static void
+ngx_http_v2_upstream_close_stream(ngx_http_v2_upstream_stream_t *h2s)
+{
+    ngx_event_t                     *ev;
+    ngx_connection_t                *c;
+    ngx_http_v2_upstream_t          *h2u;
+    ngx_http_v2_upstream_stream_t  **index;
+
+    h2u = h2s->upstream;
+    c = h2u->connection;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, h2s->connection.log, 0,
+                   "http2 upstream close stream %ui, in:%d out:%d reset:%d",
+                   h2s->id, h2s->in_closed, h2s->out_closed, h2s->reset);
+
+    if (h2s->id) {
+        if (c && !h2s->reset && !(h2s->in_closed && h2s->out_closed)) {
+            (void) ngx_http_v2_upstream_send_rst_stream(h2u, h2s->id,
+                                                        NGX_HTTP_V2_CANCEL);
+        }
+
+        for (index = &h2u->index[ngx_http_v2_upstream_index(h2s->id)];
+             *index;
+             index = &(*index)->next)
+        {
+            if (*index == h2s) {
+                *index = h2s->next;
+                break;
+            }
+        }
+    }
+
+    ev = &h2s->read;
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    if (ev->posted) {
+        ngx_delete_posted_event(ev);
+    }
+
+    ev = &h2s->write;
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    if (ev->posted) {
+        ngx_delete_posted_event(ev);
+    }
+
+    ngx_queue_remove(&h2s->queue);
+    h2u->nstreams--;
+
+    ngx_destroy_pool(h2s->connection.pool);
+
+    h2s->connection.pool = NULL;
+    h2s->request = NULL;
+    h2s->header = NULL;
+
+    h2s->next = h2u->free_streams;
+    h2u->free_streams = h2s;
+
+    if (c == NULL) {
+        if (h2u->nstreams == 0) {
+            ngx_destroy_pool(h2u->pool);
+        }
+
+        return;
+    }
+
+    if (h2u->nstreams) {
+        return;
+    }
+
+    if (h2u->goaway || ngx_exiting) {
+        ngx_http_v2_upstream_close(h2u, 0);
+        return;
+    }
+
+    c->idle = 1;
+    ngx_add_timer(c->read, h2u->idle_timeout);
+}
+
+
+static ngx_http_v2_upstream_stream_t *
+ngx_http_v2_upstream_find_stream(ngx_http_v2_upstream_t *h2u, ngx_uint_t sid)
+{
+    ngx_http_v2_upstream_stream_t  *h2s;
+
+    h2s = h2u->index[ngx_http_v2_upstream_index(sid)];
+
+    while (h2s) {
+        if (h2s->id == sid) {
+            return h2s;
+        }
+
+        h2s = h2s->next;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_v2_upstream_stream_error(ngx_http_v2_upstream_stream_t *h2s,
+    ngx_uint_t status)
+{
+    if (h2s->error) {
+        return;
+    }
+
+    if (status != NGX_HTTP_V2_NO_ERROR && !h2s->reset) {
+        (void) ngx_http_v2_upstream_send_rst_stream(h2s->upstream, h2s->id,
+                                                    status);
+    }
+
+    h2s->error = 1;
+    h2s->reset = 1;
+
+    ngx_http_v2_upstream_post(&h2s->read);
+
+    if (h2s->write.active) {
+        ngx_http_v2_upstream_post(&h2s->write);
+    }
+}
+
+
+static void
+ngx_http_v2_upstream_unblock(ngx_http_v2_upstream_t *h2u)
+{
+    ngx_queue_t                    *q;
+    ngx_http_v2_upstream_stream_t  *h2s;
+
+    for (q = ngx_queue_head(&h2u->streams);
+         q != ngx_queue_sentinel(&h2u->streams);
+         q = ngx_queue_next(q))
+    {
+        h2s = ngx_queue_data(q, ngx_http_v2_upstream_stream_t, queue);
+
+        if (h2s->blocked) {
+            h2s->blocked = 0;
+            ngx_http_v2_upstream_post(&h2s->write);
+        }
+    }
+}
+
+
+static void
+ngx_http_v2_upstream_post(ngx_event_t *ev)
+{
+    ev->active = 0;
+    ev->ready = 1;
+
+    ngx_post_event(ev, &ngx_posted_events);
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_process(ngx_http_v2_upstream_t *h2u)
+{
+    u_char      *p;
+    size_t       len, size;
+    uint32_t     head;
+    ngx_int_t    rc;
+    ngx_buf_t   *b;
+    ngx_uint_t   type, flags, sid;
+
+    b = h2u->in;
+    p = b->pos;
+
+    for ( ;; ) {
+        size = b->last - p;
+
+        if (size < NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+            break;
+        }
+
+        head = ngx_http_v2_parse_uint32(p);
+        len = ngx_http_v2_parse_length(head);
+
+        if (len > NGX_HTTP_V2_UPSTREAM_FRAME_SIZE) {
+            ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                          "upstream sent too large HTTP/2 frame: %uz", len);
+            return NGX_ERROR;
+        }
+
+        if (size < NGX_HTTP_V2_FRAME_HEADER_SIZE + len) {
+            break;
+        }
+
+        type = ngx_http_v2_parse_type(head);
+        flags = p[4];
+        sid = ngx_http_v2_parse_sid(&p[5]);
+
+        p += NGX_HTTP_V2_FRAME_HEADER_SIZE;
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, h2u->connection->log, 0,
+                       "http2 upstream frame type:%ui f:%Xd l:%uz sid:%ui",
+                       type, flags, len, sid);
+
+        if (h2u->header_sid && type != NGX_HTTP_V2_CONTINUATION_FRAME) {
+            ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                          "upstream sent frame of type %ui "
+                          "instead of CONTINUATION", type);
+            return NGX_ERROR;
+        }
+
+        switch (type) {
+
+        case NGX_HTTP_V2_DATA_FRAME:
+            rc = ngx_http_v2_upstream_data(h2u, p, len, flags, sid);
+            break;
+
+        case NGX_HTTP_V2_HEADERS_FRAME:
+            rc = ngx_http_v2_upstream_headers(h2u, p, len, flags, sid);
+            break;
+
+        case NGX_HTTP_V2_CONTINUATION_FRAME:
+            rc = ngx_http_v2_upstream_continuation(h2u, p, len, flags, sid);
+            break;
+
+        case NGX_HTTP_V2_RST_STREAM_FRAME:
+            rc = ngx_http_v2_upstream_rst_stream(h2u, p, len, sid);
+            break;
+
+        case NGX_HTTP_V2_SETTINGS_FRAME:
+            rc = ngx_http_v2_upstream_settings(h2u, p, len, flags, sid);
+            break;
+
+        case NGX_HTTP_V2_PING_FRAME:
+            rc = ngx_http_v2_upstream_ping(h2u, p, len, flags, sid);
+            break;
+
+        case NGX_HTTP_V2_GOAWAY_FRAME:
+            rc = ngx_http_v2_upstream_goaway(h2u, p, len, sid);
+            break;
+
+        case NGX_HTTP_V2_WINDOW_UPDATE_FRAME:
+            rc = ngx_http_v2_upstream_window_update(h2u, p, len, sid);
+            break;
+
+        case NGX_HTTP_V2_PUSH_PROMISE_FRAME:
+            ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                          "upstream sent PUSH_PROMISE frame "
+                          "while push is disabled");
+            return NGX_ERROR;
+
+        default:
+
+            /* PRIORITY and unknown frames are ignored */
+
+            rc = NGX_OK;
+        }
+
+        if (rc != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        p += len;
+    }
+
+    size = b->last - p;
+
+    if (size) {
+        ngx_memmove(b->start, p, size);
+    }
+
+    b->pos = b->start;
+    b->last = b->start + size;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_data(ngx_http_v2_upstream_t *h2u, u_char *pos,
+    size_t len, ngx_uint_t flags, ngx_uint_t sid)
+{
+    size_t                          size, padding;
+    ngx_buf_t                      *b;
+    ngx_http_v2_upstream_stream_t  *h2s;
+
+    size = len;
+
+    if (sid == 0) {
+        ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                      "upstream sent DATA frame with sid 0");
+        return NGX_ERROR;
+    }
+
+    if (flags & NGX_HTTP_V2_PADDED_FLAG) {
+        if (len == 0 || (size_t) pos[0] >= len) {
+            ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                          "upstream sent DATA frame with incorrect padding");
+            return NGX_ERROR;
+        }
+
+        padding = pos[0];
+
+        pos++;
+        len -= 1 + padding;
+    }
+
+    if (size > h2u->recv_window) {
+        ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                      "upstream violated connection flow control");
+        return NGX_ERROR;
+    }
+
+    h2u->recv_window -= size;
+
+    if (h2u->recv_window < NGX_HTTP_V2_MAX_WINDOW / 4) {
+        if (ngx_http_v2_upstream_send_window_update(h2u, 0,
+                                                    NGX_HTTP_V2_MAX_WINDOW
+                                                    - h2u->recv_window)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        h2u->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+    }
+
+    h2s = ngx_http_v2_upstream_find_stream(h2u, sid);
+
+    if (h2s == NULL || h2s->error || h2s->in_closed) {
+        return NGX_OK;
+    }
+
+    if (!h2s->header_received) {
+        ngx_log_error(NGX_LOG_ERR, h2s->connection.log, 0,
+                      "upstream sent DATA frame before response header");
+        ngx_http_v2_upstream_stream_error(h2s, NGX_HTTP_V2_PROTOCOL_ERROR);
+        return NGX_OK;
+    }
+
+    if (size > h2s->recv_window) {
+        ngx_log_error(NGX_LOG_ERR, h2s->connection.log, 0,
+                      "upstream violated stream flow control");
+        ngx_http_v2_upstream_stream_error(h2s, NGX_HTTP_V2_FLOW_CTRL_ERROR);
+        return NGX_OK;
+    }
+
+    h2s->recv_window -= size;
+
+    b = &h2s->data;
+
+    if (len) {
+        if (b->start == NULL) {
+            b->start = ngx_palloc(h2u->pool, NGX_HTTP_V2_UPSTREAM_WINDOW);
+            if (b->start == NULL) {
+                return NGX_ERROR;
+            }
+
+            b->pos = b->start;
+            b->last = b->start;
+            b->end = b->start + NGX_HTTP_V2_UPSTREAM_WINDOW;
+        }
+
+        /* the window guarantees that the data fit */
+
+        if ((size_t) (b->end - b->last) < len) {
+            b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+            b->pos = b->start;
+        }
+
+        b->last = ngx_cpymem(b->last, pos, len);
+    }
+
+    if (flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+        h2s->in_closed = 1;
+    }
+
+    ngx_http_v2_upstream_post(&h2s->read);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_headers(ngx_http_v2_upstream_t *h2u, u_char *pos,
+    size_t len, ngx_uint_t flags, ngx_uint_t sid)
+{
+    size_t   padding;
+    u_char  *p;
+
+    if (sid == 0 || sid % 2 == 0) {
+        ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                      "upstream sent HEADERS frame with incorrect sid %ui",
+                      sid);
+        return NGX_ERROR;
+    }
+
+    if (flags & NGX_HTTP_V2_PADDED_FLAG) {
+        if (len == 0 || (size_t) pos[0] >= len) {
+            ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                          "upstream sent HEADERS frame "
+                          "with incorrect padding");
+            return NGX_ERROR;
+        }
+
+        padding = pos[0];
+
+        pos++;
+        len -= 1 + padding;
+    }
+
+    if (flags & NGX_HTTP_V2_PRIORITY_FLAG) {
+        if (len < 5) {
+            ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                          "upstream sent too short HEADERS frame");
+            return NGX_ERROR;
+        }
+
+        pos += 5;
+        len -= 5;
+    }
+
+    if (flags & NGX_HTTP_V2_END_HEADERS_FLAG) {
+        return ngx_http_v2_upstream_header_block(h2u, sid, pos, pos + len,
+                                        flags & NGX_HTTP_V2_END_STREAM_FLAG);
+    }
+
+    /* the header block is continued, it is collected */
+
+    if (h2u->header_size < len) {
+        p = ngx_palloc(h2u->pool, ngx_max(len, 4096));
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (h2u->header_block) {
+            ngx_pfree(h2u->pool, h2u->header_block);
+        }
+
+        h2u->header_block = p;
+        h2u->header_size = ngx_max(len, 4096);
+    }
+
+    ngx_memcpy(h2u->header_block, pos, len);
+
+    h2u->header_len = len;
+    h2u->header_sid = sid;
+    h2u->header_fin = flags & NGX_HTTP_V2_END_STREAM_FLAG;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_continuation(ngx_http_v2_upstream_t *h2u, u_char *pos,
+    size_t len, ngx_uint_t flags, ngx_uint_t sid)
+{
+    u_char  *p;
+    size_t   size;
+
+    if (sid != h2u->header_sid) {
+        ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                      "upstream sent unexpected CONTINUATION frame");
+        return NGX_ERROR;
+    }
+
+    size = h2u->header_len + len;
+
+    if (size > NGX_HTTP_V2_UPSTREAM_HEADER_LIMIT) {
+        ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                      "upstream sent too large header block");
+        return NGX_ERROR;
+    }
+
+    if (h2u->header_size < size) {
+        p = ngx_palloc(h2u->pool, ngx_max(size, 2 * h2u->header_size));
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(p, h2u->header_block, h2u->header_len);
+        ngx_pfree(h2u->pool, h2u->header_block);
+
+        h2u->header_block = p;
+        h2u->header_size = ngx_max(size, 2 * h2u->header_size);
+    }
+
+    ngx_memcpy(h2u->header_block + h2u->header_len, pos, len);
+    h2u->header_len = size;
+
+    if (!(flags & NGX_HTTP_V2_END_HEADERS_FLAG)) {
+        return NGX_OK;
+    }
+
+    h2u->header_sid = 0;
+
+    return ngx_http_v2_upstream_header_block(h2u, sid, h2u->header_block,
+                                             h2u->header_block + size,
+                                             h2u->header_fin);
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_rst_stream(ngx_http_v2_upstream_t *h2u, u_char *pos,
+    size_t len, ngx_uint_t sid)
+{
+    ngx_uint_t                      status;
+    ngx_http_v2_upstream_stream_t  *h2s;
+
+    if (len != 4 || sid == 0) {
+        ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                      "upstream sent incorrect RST_STREAM frame");
+        return NGX_ERROR;
+    }
+
+    h2s = ngx_http_v2_upstream_find_stream(h2u, sid);
+
+    if (h2s == NULL || h2s->error) {
+        return NGX_OK;
+    }
+
+    status = ngx_http_v2_parse_uint32(pos);
+
+    h2s->reset = 1;
+
+    if (status == NGX_HTTP_V2_NO_ERROR && h2s->in_closed) {
+
+        /* the response is complete, the rest of the request is not needed */
+
+        h2s->out_closed = 1;
+        h2s->connection.buffered = 0;
+
+        if (h2s->write.active) {
+            ngx_http_v2_upstream_post(&h2s->write);
+        }
+
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, h2s->connection.log, 0,
+                  "upstream reset HTTP/2 stream with error %ui", status);
+
+    ngx_http_v2_upstream_stream_error(h2s, NGX_HTTP_V2_NO_ERROR);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_settings(ngx_http_v2_upstream_t *h2u, u_char *pos,
+    size_t len, ngx_uint_t flags, ngx_uint_t sid)
+{
+    ssize_t                         delta;
+    ngx_uint_t                      id, value;
+    ngx_queue_t                    *q;
+    ngx_http_v2_upstream_stream_t  *h2s;
+
+    if (sid != 0 || len % NGX_HTTP_V2_SETTINGS_PARAM_SIZE) {
+        ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                      "upstream sent incorrect SETTINGS frame");
+        return NGX_ERROR;
+    }
+
+    if (flags & NGX_HTTP_V2_ACK_FLAG) {
+        return NGX_OK;
+    }
+
+    for ( /* void */ ; len; len -= NGX_HTTP_V2_SETTINGS_PARAM_SIZE) {
+        id = ngx_http_v2_parse_uint16(pos);
+        value = ngx_http_v2_parse_uint32(&pos[2]);
+
+        pos += NGX_HTTP_V2_SETTINGS_PARAM_SIZE;
+
+        switch (id) {
+
+        case NGX_HTTP_V2_MAX_STREAMS_SETTING:
+            h2u->max_streams = ngx_min(value,
+                                       NGX_HTTP_V2_UPSTREAM_MAX_STREAMS);
+            break;
+
+        case NGX_HTTP_V2_INIT_WINDOW_SIZE_SETTING:
+
+            if (value > NGX_HTTP_V2_MAX_WINDOW) {
+                ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                              "upstream sent SETTINGS frame with "
+                              "incorrect INITIAL_WINDOW_SIZE value %ui",
+                              value);
+                return NGX_ERROR;
+            }
+
+            delta = value - h2u->init_window;
+            h2u->init_window = value;
+
+            for (q = ngx_queue_head(&h2u->streams);
+                 q != ngx_queue_sentinel(&h2u->streams);
+                 q = ngx_queue_next(q))
+            {
+                h2s = ngx_queue_data(q, ngx_http_v2_upstream_stream_t, queue);
+                h2s->send_window += delta;
+            }
+
+            break;
+
+        case NGX_HTTP_V2_MAX_FRAME_SIZE_SETTING:
+
+            if (value < NGX_HTTP_V2_UPSTREAM_FRAME_SIZE
+                || value > NGX_HTTP_V2_MAX_FRAME_SIZE)
+            {
+                ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                              "upstream sent SETTINGS frame with "
+                              "incorrect MAX_FRAME_SIZE value %ui", value);
+                return NGX_ERROR;
+            }
+
+            /* the frames sent never exceed the default size */
+
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    if (ngx_http_v2_upstream_frame(h2u, 0, NGX_HTTP_V2_SETTINGS_FRAME,
+                                   NGX_HTTP_V2_ACK_FLAG, 0)
+        == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_http_v2_upstream_unblock(h2u);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_ping(ngx_http_v2_upstream_t *h2u, u_char *pos,
+    size_t len, ngx_uint_t flags, ngx_uint_t sid)
+{
+    u_char  *p;
+
+    if (sid != 0 || len != 8) {
+        ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                      "upstream sent incorrect PING frame");
+        return NGX_ERROR;
+    }
+
+    if (flags & NGX_HTTP_V2_ACK_FLAG) {
+        return NGX_OK;
+    }
+
+    p = ngx_http_v2_upstream_frame(h2u, 8, NGX_HTTP_V2_PING_FRAME,
+                                   NGX_HTTP_V2_ACK_FLAG, 0);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(p, pos, 8);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_goaway(ngx_http_v2_upstream_t *h2u, u_char *pos,
+    size_t len, ngx_uint_t sid)
+{
+    ngx_uint_t                      last_sid;
+    ngx_queue_t                    *q;
+    ngx_http_v2_upstream_stream_t  *h2s;
+
+    if (sid != 0 || len < 8) {
+        ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                      "upstream sent incorrect GOAWAY frame");
+        return NGX_ERROR;
+    }
+
+    last_sid = ngx_http_v2_parse_sid(pos);
+
+    ngx_log_error(NGX_LOG_INFO, h2u->connection->log, 0,
+                  "upstream sent GOAWAY with error %uD, last sid %ui",
+                  ngx_http_v2_parse_uint32(&pos[4]), last_sid);
+
+    h2u->goaway = 1;
+
+    /* the streams not processed by the upstream can be retried */
+
+    for (q = ngx_queue_head(&h2u->streams);
+         q != ngx_queue_sentinel(&h2u->streams);
+         q = ngx_queue_next(q))
+    {
+        h2s = ngx_queue_data(q, ngx_http_v2_upstream_stream_t, queue);
+
+        if (h2s->id == 0 || h2s->id > last_sid) {
+            h2s->reset = 1;
+            ngx_http_v2_upstream_stream_error(h2s, NGX_HTTP_V2_NO_ERROR);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_window_update(ngx_http_v2_upstream_t *h2u, u_char *pos,
+    size_t len, ngx_uint_t sid)
+{
+    size_t                          window;
+    ngx_http_v2_upstream_stream_t  *h2s;
+
+    if (len != 4) {
+        ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                      "upstream sent incorrect WINDOW_UPDATE frame");
+        return NGX_ERROR;
+    }
+
+    window = ngx_http_v2_parse_window(pos);
+
+    if (sid == 0) {
+        if (window == 0
+            || window > NGX_HTTP_V2_MAX_WINDOW - h2u->send_window)
+        {
+            ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                          "upstream sent WINDOW_UPDATE frame "
+                          "with incorrect window increment %uz", window);
+            return NGX_ERROR;
+        }
+
+        h2u->send_window += window;
+
+        ngx_http_v2_upstream_unblock(h2u);
+
+        return NGX_OK;
+    }
+
+    h2s = ngx_http_v2_upstream_find_stream(h2u, sid);
+
+    if (h2s == NULL || h2s->error) {
+        return NGX_OK;
+    }
+
+    if (window == 0
+        || (ssize_t) window > NGX_HTTP_V2_MAX_WINDOW - h2s->send_window)
+    {
+        ngx_log_error(NGX_LOG_ERR, h2s->connection.log, 0,
+                      "upstream sent WINDOW_UPDATE frame "
+                      "with incorrect window increment %uz", window);
+        ngx_http_v2_upstream_stream_error(h2s, NGX_HTTP_V2_FLOW_CTRL_ERROR);
+        return NGX_OK;
+    }
+
+    h2s->send_window += window;
+
+    if (h2s->blocked) {
+        h2s->blocked = 0;
+        ngx_http_v2_upstream_post(&h2s->write);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_header_block(ngx_http_v2_upstream_t *h2u,
+    ngx_uint_t sid, u_char *pos, u_char *end, ngx_uint_t fin)
+{
+    u_char                          ch;
+    ngx_int_t                       rc, value;
+    ngx_uint_t                      inc;
+    ngx_pool_t                     *pool;
+    ngx_array_t                     headers;
+    ngx_http_v2_header_t            header, *h;
+    ngx_http_v2_connection_t       *hpack;
+    ngx_http_v2_upstream_stream_t  *h2s;
+
+    hpack = h2u->hpack;
+    h2s = ngx_http_v2_upstream_find_stream(h2u, sid);
+
+    /*
+     * the block is decoded even if the stream is gone
+     * to keep the dynamic table in sync
+     */
+
+    pool = ngx_create_pool(NGX_HTTP_V2_UPSTREAM_POOL_SIZE, &h2u->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_array_init(&headers, pool, 16, sizeof(ngx_http_v2_header_t))
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    hpack->state.pool = pool;
+
+    while (pos < end) {
+        ch = *pos;
+
+        if (ch & 0x80) {
+
+            /* indexed header field */
+
+            value = ngx_http_v2_upstream_parse_int(&pos, end,
+                                                   ngx_http_v2_prefix(7));
+            if (value == NGX_ERROR
+                || ngx_http_v2_get_indexed_header(hpack, value, 0) != NGX_OK)
+            {
+                goto invalid;
+            }
+
+            header = hpack->state.header;
+
+        } else if ((ch & 0xe0) == 0x20) {
+
+            /* dynamic table size update */
+
+            value = ngx_http_v2_upstream_parse_int(&pos, end,
+                                                   ngx_http_v2_prefix(5));
+            if (value == NGX_ERROR
+                || ngx_http_v2_table_size(hpack, value) != NGX_OK)
+            {
+                goto invalid;
+            }
+
+            continue;
+
+        } else {
+
+            /* literal header field, with incremental indexing or not */
+
+            inc = ch & 0x40;
+
+            value = ngx_http_v2_upstream_parse_int(&pos, end,
+                                       ngx_http_v2_prefix(inc ? 6 : 4));
+            if (value == NGX_ERROR) {
+                goto invalid;
+            }
+
+            if (value) {
+                if (ngx_http_v2_get_indexed_header(hpack, value, 1) != NGX_OK) {
+                    goto invalid;
+                }
+
+                header.name = hpack->state.header.name;
+
+            } else if (ngx_http_v2_upstream_parse_string(h2u, &header.name,
+                                                         &pos, end)
+                       != NGX_OK)
+            {
+                goto invalid;
+            }
+
+            if (ngx_http_v2_upstream_parse_string(h2u, &header.value,
+                                                  &pos, end)
+                != NGX_OK)
+            {
+                goto invalid;
+            }
+
+            if (inc && ngx_http_v2_add_header(hpack, &header) != NGX_OK) {
+                goto invalid;
+            }
+        }
+
+        if (h2s == NULL) {
+            continue;
+        }
+
+        h = ngx_array_push(&headers);
+        if (h == NULL) {
+            goto failed;
+        }
+
+        *h = header;
+    }
+
+    rc = NGX_OK;
+
+    if (h2s && !h2s->error) {
+        rc = ngx_http_v2_upstream_response_header(h2s, &headers, fin);
+    }
+
+    hpack->state.pool = NULL;
+    ngx_destroy_pool(pool);
+
+    return rc;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, h2u->connection->log, 0,
+                  "upstream sent invalid header block");
+
+failed:
+
+    hpack->state.pool = NULL;
+    ngx_destroy_pool(pool);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_parse_int(u_char **pos, u_char *end, ngx_uint_t prefix)
+{
+    u_char      *p;
+    ngx_uint_t   value, octet, shift;
+
+    p = *pos;
+
+    if (p == end) {
+        return NGX_ERROR;
+    }
+
+    value = *p++ & prefix;
+
+    if (value != prefix) {
+        *pos = p;
+        return value;
+    }
+
+    for (shift = 0; shift < 7 * NGX_HTTP_V2_INT_OCTETS; shift += 7) {
+
+        if (p == end) {
+            return NGX_ERROR;
+        }
+
+        octet = *p++;
+
+        value += (octet & 0x7f) << shift;
+
+        if (octet < 128) {
+            *pos = p;
+            return value;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_parse_string(ngx_http_v2_upstream_t *h2u, ngx_str_t *s,
+    u_char **pos, u_char *end)
+{
+    u_char      *p, *dst, state;
+    ngx_int_t    len;
+    ngx_uint_t   huff;
+
+    p = *pos;
+
+    if (p == end) {
+        return NGX_ERROR;
+    }
+
+    huff = *p & 0x80;
+
+    len = ngx_http_v2_upstream_parse_int(&p, end, ngx_http_v2_prefix(7));
+
+    if (len == NGX_ERROR || end - p < len) {
+        return NGX_ERROR;
+    }
+
+    if (huff) {
+        s->data = ngx_pnalloc(h2u->hpack->state.pool, len * 8 / 5 + 1);
+        if (s->data == NULL) {
+            return NGX_ERROR;
+        }
+
+        state = 0;
+        dst = s->data;
+
+        if (ngx_http_v2_huff_decode(&state, p, len, &dst, 1,
+                                    h2u->connection->log)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        s->len = dst - s->data;
+
+    } else {
+        s->data = p;
+        s->len = len;
+    }
+
+    *pos = p + len;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_response_header(ngx_http_v2_upstream_stream_t *h2s,
+    ngx_array_t *headers, ngx_uint_t fin)
+{
+    u_char                *p;
+    size_t                 len;
+    ngx_int_t              status;
+    ngx_buf_t             *b;
+    ngx_uint_t             i, n, regular;
+    ngx_http_v2_header_t  *h;
+
+    if (h2s->header_received) {
+
+        /* trailers are not passed */
+
+        if (fin) {
+            h2s->in_closed = 1;
+            ngx_http_v2_upstream_post(&h2s->read);
+        }
+
+        return NGX_OK;
+    }
+
+    status = 0;
+    regular = 0;
+    len = sizeof("HTTP/2.0 000" CRLF CRLF) - 1;
+
+    h = headers->elts;
+
+    for (i = 0; i < headers->nelts; i++) {
+
+        if (h[i].name.len && h[i].name.data[0] == ':') {
+
+            if (regular || status
+                || h[i].name.len != sizeof(":status") - 1
+                || ngx_strncmp(h[i].name.data, ":status",
+                               sizeof(":status") - 1)
+                   != 0
+                || h[i].value.len != 3)
+            {
+                goto invalid;
+            }
+
+            status = ngx_atoi(h[i].value.data, 3);
+
+            if (status < 100) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        regular = 1;
+
+        if (h[i].name.len == 0) {
+            goto invalid;
+        }
+
+        for (n = 0; n < h[i].name.len; n++) {
+            if (h[i].name.data[n] <= 0x20 || h[i].name.data[n] == 0x7f
+                || h[i].name.data[n] == ':'
+                || (h[i].name.data[n] >= 'A' && h[i].name.data[n] <= 'Z'))
+            {
+                goto invalid;
+            }
+        }
+
+        for (n = 0; n < h[i].value.len; n++) {
+            if (h[i].value.data[n] == '\0' || h[i].value.data[n] == CR
+                || h[i].value.data[n] == LF)
+            {
+                goto invalid;
+            }
+        }
+
+        if (ngx_http_v2_upstream_hop_header(&h[i].name)) {
+            continue;
+        }
+
+        len += h[i].name.len + sizeof(": ") - 1 + h[i].value.len
+               + sizeof(CRLF) - 1;
+    }
+
+    if (status == 0 || status == NGX_HTTP_SWITCHING_PROTOCOLS) {
+        goto invalid;
+    }
+
+    if (status < NGX_HTTP_OK) {
+
+        /* informational responses are skipped */
+
+        if (fin) {
+            goto invalid;
+        }
+
+        return NGX_OK;
+    }
+
+    b = ngx_create_temp_buf(h2s->request->pool, len);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_sprintf(b->last, "HTTP/2.0 %03i" CRLF, status);
+
+    for (i = 0; i < headers->nelts; i++) {
+
+        if (h[i].name.data[0] == ':'
+            || ngx_http_v2_upstream_hop_header(&h[i].name))
+        {
+            continue;
+        }
+
+        p = ngx_cpymem(p, h[i].name.data, h[i].name.len);
+        *p++ = ':'; *p++ = ' ';
+        p = ngx_cpymem(p, h[i].value.data, h[i].value.len);
+        *p++ = CR; *p++ = LF;
+    }
+
+    *p++ = CR; *p++ = LF;
+
+    b->last = p;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, h2s->connection.log, 0,
+                   "http2 upstream stream %ui response header:%N\"%*s\"",
+                   h2s->id, (size_t) (b->last - b->pos), b->pos);
+
+    h2s->header = b;
+    h2s->header_received = 1;
+
+    if (fin) {
+        h2s->in_closed = 1;
+    }
+
+    ngx_http_v2_upstream_post(&h2s->read);
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, h2s->connection.log, 0,
+                  "upstream sent invalid HTTP/2 response header");
+
+    ngx_http_v2_upstream_stream_error(h2s, NGX_HTTP_V2_PROTOCOL_ERROR);
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_v2_upstream_hop_header(ngx_str_t *name)
+{
+    ngx_str_t  *hop;
+
+    for (hop = ngx_http_v2_upstream_hop_headers; hop->len; hop++) {
+        if (name->len == hop->len
+            && ngx_strncasecmp(name->data, hop->data, hop->len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static u_char *
+ngx_http_v2_upstream_frame(ngx_http_v2_upstream_t *h2u, size_t len,
+    ngx_uint_t type, ngx_uint_t flags, ngx_uint_t sid)
+{
+    u_char     *p;
+    size_t      size, busy;
+    ngx_buf_t  *b;
+
+    b = h2u->out;
+    size = NGX_HTTP_V2_FRAME_HEADER_SIZE + len;
+
+    if ((size_t) (b->end - b->last) < size) {
+        busy = b->last - b->pos;
+
+        if ((size_t) (b->end - b->start) < busy + size) {
+
+            /* a large header block */
+
+            p = ngx_palloc(h2u->pool, busy + size);
+            if (p == NULL) {
+                return NULL;
+            }
+
+            ngx_memcpy(p, b->pos, busy);
+            ngx_pfree(h2u->pool, b->start);
+
+            b->start = p;
+            b->end = p + busy + size;
+
+        } else {
+            ngx_memmove(b->start, b->pos, busy);
+        }
+
+        b->pos = b->start;
+        b->last = b->start + busy;
+    }
+
+    p = b->last;
+
+    p = ngx_http_v2_write_uint32(p, len << 8 | type);
+    *p++ = (u_char) flags;
+    p = ngx_http_v2_write_sid(p, sid);
+
+    b->last = p + len;
+
+    if (h2u->connected) {
+        ngx_post_event(h2u->connection->write, &ngx_posted_events);
+    }
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_send_window_update(ngx_http_v2_upstream_t *h2u,
+    ngx_uint_t sid, size_t window)
+{
+    u_char  *p;
+
+    p = ngx_http_v2_upstream_frame(h2u, 4, NGX_HTTP_V2_WINDOW_UPDATE_FRAME,
+                                   NGX_HTTP_V2_NO_FLAG, sid);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_http_v2_write_uint32(p, window);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_send_rst_stream(ngx_http_v2_upstream_t *h2u,
+    ngx_uint_t sid, ngx_uint_t status)
+{
+    u_char  *p;
+
+    if (h2u->connection == NULL || sid == 0) {
+        return NGX_OK;
+    }
+
+    p = ngx_http_v2_upstream_frame(h2u, 4, NGX_HTTP_V2_RST_STREAM_FRAME,
+                                   NGX_HTTP_V2_NO_FLAG, sid);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_http_v2_write_uint32(p, status);
+
+    return NGX_OK;
+}
+
+
+/*
+ * The request header created by the proxy module in the first buffer
+ * is translated into a header block without the dynamic table, so that
+ * the state of the upstream decoder does not need to be tracked.
+ */
+
+static ngx_int_t
+ngx_http_v2_upstream_request_header(ngx_http_v2_upstream_stream_t *h2s,
+    ngx_buf_t *b)
+{
+    u_char                  *p, *end, *pos, *block, *tmp;
+    size_t                   len, size, rest;
+    ngx_str_t                method, path, name, value, host;
+    ngx_uint_t               type, flags, fin;
+    ngx_http_request_t      *r;
+    ngx_http_v2_upstream_t  *h2u;
+
+    r = h2s->request;
+    h2u = h2s->upstream;
+
+    end = ngx_strnstr(b->pos, CRLF CRLF, b->last - b->pos);
+
+    if (end == NULL) {
+        goto invalid;
+    }
+
+    /* the request line */
+
+    method.data = b->pos;
+
+    p = ngx_strlchr(b->pos, end, ' ');
+    if (p == NULL) {
+        goto invalid;
+    }
+
+    method.len = p - method.data;
+
+    path.data = p + 1;
+
+    p = ngx_strlchr(path.data, end, ' ');
+    if (p == NULL) {
+        goto invalid;
+    }
+
+    path.len = p - path.data;
+
+    p = ngx_strlchr(p, end, LF);
+    if (p == NULL) {
+        goto invalid;
+    }
+
+    end += sizeof(CRLF) - 1;
+    pos = p + 1;
+
+    ngx_str_null(&host);
+
+    len = method.len + path.len + 3 * (1 + NGX_HTTP_V2_INT_OCTETS) + 1;
+    size = ngx_max(method.len, path.len);
+
+    for (p = pos; p < end; /* void */ ) {
+        p = ngx_http_v2_upstream_parse_line(p, end, &name, &value);
+        if (p == NULL) {
+            goto invalid;
+        }
+
+        if (name.len == 4 && ngx_strncasecmp(name.data, (u_char *) "host", 4)
+                             == 0)
+        {
+            host = value;
+        }
+
+        len += 1 + 2 * NGX_HTTP_V2_INT_OCTETS + name.len + value.len;
+        size = ngx_max(size, ngx_max(name.len, value.len));
+    }
+
+    block = ngx_pnalloc(r->pool, len);
+    if (block == NULL) {
+        return NGX_ERROR;
+    }
+
+    tmp = ngx_pnalloc(r->pool, size);
+    if (tmp == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = block;
+
+    if (method.len == 3 && ngx_strncmp(method.data, "GET", 3) == 0) {
+        *p++ = ngx_http_v2_indexed(2);
+
+    } else if (method.len == 4 && ngx_strncmp(method.data, "POST", 4) == 0) {
+        *p++ = ngx_http_v2_indexed(3);
+
+    } else {
+        *p++ = 2;
+        p = ngx_http_v2_write_value(p, method.data, method.len, tmp);
+    }
+
+    *p++ = ngx_http_v2_indexed(6);
+
+    if (path.len == 1 && path.data[0] == '/') {
+        *p++ = ngx_http_v2_indexed(4);
+
+    } else {
+        *p++ = 4;
+        p = ngx_http_v2_write_value(p, path.data, path.len, tmp);
+    }
+
+    if (host.len) {
+        *p++ = 1;
+        p = ngx_http_v2_write_value(p, host.data, host.len, tmp);
+    }
+
+    while (pos < end) {
+        pos = ngx_http_v2_upstream_parse_line(pos, end, &name, &value);
+
+        if (ngx_http_v2_upstream_hop_header(&name)
+            || (name.len == 4
+                && ngx_strncasecmp(name.data, (u_char *) "host", 4) == 0))
+        {
+            continue;
+        }
+
+        if (name.len == 2 && ngx_strncasecmp(name.data, (u_char *) "te", 2)
+                             == 0
+            && (value.len != 8
+                || ngx_strncasecmp(value.data, (u_char *) "trailers", 8)
+                   != 0))
+        {
+            continue;
+        }
+
+        *p++ = 0;
+        p = ngx_http_v2_write_name(p, name.data, name.len, tmp);
+        p = ngx_http_v2_write_value(p, value.data, value.len, tmp);
+    }
+
+    b->pos = end + sizeof(CRLF) - 1;
+
+    fin = (b->last_buf && b->pos == b->last);
+
+    /* the stream is started */
+
+    h2s->id = h2u->next_sid;
+    h2u->next_sid += 2;
+
+    if (h2u->next_sid > NGX_HTTP_V2_UPSTREAM_MAX_SID) {
+        h2u->goaway = 1;
+    }
+
+    h2s->next = h2u->index[ngx_http_v2_upstream_index(h2s->id)];
+    h2u->index[ngx_http_v2_upstream_index(h2s->id)] = h2s;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2s->connection.log, 0,
+                   "http2 upstream stream %ui header block: %uz",
+                   h2s->id, (size_t) (p - block));
+
+    type = NGX_HTTP_V2_HEADERS_FRAME;
+    flags = fin ? NGX_HTTP_V2_END_STREAM_FLAG : NGX_HTTP_V2_NO_FLAG;
+    rest = p - block;
+    p = block;
+
+    for ( ;; ) {
+        len = ngx_min(rest, NGX_HTTP_V2_UPSTREAM_FRAME_SIZE);
+
+        if (len == rest) {
+            flags |= NGX_HTTP_V2_END_HEADERS_FLAG;
+        }
+
+        pos = ngx_http_v2_upstream_frame(h2u, len, type, flags, h2s->id);
+        if (pos == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(pos, p, len);
+
+        p += len;
+        rest -= len;
+
+        if (rest == 0) {
+            break;
+        }
+
+        type = NGX_HTTP_V2_CONTINUATION_FRAME;
+        flags = NGX_HTTP_V2_NO_FLAG;
+    }
+
+    h2s->headers_sent = 1;
+
+    if (fin) {
+        h2s->out_closed = 1;
+    }
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                  "invalid request header for HTTP/2 upstream");
+
+    return NGX_ERROR;
+}
+
+
+static u_char *
+ngx_http_v2_upstream_parse_line(u_char *p, u_char *end, ngx_str_t *name,
+    ngx_str_t *value)
+{
+    u_char  *last;
+
+    last = ngx_strlchr(p, end, LF);
+    if (last == NULL) {
+        return NULL;
+    }
+
+    name->data = p;
+
+    p = ngx_strlchr(p, last, ':');
+    if (p == NULL) {
+        return NULL;
+    }
+
+    name->len = p - name->data;
+
+    for (p++; p < last && *p == ' '; p++) { /* void */ }
+
+    value->data = p;
+
+    for (p = last; p > value->data; p--) {
+        if (p[-1] != CR && p[-1] != ' ') {
+            break;
+        }
+    }
+
+    value->len = p - value->data;
+
+    return last + 1;
+}
+
+
+static ssize_t
+ngx_http_v2_upstream_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    size_t                          n;
+    ngx_http_v2_upstream_stream_t  *h2s;
+
+    h2s = (ngx_http_v2_upstream_stream_t *) c;
+
+    n = ngx_http_v2_upstream_read_data(h2s, buf, size);
+
+    if (n) {
+        if (h2s->read.timer_set) {
+            ngx_del_timer(&h2s->read);
+        }
+
+        return n;
+    }
+
+    return ngx_http_v2_upstream_read_end(h2s);
+}
+
+
+static ssize_t
+ngx_http_v2_upstream_recv_chain(ngx_connection_t *c, ngx_chain_t *cl,
+    off_t limit)
+{
+    size_t                          n, size, total;
+    ngx_http_v2_upstream_stream_t  *h2s;
+
+    h2s = (ngx_http_v2_upstream_stream_t *) c;
+
+    total = 0;
+
+    for ( /* void */ ; cl; cl = cl->next) {
+        size = cl->buf->end - cl->buf->last;
+
+        if (limit) {
+            if ((off_t) total >= limit) {
+                break;
+            }
+
+            if ((off_t) size > limit - (off_t) total) {
+                size = (size_t) (limit - total);
+            }
+        }
+
+        n = ngx_http_v2_upstream_read_data(h2s, cl->buf->last, size);
+
+        total += n;
+
+        if (n < size) {
+            break;
+        }
+    }
+
+    if (total) {
+        if (h2s->read.timer_set) {
+            ngx_del_timer(&h2s->read);
+        }
+
+        return total;
+    }
+
+    return ngx_http_v2_upstream_read_end(h2s);
+}
+
+
+static ngx_chain_t *
+ngx_http_v2_upstream_send_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit)
+{
+    u_char                         *p;
+    size_t                          n, size;
+    ngx_buf_t                      *b;
+    ngx_uint_t                      flags;
+    ngx_http_v2_upstream_t         *h2u;
+    ngx_http_v2_upstream_stream_t  *h2s;
+
+    h2s = (ngx_http_v2_upstream_stream_t *) c;
+    h2u = h2s->upstream;
+
+    if (h2s->error) {
+        c->write->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    for ( /* void */ ; in; in = in->next) {
+        b = in->buf;
+
+        if (b->in_file && !ngx_buf_in_memory(b)) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "file buffer in HTTP/2 upstream request");
+            return NGX_CHAIN_ERROR;
+        }
+
+        if (!h2s->headers_sent
+            && ngx_http_v2_upstream_request_header(h2s, b) != NGX_OK)
+        {
+            return NGX_CHAIN_ERROR;
+        }
+
+        if (h2s->out_closed) {
+            b->pos = b->last;
+            continue;
+        }
+
+        while (b->pos < b->last) {
+            size = b->last - b->pos;
+
+            n = ngx_min(size, NGX_HTTP_V2_UPSTREAM_FRAME_SIZE);
+            n = ngx_min(n, h2u->send_window);
+
+            if (h2s->send_window < (ssize_t) n) {
+                n = ngx_max(h2s->send_window, 0);
+            }
+
+            if (n == 0
+                || h2u->out->last - h2u->out->pos
+                   >= NGX_HTTP_V2_UPSTREAM_OUTPUT_LIMIT)
+            {
+                ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                               "http2 upstream stream %ui blocked, "
+                               "window:%z conn:%uz",
+                               h2s->id, h2s->send_window, h2u->send_window);
+
+                h2s->blocked = 1;
+
+                c->write->active = 1;
+                c->write->ready = 0;
+
+                return in;
+            }
+
+            flags = (n == size && b->last_buf) ? NGX_HTTP_V2_END_STREAM_FLAG
+                                               : NGX_HTTP_V2_NO_FLAG;
+
+            p = ngx_http_v2_upstream_frame(h2u, n, NGX_HTTP_V2_DATA_FRAME,
+                                           flags, h2s->id);
+            if (p == NULL) {
+                return NGX_CHAIN_ERROR;
+            }
+
+            ngx_memcpy(p, b->pos, n);
+
+            b->pos += n;
+            c->sent += n;
+
+            h2s->send_window -= n;
+            h2u->send_window -= n;
+
+            if (flags) {
+                h2s->out_closed = 1;
+            }
+        }
+
+        if (b->last_buf && !h2s->out_closed) {
+            if (ngx_http_v2_upstream_frame(h2u, 0, NGX_HTTP_V2_DATA_FRAME,
+                                           NGX_HTTP_V2_END_STREAM_FLAG,
+                                           h2s->id)
+                == NULL)
+            {
+                return NGX_CHAIN_ERROR;
+            }
+
+            h2s->out_closed = 1;
+        }
+    }
+
+    if (h2s->out_closed) {
+        c->buffered = 0;
+    }
+
+    return NULL;
+}
+
+
+static size_t
+ngx_http_v2_upstream_read_data(ngx_http_v2_upstream_stream_t *h2s,
+    u_char *buf, size_t size)
+{
+    size_t      n, len, window;
+    ngx_buf_t  *b;
+
+    n = 0;
+    b = h2s->header;
+
+    if (b) {
+        n = ngx_min(size, (size_t) (b->last - b->pos));
+
+        buf = ngx_cpymem(buf, b->pos, n);
+        b->pos += n;
+        size -= n;
+
+        if (b->pos == b->last) {
+            h2s->header = NULL;
+        }
+    }
+
+    b = &h2s->data;
+
+    len = ngx_min(size, (size_t) (b->last - b->pos));
+
+    if (len == 0) {
+        return n;
+    }
+
+    ngx_memcpy(buf, b->pos, len);
+    b->pos += len;
+
+    if (b->pos == b->last) {
+        b->pos = b->start;
+        b->last = b->start;
+    }
+
+    /* the window is updated when a quarter of it is free */
+
+    window = NGX_HTTP_V2_UPSTREAM_WINDOW - (b->last - b->pos);
+
+    if (!h2s->in_closed && !h2s->error
+        && window - h2s->recv_window >= NGX_HTTP_V2_UPSTREAM_WINDOW / 4
+        && h2s->upstream->connection)
+    {
+        if (ngx_http_v2_upstream_send_window_update(h2s->upstream, h2s->id,
+                                                    window - h2s->recv_window)
+            == NGX_OK)
+        {
+            h2s->recv_window = window;
+        }
+    }
+
+    return n + len;
+}
+
+
+static ssize_t
+ngx_http_v2_upstream_read_end(ngx_http_v2_upstream_stream_t *h2s)
+{
+    ngx_event_t  *rev;
+
+    rev = &h2s->read;
+
+    if (h2s->error) {
+        rev->error = 1;
+        return NGX_ERROR;
+    }
+
+    if (h2s->in_closed) {
+        rev->eof = 1;
+        return 0;
+    }
+
+    rev->ready = 0;
+    rev->active = 1;
+
+    /*
+     * the event pipe does not set timers on connections without a socket,
+     * so the stream times out reading the response body by itself
+     */
+
+    if (h2s->header_received) {
+        ngx_add_timer(rev, h2s->request->upstream->conf->read_timeout);
+    }
+
+    return NGX_AGAIN;
+}
@@ -953,6 +953,10 @@ ngx_worker_process_exit(ngx_cycle_t *cycle)
         }
     }
 
+    ngx_slab_flush_magazines();
+
+    ngx_pool_log_stat(cycle->log);
+
     if (ngx_exiting) {
         c = cycle->connections;
         for (i = 0; i < cycle->connection_n; i++) {
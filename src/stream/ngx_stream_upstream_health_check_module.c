@@ -0,0 +1,480 @@
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+
+typedef struct {
+    ngx_msec_t                            interval;
+    ngx_msec_t                            timeout;
+    ngx_uint_t                            fails;
+    ngx_uint_t                            passes;
+    ngx_str_t                            *upstream;
+} ngx_stream_upstream_health_check_srv_conf_t;
+
+
+/*
+ * A server is healthy if a connection to it can be established.  As with
+ * the http health checks, the probes are sent by the first worker process
+ * and the results are kept in the upstream zone.
+ */
+
+typedef struct {
+    ngx_event_t                           event;
+    ngx_peer_connection_t                 pc;
+
+    ngx_uint_t                            fails;
+    ngx_uint_t                            passes;
+
+    ngx_stream_upstream_rr_peers_t       *peers;
+    ngx_stream_upstream_rr_peer_t        *peer;
+    ngx_stream_upstream_health_check_srv_conf_t  *conf;
+} ngx_stream_upstream_health_check_peer_t;
+
+
+static void ngx_stream_upstream_health_check_handler(ngx_event_t *ev);
+static void ngx_stream_upstream_health_check_connect_handler(ngx_event_t *ev);
+static ngx_int_t ngx_stream_upstream_health_check_test_connect(
+    ngx_connection_t *c);
+static void ngx_stream_upstream_health_check_done(
+    ngx_stream_upstream_health_check_peer_t *hp, ngx_uint_t ok);
+static void *ngx_stream_upstream_health_check_create_conf(ngx_conf_t *cf);
+static char *ngx_stream_upstream_health_check(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_stream_upstream_health_check_init_module(
+    ngx_cycle_t *cycle);
+static ngx_int_t ngx_stream_upstream_health_check_init_process(
+    ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_stream_upstream_health_check_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_ANY,
+      ngx_stream_upstream_health_check,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_upstream_health_check_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_stream_upstream_health_check_create_conf, /* create server config */
+    NULL                                   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_upstream_health_check_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_upstream_health_check_module_ctx, /* module context */
+    ngx_stream_upstream_health_check_commands, /* module directives */
+    NGX_STREAM_MODULE,                     /* module type */
+    NULL,                                  /* init master */
+    ngx_stream_upstream_health_check_init_module, /* init module */
+    ngx_stream_upstream_health_check_init_process, /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void
+ngx_stream_upstream_health_check_handler(ngx_event_t *ev)
+{
+    ngx_int_t                                 rc;
+    ngx_connection_t                         *c;
+    ngx_stream_upstream_health_check_peer_t  *hp;
+
+    hp = ev->data;
+
+    if (ngx_exiting || ngx_terminate) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "health check %V", &hp->peer->name);
+
+    hp->pc.sockaddr = hp->peer->sockaddr;
+    hp->pc.socklen = hp->peer->socklen;
+    hp->pc.name = &hp->peer->name;
+    hp->pc.get = ngx_event_get_peer;
+    hp->pc.log = ev->log;
+    hp->pc.log_error = NGX_ERROR_INFO;
+
+    rc = ngx_event_connect_peer(&hp->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        hp->pc.connection = NULL;
+        ngx_stream_upstream_health_check_done(hp, 0);
+        return;
+    }
+
+    if (rc == NGX_OK) {
+        ngx_stream_upstream_health_check_done(hp, 1);
+        return;
+    }
+
+    /* rc == NGX_AGAIN */
+
+    c = hp->pc.connection;
+
+    c->data = hp;
+    c->read->handler = ngx_stream_upstream_health_check_connect_handler;
+    c->write->handler = ngx_stream_upstream_health_check_connect_handler;
+
+    ngx_add_timer(c->write, hp->conf->timeout);
+}
+
+
+static void
+ngx_stream_upstream_health_check_connect_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                         *c;
+    ngx_stream_upstream_health_check_peer_t  *hp;
+
+    c = ev->data;
+    hp = c->data;
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "health check of %V timed out", &hp->peer->name);
+        ngx_stream_upstream_health_check_done(hp, 0);
+        return;
+    }
+
+    ngx_stream_upstream_health_check_done(hp,
+                ngx_stream_upstream_health_check_test_connect(c) == NGX_OK);
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_health_check_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
+
+            } else {
+                err = c->read->kq_errno;
+            }
+
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_upstream_health_check_done(
+    ngx_stream_upstream_health_check_peer_t *hp, ngx_uint_t ok)
+{
+    ngx_stream_upstream_rr_peer_t   *peer;
+    ngx_stream_upstream_rr_peers_t  *peers;
+
+    if (hp->pc.connection) {
+        ngx_close_connection(hp->pc.connection);
+        hp->pc.connection = NULL;
+    }
+
+    peer = hp->peer;
+    peers = hp->peers;
+
+    if (ok) {
+        hp->fails = 0;
+        hp->passes++;
+
+    } else {
+        hp->passes = 0;
+        hp->fails++;
+    }
+
+    ngx_stream_upstream_rr_peers_wlock(peers);
+
+    if (peer->down & NGX_STREAM_UPSTREAM_PEER_UNHEALTHY) {
+
+        if (hp->passes >= hp->conf->passes) {
+            peer->down &= ~NGX_STREAM_UPSTREAM_PEER_UNHEALTHY;
+
+            ngx_log_error(NGX_LOG_NOTICE, hp->event.log, 0,
+                          "upstream server %V in \"%V\" is healthy",
+                          &peer->name, hp->conf->upstream);
+        }
+
+    } else if (hp->fails >= hp->conf->fails) {
+        peer->down |= NGX_STREAM_UPSTREAM_PEER_UNHEALTHY;
+
+        ngx_log_error(NGX_LOG_WARN, hp->event.log, 0,
+                      "upstream server %V in \"%V\" is unhealthy",
+                      &peer->name, hp->conf->upstream);
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    if (!ngx_exiting && !ngx_terminate) {
+        ngx_add_timer(&hp->event, hp->conf->interval);
+    }
+}
+
+
+static void *
+ngx_stream_upstream_health_check_create_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_health_check_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_stream_upstream_health_check_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->upstream = NULL;
+     */
+
+    conf->interval = NGX_CONF_UNSET_MSEC;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+    conf->fails = NGX_CONF_UNSET_UINT;
+    conf->passes = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_upstream_health_check(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_upstream_health_check_srv_conf_t  *hcf = conf;
+
+    ngx_int_t                        n;
+    ngx_str_t                       *value, s;
+    ngx_uint_t                       i;
+    ngx_stream_upstream_srv_conf_t  *uscf;
+
+    if (hcf->upstream) {
+        return "is duplicate";
+    }
+
+    uscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_upstream_module);
+
+    hcf->upstream = &uscf->host;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hcf->interval = ngx_parse_time(&s, 0);
+            if (hcf->interval == (ngx_msec_t) NGX_ERROR || hcf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hcf->timeout = ngx_parse_time(&s, 0);
+            if (hcf->timeout == (ngx_msec_t) NGX_ERROR || hcf->timeout == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->fails = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->passes = n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    ngx_conf_init_msec_value(hcf->interval, 5000);
+    ngx_conf_init_msec_value(hcf->timeout, 1000);
+    ngx_conf_init_uint_value(hcf->fails, 1);
+    ngx_conf_init_uint_value(hcf->passes, 1);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_health_check_init_module(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                                    i;
+    ngx_stream_upstream_srv_conf_t              **uscfp;
+    ngx_stream_upstream_main_conf_t              *umcf;
+    ngx_stream_upstream_health_check_srv_conf_t  *hcf;
+
+    umcf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                 ngx_stream_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_stream_conf_upstream_srv_conf(uscfp[i],
+                                      ngx_stream_upstream_health_check_module);
+
+        if (hcf->upstream && uscfp[i]->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                          "health checks require a shared memory zone "
+                          "in upstream \"%V\" in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_health_check_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                                    i;
+    ngx_event_t                                  *ev;
+    ngx_stream_upstream_rr_peer_t                *peer;
+    ngx_stream_upstream_rr_peers_t               *peers;
+    ngx_stream_upstream_srv_conf_t              **uscfp;
+    ngx_stream_upstream_main_conf_t              *umcf;
+    ngx_stream_upstream_health_check_peer_t      *hp;
+    ngx_stream_upstream_health_check_srv_conf_t  *hcf;
+
+    if ((ngx_process != NGX_PROCESS_WORKER || ngx_worker != 0)
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                 ngx_stream_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_stream_conf_upstream_srv_conf(uscfp[i],
+                                      ngx_stream_upstream_health_check_module);
+
+        if (hcf->upstream == NULL) {
+            continue;
+        }
+
+        for (peers = uscfp[i]->peer.data; peers; peers = peers->next) {
+
+            for (peer = peers->peer; peer; peer = peer->next) {
+
+                hp = ngx_pcalloc(cycle->pool,
+                             sizeof(ngx_stream_upstream_health_check_peer_t));
+                if (hp == NULL) {
+                    return NGX_ERROR;
+                }
+
+                hp->peers = peers;
+                hp->peer = peer;
+                hp->conf = hcf;
+
+                ev = &hp->event;
+
+                ev->handler = ngx_stream_upstream_health_check_handler;
+                ev->data = hp;
+                ev->log = cycle->log;
+                ev->cancelable = 1;
+
+                ngx_add_timer(ev, ngx_random() % hcf->interval + 1);
+            }
+        }
+    }
+
+    return NGX_OK;
+}
@@ -16,6 +16,11 @@
 
 typedef struct ngx_stream_upstream_rr_peer_s   ngx_stream_upstream_rr_peer_t;
 
+
+/* set in peer->down by health checks, in addition to the "down" flag */
+#define NGX_STREAM_UPSTREAM_PEER_UNHEALTHY  0x02
+
+
 struct ngx_stream_upstream_rr_peer_s {
     struct sockaddr                 *sockaddr;
     socklen_t                        socklen;
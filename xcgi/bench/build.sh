@@ -0,0 +1,114 @@
+#!/bin/sh
+
+# Builds the xcgi benchmarks and fuzz driver against the objects of a build
+# configured with --add-module=xcgi, e.g. after ./xcgi_test_build.sh:
+#
+#     sh xcgi/bench/build.sh [objs]
+#     objs/ngx_xcgi_bench
+#     objs/ngx_xcgi_scan_bench
+#     objs/ngx_event_timer_bench
+#     objs/ngx_xcgi_fuzz -n 100000
+#
+# SANITIZE=address,undefined builds the drivers with the sanitizers given;
+# FUZZ=libfuzzer with CC=clang links the fuzz driver with libFuzzer.
+
+set -e
+
+objs=${1:-objs}
+bench=xcgi/bench
+out=$objs/xcgi_bench
+
+if [ ! -f $objs/Makefile ]; then
+    echo "$0: $objs/Makefile not found, run ./xcgi_test_build.sh first" >&2
+    exit 1
+fi
+
+make -f $objs/Makefile
+
+ngx_make_var() {
+    printf 'ngx_make_var:\n\t@echo $(%s)\n' $1 \
+        | make -s -f $objs/Makefile -f - ngx_make_var
+}
+
+CC=${CC:-`ngx_make_var CC`}
+CFLAGS="`ngx_make_var CFLAGS` -I $bench"
+INCS=`ngx_make_var ALL_INCS`
+
+if [ -n "$SANITIZE" ]; then
+    CFLAGS="$CFLAGS -fsanitize=$SANITIZE -fno-omit-frame-pointer"
+fi
+
+# the objects and libraries nginx is linked with; main() of nginx is
+# renamed, and the objects of the sources a tool includes are left out
+
+link=`sed -n -e "\\#^	\\$(LINK) -o $objs/nginx#,/^[ 	]*\$/p" $objs/Makefile \
+      | sed -e 1d -e 's/[	\\]//g'`
+
+ngx_objects() {
+    for f in $link; do
+        case $f in
+            *.o) ;;
+            *) continue ;;
+        esac
+
+        for x in nginx.o "$@"; do
+            case $f in
+                */$x) continue 2 ;;
+            esac
+        done
+
+        echo $f
+    done
+}
+
+libs=
+
+for f in $link; do
+    case $f in
+        *.o) ;;
+        *) libs="$libs $f" ;;
+    esac
+done
+
+objects=`ngx_objects ngx_http_xcgi_filter_module.o ngx_xcgi_utils.o \
+                     ngx_xcgi_form.o`
+scan_objects=`ngx_objects ngx_xcgi_scan.o`
+all_objects=`ngx_objects`
+
+mkdir -p $out
+
+objcopy --redefine-sym main=ngx_nginx_main $objs/src/core/nginx.o \
+    $out/nginx.o
+
+$CC -c $CFLAGS $INCS -o $out/ngx_xcgi_harness.o $bench/ngx_xcgi_harness.c
+$CC -c $CFLAGS $INCS -o $out/ngx_xcgi_bench.o $bench/ngx_xcgi_bench.c
+$CC -c $CFLAGS $INCS -o $out/ngx_xcgi_scan_bench.o \
+    $bench/ngx_xcgi_scan_bench.c
+$CC -c $CFLAGS $INCS -o $out/ngx_event_timer_bench.o \
+    $bench/ngx_event_timer_bench.c
+
+$CC $CFLAGS -o $objs/ngx_xcgi_bench $out/ngx_xcgi_bench.o \
+    $out/ngx_xcgi_harness.o $out/nginx.o $objects $libs
+
+$CC $CFLAGS -o $objs/ngx_xcgi_scan_bench $out/ngx_xcgi_scan_bench.o \
+    $out/nginx.o $scan_objects $libs
+
+$CC $CFLAGS -o $objs/ngx_event_timer_bench $out/ngx_event_timer_bench.o \
+    $out/nginx.o $all_objects $libs
+
+# the parsers are instrumented for libFuzzer along with the driver
+
+if [ "$FUZZ" = libfuzzer ]; then
+    fuzz=-fsanitize=fuzzer-no-link
+    fuzz_link=-fsanitize=fuzzer
+else
+    fuzz=-DNGX_XCGI_FUZZ_MAIN=1
+    fuzz_link=
+fi
+
+$CC -c $CFLAGS $fuzz $INCS -o $out/ngx_xcgi_fuzz_harness.o \
+    $bench/ngx_xcgi_harness.c
+$CC -c $CFLAGS $fuzz $INCS -o $out/ngx_xcgi_fuzz.o $bench/ngx_xcgi_fuzz.c
+
+$CC $CFLAGS $fuzz_link -o $objs/ngx_xcgi_fuzz $out/ngx_xcgi_fuzz.o \
+    $out/ngx_xcgi_fuzz_harness.o $out/nginx.o $objects $libs
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) lurenfu@qq.com
+ */
+
+
+/*
+ * Compares the timer rbtree and the timing wheel, both with and without
+ * lazy timers, under connection churn.  Each connection has a timer.  In
+ * each simulated millisecond a few connections read, which moves the
+ * timer, or close and are replaced by a new connection, which deletes it
+ * and adds another one.  The next timer is then looked up and the expired
+ * ones are run, as in the event loop; a connection timed out is replaced
+ * as well.  Simulated time does not depend on the speed of the timers, so
+ * each mode runs the same operations:
+ *
+ *     ngx_event_timer_bench [seconds]
+ *
+ * simulates the seconds given, 600 by default.  The time per operation
+ * includes the lookups and expiration runs of each millisecond.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#define NGX_EVENT_TIMER_BENCH_READ       60000
+#define NGX_EVENT_TIMER_BENCH_KEEPALIVE  75000
+
+/* a connection is used every 20 seconds on average, one use in 4 closes it */
+
+#define NGX_EVENT_TIMER_BENCH_INTERVAL   20000
+#define NGX_EVENT_TIMER_BENCH_CLOSE      4
+
+
+typedef struct {
+    char                    *name;
+    ngx_uint_t               wheel;
+    ngx_uint_t               lazy;
+} ngx_event_timer_bench_mode_t;
+
+
+typedef struct {
+    ngx_uint_t               ops;
+    ngx_uint_t               expired;
+    ngx_uint_t               late;      /* total milliseconds */
+} ngx_event_timer_bench_result_t;
+
+
+static void ngx_event_timer_bench_run(ngx_uint_t conns,
+    ngx_event_timer_bench_mode_t *mode, ngx_msec_t duration);
+static void ngx_event_timer_bench_expired(ngx_event_t *ev);
+static uint32_t ngx_event_timer_bench_random(void);
+static double ngx_event_timer_bench_now(void);
+
+
+static ngx_event_timer_bench_mode_t  ngx_event_timer_bench_modes[] = {
+    { "rbtree", 0, 0 },
+    { "wheel", 1, 0 },
+    { "rbtree lazy", 0, 1 },
+    { "wheel lazy", 1, 1 },
+    { NULL, 0, 0 }
+};
+
+
+static ngx_uint_t  ngx_event_timer_bench_conns[] = { 1000, 10000, 100000 };
+
+static ngx_open_file_t                  ngx_event_timer_bench_file;
+static ngx_log_t                        ngx_event_timer_bench_log;
+static ngx_connection_t                 ngx_event_timer_bench_c;
+static ngx_event_timer_bench_result_t   ngx_event_timer_bench_result;
+static uint32_t                         ngx_event_timer_bench_seed;
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    ngx_int_t                      n;
+    ngx_uint_t                     i;
+    ngx_msec_t                     duration;
+    ngx_event_timer_bench_mode_t  *mode;
+
+    duration = 600 * 1000;
+
+    if (argc > 1) {
+        n = ngx_atoi((u_char *) argv[1], ngx_strlen(argv[1]));
+        if (n <= 0) {
+            ngx_write_stderr("usage: ngx_event_timer_bench [seconds]"
+                             NGX_LINEFEED);
+            return 1;
+        }
+
+        duration = (ngx_msec_t) n * 1000;
+    }
+
+    ngx_event_timer_bench_file.fd = ngx_stderr;
+    ngx_event_timer_bench_log.file = &ngx_event_timer_bench_file;
+    ngx_event_timer_bench_log.log_level = NGX_LOG_WARN;
+
+    ngx_event_timer_bench_c.fd = (ngx_socket_t) -1;
+
+    printf("%-7s %-12s %10s %9s %8s %8s %9s\n", "conns", "timers", "ops",
+           "expired", "late ms", "ns/op", "wall ms");
+
+    for (i = 0; i < sizeof(ngx_event_timer_bench_conns) / sizeof(ngx_uint_t);
+         i++)
+    {
+        for (mode = ngx_event_timer_bench_modes; mode->name; mode++) {
+            ngx_event_timer_bench_run(ngx_event_timer_bench_conns[i], mode,
+                                      duration);
+        }
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_event_timer_bench_run(ngx_uint_t conns, ngx_event_timer_bench_mode_t *mode,
+    ngx_msec_t duration)
+{
+    double                           start, elapsed;
+    ngx_uint_t                       i, uses, rate;
+    ngx_msec_t                       end;
+    ngx_event_t                     *events, *ev;
+    ngx_event_timer_bench_result_t  *res;
+
+    events = ngx_calloc(conns * sizeof(ngx_event_t),
+                        &ngx_event_timer_bench_log);
+    if (events == NULL) {
+        exit(1);
+    }
+
+    res = &ngx_event_timer_bench_result;
+    ngx_memzero(res, sizeof(ngx_event_timer_bench_result_t));
+
+    ngx_event_timer_wheel = mode->wheel;
+    ngx_event_timer_lazy = mode->lazy;
+    ngx_event_timer_bench_seed = 2463534242;
+
+    ngx_current_msec = 1000000;
+
+    (void) ngx_event_timer_init(&ngx_event_timer_bench_log);
+
+    start = ngx_event_timer_bench_now();
+
+    for (i = 0; i < conns; i++) {
+        ev = &events[i];
+
+        ev->data = &ngx_event_timer_bench_c;
+        ev->log = &ngx_event_timer_bench_log;
+        ev->handler = ngx_event_timer_bench_expired;
+
+        ngx_add_timer(ev, ngx_event_timer_bench_random()
+                          % NGX_EVENT_TIMER_BENCH_READ + 1);
+        res->ops++;
+    }
+
+    /* uses per second, spread over the milliseconds */
+
+    rate = conns * 1000 / NGX_EVENT_TIMER_BENCH_INTERVAL;
+    uses = 0;
+
+    for (end = ngx_current_msec + duration; ngx_current_msec != end; ) {
+
+        ngx_current_msec++;
+
+        for (uses += rate; uses >= 1000; uses -= 1000) {
+            ev = &events[ngx_event_timer_bench_random() % conns];
+
+            if (ngx_event_timer_bench_random()
+                % NGX_EVENT_TIMER_BENCH_CLOSE == 0)
+            {
+                if (ev->timer_set) {
+                    ngx_del_timer(ev);
+                }
+
+                ngx_add_timer(ev, NGX_EVENT_TIMER_BENCH_KEEPALIVE);
+                res->ops += 2;
+
+            } else {
+                ngx_add_timer(ev, NGX_EVENT_TIMER_BENCH_READ);
+                res->ops++;
+            }
+        }
+
+        (void) ngx_event_find_timer();
+        ngx_event_expire_timers();
+    }
+
+    elapsed = ngx_event_timer_bench_now() - start;
+
+    printf("%-7u %-12s %10u %9u %8.1f %8.1f %9.1f\n",
+           (unsigned) conns, mode->name, (unsigned) res->ops,
+           (unsigned) res->expired,
+           res->expired ? (double) res->late / res->expired : 0.0,
+           elapsed * 1e9 / res->ops, elapsed * 1000);
+
+    ngx_free(events);
+}
+
+
+/* a connection timed out is closed and replaced by a new one */
+
+static void
+ngx_event_timer_bench_expired(ngx_event_t *ev)
+{
+    ngx_event_timer_bench_result_t  *res;
+
+    res = &ngx_event_timer_bench_result;
+
+    res->expired++;
+    res->late += ngx_current_msec - ev->deadline;
+
+    ev->timedout = 0;
+
+    ngx_add_timer(ev, NGX_EVENT_TIMER_BENCH_READ);
+    res->ops++;
+}
+
+
+/* xorshift32, cheap and the same for each mode */
+
+static uint32_t
+ngx_event_timer_bench_random(void)
+{
+    uint32_t  x;
+
+    x = ngx_event_timer_bench_seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    ngx_event_timer_bench_seed = x;
+
+    return x;
+}
+
+
+static double
+ngx_event_timer_bench_now(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) lurenfu@qq.com
+ */
+
+
+/*
+ * Measures the xcgi body filter and the form parser on synthetic pages
+ * and bodies passed in buffers of various sizes.  For each case the input
+ * bytes per second and, per page, the bytes and the allocations taken by
+ * the request are reported:
+ *
+ *     ngx_xcgi_bench [msec]
+ *
+ * runs each case for the time given, 200 milliseconds by default.  The
+ * split of 0 passes the input in a single buffer.
+ */
+
+#include "ngx_xcgi_harness.h"
+
+
+#define NGX_XCGI_BENCH_PAGE_SIZE    (64 * 1024)
+
+#define NGX_XCGI_BENCH_FIELD                                                  \
+    "--" NGX_XCGI_HARNESS_BOUNDARY CRLF                                       \
+    "Content-Disposition: form-data; name=\"field%04ui\"" CRLF CRLF          \
+    "value+of%%20field+%04ui%%21" CRLF
+
+#define NGX_XCGI_BENCH_FILE                                                   \
+    "--" NGX_XCGI_HARNESS_BOUNDARY CRLF                                       \
+    "Content-Disposition: form-data; name=\"file\"; "                        \
+    "filename=\"firmware.bin\"" CRLF                                         \
+    "Content-Type: application/octet-stream" CRLF CRLF
+
+#define NGX_XCGI_BENCH_LAST                                                   \
+    CRLF "--" NGX_XCGI_HARNESS_BOUNDARY "--" CRLF
+
+
+typedef struct {
+    char                    *name;
+    ngx_str_t                tag;       /* inserted every "every" bytes */
+    size_t                   every;
+    ngx_uint_t               flags;
+    ngx_str_t                page;
+} ngx_xcgi_bench_page_t;
+
+
+typedef struct {
+    char                    *name;
+    ngx_uint_t               fields;
+    size_t                   file;      /* size of the file part */
+    ngx_uint_t               flags;
+    ngx_str_t                body;
+} ngx_xcgi_bench_form_t;
+
+
+static ngx_int_t ngx_xcgi_bench_make_page(ngx_xcgi_bench_page_t *bp);
+static ngx_int_t ngx_xcgi_bench_make_form(ngx_xcgi_bench_form_t *bf);
+static ngx_int_t ngx_xcgi_bench_run(char *name, ngx_str_t *input,
+    size_t split, ngx_uint_t flags, ngx_uint_t form);
+static double ngx_xcgi_bench_now(void);
+
+
+/* plain HTML has a '<' every few dozens of bytes */
+
+static char  ngx_xcgi_bench_html[] =
+    "<tr><td class=\"name\">Interface</td><td>eth0 &amp; eth1</td></tr>\n"
+    "<p>The quick brown fox jumps over the lazy dog.</p>\n";
+
+
+static ngx_xcgi_bench_page_t  ngx_xcgi_bench_pages[] = {
+
+    { "plain", ngx_null_string, 0, 0, ngx_null_string },
+
+    { "sparse", ngx_string("<%XCGI_HelloWorld();%>"), 4096, 0,
+      ngx_null_string },
+
+    { "dense", ngx_string("<% XCGI_StringJoin(\"eth0\", 1500, \"up\"); %>"),
+      256, 0, ngx_null_string },
+
+    { "dense readonly",
+      ngx_string("<% XCGI_StringJoin(\"eth0\", 1500, \"up\"); %>"),
+      256, NGX_XCGI_HARNESS_READONLY, ngx_null_string },
+
+    { "escaped", ngx_string("<%XCGI_StringJoin(\"a \\\"b\\\"\", \"c\\td\");%>"),
+      256, 0, ngx_null_string },
+
+    { NULL, ngx_null_string, 0, 0, ngx_null_string }
+};
+
+
+static ngx_xcgi_bench_form_t  ngx_xcgi_bench_forms[] = {
+
+    { "urlencoded", 32, 0, 0, ngx_null_string },
+
+    { "urlencoded large", 1024, 0, 0, ngx_null_string },
+
+    { "urlencoded chunked", 32, 0, NGX_XCGI_HARNESS_CHUNKED,
+      ngx_null_string },
+
+    { "multipart", 8, 32768, NGX_XCGI_HARNESS_MULTIPART, ngx_null_string },
+
+    { NULL, 0, 0, 0, ngx_null_string }
+};
+
+
+/* whole, file reads, memory pages, TCP segments and a pathological one */
+
+static size_t  ngx_xcgi_bench_splits[] = { 0, 32768, 4096, 1460, 17 };
+
+static double  ngx_xcgi_bench_time = 0.2;
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    ngx_uint_t              i;
+    ngx_xcgi_bench_page_t  *bp;
+    ngx_xcgi_bench_form_t  *bf;
+
+    if (argc > 1) {
+        ngx_xcgi_bench_time = ngx_atoi((u_char *) argv[1],
+                                       ngx_strlen(argv[1]));
+        if (ngx_xcgi_bench_time <= 0) {
+            ngx_write_stderr("usage: ngx_xcgi_bench [msec]" NGX_LINEFEED);
+            return 1;
+        }
+
+        ngx_xcgi_bench_time /= 1000;
+    }
+
+    if (ngx_xcgi_harness_init(NGX_LOG_WARN) != NGX_OK) {
+        ngx_write_stderr("ngx_xcgi_harness_init() failed" NGX_LINEFEED);
+        return 1;
+    }
+
+    printf("%-20s %6s %9s %9s %8s %7s %6s %7s\n", "case", "split", "MB/s",
+           "pages/s", "pool", "allocs", "tags", "copied");
+
+    for (bp = ngx_xcgi_bench_pages; bp->name; bp++) {
+        if (ngx_xcgi_bench_make_page(bp) != NGX_OK) {
+            return 1;
+        }
+
+        for (i = 0; i < sizeof(ngx_xcgi_bench_splits) / sizeof(size_t); i++) {
+            if (ngx_xcgi_bench_run(bp->name, &bp->page,
+                                   ngx_xcgi_bench_splits[i], bp->flags, 0)
+                != NGX_OK)
+            {
+                return 1;
+            }
+        }
+    }
+
+    printf("\n%-20s %6s %9s %9s %8s %7s %6s %7s\n", "form", "split", "MB/s",
+           "bodies/s", "pool", "allocs", "fields", "parts");
+
+    for (bf = ngx_xcgi_bench_forms; bf->name; bf++) {
+        if (ngx_xcgi_bench_make_form(bf) != NGX_OK) {
+            return 1;
+        }
+
+        for (i = 0; i < sizeof(ngx_xcgi_bench_splits) / sizeof(size_t); i++) {
+            if (ngx_xcgi_bench_run(bf->name, &bf->body,
+                                   ngx_xcgi_bench_splits[i], bf->flags, 1)
+                != NGX_OK)
+            {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_xcgi_bench_make_page(ngx_xcgi_bench_page_t *bp)
+{
+    u_char  *p, *last, *next;
+    size_t   len;
+
+    p = ngx_alloc(NGX_XCGI_BENCH_PAGE_SIZE, ngx_cycle->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    bp->page.data = p;
+    last = p + NGX_XCGI_BENCH_PAGE_SIZE;
+    next = bp->every ? p + bp->every : last;
+
+    while (p < last) {
+
+        if (p >= next && (size_t) (last - p) >= bp->tag.len) {
+            p = ngx_cpymem(p, bp->tag.data, bp->tag.len);
+            next += bp->every;
+            continue;
+        }
+
+        len = ngx_min(sizeof(ngx_xcgi_bench_html) - 1, (size_t) (last - p));
+
+        if (p < next && (size_t) (next - p) < len) {
+            len = next - p;
+        }
+
+        p = ngx_cpymem(p, ngx_xcgi_bench_html, len);
+    }
+
+    bp->page.len = NGX_XCGI_BENCH_PAGE_SIZE;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_xcgi_bench_make_form(ngx_xcgi_bench_form_t *bf)
+{
+    u_char      *p;
+    size_t       len;
+    ngx_uint_t   i;
+
+    /* the format is longer than a field up to 9999 */
+
+    len = bf->fields * sizeof(NGX_XCGI_BENCH_FIELD)
+          + sizeof(NGX_XCGI_BENCH_FILE) + bf->file
+          + sizeof(NGX_XCGI_BENCH_LAST);
+
+    p = ngx_alloc(len, ngx_cycle->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    bf->body.data = p;
+
+    if (!(bf->flags & NGX_XCGI_HARNESS_MULTIPART)) {
+
+        for (i = 0; i < bf->fields; i++) {
+            p = ngx_sprintf(p, "%sfield%04ui=value+of%%20field+%04ui%%21",
+                            i ? "&" : "", i, i);
+        }
+
+        bf->body.len = p - bf->body.data;
+
+        return NGX_OK;
+    }
+
+    for (i = 0; i < bf->fields; i++) {
+        p = ngx_sprintf(p, NGX_XCGI_BENCH_FIELD, i, i);
+    }
+
+    p = ngx_cpymem(p, NGX_XCGI_BENCH_FILE, sizeof(NGX_XCGI_BENCH_FILE) - 1);
+
+    /* binary data with partial delimiters */
+
+    for (i = 0; i < bf->file; i++) {
+        *p++ = (i % 61 == 0) ? CR : (i % 67 == 0) ? '-' : (u_char) (i * 7);
+    }
+
+    p = ngx_cpymem(p, NGX_XCGI_BENCH_LAST, sizeof(NGX_XCGI_BENCH_LAST) - 1);
+
+    bf->body.len = p - bf->body.data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_xcgi_bench_run(char *name, ngx_str_t *input, size_t split,
+    ngx_uint_t flags, ngx_uint_t form)
+{
+    double                     start, elapsed;
+    ngx_int_t                  rc;
+    ngx_uint_t                 n;
+    ngx_xcgi_harness_result_t  res;
+
+    n = 0;
+    start = ngx_xcgi_bench_now();
+
+    do {
+        if (form) {
+            rc = ngx_xcgi_harness_form(input->data, input->len, &split, 1,
+                                       flags, &res);
+
+        } else {
+            rc = ngx_xcgi_harness_page(input->data, input->len, &split, 1,
+                                       flags, &res);
+        }
+
+        if (rc != NGX_OK || res.rc != NGX_OK) {
+            fprintf(stderr, "%s: failed, split %u\n", name, (unsigned) split);
+            return NGX_ERROR;
+        }
+
+        n++;
+        elapsed = ngx_xcgi_bench_now() - start;
+
+    } while (elapsed < ngx_xcgi_bench_time);
+
+    printf("%-20s %6u %9.1f %9.0f %8u %7u %6u %7u\n",
+           name, (unsigned) split,
+           input->len * n / elapsed / (1024 * 1024), n / elapsed,
+           (unsigned) res.pool_size, (unsigned) res.allocs,
+           (unsigned) (form ? res.vars : res.tags),
+           (unsigned) (form ? res.parts : res.tags_copied));
+
+    return NGX_OK;
+}
+
+
+static double
+ngx_xcgi_bench_now(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) lurenfu@qq.com
+ */
+
+
+/*
+ * A libFuzzer driver for the tag parser of the body filter and for the
+ * form parser.  The first byte of an input selects the parser and the
+ * buffer flags, the next four the sizes of the buffers the rest is split
+ * into.  The input is parsed once in a single buffer and once split; the
+ * parsers must give the same result and the same output either way.
+ *
+ * Built without libFuzzer, the driver runs the files given, or mutations
+ * of a few built-in inputs:
+ *
+ *     ngx_xcgi_fuzz [-n runs] [file ...]
+ */
+
+#include "ngx_xcgi_harness.h"
+
+
+#define NGX_XCGI_FUZZ_FORM       0x01
+#define NGX_XCGI_FUZZ_READONLY   0x02
+#define NGX_XCGI_FUZZ_MULTIPART  0x04
+#define NGX_XCGI_FUZZ_CHUNKED    0x08
+
+#define NGX_XCGI_FUZZ_HEADER     5
+#define NGX_XCGI_FUZZ_MAX_LEN    4096
+
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+
+int
+LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    if (ngx_xcgi_harness_init(NGX_LOG_ALERT) != NGX_OK) {
+        ngx_write_stderr("ngx_xcgi_harness_init() failed" NGX_LINEFEED);
+        exit(1);
+    }
+
+    return 0;
+}
+
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    u_char                     *whole;
+    size_t                      chunks[NGX_XCGI_FUZZ_HEADER - 1], len;
+    ngx_int_t                   rc;
+    ngx_uint_t                  i, mode, flags;
+    ngx_xcgi_harness_result_t   one, split;
+
+    if (size < NGX_XCGI_FUZZ_HEADER) {
+        return 0;
+    }
+
+    mode = data[0];
+
+    for (i = 0; i < NGX_XCGI_FUZZ_HEADER - 1; i++) {
+        chunks[i] = (size_t) data[i + 1] + 1;
+    }
+
+    data += NGX_XCGI_FUZZ_HEADER;
+    size -= NGX_XCGI_FUZZ_HEADER;
+
+    flags = NGX_XCGI_HARNESS_OUTPUT;
+
+    if (mode & NGX_XCGI_FUZZ_READONLY) {
+        flags |= NGX_XCGI_HARNESS_READONLY;
+    }
+
+    if (mode & NGX_XCGI_FUZZ_MULTIPART) {
+        flags |= NGX_XCGI_HARNESS_MULTIPART;
+    }
+
+    if (mode & NGX_XCGI_FUZZ_CHUNKED) {
+        flags |= NGX_XCGI_HARNESS_CHUNKED;
+    }
+
+    len = 0;
+
+    if (mode & NGX_XCGI_FUZZ_FORM) {
+        rc = ngx_xcgi_harness_form((u_char *) data, size, &len, 1, flags,
+                                   &one);
+
+    } else {
+        rc = ngx_xcgi_harness_page((u_char *) data, size, &len, 1, flags,
+                                   &one);
+    }
+
+    if (rc != NGX_OK) {
+        return 0;
+    }
+
+    whole = NULL;
+
+    if (one.out_len) {
+        whole = ngx_alloc(one.out_len, ngx_cycle->log);
+        if (whole == NULL) {
+            return 0;
+        }
+
+        ngx_memcpy(whole, one.out, one.out_len);
+    }
+
+    if (mode & NGX_XCGI_FUZZ_FORM) {
+        rc = ngx_xcgi_harness_form((u_char *) data, size, chunks,
+                                   NGX_XCGI_FUZZ_HEADER - 1, flags, &split);
+
+    } else {
+        rc = ngx_xcgi_harness_page((u_char *) data, size, chunks,
+                                   NGX_XCGI_FUZZ_HEADER - 1, flags, &split);
+    }
+
+    if (rc == NGX_OK
+        && (split.rc != one.rc
+            || (one.rc == NGX_OK
+                && (split.out_len != one.out_len
+                    || split.tags != one.tags
+                    || split.vars != one.vars
+                    || split.uploaded != one.uploaded
+                    || (one.out_len
+                        && ngx_memcmp(split.out, whole, one.out_len) != 0)))))
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "xcgi %s split %uz/%uz/%uz/%uz: rc %i/%i, "
+                      "output %uz/%uz bytes, tags %ui/%ui, fields %ui/%ui",
+                      (mode & NGX_XCGI_FUZZ_FORM) ? "form" : "page",
+                      chunks[0], chunks[1], chunks[2], chunks[3],
+                      one.rc, split.rc, one.out_len, split.out_len,
+                      one.tags, split.tags, one.vars, split.vars);
+        abort();
+    }
+
+    ngx_free(whole);
+
+    return 0;
+}
+
+
+#if (NGX_XCGI_FUZZ_MAIN)
+
+static ngx_int_t ngx_xcgi_fuzz_file(char *name);
+static size_t ngx_xcgi_fuzz_mutate(u_char *buf, size_t len);
+
+
+static char  *ngx_xcgi_fuzz_seeds[] = {
+
+    "\x10\x01\x07\x10\x02"
+    "<html><%XCGI_StringJoin(\"a \\\"b\\\"\", 12, \"c\\td\");%><p>"
+    "<<% XCGI_HelloWorld ( ) ; %>>< %><%XCGI_JSON_Args(1,\"\\n\")%>"
+    "<%XCGI_Unknown(\"x\")%><%XCGI_StringJoin(\"x\",\"y\"%><%% %>%<",
+
+    "\x01\x03\x01\x1f\x05"
+    "a=1&b=%41%zz+c&&=x&d&long+name%20=value%2&e=%%25&a=2",
+
+    "\x05\x0a\x01\x3f\x01"
+    "preamble\r\n--" NGX_XCGI_HARNESS_BOUNDARY "\r\n"
+    "Content-Disposition: form-data; name=\"a\"\r\n\r\n"
+    "one+two%21\r\n--" NGX_XCGI_HARNESS_BOUNDARY "\r\n"
+    "Content-Disposition: form-data; name=\"f\"; filename=\"x.bin\"\r\n"
+    "Content-Type: application/octet-stream\r\n\r\n"
+    "\r\n--xcgi-\r\n-\r\n--" NGX_XCGI_HARNESS_BOUNDARY "x\r\n"
+    "--" NGX_XCGI_HARNESS_BOUNDARY "--\r\nepilogue",
+
+    NULL
+};
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    u_char      buf[NGX_XCGI_FUZZ_MAX_LEN];
+    size_t      len;
+    ngx_int_t   n, runs;
+    ngx_uint_t  i, seeds;
+
+    (void) LLVMFuzzerInitialize(&argc, (char ***) &argv);
+
+    runs = 100000;
+
+    for (i = 1; i < (ngx_uint_t) argc; i++) {
+        if (ngx_strcmp(argv[i], "-n") != 0) {
+            break;
+        }
+
+        if (++i == (ngx_uint_t) argc
+            || (runs = ngx_atoi((u_char *) argv[i], ngx_strlen(argv[i])))
+               == NGX_ERROR)
+        {
+            ngx_write_stderr("usage: ngx_xcgi_fuzz [-n runs] [file ...]"
+                             NGX_LINEFEED);
+            return 1;
+        }
+    }
+
+    if (i < (ngx_uint_t) argc) {
+        for ( /* void */ ; i < (ngx_uint_t) argc; i++) {
+            if (ngx_xcgi_fuzz_file(argv[i]) != NGX_OK) {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    for (seeds = 0; ngx_xcgi_fuzz_seeds[seeds]; seeds++) { /* void */ }
+
+    srandom(1);
+
+    for (n = 0; n < runs; n++) {
+        len = ngx_strlen(ngx_xcgi_fuzz_seeds[n % seeds]);
+
+        ngx_memcpy(buf, ngx_xcgi_fuzz_seeds[n % seeds], len);
+
+        len = ngx_xcgi_fuzz_mutate(buf, len);
+
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+
+    printf("%d runs\n", (int) runs);
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_xcgi_fuzz_file(char *name)
+{
+    u_char          *buf;
+    ssize_t          n;
+    ngx_fd_t         fd;
+    ngx_file_info_t  fi;
+
+    fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_EMERG, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", name);
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_EMERG, ngx_cycle->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", name);
+        ngx_close_file(fd);
+        return NGX_ERROR;
+    }
+
+    buf = ngx_alloc(ngx_file_size(&fi) + 1, ngx_cycle->log);
+    if (buf == NULL) {
+        ngx_close_file(fd);
+        return NGX_ERROR;
+    }
+
+    n = ngx_read_fd(fd, buf, ngx_file_size(&fi));
+
+    ngx_close_file(fd);
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_EMERG, ngx_cycle->log, ngx_errno,
+                      ngx_read_fd_n " \"%s\" failed", name);
+        ngx_free(buf);
+        return NGX_ERROR;
+    }
+
+    LLVMFuzzerTestOneInput(buf, n);
+
+    ngx_free(buf);
+
+    return NGX_OK;
+}
+
+
+/* a few random edits, copies of parts included */
+
+static size_t
+ngx_xcgi_fuzz_mutate(u_char *buf, size_t len)
+{
+    size_t      pos, from, n;
+    ngx_uint_t  edits;
+
+    static u_char  special[] = "<%>()\"\\,; \r\n-&=+";
+
+    for (edits = random() % 8 + 1; edits; edits--) {
+        pos = random() % (len + 1);
+
+        switch (random() % 5) {
+
+        case 0:
+            if (pos < len) {
+                buf[pos] = (u_char) random();
+            }
+            break;
+
+        case 1:
+            if (pos < len) {
+                buf[pos] = special[random() % (sizeof(special) - 1)];
+            }
+            break;
+
+        case 2:
+            if (len < NGX_XCGI_FUZZ_MAX_LEN) {
+                ngx_memmove(buf + pos + 1, buf + pos, len - pos);
+                buf[pos] = special[random() % (sizeof(special) - 1)];
+                len++;
+            }
+            break;
+
+        case 3:
+            if (pos < len) {
+                n = random() % 16 + 1;
+                n = ngx_min(n, len - pos);
+
+                ngx_memmove(buf + pos, buf + pos + n, len - pos - n);
+                len -= n;
+            }
+            break;
+
+        default:
+            from = random() % (len + 1);
+
+            n = random() % 64 + 1;
+            n = ngx_min(n, len - from);
+            n = ngx_min(n, NGX_XCGI_FUZZ_MAX_LEN - len);
+
+            ngx_memmove(buf + pos + n, buf + pos, len - pos);
+            ngx_memmove(buf + pos, buf + from + (from >= pos ? n : 0), n);
+            len += n;
+            break;
+        }
+    }
+
+    return len;
+}
+
+#endif
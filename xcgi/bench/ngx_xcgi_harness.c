@@ -0,0 +1,566 @@
+/*
+ * Copyright (C) lurenfu@qq.com
+ */
+
+
+/*
+ * The filter, the request variables and the form parser are included
+ * here to reach their static functions; their objects are left out of
+ * the link by build.sh.
+ */
+
+#include "../ngx_http_xcgi_filter_module.c"
+#include "../ngx_xcgi_utils.c"
+#include "../ngx_xcgi_form.c"
+
+#include "ngx_xcgi_harness.h"
+
+
+#define NGX_XCGI_HARNESS_REQUEST_POOL_SIZE  4096
+
+
+static ngx_http_request_t *ngx_xcgi_harness_request(void);
+static ngx_buf_t *ngx_xcgi_harness_buf(ngx_http_request_t *r, u_char *data,
+    size_t size, size_t *chunks, ngx_uint_t nchunks, ngx_uint_t *n);
+static void ngx_xcgi_harness_done(ngx_http_request_t *r,
+    ngx_xcgi_harness_result_t *res, ngx_xcgi_stats_t *st);
+static ngx_int_t ngx_xcgi_harness_append(u_char *data, size_t len);
+static ngx_int_t ngx_xcgi_harness_body_filter(ngx_http_request_t *r,
+    ngx_chain_t *in);
+static ngx_int_t ngx_xcgi_harness_upload(ngx_http_request_t *r,
+    ngx_xcgi_part_t *part, u_char *data, size_t len, ngx_uint_t last);
+
+
+static ngx_log_t                   ngx_xcgi_harness_log;
+static ngx_open_file_t             ngx_xcgi_harness_log_file;
+static ngx_cycle_t                 ngx_xcgi_harness_cycle;
+
+static void                       *ngx_xcgi_harness_main_conf[2];
+static void                       *ngx_xcgi_harness_loc_conf[2];
+static ngx_http_core_loc_conf_t    ngx_xcgi_harness_clcf;
+
+static ngx_uint_t                  ngx_xcgi_harness_output;
+static u_char                     *ngx_xcgi_harness_out;
+static size_t                      ngx_xcgi_harness_out_len;
+static size_t                      ngx_xcgi_harness_out_size;
+
+static ngx_xcgi_harness_result_t  *ngx_xcgi_harness_res;
+
+static ngx_xcgi_handler_t          ngx_xcgi_harness_form_handler = {
+    .name = ngx_string("XCGI_Harness"),
+    .upload = ngx_xcgi_harness_upload,
+};
+
+
+ngx_int_t
+ngx_xcgi_harness_init(ngx_uint_t log_level)
+{
+    ngx_uint_t                 n;
+    ngx_conf_t                 cf;
+    ngx_http_conf_ctx_t        ctx;
+    ngx_http_xcgi_loc_conf_t  *prev, *conf;
+
+    ngx_pagesize = getpagesize();
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+
+    for (n = ngx_pagesize; n >>= 1; ngx_pagesize_shift++) { /* void */ }
+
+    ngx_time_init();
+
+    ngx_pid = ngx_getpid();
+
+    ngx_xcgi_harness_log_file.fd = ngx_stderr;
+    ngx_xcgi_harness_log.file = &ngx_xcgi_harness_log_file;
+    ngx_xcgi_harness_log.log_level = log_level;
+
+    ngx_xcgi_harness_cycle.log = &ngx_xcgi_harness_log;
+    ngx_cycle = &ngx_xcgi_harness_cycle;
+
+    ngx_memzero(&cf, sizeof(ngx_conf_t));
+
+    cf.pool = ngx_create_pool(NGX_CYCLE_POOL_SIZE, &ngx_xcgi_harness_log);
+    if (cf.pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    cf.temp_pool = cf.pool;
+    cf.log = &ngx_xcgi_harness_log;
+    cf.ctx = &ctx;
+
+    /* the location configuration of the core and of the filter module */
+
+    ngx_http_core_module.ctx_index = 0;
+    ngx_http_xcgi_filter_module.ctx_index = 1;
+
+    ctx.main_conf = ngx_xcgi_harness_main_conf;
+    ctx.loc_conf = ngx_xcgi_harness_loc_conf;
+
+    ngx_xcgi_harness_main_conf[1] = ngx_http_xcgi_create_main_conf(&cf);
+    if (ngx_xcgi_harness_main_conf[1] == NULL) {
+        return NGX_ERROR;
+    }
+
+    prev = ngx_http_xcgi_create_loc_conf(&cf);
+    conf = ngx_http_xcgi_create_loc_conf(&cf);
+
+    if (prev == NULL || conf == NULL) {
+        return NGX_ERROR;
+    }
+
+    conf->enable = 1;
+
+    if (ngx_http_xcgi_merge_loc_conf(&cf, prev, conf) != NGX_CONF_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_xcgi_harness_loc_conf[0] = &ngx_xcgi_harness_clcf;
+    ngx_xcgi_harness_loc_conf[1] = conf;
+
+    ngx_xcgi_harness_clcf.client_body_buffer_size = 2 * ngx_pagesize;
+
+    if (ngx_xcgi_private_init(&cf) != NGX_OK
+        || ngx_xcgi_handlers_init(&cf) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_http_next_body_filter = ngx_xcgi_harness_body_filter;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_xcgi_harness_page(u_char *data, size_t len, size_t *chunks,
+    ngx_uint_t nchunks, ngx_uint_t flags, ngx_xcgi_harness_result_t *res)
+{
+    size_t                     size;
+    ngx_int_t                  rc;
+    ngx_uint_t                 n;
+    ngx_buf_t                 *b;
+    ngx_chain_t                cl;
+    ngx_xcgi_stats_t           st;
+    ngx_http_request_t        *r;
+    ngx_http_xcgi_ctx_t       *ctx;
+    ngx_http_xcgi_loc_conf_t  *xlcf;
+
+    r = ngx_xcgi_harness_request();
+    if (r == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(res, sizeof(ngx_xcgi_harness_result_t));
+
+    st = ngx_xcgi_stats;
+
+    ngx_xcgi_harness_res = res;
+    ngx_xcgi_harness_output = flags & NGX_XCGI_HARNESS_OUTPUT;
+    ngx_xcgi_harness_out_len = 0;
+
+    /* as set by the header filter */
+
+    xlcf = ngx_http_get_module_loc_conf(r, ngx_http_xcgi_filter_module);
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_xcgi_ctx_t));
+    if (ctx == NULL) {
+        goto failed;
+    }
+
+    ctx->last_out = &ctx->out;
+    ctx->max_args = xlcf->max_args;
+
+    ctx->argv = ngx_palloc(r->pool, xlcf->max_args * sizeof(char *));
+    ctx->argvlen = ngx_palloc(r->pool, xlcf->max_args * sizeof(int));
+
+    if (ctx->argv == NULL || ctx->argvlen == NULL) {
+        goto failed;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_xcgi_filter_module);
+
+    rc = NGX_OK;
+    n = 0;
+
+    do {
+        b = ngx_xcgi_harness_buf(r, data, len, chunks, nchunks, &n);
+        if (b == NULL) {
+            goto failed;
+        }
+
+        size = b->last - b->pos;
+
+        if (flags & NGX_XCGI_HARNESS_READONLY) {
+            b->temporary = 0;
+            b->memory = 1;
+        }
+
+        data += size;
+        len -= size;
+
+        b->last_buf = (len == 0);
+
+        cl.buf = b;
+        cl.next = NULL;
+
+        rc = ngx_http_xcgi_body_filter(r, &cl);
+
+        /* the buffer is consumed and may be reused */
+
+        ngx_free(b);
+
+    } while (rc == NGX_OK && len);
+
+    res->rc = rc;
+
+    ngx_xcgi_harness_done(r, res, &st);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_destroy_pool(r->pool);
+
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_xcgi_harness_form(u_char *data, size_t len, size_t *chunks,
+    ngx_uint_t nchunks, ngx_uint_t flags, ngx_xcgi_harness_result_t *res)
+{
+    u_char              *body, *last;
+    size_t               size;
+    ngx_int_t            rc;
+    ngx_uint_t           i, n;
+    ngx_str_t            value;
+    ngx_buf_t           *b;
+    ngx_chain_t          cl;
+    ngx_xcgi_var_t      *var;
+    ngx_xcgi_form_t     *form;
+    ngx_xcgi_vars_t     *vars;
+    ngx_xcgi_stats_t     st;
+    ngx_table_elt_t     *h;
+    ngx_http_request_t  *r;
+
+    r = ngx_xcgi_harness_request();
+    if (r == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(res, sizeof(ngx_xcgi_harness_result_t));
+
+    st = ngx_xcgi_stats;
+
+    ngx_xcgi_harness_res = res;
+    ngx_xcgi_harness_output = flags & NGX_XCGI_HARNESS_OUTPUT;
+    ngx_xcgi_harness_out_len = 0;
+
+    if (flags & NGX_XCGI_HARNESS_MULTIPART) {
+        h = ngx_pcalloc(r->pool, sizeof(ngx_table_elt_t));
+        if (h == NULL) {
+            goto failed;
+        }
+
+        ngx_str_set(&h->key, "Content-Type");
+        ngx_str_set(&h->value, "multipart/form-data; boundary="
+                               NGX_XCGI_HARNESS_BOUNDARY);
+
+        r->headers_in.content_type = h;
+    }
+
+    if (flags & NGX_XCGI_HARNESS_CHUNKED) {
+        r->headers_in.chunked = 1;
+
+    } else {
+        r->headers_in.content_length_n = len;
+    }
+
+    rc = ngx_xcgi_form_create(r, &ngx_xcgi_harness_form_handler, &form);
+
+    if (rc == NGX_ERROR) {
+        goto failed;
+    }
+
+    /*
+     * a body kept in memory is read into a single buffer, other bodies
+     * are passed in buffers which are reused once consumed
+     */
+
+    body = NULL;
+    last = NULL;
+
+    if (rc == NGX_OK && form->in_place && len) {
+        body = ngx_alloc(len, r->connection->log);
+        if (body == NULL) {
+            goto failed;
+        }
+
+        last = body;
+    }
+
+    n = 0;
+
+    while (rc == NGX_OK) {
+        b = ngx_xcgi_harness_buf(r, data, len, chunks, nchunks, &n);
+        if (b == NULL) {
+            ngx_free(body);
+            goto failed;
+        }
+
+        size = b->last - b->pos;
+
+        if (body) {
+
+            /* the data arrives into the body buffer */
+
+            b->start = last;
+            b->pos = last;
+            b->last = ngx_cpymem(last, data, size);
+            b->end = b->last;
+
+            last = b->last;
+        }
+
+        data += size;
+        len -= size;
+
+        b->last_buf = (len == 0);
+
+        cl.buf = b;
+        cl.next = NULL;
+
+        ngx_xcgi_stats.form_bytes += size;
+
+        rc = ngx_xcgi_form_feed(r, form, &cl);
+
+        ngx_free(b);
+
+        if (len == 0) {
+            break;
+        }
+    }
+
+    res->rc = rc;
+
+    /* the fields are decoded on the first read */
+
+    vars = r->xcgi_var;
+
+    for (i = 0; rc == NGX_OK && vars && i < vars->size; i++) {
+        var = &vars->slots[i];
+
+        if (var->name.data == NULL) {
+            continue;
+        }
+
+        res->vars++;
+
+        if (ngx_xcgi_get_var_str(r, &var->name, &value) != NGX_OK
+            || ngx_xcgi_harness_append(var->name.data, var->name.len)
+               != NGX_OK
+            || ngx_xcgi_harness_append((u_char *) "=", 1) != NGX_OK
+            || ngx_xcgi_harness_append(value.data, value.len) != NGX_OK
+            || ngx_xcgi_harness_append((u_char *) "\n", 1) != NGX_OK)
+        {
+            res->rc = NGX_ERROR;
+            break;
+        }
+    }
+
+    ngx_xcgi_harness_done(r, res, &st);
+
+    ngx_free(body);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_destroy_pool(r->pool);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_http_request_t *
+ngx_xcgi_harness_request(void)
+{
+    ngx_pool_t          *pool;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    pool = ngx_create_pool(NGX_XCGI_HARNESS_REQUEST_POOL_SIZE,
+                           &ngx_xcgi_harness_log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    r = ngx_pcalloc(pool, sizeof(ngx_http_request_t));
+    c = ngx_pcalloc(pool, sizeof(ngx_connection_t));
+
+    if (r == NULL || c == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    r->ctx = ngx_pcalloc(pool, 2 * sizeof(void *));
+    if (r->ctx == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    c->log = &ngx_xcgi_harness_log;
+    c->pool = pool;
+
+    r->pool = pool;
+    r->connection = c;
+    r->main = r;
+    r->main_conf = ngx_xcgi_harness_main_conf;
+    r->loc_conf = ngx_xcgi_harness_loc_conf;
+
+    r->headers_in.content_length_n = -1;
+
+    return r;
+}
+
+
+static ngx_buf_t *
+ngx_xcgi_harness_buf(ngx_http_request_t *r, u_char *data, size_t size,
+    size_t *chunks, ngx_uint_t nchunks, ngx_uint_t *n)
+{
+    u_char     *p;
+    ngx_buf_t  *b;
+
+    if (chunks[*n % nchunks] && chunks[*n % nchunks] < size) {
+        size = chunks[*n % nchunks];
+    }
+
+    (*n)++;
+
+    /*
+     * the buffer is not taken from the request pool, and the data ends
+     * the allocation, so that reads past it are caught
+     */
+
+    b = ngx_alloc(sizeof(ngx_buf_t) + size, r->connection->log);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(b, sizeof(ngx_buf_t));
+
+    p = (u_char *) (b + 1);
+
+    b->start = p;
+    b->pos = p;
+    b->last = ngx_cpymem(p, data, size);
+    b->end = b->last;
+    b->temporary = 1;
+
+    return b;
+}
+
+
+static void
+ngx_xcgi_harness_done(ngx_http_request_t *r, ngx_xcgi_harness_result_t *res,
+    ngx_xcgi_stats_t *st)
+{
+    ngx_pool_t        *p;
+    ngx_pool_large_t  *l;
+
+    for (p = r->pool; p; p = p->d.next) {
+        res->pool_size += p->d.last - (u_char *) p;
+        res->allocs++;
+    }
+
+    for (l = r->pool->large; l; l = l->next) {
+        res->allocs += (l->alloc != NULL);
+    }
+
+    res->tags = ngx_xcgi_stats.tags - st->tags;
+    res->tags_copied = ngx_xcgi_stats.tags_copied - st->tags_copied;
+    res->blocks = ngx_xcgi_stats.blocks - st->blocks;
+
+    res->allocs += res->blocks;
+
+    res->out = ngx_xcgi_harness_out;
+
+    ngx_destroy_pool(r->pool);
+}
+
+
+static ngx_int_t
+ngx_xcgi_harness_append(u_char *data, size_t len)
+{
+    u_char  *p;
+    size_t   size;
+
+    ngx_xcgi_harness_res->out_len += len;
+
+    if (!ngx_xcgi_harness_output) {
+        return NGX_OK;
+    }
+
+    if (ngx_xcgi_harness_out_len + len > ngx_xcgi_harness_out_size) {
+        size = ngx_max(2 * ngx_xcgi_harness_out_size,
+                       ngx_xcgi_harness_out_len + len);
+
+        p = ngx_alloc(size, &ngx_xcgi_harness_log);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_xcgi_harness_out_len) {
+            ngx_memcpy(p, ngx_xcgi_harness_out, ngx_xcgi_harness_out_len);
+        }
+
+        ngx_free(ngx_xcgi_harness_out);
+
+        ngx_xcgi_harness_out = p;
+        ngx_xcgi_harness_out_size = size;
+    }
+
+    ngx_memcpy(ngx_xcgi_harness_out + ngx_xcgi_harness_out_len, data, len);
+    ngx_xcgi_harness_out_len += len;
+
+    return NGX_OK;
+}
+
+
+/* the next body filter, the output is sent at once */
+
+static ngx_int_t
+ngx_xcgi_harness_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (ngx_buf_in_memory(b)) {
+            if (ngx_xcgi_harness_append(b->pos, b->last - b->pos) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            b->pos = b->last;
+        }
+
+        if (b->in_file) {
+            ngx_xcgi_harness_res->out_len += b->file_last - b->file_pos;
+            b->file_pos = b->file_last;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_xcgi_harness_upload(ngx_http_request_t *r, ngx_xcgi_part_t *part,
+    u_char *data, size_t len, ngx_uint_t last)
+{
+    ngx_xcgi_harness_res->uploaded += len;
+    ngx_xcgi_harness_res->parts += (last != 0);
+
+    return NGX_OK;
+}
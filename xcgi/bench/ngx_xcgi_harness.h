@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) lurenfu@qq.com
+ */
+
+
+#ifndef __NGX_XCGI_HARNESS_H_INCLUDED__
+#define __NGX_XCGI_HARNESS_H_INCLUDED__
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * Runs pages through the xcgi body filter and bodies through the form
+ * parser outside of a server, with a request made up of a pool and the
+ * default location configuration.  The input is passed in buffers of
+ * the sizes given, used in turn, and each buffer is freed as soon as it
+ * is consumed, so references kept into a previous buffer are caught by
+ * a memory checker.
+ */
+
+#define NGX_XCGI_HARNESS_READONLY   0x01    /* page buffers not temporary */
+#define NGX_XCGI_HARNESS_OUTPUT     0x02    /* collect the output */
+#define NGX_XCGI_HARNESS_MULTIPART  0x04    /* multipart/form-data body */
+#define NGX_XCGI_HARNESS_CHUNKED    0x08    /* body without length */
+
+#define NGX_XCGI_HARNESS_BOUNDARY   "xcgi-harness-boundary"
+
+
+typedef struct {
+    ngx_int_t                rc;
+
+    u_char                  *out;       /* with NGX_XCGI_HARNESS_OUTPUT */
+    size_t                   out_len;
+
+    size_t                   pool_size; /* taken from the request pool */
+    ngx_uint_t               allocs;    /* pool blocks and large allocs */
+
+    ngx_uint_t               tags;
+    ngx_uint_t               tags_copied;
+    ngx_uint_t               blocks;    /* new output blocks */
+
+    ngx_uint_t               vars;      /* form fields */
+    ngx_uint_t               parts;     /* file parts */
+    size_t                   uploaded;
+} ngx_xcgi_harness_result_t;
+
+
+ngx_int_t ngx_xcgi_harness_init(ngx_uint_t log_level);
+
+ngx_int_t ngx_xcgi_harness_page(u_char *data, size_t len, size_t *chunks,
+    ngx_uint_t nchunks, ngx_uint_t flags, ngx_xcgi_harness_result_t *res);
+ngx_int_t ngx_xcgi_harness_form(u_char *data, size_t len, size_t *chunks,
+    ngx_uint_t nchunks, ngx_uint_t flags, ngx_xcgi_harness_result_t *res);
+
+
+#endif /* __NGX_XCGI_HARNESS_H_INCLUDED__ */
@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) lurenfu@qq.com
+ */
+
+
+/*
+ * Compares the tag scanners of ngx_xcgi_scan.c available on this CPU on
+ * large pages, whole and in the buffers of the body filter.  memcpy() of
+ * the same pages is the reference of what passing them on costs at least:
+ *
+ *     ngx_xcgi_scan_bench [msec]
+ *
+ * runs each case for the time given, 200 milliseconds by default.  The
+ * scanners must find the same tags.
+ */
+
+#include "../ngx_xcgi_scan.c"
+
+
+#define NGX_XCGI_SCAN_BENCH_SIZE    (1024 * 1024)
+
+
+typedef u_char *(*ngx_xcgi_scan_pt)(u_char *p, u_char *last);
+
+
+typedef struct {
+    char                    *name;
+    ngx_xcgi_scan_pt         scan;
+} ngx_xcgi_scan_bench_scanner_t;
+
+
+typedef struct {
+    char                    *name;
+    ngx_str_t                text;      /* repeated */
+    ngx_str_t                tag;       /* inserted every "every" bytes */
+    size_t                   every;
+} ngx_xcgi_scan_bench_page_t;
+
+
+static void ngx_xcgi_scan_bench_make_page(ngx_xcgi_scan_bench_page_t *bp,
+    u_char *page);
+static ngx_uint_t ngx_xcgi_scan_bench_scan(ngx_xcgi_scan_pt scan,
+    u_char *page, size_t split, uintptr_t *sum);
+static double ngx_xcgi_scan_bench_now(void);
+
+
+static ngx_xcgi_scan_bench_scanner_t  ngx_xcgi_scan_bench_scanners[] = {
+
+    { "scalar", ngx_xcgi_scan_tag_scalar },
+#if (NGX_XCGI_HAVE_SSE2)
+    { "sse2", ngx_xcgi_scan_tag_sse2 },
+#endif
+#if (NGX_XCGI_HAVE_AVX2)
+    { "avx2", ngx_xcgi_scan_tag_avx2 },
+#endif
+    { NULL, NULL }
+};
+
+
+static ngx_xcgi_scan_bench_page_t  ngx_xcgi_scan_bench_pages[] = {
+
+    /* no '<' at all */
+
+    { "text", ngx_string("The quick brown fox jumps over the lazy dog. "),
+      ngx_null_string, 0 },
+
+    /* a '<' every few dozens of bytes, a tag in a few kilobytes */
+
+    { "html",
+      ngx_string("<tr><td class=\"name\">Interface</td><td>eth0</td></tr>\n"),
+      ngx_string("<%XCGI_HelloWorld();%>"), 4096 },
+
+    { "tags",
+      ngx_string("<tr><td class=\"name\">Interface</td><td>eth0</td></tr>\n"),
+      ngx_string("<%XCGI_HelloWorld();%>"), 128 },
+
+    /* a '<' in every byte */
+
+    { "lt", ngx_string("<"), ngx_null_string, 0 },
+
+    { NULL, ngx_null_string, ngx_null_string, 0 }
+};
+
+
+/* whole and the buffers of the body filter for files and for proxying */
+
+static size_t  ngx_xcgi_scan_bench_splits[] = { 0, 32768, 4096 };
+
+static double  ngx_xcgi_scan_bench_time = 0.2;
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    u_char                         *page, *copy;
+    size_t                          split;
+    double                          start, elapsed;
+    uintptr_t                       sum, first_sum;
+    ngx_uint_t                      i, n, found, first;
+    ngx_xcgi_scan_bench_page_t     *bp;
+    ngx_xcgi_scan_bench_scanner_t  *sc;
+
+    if (argc > 1) {
+        ngx_xcgi_scan_bench_time = ngx_atoi((u_char *) argv[1],
+                                            ngx_strlen(argv[1]));
+        if (ngx_xcgi_scan_bench_time <= 0) {
+            ngx_write_stderr("usage: ngx_xcgi_scan_bench [msec]"
+                             NGX_LINEFEED);
+            return 1;
+        }
+
+        ngx_xcgi_scan_bench_time /= 1000;
+    }
+
+    page = malloc(NGX_XCGI_SCAN_BENCH_SIZE);
+    copy = malloc(NGX_XCGI_SCAN_BENCH_SIZE);
+
+    if (page == NULL || copy == NULL) {
+        ngx_write_stderr("malloc() failed" NGX_LINEFEED);
+        return 1;
+    }
+
+    printf("%-6s %6s %-8s %10s %8s\n", "page", "split", "scanner", "MB/s",
+           "tags");
+
+    for (bp = ngx_xcgi_scan_bench_pages; bp->name; bp++) {
+
+        ngx_xcgi_scan_bench_make_page(bp, page);
+
+        n = 0;
+        start = ngx_xcgi_scan_bench_now();
+
+        do {
+            ngx_memcpy(copy, page, NGX_XCGI_SCAN_BENCH_SIZE);
+            n++;
+            elapsed = ngx_xcgi_scan_bench_now() - start;
+        } while (elapsed < ngx_xcgi_scan_bench_time);
+
+        printf("%-6s %6s %-8s %10.1f %8s\n", bp->name, "", "memcpy",
+               (double) NGX_XCGI_SCAN_BENCH_SIZE * n / elapsed
+               / (1024 * 1024), "");
+
+        for (i = 0; i < sizeof(ngx_xcgi_scan_bench_splits) / sizeof(size_t);
+             i++)
+        {
+            split = ngx_xcgi_scan_bench_splits[i];
+            first = 0;
+            first_sum = 0;
+
+            for (sc = ngx_xcgi_scan_bench_scanners; sc->name; sc++) {
+
+#if (NGX_XCGI_HAVE_AVX2)
+                if (sc->scan == ngx_xcgi_scan_tag_avx2
+                    && !__builtin_cpu_supports("avx2"))
+                {
+                    continue;
+                }
+#endif
+
+                n = 0;
+                start = ngx_xcgi_scan_bench_now();
+
+                do {
+                    sum = 0;
+                    found = ngx_xcgi_scan_bench_scan(sc->scan, page, split,
+                                                     &sum);
+                    n++;
+                    elapsed = ngx_xcgi_scan_bench_now() - start;
+                } while (elapsed < ngx_xcgi_scan_bench_time);
+
+                printf("%-6s %6u %-8s %10.1f %8u\n", bp->name,
+                       (unsigned) split, sc->name,
+                       (double) NGX_XCGI_SCAN_BENCH_SIZE * n / elapsed
+                       / (1024 * 1024), (unsigned) found);
+
+                if (sc == ngx_xcgi_scan_bench_scanners) {
+                    first = found;
+                    first_sum = sum;
+
+                } else if (found != first || sum != first_sum) {
+                    fprintf(stderr, "%s: %s found other tags than %s\n",
+                            bp->name, sc->name,
+                            ngx_xcgi_scan_bench_scanners[0].name);
+                    return 1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_xcgi_scan_bench_make_page(ngx_xcgi_scan_bench_page_t *bp, u_char *page)
+{
+    u_char  *p, *last, *next;
+    size_t   len;
+
+    p = page;
+    last = page + NGX_XCGI_SCAN_BENCH_SIZE;
+    next = bp->every ? p + bp->every : last;
+
+    while (p < last) {
+
+        if (p >= next && (size_t) (last - p) >= bp->tag.len) {
+            p = ngx_cpymem(p, bp->tag.data, bp->tag.len);
+            next += bp->every;
+            continue;
+        }
+
+        len = ngx_min(bp->text.len, (size_t) (last - p));
+
+        if (p < next && (size_t) (next - p) < len) {
+            len = next - p;
+        }
+
+        p = ngx_cpymem(p, bp->text.data, len);
+    }
+}
+
+
+/* the scan of the body filter, with each buffer scanned on its own */
+
+static ngx_uint_t
+ngx_xcgi_scan_bench_scan(ngx_xcgi_scan_pt scan, u_char *page, size_t split,
+    uintptr_t *sum)
+{
+    u_char      *p, *last, *end;
+    ngx_uint_t   found;
+
+    found = 0;
+    end = page + NGX_XCGI_SCAN_BENCH_SIZE;
+
+    for (p = page; p < end; p = last) {
+        last = (split && (size_t) (end - p) > split) ? p + split : end;
+
+        for ( ;; ) {
+            p = scan(p, last);
+
+            if (p == last) {
+                break;
+            }
+
+            /* a '<' ending the buffer is returned as well */
+
+            found += (p + 1 < last && p[1] == '%');
+            *sum += p - page;
+            p++;
+        }
+    }
+
+    return found;
+}
+
+
+static double
+ngx_xcgi_scan_bench_now(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -8,12 +8,7 @@
 #include "ngx_xcgi_private.h"
 
 #define NGX_HTTP_XCGI_COMMAND_LEN       64
-#define NGX_HTTP_XCGI_PARAM_COUNT       8
 #define NGX_HTTP_XCGI_PARAM_LEN         1023
-#define NGX_HTTP_XCGI_PARAM_TOTAL_LEN   \
-            (NGX_HTTP_XCGI_PARAM_COUNT*(NGX_HTTP_XCGI_PARAM_LEN+1))
-
-static ngx_str_t s_xcgi_form_prefix = ngx_string("/XCGI_Form/");
 
 typedef enum {
     xcgi_init_state = 0,
@@ -48,46 +43,188 @@ typedef struct {
     ngx_chain_t            *busy;
     ngx_chain_t            *free;
 
+    ngx_xcgi_form_t        *form;
+    ngx_xcgi_writer_t      *writer;
+    ngx_xcgi_task_t        *task;       /* posted by the current handler */
+    ngx_xcgi_cache_lock_t  *lock;       /* the task output is to be cached */
+    ngx_str_t              *form_prefix;
+
+    ngx_xcgi_template_t    *tpl;
+    ngx_xcgi_tpl_builder_t *builder;
+    ngx_file_t             *file;       /* the page sent with sendfile */
+    off_t                   received;
+    ngx_uint_t              node;       /* the next template node to send */
+    unsigned                last_buf:1;
+    unsigned                last_in_chain:1;
+
+    /*
+     * the command and arguments of a tag point into the page buffer;
+     * they are copied to argvdata only if the tag straddles buffers,
+     * has escapes or the buffer is not writable
+     */
+
     ngx_uint_t              state;
     ngx_str_t               command;
     int                     argc;
-    char                   *argv[NGX_HTTP_XCGI_PARAM_COUNT];
-    int                     argvlen[NGX_HTTP_XCGI_PARAM_COUNT];
-    char                    argvdata[NGX_HTTP_XCGI_PARAM_TOTAL_LEN];
+    int                     max_args;
+    char                  **argv;
+    int                    *argvlen;
+    char                   *argvdata;
+    unsigned                copied:1;
+    unsigned                lt:1;       /* '<' ending the previous buffer */
 } ngx_http_xcgi_ctx_t;
 
 
+typedef struct {
+    ngx_xcgi_task_t         task;
+    ngx_http_request_t     *request;
+#if (NGX_THREADS)
+    ngx_thread_task_t      *thread;
+#endif
+} ngx_http_xcgi_task_ctx_t;
+
+
 static ngx_int_t ngx_http_xcgi_output(ngx_http_request_t  *r,
                                       ngx_http_xcgi_ctx_t *ctx);
 
 static ngx_int_t ngx_http_xcgi_parse(ngx_http_request_t   *r,
                                      ngx_http_xcgi_ctx_t  *ctx);
-
+static void ngx_http_xcgi_arg_start(ngx_http_xcgi_ctx_t *ctx, u_char *p);
+static ngx_int_t ngx_http_xcgi_arg_add(ngx_http_xcgi_ctx_t *ctx, u_char ch);
+static ngx_int_t ngx_http_xcgi_copy_args(ngx_http_request_t *r,
+    ngx_http_xcgi_ctx_t *ctx, ngx_uint_t partial);
+static ngx_buf_t *ngx_http_xcgi_literal(ngx_http_request_t *r,
+    ngx_http_xcgi_ctx_t *ctx, u_char *start, u_char *end, off_t offset);
+
+static ngx_int_t ngx_http_xcgi_call(ngx_http_request_t *r,
+    ngx_http_xcgi_ctx_t *ctx, ngx_xcgi_handler_t *h, int argc, char **argv);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_xcgi_task_done(ngx_http_request_t *r,
+    ngx_http_xcgi_ctx_t *ctx);
+static void ngx_http_xcgi_task_handler(void *data, ngx_log_t *log);
+static void ngx_http_xcgi_task_event_handler(ngx_event_t *ev);
+#endif
+static void ngx_http_xcgi_xform_send(ngx_http_request_t *r,
+    ngx_http_xcgi_ctx_t *ctx);
+static void ngx_http_xcgi_template_open(ngx_http_request_t *r,
+    ngx_http_xcgi_ctx_t *ctx);
+static ngx_int_t ngx_http_xcgi_template_body(ngx_http_request_t *r,
+    ngx_http_xcgi_ctx_t *ctx, ngx_chain_t *in);
+
+static void *ngx_http_xcgi_create_main_conf(ngx_conf_t *cf);
+static void *ngx_http_xcgi_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_xcgi_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_http_xcgi_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_xcgi_library(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+#if (NGX_HAVE_DLOPEN)
+static void ngx_http_xcgi_unload_library(void *data);
+#endif
+static char *ngx_http_xcgi_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_xcgi_cache_valid(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 static ngx_int_t ngx_http_xcgi_module_init(ngx_conf_t *cf);
 static ngx_int_t ngx_http_xcgi_filter_init(ngx_conf_t *cf);
 static void      ngx_http_xcgi_ctx_init(ngx_http_request_t  *r,
                                      ngx_http_xcgi_ctx_t *ctx);
 
 
+static ngx_conf_num_bounds_t  ngx_http_xcgi_max_args_bounds = {
+    ngx_conf_check_num_bounds, 1, 64
+};
+
+
+static ngx_command_t  ngx_http_xcgi_commands[] = {
+
+    { ngx_string("xcgi"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_xcgi_loc_conf_t, enable),
+      NULL },
+
+    { ngx_string("xcgi_types"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_types_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_xcgi_loc_conf_t, types_keys),
+      &ngx_http_html_default_types[0] },
+
+    { ngx_string("xcgi_form_prefix"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_xcgi_loc_conf_t, form_prefix),
+      NULL },
+
+    { ngx_string("xcgi_max_args"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_xcgi_loc_conf_t, max_args),
+      &ngx_http_xcgi_max_args_bounds },
+
+    { ngx_string("xcgi_buffer_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_xcgi_loc_conf_t, buffer_size),
+      NULL },
+
+    { ngx_string("xcgi_thread_pool"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_xcgi_thread_pool,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("xcgi_library"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_xcgi_library,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("xcgi_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_xcgi_cache_zone,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("xcgi_cache_valid"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      ngx_http_xcgi_cache_valid,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
 static ngx_http_module_t ngx_http_xcgi_filter_module_ctx = {
     ngx_http_xcgi_module_init,              /* preconfiguration */
     ngx_http_xcgi_filter_init,              /* postconfiguration */
 
-    NULL,                                   /* create main configuration */
+    ngx_http_xcgi_create_main_conf,         /* create main configuration */
     NULL,                                   /* init main configuration */
 
     NULL,                                   /* create server configuration */
     NULL,                                   /* merge server configuration */
 
-    NULL,                                   /* create location configuration */
-    NULL                                    /* merge location configuration */
+    ngx_http_xcgi_create_loc_conf,          /* create location configuration */
+    ngx_http_xcgi_merge_loc_conf            /* merge location configuration */
 };
 
 
 ngx_module_t ngx_http_xcgi_filter_module = {
     NGX_MODULE_V1,
     &ngx_http_xcgi_filter_module_ctx,       /* module context */
-    NULL,                                   /* module directives */
+    ngx_http_xcgi_commands,                 /* module directives */
     NGX_HTTP_MODULE,                        /* module type */
     NULL,                                   /* init master */
     NULL,                                   /* init module */
@@ -102,34 +239,69 @@ ngx_module_t ngx_http_xcgi_filter_module = {
 
 static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+static ngx_http_request_body_filter_pt   ngx_http_next_request_body_filter;
 
 static ngx_int_t
 ngx_http_xcgi_header_filter(ngx_http_request_t *r)
 {
     ngx_http_xcgi_ctx_t        *ctx;
+    ngx_http_xcgi_loc_conf_t   *xlcf;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http xcgi header filter \"%V\"", &r->uri);
+    xlcf = ngx_http_get_module_loc_conf(r, ngx_http_xcgi_filter_module);
+
+    /* the response of a /XCGI_Form/ request already has the context */
 
-    if (r->headers_out.content_length_n == 0)
+    if (!xlcf->enable
+        || r->headers_out.content_length_n == 0
+        || ngx_http_test_content_type(r, &xlcf->types) == NULL
+        || ngx_http_get_module_ctx(r, ngx_http_xcgi_filter_module))
     {
         return ngx_http_next_header_filter(r);
     }
 
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http xcgi header filter \"%V\"", &r->uri);
+
     ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_xcgi_ctx_t));
     if (ctx == NULL) {
         return NGX_ERROR;
     }
 
+    ctx->last_out = &ctx->out;
+
+    if (r->headers_out.status == NGX_HTTP_OK) {
+        ngx_http_xcgi_template_open(r, ctx);
+    }
+
+    ngx_xcgi_stats.pages++;
+    ngx_xcgi_stats.template_hits += (ctx->tpl != NULL);
+
+    if (ctx->tpl && ctx->tpl->plain) {
+        /* the page has no tags and is sent as is */
+        return ngx_http_next_header_filter(r);
+    }
+
     ngx_http_set_ctx(r, ctx, ngx_http_xcgi_filter_module);
 
-    ctx->last_out = &ctx->out;
+    /* only a page not yet compiled is parsed */
+
+    if (ctx->tpl == NULL) {
+        r->filter_need_in_memory = 1;
+
+        ctx->max_args = xlcf->max_args;
+
+        ctx->argv = ngx_palloc(r->pool, xlcf->max_args * sizeof(char *));
+        ctx->argvlen = ngx_palloc(r->pool, xlcf->max_args * sizeof(int));
 
-    r->filter_need_in_memory = 1;
+        if (ctx->argv == NULL || ctx->argvlen == NULL) {
+            return NGX_ERROR;
+        }
+    }
 
     if (r == r->main) {
         ngx_http_clear_content_length(r);
         ngx_http_clear_last_modified(r);
+        ngx_http_clear_etag(r);
     }
 
     return ngx_http_next_header_filter(r);
@@ -142,26 +314,16 @@ ngx_http_xcgi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_int_t                  rc;
     ngx_buf_t                 *b;
     ngx_chain_t               *cl;
+    ngx_xcgi_handler_t        *h;
     ngx_http_xcgi_ctx_t        *ctx;
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_xcgi_filter_module);
-    if (ctx == NULL) {
+    if (ctx == NULL || ctx->form) {
         return ngx_http_next_body_filter(r, in);
     }
 
-    /* only scan *.htm or *.html files for xcgi_modules */
-    {
-        int len = r->uri.len;
-
-        if (len < 5 || len > 256) {
-            return ngx_http_next_body_filter(r, in);
-        }
-
-        if (memcmp(r->uri.data + r->uri.len - 4, ".htm", 4) &&
-            memcmp(r->uri.data + r->uri.len - 5, ".html", 5))
-        {
-            return ngx_http_next_body_filter(r, in);
-        }
+    if (ctx->tpl) {
+        return ngx_http_xcgi_template_body(r, ctx, in);
     }
 
     if ((in == NULL
@@ -184,12 +346,16 @@ ngx_http_xcgi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http xcgi filter \"%V\"", &r->uri);
 
-    while (ctx->in || ctx->buf) {
+    /* the rest of the page waits for the output of the posted task */
+
+    while ((ctx->in || ctx->buf) && ctx->task == NULL) {
 
         if (ctx->buf == NULL) {
             ctx->buf = ctx->in->buf;
             ctx->in = ctx->in->next;
             ctx->pos = ctx->buf->pos;
+            ctx->received += ctx->buf->last - ctx->buf->pos;
+            ngx_xcgi_stats.parsed += ctx->buf->last - ctx->buf->pos;
         }
 
         if (ctx->state == xcgi_init_state) {
@@ -209,43 +375,25 @@ ngx_http_xcgi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
                 return rc;
             }
 
-            if (ctx->copy_start != ctx->copy_end) {
-
-                if (ctx->free) {
-                    cl = ctx->free;
-                    ctx->free = ctx->free->next;
-                    b = cl->buf;
+            if (ctx->lt) {
+                ctx->lt = 0;
 
-                } else {
-                    b = ngx_alloc_buf(r->pool);
-                    if (b == NULL) {
-                        return NGX_ERROR;
-                    }
-
-                    cl = ngx_alloc_chain_link(r->pool);
-                    if (cl == NULL) {
-                        return NGX_ERROR;
-                    }
-
-                    cl->buf = b;
+                b = ngx_http_xcgi_literal(r, ctx, NULL, NULL,
+                                          ctx->received - 1
+                                          - (ctx->buf->last - ctx->buf->pos));
+                if (b == NULL) {
+                    return NGX_ERROR;
                 }
+            }
 
-                ngx_memcpy(b, ctx->buf, sizeof(ngx_buf_t));
-
-                b->pos = ctx->copy_start;
-                b->last = ctx->copy_end;
-                b->shadow = NULL;
-                b->last_buf = 0;
-                b->recycled = 0;
-
-                if (b->in_file) {
-                    b->file_last = b->file_pos + (b->last - ctx->buf->pos);
-                    b->file_pos += b->pos - ctx->buf->pos;
+            if (ctx->copy_start != ctx->copy_end) {
+                b = ngx_http_xcgi_literal(r, ctx, ctx->copy_start,
+                                          ctx->copy_end,
+                                          ctx->received
+                                          - (ctx->buf->last - ctx->copy_start));
+                if (b == NULL) {
+                    return NGX_ERROR;
                 }
-
-                cl->next = NULL;
-                *ctx->last_out = cl;
-                ctx->last_out = &cl->next;
             }
 
             if (ctx->state == xcgi_init_state) {
@@ -261,31 +409,61 @@ ngx_http_xcgi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
                 continue;
             }
 
-            b = ngx_create_temp_buf(r->pool, 4096);
-            if (b == NULL) {
-                return NGX_ERROR;
-            }
+            h = ngx_xcgi_find_handler(r, &ctx->command);
 
-            cl = ngx_alloc_chain_link(r->pool);
-            if (cl == NULL) {
-                return NGX_ERROR;
+            if (ctx->builder
+                && ngx_xcgi_template_add_call(ctx->builder, &ctx->command,
+                                              h, ctx->argc, ctx->argv)
+                   != NGX_OK)
+            {
+                ctx->builder = NULL;
             }
 
-            ngx_xcgi_call_handler(&ctx->command, r, b, ctx->argc, ctx->argv);
+            rc = ngx_http_xcgi_call(r, ctx, h, ctx->argc, ctx->argv);
             ngx_http_xcgi_ctx_init(r, ctx);
-            if (b->last == b->pos) {
-                ngx_pfree(r->pool, b);
-                continue;
+
+            if (rc == NGX_ERROR) {
+                return rc;
             }
 
-            cl->buf = b;
-            cl->next = NULL;
-            *ctx->last_out = cl;
-            ctx->last_out = &cl->next;
+            b = NULL;
+
+            if (ctx->task) {
+                break;
+            }
 
             continue;
         }
 
+        if (ctx->task) {
+            break;
+        }
+
+        if (ctx->state == xcgi_start_state && ctx->buf->last_buf) {
+
+            /* the page ends with '<' */
+
+            b = ngx_http_xcgi_literal(r, ctx, NULL, NULL, ctx->received - 1);
+            if (b == NULL) {
+                return NGX_ERROR;
+            }
+
+            ctx->state = xcgi_init_state;
+        }
+
+        if (ctx->builder
+            && (ctx->buf->last_buf || ctx->buf->last_in_chain))
+        {
+            if (ctx->state == xcgi_init_state
+                && ctx->received == ctx->builder->size)
+            {
+                (void) ngx_xcgi_template_insert(ctx->builder,
+                                                r->connection->log);
+            }
+
+            ctx->builder = NULL;
+        }
+
         if (ctx->buf->last_buf || ngx_buf_in_memory(ctx->buf)) {
             if (b == NULL) {
                 if (ctx->free) {
@@ -332,6 +510,84 @@ ngx_http_xcgi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 }
 
 
+/*
+ * Links a part of the current page buffer to the output; a NULL start
+ * stands for a '<' which was held back as a possible start of a tag
+ * until the end of its buffer but turned out to be text.
+ */
+
+static ngx_buf_t *
+ngx_http_xcgi_literal(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx,
+    u_char *start, u_char *end, off_t offset)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    static u_char  lt[] = "<";
+
+    if (start == NULL) {
+        start = lt;
+        end = lt + 1;
+    }
+
+    if (ctx->builder
+        && ngx_xcgi_template_add_literal(ctx->builder, start, end, offset)
+           != NGX_OK)
+    {
+        ctx->builder = NULL;
+    }
+
+    if (ctx->free) {
+        cl = ctx->free;
+        ctx->free = ctx->free->next;
+        b = cl->buf;
+
+    } else {
+        b = ngx_alloc_buf(r->pool);
+        if (b == NULL) {
+            return NULL;
+        }
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NULL;
+        }
+
+        cl->buf = b;
+    }
+
+    if (start == lt) {
+        ngx_memzero(b, sizeof(ngx_buf_t));
+
+        b->memory = 1;
+        b->start = start;
+        b->pos = start;
+        b->last = end;
+        b->end = end;
+
+    } else {
+        ngx_memcpy(b, ctx->buf, sizeof(ngx_buf_t));
+
+        b->pos = start;
+        b->last = end;
+        b->shadow = NULL;
+        b->last_buf = 0;
+        b->recycled = 0;
+
+        if (b->in_file) {
+            b->file_last = b->file_pos + (b->last - ctx->buf->pos);
+            b->file_pos += b->pos - ctx->buf->pos;
+        }
+    }
+
+    cl->next = NULL;
+    *ctx->last_out = cl;
+    ctx->last_out = &cl->next;
+
+    return b;
+}
+
+
 static ngx_int_t
 ngx_http_xcgi_output(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
 {
@@ -373,39 +629,528 @@ ngx_http_xcgi_output(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
         }
     }
 
-    if (ctx->in || ctx->buf) {
+    if (ctx->in || ctx->buf || ctx->task) {
         r->buffered |= NGX_HTTP_XCGI_BUFFERED;
     } else {
         r->buffered &= ~NGX_HTTP_XCGI_BUFFERED;
     }
 
-    return rc;
-}
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_xcgi_call(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx,
+    ngx_xcgi_handler_t *h, int argc, char **argv)
+{
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_str_t                  value;
+    ngx_chain_t              **last;
+    ngx_xcgi_cache_lock_t     *lock;
+    ngx_http_xcgi_loc_conf_t  *xlcf;
+
+    if (h == NULL || h->data.func == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_xcgi_stats.calls++;
+
+    if (ctx->writer == NULL) {
+        ctx->writer = ngx_palloc(r->pool, sizeof(ngx_xcgi_writer_t));
+        if (ctx->writer == NULL) {
+            return NGX_ERROR;
+        }
+
+        xlcf = ngx_http_get_module_loc_conf(r, ngx_http_xcgi_filter_module);
+
+        if (ngx_xcgi_writer_init(r, ctx->writer, xlcf->buffer_size)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    b = ngx_xcgi_writer_begin(ctx->writer);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    rc = ngx_xcgi_cache_lookup(r, h, argc, argv, &value, &lock);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_OK) {
+        ngx_xcgi_stats.cache_hits++;
+
+        if (ngx_xcgi_write_str(r, b, value.data, value.len) < 0) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        (void) h->data.func(r, b, argc, argv);
+
+        if (ctx->task) {
+            ctx->lock = lock;
+            r->buffered |= NGX_HTTP_XCGI_BUFFERED;
+            return NGX_OK;
+        }
+    }
+
+    last = ctx->last_out;
+
+    if (ngx_xcgi_writer_end(ctx->writer, &ctx->last_out) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (lock) {
+        ngx_xcgi_cache_update(lock, *last);
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_xcgi_task_t *
+ngx_xcgi_task_alloc(ngx_http_request_t *r, size_t size)
+{
+    ngx_http_xcgi_task_ctx_t  *tctx;
+#if (NGX_THREADS)
+    ngx_thread_task_t         *thread;
+
+    thread = ngx_thread_task_alloc(r->pool,
+                                   sizeof(ngx_http_xcgi_task_ctx_t) + size);
+    if (thread == NULL) {
+        return NULL;
+    }
+
+    tctx = thread->ctx;
+    tctx->thread = thread;
+
+#else
+
+    tctx = ngx_pcalloc(r->pool, sizeof(ngx_http_xcgi_task_ctx_t) + size);
+    if (tctx == NULL) {
+        return NULL;
+    }
+
+#endif
+
+    tctx->request = r;
+    tctx->task.data = size ? (void *) (tctx + 1) : NULL;
+
+    return &tctx->task;
+}
+
+
+ngx_int_t
+ngx_xcgi_task_post(ngx_http_request_t *r, ngx_buf_t *b, ngx_xcgi_task_t *task)
+{
+    ngx_http_xcgi_ctx_t        *ctx;
+#if (NGX_THREADS)
+    ngx_http_xcgi_task_ctx_t   *tctx;
+    ngx_thread_task_t          *thread;
+    ngx_http_xcgi_main_conf_t  *xmcf;
+#endif
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_xcgi_filter_module);
+
+    if (ctx == NULL || ctx->writer == NULL || b != &ctx->writer->buf
+        || ctx->task)
+    {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "xcgi task posted outside of a handler call");
+        return NGX_ERROR;
+    }
+
+#if (NGX_THREADS)
+
+    xmcf = ngx_http_get_module_main_conf(r, ngx_http_xcgi_filter_module);
+
+    if (xmcf->thread_pool) {
+        tctx = (ngx_http_xcgi_task_ctx_t *) task;
+        thread = tctx->thread;
+
+        thread->handler = ngx_http_xcgi_task_handler;
+        thread->event.data = tctx;
+        thread->event.handler = ngx_http_xcgi_task_event_handler;
+
+        if (ngx_thread_task_post(xmcf->thread_pool, thread) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ctx->task = task;
+
+        r->main->blocked++;
+        r->aio = 1;
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
+    task->handler(task->data, r->connection->log);
+
+    return task->done(r, b, task->data) < 0 ? NGX_ERROR : NGX_OK;
+}
+
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_xcgi_task_done(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
+{
+    ngx_chain_t           **last;
+    ngx_xcgi_task_t        *task;
+    ngx_xcgi_cache_lock_t  *lock;
+
+    task = ctx->task;
+    ctx->task = NULL;
+
+    lock = ctx->lock;
+    ctx->lock = NULL;
+
+    r->buffered &= ~NGX_HTTP_XCGI_BUFFERED;
+
+    /* as in ngx_xcgi_task_post(), a negative result is an error */
+
+    if (task->done(r, &ctx->writer->buf, task->data) < 0) {
+        return NGX_ERROR;
+    }
+
+    last = ctx->last_out;
+
+    if (ngx_xcgi_writer_end(ctx->writer, &ctx->last_out) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (lock) {
+        ngx_xcgi_cache_update(lock, *last);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_xcgi_task_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_xcgi_task_ctx_t  *tctx = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "xcgi task handler");
+
+    tctx->task.handler(tctx->task.data, log);
+}
+
+
+static void
+ngx_http_xcgi_task_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t          *c;
+    ngx_http_request_t        *r;
+    ngx_http_xcgi_ctx_t       *ctx;
+    ngx_http_xcgi_task_ctx_t  *tctx;
+
+    tctx = ev->data;
+    r = tctx->request;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "xcgi task done: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_xcgi_filter_module);
+
+    if (ngx_http_xcgi_task_done(r, ctx) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    if (ctx->form) {
+        ngx_http_xcgi_xform_send(r, ctx);
+
+    } else if (r->done) {
+        /*
+         * trigger connection event handler if the request was
+         * already finalized
+         */
+
+        c->write->handler(c->write);
+        return;
+
+    } else {
+        r->write_event_handler(r);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+
+/*
+ * Responses coming straight from a static file are looked up in the
+ * compiled template cache; on a miss the page is compiled while it is
+ * scanned, so that later responses only run the handlers.
+ */
+
+static void
+ngx_http_xcgi_template_open(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
+{
+    u_char                    *last;
+    size_t                     root;
+    ngx_str_t                  path;
+    ngx_open_file_info_t       of;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    last = ngx_http_map_uri_to_path(r, &path, &root, 0);
+    if (last == NULL) {
+        return;
+    }
+
+    path.len = last - path.data;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+    of.test_only = 1;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+
+    if (ngx_http_set_disable_symlinks(r, clcf, &path, &of) != NGX_OK) {
+        return;
+    }
+
+    if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool)
+        != NGX_OK)
+    {
+        return;
+    }
+
+    /* the response must be the file itself, not e.g. a proxied page */
+
+    if (!of.is_file
+        || of.size != r->headers_out.content_length_n
+        || of.mtime != r->headers_out.last_modified_time)
+    {
+        return;
+    }
+
+    ctx->tpl = ngx_xcgi_template_lookup(&path, &of, r->pool);
+
+    if (ctx->tpl == NULL) {
+        ctx->builder = ngx_xcgi_template_builder(&path, &of, r->pool);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_xcgi_template_body(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx,
+    ngx_chain_t *in)
+{
+    ngx_buf_t            *b;
+    ngx_chain_t          *cl;
+    ngx_xcgi_tpl_node_t  *node;
+
+    /* the page itself is not needed, the compiled template is sent instead */
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        ctx->last_buf |= b->last_buf;
+        ctx->last_in_chain |= b->last_in_chain;
+
+        /*
+         * the page is sent from the file, so long literals can be too;
+         * if the page was read to memory, it is needed there downstream
+         */
+
+        if (b->in_file && !ngx_buf_in_memory(b)) {
+            ctx->file = b->file;
+        }
+
+        b->pos = b->last;
+
+        if (b->in_file) {
+            b->file_pos = b->file_last;
+        }
+    }
+
+    while (ctx->node < ctx->tpl->nnodes && ctx->task == NULL) {
+
+        node = &ctx->tpl->nodes[ctx->node++];
+
+        if (node->call) {
+            if (ngx_http_xcgi_call(r, ctx, node->handler, node->argc,
+                                   node->argv)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ctx->file && node->text.len >= NGX_XCGI_TEMPLATE_FILE_MIN) {
+            b->in_file = 1;
+            b->file = ctx->file;
+            b->file_pos = node->offset;
+            b->file_last = node->offset + node->text.len;
+
+        } else {
+            b->memory = 1;
+            b->pos = node->text.data;
+            b->last = node->text.data + node->text.len;
+            b->start = b->pos;
+            b->end = b->last;
+        }
+
+        cl->buf = b;
+        cl->next = NULL;
+        *ctx->last_out = cl;
+        ctx->last_out = &cl->next;
+    }
+
+    if (ctx->task == NULL
+        && ctx->node == ctx->tpl->nnodes
+        && (ctx->last_buf || ctx->last_in_chain))
+    {
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->sync = 1;
+        b->last_buf = ctx->last_buf;
+        b->last_in_chain = ctx->last_in_chain;
+
+        ctx->last_buf = 0;
+        ctx->last_in_chain = 0;
+
+        cl->buf = b;
+        cl->next = NULL;
+        *ctx->last_out = cl;
+        ctx->last_out = &cl->next;
+    }
+
+    if (ctx->out == NULL && ctx->busy == NULL) {
+        return NGX_OK;
+    }
+
+    return ngx_http_xcgi_output(r, ctx);
+}
+
+
+static void
+ngx_http_xcgi_ctx_init(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
+{
+    ctx->command.len = 0;
+    ctx->argc = 0;
+    ctx->copied = 0;
+}
+
+
+#define ngx_http_xcgi_arg_slot(ctx, n)                                        \
+    ((ctx)->argvdata + NGX_HTTP_XCGI_COMMAND_LEN                              \
+     + (n) * (NGX_HTTP_XCGI_PARAM_LEN + 1))
+
+
+static void
+ngx_http_xcgi_arg_start(ngx_http_xcgi_ctx_t *ctx, u_char *p)
+{
+    ctx->argv[ctx->argc] = ctx->copied ? ngx_http_xcgi_arg_slot(ctx, ctx->argc)
+                                       : (char *) p;
+    ctx->argvlen[ctx->argc] = 0;
+}
+
+
+static ngx_int_t
+ngx_http_xcgi_arg_add(ngx_http_xcgi_ctx_t *ctx, u_char ch)
+{
+    if (ctx->argvlen[ctx->argc] >= NGX_HTTP_XCGI_PARAM_LEN) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->copied) {
+        ctx->argv[ctx->argc][ctx->argvlen[ctx->argc]] = ch;
+    }
+
+    ctx->argvlen[ctx->argc]++;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_xcgi_copy_args(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx,
+    ngx_uint_t partial)
+{
+    int    i, n;
+    char  *p;
+
+    if (ctx->argvdata == NULL) {
+        ctx->argvdata = ngx_pnalloc(r->pool, NGX_HTTP_XCGI_COMMAND_LEN
+                                             + ctx->max_args
+                                               * (NGX_HTTP_XCGI_PARAM_LEN + 1));
+        if (ctx->argvdata == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ctx->command.len) {
+        ngx_memcpy(ctx->argvdata, ctx->command.data, ctx->command.len);
+    }
 
+    ctx->command.data = (u_char *) ctx->argvdata;
 
-static void
-ngx_http_xcgi_ctx_init(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
-{
-    int     i;
+    /* the argument being parsed is copied as well */
 
-    if (NULL == ctx->command.data) {
-        ctx->command.data = ngx_pnalloc(r->pool, NGX_HTTP_XCGI_COMMAND_LEN);
+    n = partial ? ctx->argc + 1 : ctx->argc;
+
+    for (i = 0; i < n; i++) {
+        p = ngx_http_xcgi_arg_slot(ctx, i);
+        ngx_memcpy(p, ctx->argv[i], ctx->argvlen[i]);
+        ctx->argv[i] = p;
     }
-    ctx->command.len = 0;
 
-    ctx->argc = 0;
-    memset(ctx->argvdata, 0, sizeof(ctx->argvdata));
+    ctx->copied = 1;
 
-    for (i = 0; i < NGX_HTTP_XCGI_PARAM_COUNT; i++) {
-        ctx->argvlen[i] = 0;
-        ctx->argv[i] = ctx->argvdata + (i*(NGX_HTTP_XCGI_PARAM_LEN+1));
-    }
+    ngx_xcgi_stats.tags_copied++;
+
+    return NGX_OK;
 }
 
+
 static ngx_int_t
 ngx_http_xcgi_parse(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
 {
-    u_char                *p, *last, *copy_end, ch;
+    int                     i;
+    u_char                 *p, *last, *copy_end, ch;
     ngx_http_xcgi_state_e   state;
 
     state = ctx->state;
@@ -415,18 +1160,12 @@ ngx_http_xcgi_parse(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
     for (p = ctx->pos; p < last; p++) {
         ch = *p;
         if (state == xcgi_init_state) {
-            for ( ;; ) {
-                if (ch == '<') {
-                    copy_end = p;
-                    state = xcgi_start_state;
-                    goto xcgi_started;
-                }
-
-                if (++p == last) {
-                    break;
-                }
+            p = ngx_xcgi_scan_tag(p, last);
 
-                ch = *p;
+            if (p < last) {
+                copy_end = p;
+                state = xcgi_start_state;
+                goto xcgi_started;
             }
 
             ctx->state = state;
@@ -458,10 +1197,12 @@ ngx_http_xcgi_parse(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
 
             case '<':
                 copy_end = p;
+                ctx->lt = (p == ctx->buf->pos);
                 break;
 
             default:
                 copy_end = p;
+                ctx->lt = (p == ctx->buf->pos);
                 state = xcgi_init_state;
                 break;
             }
@@ -529,15 +1270,14 @@ ngx_http_xcgi_parse(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
             case 'X':
             case 'Y':
             case 'Z':
-                if (ctx->command.data == NULL) {
-                    ctx->command.data = ngx_pnalloc(r->pool,
-                            NGX_HTTP_XCGI_COMMAND_LEN);
-                    if (ctx->command.data == NULL) {
-                        return NGX_ERROR;
-                    }
+                if (ctx->copied) {
+                    ctx->command.data = (u_char *) ctx->argvdata;
+                    ctx->command.data[0] = ch;
+
+                } else {
+                    ctx->command.data = p;
                 }
 
-                ctx->command.data[0] = ch;
                 ctx->command.len = 1;
 
                 state = xcgi_command_state;
@@ -624,9 +1364,14 @@ ngx_http_xcgi_parse(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
             case '9':
                 if (ctx->command.len == NGX_HTTP_XCGI_COMMAND_LEN) {
                     state = xcgi_error_state;
-                } else {
-                    ctx->command.data[ctx->command.len++] = ch;
+                    break;
                 }
+
+                if (ctx->copied) {
+                    ctx->command.data[ctx->command.len] = ch;
+                }
+
+                ctx->command.len++;
                 break;
 
             case '(':
@@ -680,11 +1425,13 @@ ngx_http_xcgi_parse(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
             case '8':
             case '9':
                 state = xcgi_intparam_state;
-                ctx->argv[ctx->argc][ctx->argvlen[ctx->argc]++] = ch;
+                ngx_http_xcgi_arg_start(ctx, p);
+                (void) ngx_http_xcgi_arg_add(ctx, ch);
                 break;
 
             case '\"':
                 state = xcgi_stringparam_state;
+                ngx_http_xcgi_arg_start(ctx, p + 1);
                 break;
 
             case ')':
@@ -718,10 +1465,8 @@ ngx_http_xcgi_parse(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
             case '7':
             case '8':
             case '9':
-                if (ctx->argvlen[ctx->argc] >= NGX_HTTP_XCGI_PARAM_LEN) {
+                if (ngx_http_xcgi_arg_add(ctx, ch) != NGX_OK) {
                     state = xcgi_error_state;
-                } else {
-                    ctx->argv[ctx->argc][ctx->argvlen[ctx->argc]++] = ch;
                 }
                 break;
 
@@ -733,7 +1478,7 @@ ngx_http_xcgi_parse(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
             case ',':
                 state = xcgi_nextparam_state;
                 ctx->argc++;
-                if (ctx->argc >= NGX_HTTP_XCGI_PARAM_COUNT) {
+                if (ctx->argc >= ctx->max_args) {
                     state = xcgi_error_state;
                 }
                 break;
@@ -761,7 +1506,7 @@ ngx_http_xcgi_parse(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
 
             case ',':
                 state = xcgi_nextparam_state;
-                if (ctx->argc >= NGX_HTTP_XCGI_PARAM_COUNT) {
+                if (ctx->argc >= ctx->max_args) {
                     state = xcgi_error_state;
                 }
                 break;
@@ -792,11 +1537,13 @@ ngx_http_xcgi_parse(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
             case '8':
             case '9':
                 state = xcgi_intparam_state;
-                ctx->argv[ctx->argc][ctx->argvlen[ctx->argc]++] = ch;
+                ngx_http_xcgi_arg_start(ctx, p);
+                (void) ngx_http_xcgi_arg_add(ctx, ch);
                 break;
 
             case '\"':
                 state = xcgi_stringparam_state;
+                ngx_http_xcgi_arg_start(ctx, p + 1);
                 break;
 
             default:
@@ -809,6 +1556,15 @@ ngx_http_xcgi_parse(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
             switch (ch) {
             case    '\\':
                 state = xcgi_stringescape_state;
+
+                /* the unescaped argument differs from the page */
+
+                if (!ctx->copied
+                    && ngx_http_xcgi_copy_args(r, ctx, 1) != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
                 break;
 
             case    '\"':
@@ -817,21 +1573,14 @@ ngx_http_xcgi_parse(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
                 break;
 
             default:
-                if (ctx->argvlen[ctx->argc] >= NGX_HTTP_XCGI_PARAM_LEN) {
+                if (ngx_http_xcgi_arg_add(ctx, ch) != NGX_OK) {
                     state = xcgi_error_state;
-                } else {
-                    ctx->argv[ctx->argc][ctx->argvlen[ctx->argc]++] = ch;
                 }
                 break;
             }
             break;
 
         case xcgi_stringescape_state:
-            if (ctx->argvlen[ctx->argc] >= NGX_HTTP_XCGI_PARAM_LEN) {
-                state = xcgi_error_state;
-                break;
-            }
-
             switch (ch) {
             case '\\':
             case '\'':
@@ -859,8 +1608,10 @@ ngx_http_xcgi_parse(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
                 break;
             }
 
-            if (xcgi_stringparam_state == state) {
-                ctx->argv[ctx->argc][ctx->argvlen[ctx->argc]++] = ch;
+            if (xcgi_stringparam_state == state
+                && ngx_http_xcgi_arg_add(ctx, ch) != NGX_OK)
+            {
+                state = xcgi_error_state;
             }
             break;
 
@@ -896,6 +1647,24 @@ ngx_http_xcgi_parse(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
                     ctx->copy_start = ctx->buf->pos;
                 }
 
+                /*
+                 * the arguments are terminated in place, each is followed
+                 * by the quote or the delimiter already parsed
+                 */
+
+                if (!ctx->copied
+                    && !ctx->buf->temporary
+                    && ngx_http_xcgi_copy_args(r, ctx, 0) != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                for (i = 0; i < ctx->argc; i++) {
+                    ctx->argv[i][ctx->argvlen[i]] = '\0';
+                }
+
+                ngx_xcgi_stats.tags++;
+
                 return NGX_OK;
 
             default:
@@ -940,110 +1709,101 @@ ngx_http_xcgi_parse(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
         ctx->copy_start = ctx->buf->pos;
     }
 
+    /* the tag continues in the next buffer, this one may be reused */
+
+    if (state > xcgi_start_state
+        && state != xcgi_error_state
+        && !ctx->copied
+        && ngx_http_xcgi_copy_args(r, ctx,
+                                   state == xcgi_intparam_state
+                                   || state == xcgi_stringparam_state
+                                   || state == xcgi_stringescape_state)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
     return NGX_AGAIN;
 }
 
-static void ngx_xcgi_parse_post_data(ngx_http_request_t *r)
+static void ngx_http_xcgi_xform_body(ngx_http_request_t *r)
 {
-    int             start, and, equal, len;
-    ngx_xcgi_handler_t *var;
-    ngx_buf_t      *b = r->request_body->bufs->buf;
+    ngx_str_t              xform;
+    ngx_xcgi_handler_t    *h;
+    ngx_http_xcgi_ctx_t   *ctx;
 
-    if (!b) {
+    if (!r->request_body) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
         return;
     }
 
-    if (NULL == r->xcgi_var) {
-        ngx_xcgi_init_xcgi_variable(r);
-        if (NULL == r->xcgi_var) {
-            return;
-        }
-    }
-
-    len = b->last - b->pos;
-    start = and = 0;
-    while (and < len) {
-        for (and = start; and < len; and++) {
-            if ('&' == b->pos[and]) {
-                break;
-            }
-        }
-
-        for (equal = start; equal < and; equal++) {
-            if ('=' == b->pos[equal]) {
-                break;
-            }
-        }
+    /* the form fields were parsed by the request body filter */
 
-        if (equal == and) {
-            break;
-        }
+    ctx = ngx_http_get_module_ctx(r, ngx_http_xcgi_filter_module);
 
-        if (and != equal+1) {
-            var = ngx_pcalloc(r->pool, sizeof(ngx_xcgi_handler_t));
-            if (NULL == var) {
-                return;
-            }
+    xform.len = r->uri.len - ctx->form_prefix->len;
+    xform.data = r->uri.data + ctx->form_prefix->len;
 
-            var->name.data = b->pos + start;
-            var->name.len = equal - start;
-            var->data.value = ngx_palloc(r->pool, and-equal);
-            if (NULL == var->data.value) {
-                return;
-            }
-            memcpy(var->data.value, b->pos + equal+1, and - (equal+1));
-            var->data.value[and - (equal+1)] = 0;
+    h = ngx_xcgi_find_handler(r, &xform);
 
-            ngx_xcgi_set_var_internal(r, var);
-        }
+    ctx->out = NULL;
+    ctx->last_out = &ctx->out;
 
-        if (and == len) {
-            break;
+    if (ngx_http_xcgi_call(r, ctx, h, 0, NULL) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
 
-        }
-        start = and+1;
+    if (ctx->task) {
+        /* the response is sent when the task is done */
+        return;
     }
+
+    ngx_http_xcgi_xform_send(r, ctx);
 }
 
-static void ngx_http_xcgi_xform_body(ngx_http_request_t *r)
+
+static void
+ngx_http_xcgi_xform_send(ngx_http_request_t *r, ngx_http_xcgi_ctx_t *ctx)
 {
-    ngx_buf_t       *b;
-    ngx_chain_t     out;
-    ngx_int_t       rc;
-    ngx_str_t       xform;
+    off_t         len;
+    ngx_buf_t    *b;
+    ngx_int_t     rc;
+    ngx_chain_t  *cl, *out;
 
-    if (!r->request_body || !r->request_body->bufs) {
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
         ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
         return;
     }
 
-    ngx_xcgi_parse_post_data(r);
-
-    xform.len = r->uri.len - s_xcgi_form_prefix.len;
-    xform.data = r->uri.data + s_xcgi_form_prefix.len;
+    b->last_buf = 1;
 
-    b = ngx_create_temp_buf(r->pool, 4096);
-    if (b == NULL) {
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
         ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
         return;
     }
 
+    cl->buf = b;
+    cl->next = NULL;
+    *ctx->last_out = cl;
 
-    b->memory = 1;
-
-    b->last_buf = 1;
-
-    ngx_xcgi_call_handler(&xform, r, b, 0, NULL);
+    out = ctx->out;
+    ctx->out = NULL;
 
-    out.buf = b;
+    len = 0;
 
-    out.next = NULL;
+    for (cl = out; cl; cl = cl->next) {
+        len += ngx_buf_size(cl->buf);
+    }
 
-    r->headers_out.content_type.len = sizeof("text/html") - 1;
-    r->headers_out.content_type.data = (u_char *) "text/html";
+    r->headers_out.content_type_len = sizeof("text/html") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/html");
+    ngx_str_set(&r->headers_out.charset, "utf-8");
 
     r->headers_out.status = NGX_HTTP_OK;
-    r->headers_out.content_length_n = b->last - b->pos;
+    r->headers_out.content_length_n = len;
 
     rc = ngx_http_send_header(r);
     if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
@@ -1051,20 +1811,22 @@ static void ngx_http_xcgi_xform_body(ngx_http_request_t *r)
         return;
     }
 
-    rc = ngx_http_output_filter(r, &out);
-    if (r->main->count > 0) {
-        r->main->count--;
-    }
-    ngx_http_finalize_request(r, rc);
+    ngx_http_finalize_request(r, ngx_http_output_filter(r, out));
 }
 
 static ngx_int_t ngx_http_xcgi_xform_handler(ngx_http_request_t *r)
 {
-    ngx_int_t   rc;
+    ngx_int_t                  rc;
+    ngx_str_t                  xform;
+    ngx_xcgi_handler_t        *h;
+    ngx_http_xcgi_ctx_t       *ctx;
+    ngx_http_xcgi_loc_conf_t  *xlcf;
 
-    r->headers_out.charset.data = (u_char *)"utf-8";
-    r->headers_out.charset.len = 5;
-    r->keepalive = 0;
+    xlcf = ngx_http_get_module_loc_conf(r, ngx_http_xcgi_filter_module);
+
+    if (!xlcf->enable) {
+        return NGX_DECLINED;
+    }
 
     if (!(r->method & (NGX_HTTP_POST))) {
         return NGX_DECLINED;
@@ -1074,20 +1836,74 @@ static ngx_int_t ngx_http_xcgi_xform_handler(ngx_http_request_t *r)
         return NGX_DECLINED;
     }
 
-    if (r->uri.len <= s_xcgi_form_prefix.len ||
-        ngx_strncmp(r->uri.data, s_xcgi_form_prefix.data, s_xcgi_form_prefix.len))
+    if (r->uri.len <= xlcf->form_prefix.len
+        || ngx_strncmp(r->uri.data, xlcf->form_prefix.data,
+                       xlcf->form_prefix.len) != 0)
     {
         return NGX_DECLINED;
     }
 
-    rc = ngx_http_read_client_request_body(r, ngx_http_xcgi_xform_body);
+    xform.len = r->uri.len - xlcf->form_prefix.len;
+    xform.data = r->uri.data + xlcf->form_prefix.len;
+
+    h = ngx_xcgi_find_handler(r, &xform);
+
+    if (h && (h->flags & NGX_XCGI_NO_FORM)) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_xcgi_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx->form_prefix = &xlcf->form_prefix;
+
+    rc = ngx_xcgi_form_create(r, h, &ctx->form);
+
+    if (rc == NGX_DECLINED) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
     if (rc != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_xcgi_filter_module);
+
+    ngx_xcgi_stats.forms++;
+
+    rc = ngx_http_read_client_request_body(r, ngx_http_xcgi_xform_body);
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
         return rc;
     }
 
     return NGX_DONE;
 }
 
+static ngx_int_t
+ngx_http_xcgi_request_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    ngx_chain_t          *cl;
+    ngx_http_xcgi_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_xcgi_filter_module);
+
+    if (ctx == NULL || ctx->form == NULL) {
+        return ngx_http_next_request_body_filter(r, in);
+    }
+
+    for (cl = in; cl; cl = cl->next) {
+        ngx_xcgi_stats.form_bytes += ngx_buf_size(cl->buf);
+    }
+
+    if (ngx_xcgi_form_feed(r, ctx->form, in) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return ngx_http_next_request_body_filter(r, in);
+}
+
 static ngx_int_t ngx_http_xcgi_filter_init(ngx_conf_t *cf)
 {
     ngx_http_handler_pt        *h;
@@ -1108,14 +1924,323 @@ static ngx_int_t ngx_http_xcgi_filter_init(ngx_conf_t *cf)
     ngx_http_next_body_filter = ngx_http_top_body_filter;
     ngx_http_top_body_filter = ngx_http_xcgi_body_filter;
 
-    return NGX_OK;
+    ngx_http_next_request_body_filter = ngx_http_top_request_body_filter;
+    ngx_http_top_request_body_filter = ngx_http_xcgi_request_body_filter;
+
+    return ngx_xcgi_handlers_init(cf);
 }
 
 
-static ngx_int_t ngx_http_xcgi_module_init(ngx_conf_t *cf)
+static char *
+ngx_http_xcgi_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_xcgi_private_init();
+#if (NGX_THREADS)
+    ngx_http_xcgi_main_conf_t *xmcf = conf;
 
-    return NGX_OK;
+    ngx_str_t  *value;
+
+    if (xmcf->thread_pool) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    xmcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (xmcf->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"xcgi_thread_pool\" is unsupported on this platform");
+
+    return NGX_CONF_ERROR;
+
+#endif
+}
+
+
+/*
+ * Handler libraries are loaded for each configuration and stay loaded
+ * as long as it is used, so a reload switches all handlers at once.
+ * A library is found by its real path: a file replaced in place is not
+ * loaded again while the previous configuration still has it, while
+ * a new version installed under a new name, e.g. behind a symlink, is.
+ */
+
+static char *
+ngx_http_xcgi_library(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_HAVE_DLOPEN)
+    void                *handle;
+    void               (*reg)(void);
+    u_char               path[NGX_MAX_PATH];
+    ngx_str_t           *value, file;
+    ngx_pool_cleanup_t  *cln;
+
+    value = cf->args->elts;
+
+    file = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &file, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_realpath(file.data, path) == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_realpath_n " \"%s\" failed", file.data);
+        return NGX_CONF_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->cycle->pool, 0);
+    if (cln == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    handle = ngx_dlopen(path);
+    if (handle == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           ngx_dlopen_n " \"%s\" failed (%s)",
+                           path, ngx_dlerror());
+        return NGX_CONF_ERROR;
+    }
+
+    cln->handler = ngx_http_xcgi_unload_library;
+    cln->data = handle;
+
+    reg = (void (*)(void)) ngx_dlsym(handle, "ngx_xcgi_register_user_handlers");
+    if (reg == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           ngx_dlsym_n " \"%V\", \"%s\" failed (%s)",
+                           &value[1], "ngx_xcgi_register_user_handlers",
+                           ngx_dlerror());
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "xcgi library \"%s\"", path);
+
+    reg();
+
+    return NGX_CONF_OK;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"xcgi_library\" is not supported on this platform");
+
+    return NGX_CONF_ERROR;
+
+#endif
+}
+
+
+#if (NGX_HAVE_DLOPEN)
+
+static void
+ngx_http_xcgi_unload_library(void *data)
+{
+    void  *handle = data;
+
+    if (ngx_dlclose(handle) != 0) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      ngx_dlclose_n " failed (%s)", ngx_dlerror());
+    }
+}
+
+#endif
+
+
+static char *
+ngx_http_xcgi_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_xcgi_main_conf_t *xmcf = conf;
+
+    u_char            *p;
+    ssize_t            size;
+    ngx_str_t         *value, name, s;
+    ngx_xcgi_cache_t  *cache;
+
+    if (xmcf->cache_zone) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    p = (u_char *) ngx_strchr(value[1].data, ':');
+
+    if (p == NULL || p == value[1].data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value[1].data;
+    name.len = p - value[1].data;
+
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size(&s);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_xcgi_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    xmcf->cache_zone = ngx_shared_memory_add(cf, &name, size,
+                                             &ngx_http_xcgi_filter_module);
+    if (xmcf->cache_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (xmcf->cache_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    xmcf->cache_zone->init = ngx_xcgi_cache_init_zone;
+    xmcf->cache_zone->data = cache;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_xcgi_cache_valid(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_xcgi_main_conf_t *xmcf = conf;
+
+    time_t                   valid;
+    ngx_str_t               *value;
+    ngx_xcgi_cache_valid_t  *cv;
+
+    value = cf->args->elts;
+
+    valid = ngx_parse_time(&value[2], 1);
+    if (valid == (time_t) NGX_ERROR) {
+        return "invalid time value";
+    }
+
+    if (xmcf->cache_valid == NULL) {
+        xmcf->cache_valid = ngx_array_create(cf->pool, 4,
+                                             sizeof(ngx_xcgi_cache_valid_t));
+        if (xmcf->cache_valid == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    cv = ngx_array_push(xmcf->cache_valid);
+    if (cv == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cv->name = value[1];
+    cv->valid = valid;
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_xcgi_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_xcgi_main_conf_t  *xmcf;
+
+    xmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_xcgi_main_conf_t));
+    if (xmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&xmcf->handlers, cf->temp_pool, 64,
+                       sizeof(ngx_hash_key_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return xmcf;
+}
+
+
+static void *
+ngx_http_xcgi_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_xcgi_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_xcgi_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->types = { NULL };
+     *     conf->types_keys = NULL;
+     *     conf->form_prefix = { 0, NULL };
+     */
+
+    conf->enable = NGX_CONF_UNSET;
+    conf->max_args = NGX_CONF_UNSET_UINT;
+    conf->buffer_size = NGX_CONF_UNSET_SIZE;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_xcgi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_xcgi_loc_conf_t *prev = parent;
+    ngx_http_xcgi_loc_conf_t *conf = child;
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+
+    if (ngx_http_merge_types(cf, &conf->types_keys, &conf->types,
+                             &prev->types_keys, &prev->types,
+                             ngx_http_html_default_types)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_str_value(conf->form_prefix, prev->form_prefix,
+                             "/XCGI_Form/");
+
+    ngx_conf_merge_uint_value(conf->max_args, prev->max_args, 8);
+
+    ngx_conf_merge_size_value(conf->buffer_size, prev->buffer_size, 4096);
+
+    if (conf->buffer_size < NGX_XCGI_WRITE_MIN) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"xcgi_buffer_size\" must be at least %d bytes",
+                           NGX_XCGI_WRITE_MIN);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t ngx_http_xcgi_module_init(ngx_conf_t *cf)
+{
+    return ngx_xcgi_private_init(cf);
 }
 
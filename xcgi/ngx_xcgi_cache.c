@@ -0,0 +1,399 @@
+/*
+ * Copyright (C) lurenfu@qq.com
+ */
+
+#include "ngx_xcgi_private.h"
+
+
+static ngx_xcgi_cache_node_t *ngx_xcgi_cache_create(ngx_xcgi_cache_t *cache,
+    ngx_str_t *key, uint32_t hash);
+static void *ngx_xcgi_cache_alloc(ngx_xcgi_cache_t *cache, size_t size);
+static void ngx_xcgi_cache_delete(ngx_xcgi_cache_t *cache,
+    ngx_xcgi_cache_node_t *node);
+static void ngx_xcgi_cache_copy(u_char *p, ngx_chain_t *in);
+static void ngx_xcgi_cache_unlock(void *data);
+
+
+ngx_int_t
+ngx_xcgi_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_xcgi_cache_t  *ocache = data;
+
+    size_t             len;
+    ngx_xcgi_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_xcgi_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in xcgi cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in xcgi cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Returns NGX_OK with a copy of the cached output in value, or
+ * NGX_DECLINED if the handler is to be called.  In the latter case
+ * a lock is returned if the output is to be stored with
+ * ngx_xcgi_cache_update().
+ */
+
+ngx_int_t
+ngx_xcgi_cache_lookup(ngx_http_request_t *r, ngx_xcgi_handler_t *h,
+    int argc, char **argv, ngx_str_t *value, ngx_xcgi_cache_lock_t **lockp)
+{
+    int                         i;
+    size_t                      len;
+    u_char                     *p;
+    time_t                      now;
+    ngx_pool_cleanup_t         *cln;
+    ngx_xcgi_cache_t           *cache;
+    ngx_xcgi_cache_lock_t      *lock;
+    ngx_xcgi_cache_node_t      *node;
+    ngx_http_xcgi_main_conf_t  *xmcf;
+
+    *lockp = NULL;
+
+    xmcf = ngx_http_get_module_main_conf(r, ngx_http_xcgi_filter_module);
+
+    if (xmcf->cache_zone == NULL
+        || !(h->flags & NGX_XCGI_CACHEABLE)
+        || h->valid <= 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    cache = xmcf->cache_zone->data;
+
+    /* the null-terminated handler name and arguments */
+
+    len = h->name.len + 1;
+
+    for (i = 0; i < argc; i++) {
+        len += ngx_strlen(argv[i]) + 1;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_xcgi_cache_lock_t) + len);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    lock = cln->data;
+
+    lock->cache = cache;
+    lock->key.len = len;
+    lock->key.data = (u_char *) (lock + 1);
+    lock->valid = h->valid;
+    lock->locked = 0;
+
+    p = ngx_cpymem(lock->key.data, h->name.data, h->name.len);
+    *p++ = '\0';
+
+    for (i = 0; i < argc; i++) {
+        p = ngx_cpymem(p, argv[i], ngx_strlen(argv[i]) + 1);
+    }
+
+    lock->hash = ngx_crc32_long(lock->key.data, lock->key.len);
+
+    cln->handler = ngx_xcgi_cache_unlock;
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = (ngx_xcgi_cache_node_t *)
+               ngx_str_rbtree_lookup(&cache->sh->rbtree, &lock->key,
+                                     lock->hash);
+
+    if (node) {
+        ngx_queue_remove(&node->queue);
+        ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+        /* an expired output is still sent while another worker updates it */
+
+        if (node->value.data
+            && (node->expire > now || (node->updating && node->lock > now)))
+        {
+            value->len = node->value.len;
+            value->data = ngx_pnalloc(r->pool, value->len);
+
+            if (value->data) {
+                ngx_memcpy(value->data, node->value.data, value->len);
+            }
+
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "xcgi cache hit \"%V\", %uz bytes",
+                           &h->name, value->len);
+
+            return value->data ? NGX_OK : NGX_ERROR;
+        }
+
+        if (node->updating && node->lock > now) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_DECLINED;
+        }
+
+    } else {
+        node = ngx_xcgi_cache_create(cache, &lock->key, lock->hash);
+
+        if (node == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_DECLINED;
+        }
+    }
+
+    node->updating = 1;
+    node->lock = now + NGX_XCGI_CACHE_LOCK_TIMEOUT;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "xcgi cache update \"%V\"", &h->name);
+
+    lock->locked = 1;
+    *lockp = lock;
+
+    return NGX_DECLINED;
+}
+
+
+void
+ngx_xcgi_cache_update(ngx_xcgi_cache_lock_t *lock, ngx_chain_t *in)
+{
+    size_t                  size;
+    u_char                 *value, *old;
+    ngx_buf_t              *b;
+    ngx_chain_t            *cl;
+    ngx_xcgi_cache_t       *cache;
+    ngx_xcgi_cache_node_t  *node;
+
+    size = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (ngx_buf_in_memory(b)) {
+            size += b->last - b->pos;
+            continue;
+        }
+
+        if (ngx_buf_size(b)) {
+            /* output sent from a file is not cached */
+            ngx_xcgi_cache_unlock(lock);
+            return;
+        }
+    }
+
+    cache = lock->cache;
+
+    /*
+     * The output is copied before the zone is locked; the lock is taken
+     * again to evict entries only if the zone is full.
+     * An empty output is stored as a byte so that it is seen as cached.
+     */
+
+    value = ngx_slab_alloc(cache->shpool, size ? size : 1);
+
+    if (value) {
+        ngx_xcgi_cache_copy(value, in);
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (value == NULL) {
+        value = ngx_xcgi_cache_alloc(cache, size ? size : 1);
+
+        if (value) {
+            ngx_xcgi_cache_copy(value, in);
+        }
+    }
+
+    node = (ngx_xcgi_cache_node_t *)
+               ngx_str_rbtree_lookup(&cache->sh->rbtree, &lock->key,
+                                     lock->hash);
+
+    if (node == NULL && value) {
+        /* the entry was dropped meanwhile */
+        node = ngx_xcgi_cache_create(cache, &lock->key, lock->hash);
+    }
+
+    if (node == NULL || value == NULL) {
+        if (node) {
+            node->updating = 0;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        if (value) {
+            ngx_slab_free(cache->shpool, value);
+        }
+
+        lock->locked = 0;
+        return;
+    }
+
+    old = node->value.data;
+
+    node->value.data = value;
+    node->value.len = size;
+    node->expire = ngx_time() + lock->valid;
+    node->updating = 0;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (old) {
+        ngx_slab_free(cache->shpool, old);
+    }
+
+    lock->locked = 0;
+}
+
+
+static void
+ngx_xcgi_cache_copy(u_char *p, ngx_chain_t *in)
+{
+    for ( /* void */ ; in; in = in->next) {
+        if (ngx_buf_in_memory(in->buf)) {
+            p = ngx_cpymem(p, in->buf->pos, in->buf->last - in->buf->pos);
+        }
+    }
+}
+
+
+static ngx_xcgi_cache_node_t *
+ngx_xcgi_cache_create(ngx_xcgi_cache_t *cache, ngx_str_t *key, uint32_t hash)
+{
+    ngx_xcgi_cache_node_t  *node;
+
+    node = ngx_xcgi_cache_alloc(cache, sizeof(ngx_xcgi_cache_node_t)
+                                       + key->len);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    node->sn.node.key = hash;
+    node->sn.str.len = key->len;
+    node->sn.str.data = (u_char *) (node + 1);
+
+    ngx_memcpy(node->sn.str.data, key->data, key->len);
+
+    node->expire = 0;
+    node->lock = 0;
+    node->value.len = 0;
+    node->value.data = NULL;
+    node->updating = 0;
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &node->sn.node);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    return node;
+}
+
+
+static void *
+ngx_xcgi_cache_alloc(ngx_xcgi_cache_t *cache, size_t size)
+{
+    void                   *p;
+    ngx_queue_t            *q;
+    ngx_xcgi_cache_node_t  *node;
+
+    /* the least recently used entries are dropped to make room */
+
+    for ( ;; ) {
+        p = ngx_slab_alloc_locked(cache->shpool, size);
+
+        if (p || ngx_queue_empty(&cache->sh->queue)) {
+            return p;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+        node = ngx_queue_data(q, ngx_xcgi_cache_node_t, queue);
+
+        ngx_xcgi_cache_delete(cache, node);
+    }
+}
+
+
+static void
+ngx_xcgi_cache_delete(ngx_xcgi_cache_t *cache, ngx_xcgi_cache_node_t *node)
+{
+    ngx_queue_remove(&node->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, &node->sn.node);
+
+    if (node->value.data) {
+        ngx_slab_free_locked(cache->shpool, node->value.data);
+    }
+
+    ngx_slab_free_locked(cache->shpool, node);
+}
+
+
+/*
+ * The lock is released if the output could not be stored, e.g. the
+ * request was finalized before its handler task was done.
+ */
+
+static void
+ngx_xcgi_cache_unlock(void *data)
+{
+    ngx_xcgi_cache_lock_t  *lock = data;
+
+    ngx_xcgi_cache_t       *cache;
+    ngx_xcgi_cache_node_t  *node;
+
+    if (!lock->locked) {
+        return;
+    }
+
+    lock->locked = 0;
+
+    cache = lock->cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = (ngx_xcgi_cache_node_t *)
+               ngx_str_rbtree_lookup(&cache->sh->rbtree, &lock->key,
+                                     lock->hash);
+
+    if (node) {
+        node->updating = 0;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
@@ -13,7 +13,8 @@ static char *str_xcgi_copyleft =
 static int XCGI_CopyLeft(ngx_http_request_t *r, ngx_buf_t *b,
                          int argc, char **argv)
 {
-    return ngx_xcgi_write(r, b, "%s", str_xcgi_copyleft);
+    return ngx_xcgi_write_str(r, b, (u_char *) str_xcgi_copyleft,
+                              ngx_strlen(str_xcgi_copyleft));
 }
 
 static int XCGI_HelloWorld(ngx_http_request_t *r, ngx_buf_t *b,
@@ -46,6 +47,85 @@ static int XCGI_StringJoin(ngx_http_request_t *r, ngx_buf_t *b,
     return n;
 }
 
+static int XCGI_JSON_Args(ngx_http_request_t *r, ngx_buf_t *b,
+                          int argc, char **argv)
+{
+    int              i;
+    ngx_xcgi_json_t  js;
+
+    ngx_xcgi_json_init(&js, r, b);
+    ngx_xcgi_json_object(&js);
+
+    ngx_xcgi_json_key(&js, "argc");
+    ngx_xcgi_json_int(&js, argc);
+
+    ngx_xcgi_json_key(&js, "argv");
+    ngx_xcgi_json_array(&js);
+
+    for (i = 0; i < argc; i++) {
+        ngx_xcgi_json_string(&js, argv[i]);
+    }
+
+    ngx_xcgi_json_array_end(&js);
+    ngx_xcgi_json_key(&js, "uri");
+    ngx_xcgi_json_str(&js, &r->uri);
+
+    ngx_xcgi_json_object_end(&js);
+
+    return ngx_xcgi_json_done(&js);
+}
+
+typedef struct {
+    u_char  data[64];
+    ssize_t n;
+} xcgi_loadavg_t;
+
+static void XCGI_LoadAvg_Read(void *data, ngx_log_t *log)
+{
+    xcgi_loadavg_t  *la = data;
+    ngx_fd_t         fd;
+
+    /* called in a thread, may block */
+
+    la->n = -1;
+
+    fd = ngx_open_file("/proc/loadavg", NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        return;
+    }
+
+    la->n = read(fd, la->data, sizeof(la->data));
+
+    (void) ngx_close_file(fd);
+}
+
+static int XCGI_LoadAvg_Done(ngx_http_request_t *r, ngx_buf_t *b, void *data)
+{
+    xcgi_loadavg_t  *la = data;
+
+    if (la->n <= 0) {
+        return ngx_xcgi_write(r, b, "unknown");
+    }
+
+    return ngx_xcgi_write(r, b, "%.*s", (int) la->n - 1, la->data);
+}
+
+static int XCGI_LoadAvg(ngx_http_request_t *r, ngx_buf_t *b,
+                        int argc, char **argv)
+{
+    ngx_xcgi_task_t  *task;
+
+    task = ngx_xcgi_task_alloc(r, sizeof(xcgi_loadavg_t));
+    if (task == NULL) {
+        return -1;
+    }
+
+    task->handler = XCGI_LoadAvg_Read;
+    task->done = XCGI_LoadAvg_Done;
+
+    return ngx_xcgi_task_post(r, b, task);
+}
+
 static ngx_xcgi_handler_t   xcgi_example_handlers[] = {
     {
         .name = ngx_string("XCGI_CopyLeft"),
@@ -62,6 +142,18 @@ static ngx_xcgi_handler_t   xcgi_example_handlers[] = {
     {
         .name = ngx_string("XCGI_StringJoin"),
         .data.func = XCGI_StringJoin,
+        .flags = NGX_XCGI_CACHEABLE,
+        .valid = 60,
+    },
+    {
+        .name = ngx_string("XCGI_JSON_Args"),
+        .data.func = XCGI_JSON_Args,
+    },
+    {
+        .name = ngx_string("XCGI_LoadAvg"),
+        .data.func = XCGI_LoadAvg,
+        .flags = NGX_XCGI_CACHEABLE,
+        .valid = 1,
     },
 };
 
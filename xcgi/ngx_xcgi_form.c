@@ -0,0 +1,859 @@
+/*
+ * Copyright (C) lurenfu@qq.com
+ */
+
+#include "ngx_xcgi_private.h"
+
+
+/*
+ * Incremental parser of /XCGI_Form/ request bodies, fed from the request
+ * body filter chain as the body arrives, so it sees every buffer before
+ * the body is possibly written to a temporary file.
+ *
+ * Names and values are referenced in the body buffers in place if the
+ * whole body is known to stay in memory and the string does not cross
+ * a buffer boundary; otherwise they are copied.  Data of multipart file
+ * parts is passed to the upload handler of the form as it arrives.
+ */
+
+#define NGX_XCGI_FORM_URLENCODED    1
+#define NGX_XCGI_FORM_MULTIPART     2
+
+#define NGX_XCGI_FORM_HEADER_LEN    1024
+
+
+typedef struct {
+    u_char                  *start;     /* pending bytes in the buffer */
+    u_char                  *data;      /* copied bytes */
+    size_t                   len;
+    size_t                   size;
+    unsigned                 active:1;
+} ngx_xcgi_form_str_t;
+
+
+typedef enum {
+    xform_name_state = 0,
+    xform_value_state,
+
+    xform_preamble_state,
+    xform_boundary_state,
+    xform_boundary_end_state,
+    xform_boundary_skip_state,
+    xform_header_state,
+    xform_data_state,
+    xform_done_state
+} ngx_xcgi_form_state_e;
+
+
+struct ngx_xcgi_form_s {
+    ngx_uint_t               type;
+    ngx_uint_t               state;
+
+    ngx_xcgi_form_str_t      name;
+    ngx_xcgi_form_str_t      value;
+    ngx_str_t                field;         /* name of the current field */
+
+    /* multipart/form-data */
+
+    ngx_str_t                delimiter;     /* CRLF "--" boundary */
+    size_t                   matched;
+    size_t                   held;          /* matched in previous bufs */
+    u_char                  *data_start;
+
+    ngx_xcgi_part_t          part;
+    ngx_xcgi_upload_pt       upload;
+
+    size_t                   header_len;
+    u_char                   header[NGX_XCGI_FORM_HEADER_LEN];
+
+    unsigned                 in_place:1;
+    unsigned                 file:1;
+};
+
+
+static ngx_int_t ngx_xcgi_form_urlencoded(ngx_http_request_t *r,
+    ngx_xcgi_form_t *form, u_char *pos, u_char *last, ngx_uint_t last_buf);
+static ngx_int_t ngx_xcgi_form_multipart(ngx_http_request_t *r,
+    ngx_xcgi_form_t *form, u_char *pos, u_char *last);
+static ngx_int_t ngx_xcgi_form_header(ngx_http_request_t *r,
+    ngx_xcgi_form_t *form);
+static ngx_int_t ngx_xcgi_form_param(ngx_http_request_t *r, u_char *start,
+    u_char *end, char *param, ngx_str_t *value);
+static ngx_int_t ngx_xcgi_form_part_data(ngx_http_request_t *r,
+    ngx_xcgi_form_t *form, u_char *data, size_t len);
+static ngx_int_t ngx_xcgi_form_part_end(ngx_http_request_t *r,
+    ngx_xcgi_form_t *form, u_char *last);
+static ngx_int_t ngx_xcgi_form_str_append(ngx_pool_t *pool,
+    ngx_xcgi_form_str_t *s, u_char *data, size_t len);
+static ngx_int_t ngx_xcgi_form_str_end(ngx_http_request_t *r,
+    ngx_xcgi_form_t *form, ngx_xcgi_form_str_t *s, u_char *last,
+    ngx_str_t *str, ngx_uint_t *copied);
+
+
+ngx_int_t
+ngx_xcgi_form_create(ngx_http_request_t *r, ngx_xcgi_handler_t *handler,
+    ngx_xcgi_form_t **formp)
+{
+    u_char                    *p, *last;
+    ngx_str_t                  boundary;
+    ngx_xcgi_form_t           *form;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    form = ngx_pcalloc(r->pool, sizeof(ngx_xcgi_form_t));
+    if (form == NULL) {
+        return NGX_ERROR;
+    }
+
+    form->type = NGX_XCGI_FORM_URLENCODED;
+    form->state = xform_name_state;
+
+    if (r->headers_in.content_type
+        && r->headers_in.content_type->value.len >= sizeof("multipart/") - 1
+        && ngx_strncasecmp(r->headers_in.content_type->value.data,
+                           (u_char *) "multipart/",
+                           sizeof("multipart/") - 1)
+           == 0)
+    {
+        p = r->headers_in.content_type->value.data;
+        last = p + r->headers_in.content_type->value.len;
+
+        if (ngx_xcgi_form_param(r, p, last, "boundary", &boundary) != NGX_OK
+            || boundary.len == 0 || boundary.len > 70)
+        {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "xcgi form without valid multipart boundary");
+            return NGX_DECLINED;
+        }
+
+        form->delimiter.len = sizeof(CRLF "--") - 1 + boundary.len;
+        form->delimiter.data = ngx_pnalloc(r->pool, form->delimiter.len);
+        if (form->delimiter.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(ngx_cpymem(form->delimiter.data, CRLF "--",
+                              sizeof(CRLF "--") - 1),
+                   boundary.data, boundary.len);
+
+        form->type = NGX_XCGI_FORM_MULTIPART;
+        form->state = xform_preamble_state;
+
+        /* the first boundary is not preceded by CRLF */
+        form->matched = 2;
+
+        form->upload = handler ? handler->upload : NULL;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    /*
+     * a body which fits into client_body_buffer_size is not written
+     * to a temporary file, so its buffers are not reused, unless
+     * client_body_in_file_only is set
+     */
+
+    form->in_place = (r->headers_in.content_length_n >= 0
+                      && !r->headers_in.chunked
+                      && !r->request_body_in_file_only
+                      && r->headers_in.content_length_n
+                         <= (off_t) clcf->client_body_buffer_size);
+
+    *formp = form;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_xcgi_form_feed(ngx_http_request_t *r, ngx_xcgi_form_t *form,
+    ngx_chain_t *in)
+{
+    ngx_int_t     rc;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (ngx_buf_in_memory(b) && b->last > b->pos) {
+
+            if (form->type == NGX_XCGI_FORM_URLENCODED) {
+                rc = ngx_xcgi_form_urlencoded(r, form, b->pos, b->last,
+                                              b->last_buf);
+
+            } else {
+                rc = ngx_xcgi_form_multipart(r, form, b->pos, b->last);
+            }
+
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+            if (b->last_buf) {
+                return ngx_xcgi_form_finish(r, form, b->last);
+            }
+        }
+
+        if (b->last_buf) {
+            return ngx_xcgi_form_finish(r, form, NULL);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_xcgi_form_finish(ngx_http_request_t *r, ngx_xcgi_form_t *form,
+    u_char *last)
+{
+    ngx_str_t   value;
+    ngx_uint_t  copied;
+
+    switch (form->state) {
+
+    case xform_value_state:
+
+        if (ngx_xcgi_form_str_end(r, form, &form->value, last, &value,
+                                  &copied)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        /* a value in place at the very end of the body cannot be terminated */
+
+        if (value.len && form->field.len
+            && ngx_xcgi_set_var_internal(r, &form->field, &value,
+                                         copied ? NGX_XCGI_VAR_SPARE : 0)
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        break;
+
+    case xform_data_state:
+
+        if (form->file && form->upload) {
+
+            /* the body ended in the middle of a file part */
+
+            if (form->upload(r, &form->part, NULL, 0, 1) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        break;
+
+    default:
+        break;
+    }
+
+    form->state = xform_done_state;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_xcgi_form_urlencoded(ngx_http_request_t *r, ngx_xcgi_form_t *form,
+    u_char *pos, u_char *last, ngx_uint_t last_buf)
+{
+    u_char      *p;
+    ngx_str_t    value;
+    ngx_uint_t   copied;
+
+    if (form->name.active) {
+        form->name.start = pos;
+    }
+
+    if (form->value.active) {
+        form->value.start = pos;
+    }
+
+    for (p = pos; p < last; p++) {
+
+        switch (form->state) {
+
+        case xform_name_state:
+
+            if (!form->name.active) {
+                form->name.active = 1;
+                form->name.start = p;
+            }
+
+            if (*p == '&') {
+                /* a field without value is ignored */
+                form->name.active = 0;
+                form->name.len = 0;
+                form->name.size = 0;
+                form->name.data = NULL;
+                break;
+            }
+
+            if (*p != '=') {
+                break;
+            }
+
+            if (ngx_xcgi_form_str_end(r, form, &form->name, p, &form->field,
+                                      &copied)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            form->state = xform_value_state;
+            form->value.active = 1;
+            form->value.start = p + 1;
+
+            break;
+
+        case xform_value_state:
+
+            if (*p != '&') {
+                break;
+            }
+
+            if (ngx_xcgi_form_str_end(r, form, &form->value, p, &value,
+                                      &copied)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            /* a value in place is terminated over '&' when read */
+
+            if (value.len && form->field.len
+                && ngx_xcgi_set_var_internal(r, &form->field, &value,
+                                             NGX_XCGI_VAR_SPARE)
+                   != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            form->state = xform_name_state;
+
+            break;
+
+        default:
+            return NGX_OK;
+        }
+    }
+
+    if (last_buf) {
+        return NGX_OK;
+    }
+
+    /* strings crossing the buffer boundary are copied */
+
+    if (form->name.active) {
+        if (ngx_xcgi_form_str_append(r->pool, &form->name, form->name.start,
+                                     last - form->name.start)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        form->name.start = NULL;
+    }
+
+    if (form->value.active) {
+        if (ngx_xcgi_form_str_append(r->pool, &form->value,
+                                     form->value.start,
+                                     last - form->value.start)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        form->value.start = NULL;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_xcgi_form_multipart(ngx_http_request_t *r, ngx_xcgi_form_t *form,
+    u_char *pos, u_char *last)
+{
+    u_char   *p, *d, ch;
+    size_t    n;
+
+    form->data_start = pos;
+
+    if (form->value.active) {
+        form->value.start = pos;
+    }
+
+    d = form->delimiter.data;
+
+    for (p = pos; p < last; p++) {
+        ch = *p;
+
+        switch (form->state) {
+
+        case xform_preamble_state:
+
+            if (ch == d[form->matched]) {
+                if (++form->matched == form->delimiter.len) {
+                    form->state = xform_boundary_state;
+                }
+
+                break;
+            }
+
+            form->matched = (ch == d[0]) ? 1 : 0;
+
+            break;
+
+        case xform_boundary_state:
+
+            if (ch == '-') {
+                form->state = xform_boundary_end_state;
+                break;
+            }
+
+            form->state = xform_boundary_skip_state;
+
+            /* fall through */
+
+        case xform_boundary_skip_state:
+
+            if (ch == LF) {
+                form->state = xform_header_state;
+                form->header_len = 0;
+                form->file = 0;
+                ngx_memzero(&form->part, sizeof(ngx_xcgi_part_t));
+            }
+
+            break;
+
+        case xform_boundary_end_state:
+
+            if (ch == '-') {
+                form->state = xform_done_state;
+                break;
+            }
+
+            form->state = xform_boundary_skip_state;
+
+            break;
+
+        case xform_header_state:
+
+            if (ch != LF) {
+                if (form->header_len < NGX_XCGI_FORM_HEADER_LEN) {
+                    form->header[form->header_len++] = ch;
+                }
+
+                break;
+            }
+
+            if (form->header_len && form->header[form->header_len - 1] == CR)
+            {
+                form->header_len--;
+            }
+
+            if (form->header_len) {
+                if (ngx_xcgi_form_header(r, form) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+                form->header_len = 0;
+                break;
+            }
+
+            /* an empty line ends the part headers */
+
+            form->state = xform_data_state;
+            form->matched = 0;
+            form->held = 0;
+            form->data_start = p + 1;
+
+            if (!form->file) {
+                form->value.active = 1;
+                form->value.start = p + 1;
+                form->value.data = NULL;
+                form->value.len = 0;
+                form->value.size = 0;
+            }
+
+            break;
+
+        case xform_data_state:
+
+            if (ch == d[form->matched]) {
+                if (++form->matched < form->delimiter.len) {
+                    break;
+                }
+
+                /* the data ends where the delimiter starts */
+
+                n = form->delimiter.len - form->held;
+
+                if (ngx_xcgi_form_part_end(r, form, p + 1 - n) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+                form->state = xform_boundary_state;
+                form->matched = 0;
+                form->held = 0;
+
+                break;
+            }
+
+            if (form->held) {
+
+                /* delimiter bytes held in previous buffers are data */
+
+                if (ngx_xcgi_form_part_data(r, form, d, form->held)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                form->held = 0;
+            }
+
+            form->matched = (ch == d[0]) ? 1 : 0;
+
+            break;
+
+        default: /* xform_done_state */
+            return NGX_OK;
+        }
+    }
+
+    if (form->state == xform_data_state) {
+
+        /* data matching the delimiter so far is held back */
+
+        n = form->matched - form->held;
+
+        if (ngx_xcgi_form_part_data(r, form, form->data_start,
+                                    last - n - form->data_start)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        form->held = form->matched;
+        form->value.start = NULL;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_xcgi_form_header(ngx_http_request_t *r, ngx_xcgi_form_t *form)
+{
+    u_char     *p, *last;
+    ngx_str_t   value;
+
+    p = form->header;
+    last = form->header + form->header_len;
+
+    if (form->header_len > sizeof("Content-Disposition:") - 1
+        && ngx_strncasecmp(p, (u_char *) "Content-Disposition:",
+                           sizeof("Content-Disposition:") - 1)
+           == 0)
+    {
+        p += sizeof("Content-Disposition:") - 1;
+
+        if (ngx_xcgi_form_param(r, p, last, "name", &value) == NGX_OK) {
+            form->part.name.data = ngx_pstrdup(r->pool, &value);
+            if (form->part.name.data == NULL) {
+                return NGX_ERROR;
+            }
+
+            form->part.name.len = value.len;
+        }
+
+        if (ngx_xcgi_form_param(r, p, last, "filename", &value) == NGX_OK) {
+            form->part.filename.data = ngx_pnalloc(r->pool, value.len + 1);
+            if (form->part.filename.data == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(form->part.filename.data, value.data, value.len);
+            form->part.filename.data[value.len] = '\0';
+            form->part.filename.len = value.len;
+
+            form->file = 1;
+        }
+
+        return NGX_OK;
+    }
+
+    if (form->header_len > sizeof("Content-Type:") - 1
+        && ngx_strncasecmp(p, (u_char *) "Content-Type:",
+                           sizeof("Content-Type:") - 1)
+           == 0)
+    {
+        p += sizeof("Content-Type:") - 1;
+
+        while (p < last && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        value.data = p;
+        value.len = last - p;
+
+        form->part.content_type.data = ngx_pstrdup(r->pool, &value);
+        if (form->part.content_type.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        form->part.content_type.len = value.len;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Finds a parameter such as "name" in "form-data; name=\"a\"; filename=b",
+ * quotes are stripped and no unescaping is done.
+ */
+
+static ngx_int_t
+ngx_xcgi_form_param(ngx_http_request_t *r, u_char *start, u_char *end,
+    char *param, ngx_str_t *value)
+{
+    u_char  *p, *name;
+    size_t   len;
+
+    len = ngx_strlen(param);
+
+    for (p = start; p < end; /* void */) {
+
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ';')) {
+            p++;
+        }
+
+        name = p;
+
+        while (p < end && *p != '=' && *p != ';') {
+            p++;
+        }
+
+        if (p == end || *p == ';') {
+            continue;
+        }
+
+        /* *p == '=' */
+
+        if ((size_t) (p - name) == len
+            && ngx_strncasecmp(name, (u_char *) param, len) == 0)
+        {
+            p++;
+
+            if (p < end && *p == '"') {
+                value->data = ++p;
+
+                while (p < end && *p != '"') {
+                    p++;
+                }
+
+            } else {
+                value->data = p;
+
+                while (p < end && *p != ';' && *p != ' ' && *p != '\t') {
+                    p++;
+                }
+            }
+
+            value->len = p - value->data;
+
+            return NGX_OK;
+        }
+
+        /* skip the value of another parameter */
+
+        p++;
+
+        if (p < end && *p == '"') {
+            for (p++; p < end && *p != '"'; p++) { /* void */ }
+            p++;
+        }
+
+        while (p < end && *p != ';') {
+            p++;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_xcgi_form_part_data(ngx_http_request_t *r, ngx_xcgi_form_t *form,
+    u_char *data, size_t len)
+{
+    if (len == 0) {
+        return NGX_OK;
+    }
+
+    /*
+     * delimiter bytes held in previous buffers precede any data of the
+     * current buffer, which is only passed at its end or at the delimiter
+     */
+
+    if (!form->file) {
+        return ngx_xcgi_form_str_append(r->pool, &form->value, data, len);
+    }
+
+    form->part.size += len;
+
+    if (form->upload == NULL) {
+        return NGX_OK;
+    }
+
+    return form->upload(r, &form->part, data, len, 0);
+}
+
+
+static ngx_int_t
+ngx_xcgi_form_part_end(ngx_http_request_t *r, ngx_xcgi_form_t *form,
+    u_char *last)
+{
+    ngx_str_t   value;
+    ngx_uint_t  copied;
+
+    if (form->file) {
+
+        if (last > form->data_start) {
+            form->part.size += last - form->data_start;
+
+            if (form->upload
+                && form->upload(r, &form->part, form->data_start,
+                                last - form->data_start, 0)
+                   != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        form->part.complete = 1;
+
+        if (form->upload
+            && form->upload(r, &form->part, NULL, 0, 1) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        /* handlers find the name of an uploaded file by the field name */
+
+        value = form->part.filename;
+
+        if (form->part.name.len
+            && ngx_xcgi_set_var_internal(r, &form->part.name, &value,
+                                         NGX_XCGI_VAR_SPARE
+                                         |NGX_XCGI_VAR_RAW)
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        form->file = 0;
+
+        return NGX_OK;
+    }
+
+    if (ngx_xcgi_form_str_end(r, form, &form->value, last, &value, &copied)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /* a value in place is followed by the delimiter, which is writable */
+
+    if (form->part.name.len
+        && ngx_xcgi_set_var_internal(r, &form->part.name, &value,
+                                     NGX_XCGI_VAR_SPARE|NGX_XCGI_VAR_RAW)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_xcgi_form_str_append(ngx_pool_t *pool, ngx_xcgi_form_str_t *s,
+    u_char *data, size_t len)
+{
+    u_char  *p;
+    size_t   size;
+
+    if (len == 0) {
+        return NGX_OK;
+    }
+
+    /* one spare byte is kept for the terminating null */
+
+    if (s->len + len + 1 > s->size) {
+        size = ngx_max(2 * s->size, s->len + len + 1);
+        size = ngx_max(size, 64);
+
+        p = ngx_pnalloc(pool, size);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (s->len) {
+            ngx_memcpy(p, s->data, s->len);
+        }
+
+        s->data = p;
+        s->size = size;
+    }
+
+    ngx_memcpy(s->data + s->len, data, len);
+    s->len += len;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_xcgi_form_str_end(ngx_http_request_t *r, ngx_xcgi_form_t *form,
+    ngx_xcgi_form_str_t *s, u_char *last, ngx_str_t *str, ngx_uint_t *copied)
+{
+    if (last && s->data == NULL && form->in_place) {
+
+        str->data = s->start;
+        str->len = last - s->start;
+
+        *copied = 0;
+        goto done;
+    }
+
+    /* with no last pointer all bytes have been copied already */
+
+    if (last
+        && ngx_xcgi_form_str_append(r->pool, s, s->start, last - s->start)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    str->data = s->data;
+    str->len = s->len;
+
+    *copied = 1;
+
+done:
+
+    s->start = NULL;
+    s->data = NULL;
+    s->len = 0;
+    s->size = 0;
+    s->active = 0;
+
+    return NGX_OK;
+}
@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) lurenfu@qq.com
+ */
+
+#include "ngx_xcgi_private.h"
+
+
+/*
+ * JSON is formatted directly into the output buffers of the writer.
+ * Strings are escaped with a table lookup per byte and copied in runs,
+ * numbers are formatted with ngx_sprintf(), printf() is never used.
+ * An error sticks, so a handler checks only the ngx_xcgi_json_done()
+ * result.
+ */
+
+#define NGX_XCGI_JSON_ESCAPE_LEN  (sizeof("\\u0000") - 1)
+
+#define ngx_xcgi_json_bit(js)     ((uint32_t) 1 << (js)->depth)
+
+
+static void ngx_xcgi_json_open(ngx_xcgi_json_t *js, u_char ch);
+static void ngx_xcgi_json_close(ngx_xcgi_json_t *js, u_char ch);
+static void ngx_xcgi_json_value(ngx_xcgi_json_t *js);
+static void ngx_xcgi_json_quote(ngx_xcgi_json_t *js, u_char *p, size_t len);
+static void ngx_xcgi_json_write(ngx_xcgi_json_t *js, u_char *p, size_t len);
+
+
+/* the character following the backslash, 'u' for \u00XX, or 0 */
+
+static u_char  ngx_xcgi_json_escape[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+     0,   0,  '"',  0,   0,   0,   0,   0,
+     0,   0,   0,   0,   0,   0,   0,   0,
+     0,   0,   0,   0,   0,   0,   0,   0,
+     0,   0,   0,   0,   0,   0,   0,   0,
+     0,   0,   0,   0,   0,   0,   0,   0,
+     0,   0,   0,   0,   0,   0,   0,   0,
+     0,   0,   0,   0,   0,   0,   0,   0,
+     0,   0,   0,   0, '\\',  0,   0,   0,
+     0,   0,   0,   0,   0,   0,   0,   0,
+     0,   0,   0,   0,   0,   0,   0,   0,
+     0,   0,   0,   0,   0,   0,   0,   0,
+     0,   0,   0,   0,   0,   0,   0, 'u',
+};
+
+
+void
+ngx_xcgi_json_init(ngx_xcgi_json_t *js, ngx_http_request_t *r, ngx_buf_t *b)
+{
+    js->request = r;
+    js->buf = b;
+    js->n = 0;
+    js->depth = 0;
+    js->first = 1;
+    js->arrays = 0;
+    js->key = 0;
+}
+
+
+void
+ngx_xcgi_json_object(ngx_xcgi_json_t *js)
+{
+    ngx_xcgi_json_open(js, '{');
+}
+
+
+void
+ngx_xcgi_json_object_end(ngx_xcgi_json_t *js)
+{
+    ngx_xcgi_json_close(js, '}');
+}
+
+
+void
+ngx_xcgi_json_array(ngx_xcgi_json_t *js)
+{
+    ngx_xcgi_json_open(js, '[');
+}
+
+
+void
+ngx_xcgi_json_array_end(ngx_xcgi_json_t *js)
+{
+    ngx_xcgi_json_close(js, ']');
+}
+
+
+void
+ngx_xcgi_json_key(ngx_xcgi_json_t *js, const char *key)
+{
+    if (js->depth == 0 || (js->arrays & ngx_xcgi_json_bit(js)) || js->key) {
+        js->n = -1;
+        return;
+    }
+
+    ngx_xcgi_json_value(js);
+    ngx_xcgi_json_quote(js, (u_char *) key, ngx_strlen(key));
+    ngx_xcgi_json_write(js, (u_char *) ":", 1);
+
+    js->key = 1;
+}
+
+
+void
+ngx_xcgi_json_int(ngx_xcgi_json_t *js, int64_t value)
+{
+    u_char  *p, buf[NGX_INT64_LEN];
+
+    ngx_xcgi_json_value(js);
+
+    p = ngx_sprintf(buf, "%L", value);
+
+    ngx_xcgi_json_write(js, buf, p - buf);
+}
+
+
+void
+ngx_xcgi_json_uint(ngx_xcgi_json_t *js, uint64_t value)
+{
+    u_char  *p, buf[NGX_INT64_LEN];
+
+    ngx_xcgi_json_value(js);
+
+    p = ngx_sprintf(buf, "%uL", value);
+
+    ngx_xcgi_json_write(js, buf, p - buf);
+}
+
+
+void
+ngx_xcgi_json_bool(ngx_xcgi_json_t *js, ngx_uint_t value)
+{
+    ngx_xcgi_json_value(js);
+
+    if (value) {
+        ngx_xcgi_json_write(js, (u_char *) "true", sizeof("true") - 1);
+
+    } else {
+        ngx_xcgi_json_write(js, (u_char *) "false", sizeof("false") - 1);
+    }
+}
+
+
+void
+ngx_xcgi_json_null(ngx_xcgi_json_t *js)
+{
+    ngx_xcgi_json_value(js);
+    ngx_xcgi_json_write(js, (u_char *) "null", sizeof("null") - 1);
+}
+
+
+void
+ngx_xcgi_json_string(ngx_xcgi_json_t *js, const char *value)
+{
+    if (value == NULL) {
+        ngx_xcgi_json_null(js);
+        return;
+    }
+
+    ngx_xcgi_json_value(js);
+    ngx_xcgi_json_quote(js, (u_char *) value, ngx_strlen(value));
+}
+
+
+void
+ngx_xcgi_json_str(ngx_xcgi_json_t *js, ngx_str_t *value)
+{
+    ngx_xcgi_json_value(js);
+    ngx_xcgi_json_quote(js, value->data, value->len);
+}
+
+
+int
+ngx_xcgi_json_done(ngx_xcgi_json_t *js)
+{
+    if (js->depth || js->key) {
+        ngx_log_error(NGX_LOG_ALERT, js->request->connection->log, 0,
+                      "xcgi json output is not complete");
+        return -1;
+    }
+
+    return js->n;
+}
+
+
+static void
+ngx_xcgi_json_open(ngx_xcgi_json_t *js, u_char ch)
+{
+    ngx_xcgi_json_value(js);
+
+    if (js->depth == NGX_XCGI_JSON_MAX_DEPTH) {
+        js->n = -1;
+        return;
+    }
+
+    ngx_xcgi_json_write(js, &ch, 1);
+
+    js->depth++;
+    js->first |= ngx_xcgi_json_bit(js);
+
+    if (ch == '[') {
+        js->arrays |= ngx_xcgi_json_bit(js);
+
+    } else {
+        js->arrays &= ~ngx_xcgi_json_bit(js);
+    }
+}
+
+
+static void
+ngx_xcgi_json_close(ngx_xcgi_json_t *js, u_char ch)
+{
+    if (js->depth == 0
+        || js->key
+        || (ch == ']') != ((js->arrays & ngx_xcgi_json_bit(js)) != 0))
+    {
+        js->n = -1;
+        return;
+    }
+
+    js->depth--;
+
+    ngx_xcgi_json_write(js, &ch, 1);
+}
+
+
+/* separates a value or a key from the previous one at its level */
+
+static void
+ngx_xcgi_json_value(ngx_xcgi_json_t *js)
+{
+    if (js->key) {
+        js->key = 0;
+        return;
+    }
+
+    if (js->first & ngx_xcgi_json_bit(js)) {
+        js->first &= ~ngx_xcgi_json_bit(js);
+        return;
+    }
+
+    /* a document is a single value */
+
+    if (js->depth == 0) {
+        js->n = -1;
+        return;
+    }
+
+    ngx_xcgi_json_write(js, (u_char *) ",", 1);
+}
+
+
+static void
+ngx_xcgi_json_quote(ngx_xcgi_json_t *js, u_char *p, size_t len)
+{
+    u_char     *end, *last, ch, esc;
+    ngx_buf_t  *t;
+
+    static u_char  hex[] = "0123456789abcdef";
+
+    end = p + len;
+
+    t = NULL;
+    last = NULL;
+
+    ngx_xcgi_json_write(js, (u_char *) "\"", 1);
+
+    while (p < end && js->n >= 0) {
+
+        /* room for at least an escaped character */
+
+        t = ngx_xcgi_write_reserve(js->request, js->buf,
+                                   NGX_XCGI_JSON_ESCAPE_LEN);
+        if (t == NULL) {
+            js->n = -1;
+            return;
+        }
+
+        last = t->last;
+
+        while (p < end) {
+            ch = *p;
+            esc = ngx_xcgi_json_escape[ch];
+
+            if (esc == 0) {
+                if (last == t->end) {
+                    break;
+                }
+
+                *last++ = ch;
+                p++;
+                continue;
+            }
+
+            if ((size_t) (t->end - last) < NGX_XCGI_JSON_ESCAPE_LEN) {
+                break;
+            }
+
+            *last++ = '\\';
+            *last++ = esc;
+
+            if (esc == 'u') {
+                *last++ = '0';
+                *last++ = '0';
+                *last++ = hex[ch >> 4];
+                *last++ = hex[ch & 0xf];
+            }
+
+            p++;
+        }
+
+        js->n += last - t->last;
+        t->last = last;
+    }
+
+    ngx_xcgi_json_write(js, (u_char *) "\"", 1);
+}
+
+
+static void
+ngx_xcgi_json_write(ngx_xcgi_json_t *js, u_char *p, size_t len)
+{
+    ngx_buf_t  *t;
+
+    if (js->n < 0) {
+        return;
+    }
+
+    t = ngx_xcgi_write_reserve(js->request, js->buf, len);
+    if (t == NULL) {
+        js->n = -1;
+        return;
+    }
+
+    t->last = ngx_cpymem(t->last, p, len);
+    js->n += len;
+}
@@ -9,18 +9,248 @@
 
 #include "ngx_xcgi_public.h"
 
-#define NGX_XCGI_HANDLER_HASH_TABLE_SIZE    256
+extern ngx_module_t  ngx_http_xcgi_filter_module;
 
-void  ngx_xcgi_private_init(void);
+#define NGX_XCGI_HANDLERS_HASH_MAX_SIZE     4096
+#define NGX_XCGI_HANDLER_NAME_LEN           256
+
+#define NGX_XCGI_VARS_INLINE                8
+
+#define NGX_XCGI_VAR_SPARE                  0x01
+#define NGX_XCGI_VAR_RAW                    0x02
+
+#define NGX_XCGI_TEMPLATE_CACHE_MAX         64
+#define NGX_XCGI_TEMPLATE_MAX_SIZE          (1024 * 1024)
+#define NGX_XCGI_TEMPLATE_FILE_MIN          1024
+
+#define NGX_XCGI_WRITE_MIN                  64
+#define NGX_XCGI_WRITE_COPY_MAX             128
+#define NGX_XCGI_WRITE_FREE_MAX             64
+
+#define NGX_XCGI_CACHE_LOCK_TIMEOUT         5
+
+
+typedef struct ngx_xcgi_form_s   ngx_xcgi_form_t;
+typedef struct ngx_xcgi_block_s  ngx_xcgi_block_t;
+
+
+typedef struct {
+    ngx_flag_t               enable;
+    ngx_hash_t               types;
+    ngx_array_t             *types_keys;
+    ngx_str_t                form_prefix;
+    ngx_uint_t               max_args;
+    size_t                   buffer_size;
+} ngx_http_xcgi_loc_conf_t;
+
+
+typedef struct {
+    ngx_array_t              handlers;  /* of ngx_hash_key_t */
+    ngx_hash_t               handlers_hash;
+    ngx_shm_zone_t          *cache_zone;
+    ngx_array_t             *cache_valid;   /* of ngx_xcgi_cache_valid_t */
+#if (NGX_THREADS)
+    ngx_thread_pool_t       *thread_pool;
+#endif
+} ngx_http_xcgi_main_conf_t;
+
+
+typedef struct {
+    ngx_str_t                name;
+    time_t                   valid;
+} ngx_xcgi_cache_valid_t;
+
+
+/*
+ * The outputs of cacheable handlers are kept in a shared zone keyed by
+ * the handler name and arguments.  An expired entry is recomputed by the
+ * worker which locked it first, others send the old output meanwhile.
+ */
+
+typedef struct {
+    ngx_rbtree_t             rbtree;
+    ngx_rbtree_node_t        sentinel;
+    ngx_queue_t              queue;
+} ngx_xcgi_cache_sh_t;
+
+
+typedef struct {
+    ngx_xcgi_cache_sh_t     *sh;
+    ngx_slab_pool_t         *shpool;
+} ngx_xcgi_cache_t;
+
+
+typedef struct {
+    ngx_str_node_t           sn;
+    ngx_queue_t              queue;
+    time_t                   expire;
+    time_t                   lock;      /* the update is taken over after */
+    ngx_str_t                value;
+    unsigned                 updating:1;
+} ngx_xcgi_cache_node_t;
+
+
+typedef struct {
+    ngx_xcgi_cache_t        *cache;
+    ngx_str_t                key;
+    uint32_t                 hash;
+    time_t                   valid;
+    unsigned                 locked:1;
+} ngx_xcgi_cache_lock_t;
+
+
+typedef struct {
+    ngx_str_t                name;
+    ngx_str_t                value;
+    ngx_uint_t               hash;
+    unsigned                 decoded:1;
+    unsigned                 spare:1;   /* a writable byte follows value */
+} ngx_xcgi_var_t;
+
+
+typedef struct {
+    ngx_uint_t               nelts;
+    ngx_uint_t               size;
+    ngx_xcgi_var_t          *slots;
+    ngx_xcgi_var_t           inline_slots[NGX_XCGI_VARS_INLINE];
+} ngx_xcgi_vars_t;
+
+
+/*
+ * A compiled template is the page split into literal segments and
+ * handler calls, so that later responses do not rescan the page.
+ */
+
+typedef struct {
+    ngx_str_t                text;      /* literal bytes or handler name */
+    off_t                    offset;    /* of the literal bytes in the file */
+    ngx_xcgi_handler_t      *handler;
+    int                      argc;
+    char                   **argv;
+    unsigned                 call:1;
+} ngx_xcgi_tpl_node_t;
+
+
+typedef struct {
+    ngx_str_node_t           sn;
+    ngx_queue_t              queue;
+
+    ngx_file_uniq_t          uniq;
+    time_t                   mtime;
+    off_t                    size;
+
+    ngx_uint_t               count;
+    unsigned                 evicted:1;
+    unsigned                 plain:1;   /* no handler calls */
+
+    ngx_uint_t               nnodes;
+    ngx_xcgi_tpl_node_t     *nodes;
+} ngx_xcgi_template_t;
+
+
+/*
+ * Collects the output of handler calls into a chain of buffers.
+ */
+
+typedef struct {
+    ngx_buf_t                buf;       /* handed to the handler */
+    ngx_http_request_t      *request;
+
+    ngx_buf_t               *tail;      /* the buffer being written */
+    ngx_chain_t             *out;       /* the buffers following buf */
+    ngx_chain_t            **last;
+
+    u_char                  *pos;       /* free space of the last block */
+    u_char                  *end;
+    ngx_xcgi_block_t        *blocks;
+    size_t                   block_size;
+} ngx_xcgi_writer_t;
+
+
+/*
+ * Per-worker counters of the work done by the filter, reported by the
+ * built-in XCGI_Stats handler, which may be called from templates only.
+ */
+
+typedef struct {
+    ngx_uint_t               pages;
+    ngx_uint_t               template_hits;
+    ngx_uint_t               templates;     /* compiled */
+    off_t                    parsed;        /* page bytes scanned for tags */
+    ngx_uint_t               tags;
+    ngx_uint_t               tags_copied;   /* arguments copied from a page */
+    ngx_uint_t               calls;
+    ngx_uint_t               cache_hits;
+    ngx_uint_t               blocks;        /* output blocks allocated */
+    ngx_uint_t               blocks_reused;
+    ngx_uint_t               forms;
+    off_t                    form_bytes;
+} ngx_xcgi_stats_t;
+
+
+typedef struct {
+    ngx_array_t              nodes;     /* of ngx_xcgi_tpl_node_t */
+    ngx_array_t              data;      /* of u_char */
+
+    ngx_str_t                name;
+    ngx_file_uniq_t          uniq;
+    time_t                   mtime;
+    off_t                    size;
+} ngx_xcgi_tpl_builder_t;
+
+
+extern ngx_xcgi_stats_t  ngx_xcgi_stats;
+
+ngx_int_t   ngx_xcgi_private_init(ngx_conf_t *cf);
+
+ngx_int_t   ngx_xcgi_handlers_init(ngx_conf_t *cf);
+
+void  ngx_xcgi_template_init(void);
+
+void  ngx_xcgi_scan_init(ngx_log_t *log);
+extern u_char *(*ngx_xcgi_scan_tag)(u_char *p, u_char *last);
 
 void  ngx_xcgi_register_user_handlers(void);
 
-void  ngx_xcgi_init_xcgi_variable(ngx_http_request_t *r);
+ngx_int_t   ngx_xcgi_set_var_internal(ngx_http_request_t *r, ngx_str_t *name,
+                                      ngx_str_t *value, ngx_uint_t flags);
 
-int   ngx_xcgi_set_var_internal(ngx_http_request_t *r, ngx_xcgi_handler_t *var);
+ngx_xcgi_handler_t *ngx_xcgi_find_handler(ngx_http_request_t *r,
+                                          ngx_str_t *name);
 
 ngx_int_t   ngx_xcgi_call_handler(ngx_str_t *name, ngx_http_request_t *r,
                             ngx_buf_t *b, int argc, char **argv);
 
+ngx_xcgi_template_t *ngx_xcgi_template_lookup(ngx_str_t *name,
+    ngx_open_file_info_t *of, ngx_pool_t *pool);
+ngx_xcgi_tpl_builder_t *ngx_xcgi_template_builder(ngx_str_t *name,
+    ngx_open_file_info_t *of, ngx_pool_t *pool);
+ngx_int_t ngx_xcgi_template_add_literal(ngx_xcgi_tpl_builder_t *tb,
+    u_char *start, u_char *end, off_t offset);
+ngx_int_t ngx_xcgi_template_add_call(ngx_xcgi_tpl_builder_t *tb,
+    ngx_str_t *name, ngx_xcgi_handler_t *handler, int argc, char **argv);
+ngx_int_t ngx_xcgi_template_insert(ngx_xcgi_tpl_builder_t *tb,
+    ngx_log_t *log);
+
+ngx_int_t ngx_xcgi_writer_init(ngx_http_request_t *r, ngx_xcgi_writer_t *w,
+    size_t size);
+ngx_buf_t *ngx_xcgi_writer_begin(ngx_xcgi_writer_t *w);
+ngx_int_t ngx_xcgi_writer_end(ngx_xcgi_writer_t *w, ngx_chain_t ***last);
+ngx_buf_t *ngx_xcgi_write_reserve(ngx_http_request_t *r, ngx_buf_t *b,
+    size_t size);
+
+ngx_int_t ngx_xcgi_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+ngx_int_t ngx_xcgi_cache_lookup(ngx_http_request_t *r,
+    ngx_xcgi_handler_t *h, int argc, char **argv, ngx_str_t *value,
+    ngx_xcgi_cache_lock_t **lockp);
+void ngx_xcgi_cache_update(ngx_xcgi_cache_lock_t *lock, ngx_chain_t *in);
+
+ngx_int_t ngx_xcgi_form_create(ngx_http_request_t *r,
+    ngx_xcgi_handler_t *handler, ngx_xcgi_form_t **formp);
+ngx_int_t ngx_xcgi_form_feed(ngx_http_request_t *r, ngx_xcgi_form_t *form,
+    ngx_chain_t *in);
+ngx_int_t ngx_xcgi_form_finish(ngx_http_request_t *r, ngx_xcgi_form_t *form,
+    u_char *last);
+
 
 #endif /* __NGX_XCGI_PRIVATE_H_INCLUDED__ */
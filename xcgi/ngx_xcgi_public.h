@@ -14,16 +14,103 @@
 typedef int (*ngx_xcgi_pfunc)(ngx_http_request_t *r, ngx_buf_t *b,
                               int argc, char **argv);
 
+/*
+ * A file part of a multipart/form-data form, passed to the upload handler
+ * of the form as its data arrives.
+ */
+
+typedef struct {
+    ngx_str_t            name;
+    ngx_str_t            filename;
+    ngx_str_t            content_type;
+    off_t                size;          /* bytes received so far */
+    void                *data;          /* for use by the upload handler */
+    unsigned             complete:1;    /* the part was fully received */
+} ngx_xcgi_part_t;
+
+/*
+ * Called with each chunk of a file part as it arrives, and once more with
+ * last set when the part ends.  The data is only valid during the call.
+ */
+
+typedef ngx_int_t (*ngx_xcgi_upload_pt)(ngx_http_request_t *r,
+                                        ngx_xcgi_part_t *part,
+                                        u_char *data, size_t len,
+                                        ngx_uint_t last);
+
+/*
+ * A handler may move slow work off the event loop: it allocates a task,
+ * copies what the work needs into task->data, posts the task and returns
+ * NGX_AGAIN.  The task handler is then called in a thread of the pool set
+ * by "xcgi_thread_pool" and must not use the request or its pool.  Once
+ * it returns, the done handler is called in the worker and writes the
+ * output of the handler into b.  Without a thread pool both are called
+ * right away.
+ */
+
+typedef void (*ngx_xcgi_task_pt)(void *data, ngx_log_t *log);
+typedef int (*ngx_xcgi_task_done_pt)(ngx_http_request_t *r, ngx_buf_t *b,
+                                     void *data);
+
+typedef struct {
+    void                    *data;
+    ngx_xcgi_task_pt         handler;
+    ngx_xcgi_task_done_pt    done;
+} ngx_xcgi_task_t;
+
+/*
+ * The output of a cacheable handler depends on its arguments only, so it
+ * may be reused for "valid" seconds by all workers if "xcgi_cache_zone"
+ * is set.  The time may be changed with "xcgi_cache_valid".
+ */
+
+#define NGX_XCGI_CACHEABLE   0x01
+
+/*
+ * A template only handler is not called by /XCGI_Form/ requests, which
+ * any client may send; such requests are rejected with 404.
+ */
+
+#define NGX_XCGI_NO_FORM     0x02
+
 typedef struct ngx_xcgi_handler_s ngx_xcgi_handler_t;
 
+/*
+ * Formats a JSON document into the output of a handler, e.g.
+ *
+ *     ngx_xcgi_json_init(&js, r, b);
+ *     ngx_xcgi_json_object(&js);
+ *     ngx_xcgi_json_key(&js, "name");
+ *     ngx_xcgi_json_str(&js, &name);
+ *     ngx_xcgi_json_object_end(&js);
+ *
+ *     return ngx_xcgi_json_done(&js);
+ *
+ * Strings are escaped as they are copied.  ngx_xcgi_json_done() returns
+ * the bytes written, or -1 if the output failed or is not a document.
+ */
+
+#define NGX_XCGI_JSON_MAX_DEPTH  31
+
+typedef struct {
+    ngx_http_request_t  *request;
+    ngx_buf_t           *buf;
+    int                  n;             /* bytes written, -1 on error */
+    ngx_uint_t           depth;
+    uint32_t             first;         /* levels without values yet */
+    uint32_t             arrays;        /* levels which are arrays */
+    unsigned             key:1;         /* a key waits for its value */
+} ngx_xcgi_json_t;
+
 struct ngx_xcgi_handler_s {
-    ngx_xcgi_handler_t  *next;
-    ngx_xcgi_handler_t  *prev;
     ngx_str_t            name;
     union {
         ngx_xcgi_pfunc   func;
         char            *value;
     } data;
+    ngx_xcgi_upload_pt   upload;        /* optional, /XCGI_Form/ only */
+    ngx_uint_t           flags;
+    time_t               valid;
 };
 
 
@@ -33,17 +120,56 @@ struct ngx_xcgi_handler_s {
 
 char* ngx_xcgi_get_var(ngx_http_request_t *r, char *name, char *default_value);
 
+ngx_int_t ngx_xcgi_get_var_str(ngx_http_request_t *r, ngx_str_t *name,
+                               ngx_str_t *value);
+
 int   ngx_xcgi_set_var(ngx_http_request_t *r, const char *name,
                        const char *value);
 
 int   ngx_xcgi_write(ngx_http_request_t *r, ngx_buf_t *b, char *fmt, ...);
 
+/*
+ * Append data to the output without formatting.  Long strings and the
+ * buffer are linked into the output as is, so they must stay valid until
+ * the response is sent; a file buffer is sent only if sendfile is on.
+ */
+
+int   ngx_xcgi_write_str(ngx_http_request_t *r, ngx_buf_t *b, u_char *data,
+                         size_t len);
+
+int   ngx_xcgi_write_buf(ngx_http_request_t *r, ngx_buf_t *b, ngx_buf_t *buf);
+
+void  ngx_xcgi_json_init(ngx_xcgi_json_t *js, ngx_http_request_t *r,
+                         ngx_buf_t *b);
+void  ngx_xcgi_json_object(ngx_xcgi_json_t *js);
+void  ngx_xcgi_json_object_end(ngx_xcgi_json_t *js);
+void  ngx_xcgi_json_array(ngx_xcgi_json_t *js);
+void  ngx_xcgi_json_array_end(ngx_xcgi_json_t *js);
+void  ngx_xcgi_json_key(ngx_xcgi_json_t *js, const char *key);
+void  ngx_xcgi_json_int(ngx_xcgi_json_t *js, int64_t value);
+void  ngx_xcgi_json_uint(ngx_xcgi_json_t *js, uint64_t value);
+void  ngx_xcgi_json_bool(ngx_xcgi_json_t *js, ngx_uint_t value);
+void  ngx_xcgi_json_null(ngx_xcgi_json_t *js);
+void  ngx_xcgi_json_string(ngx_xcgi_json_t *js, const char *value);
+void  ngx_xcgi_json_str(ngx_xcgi_json_t *js, ngx_str_t *value);
+int   ngx_xcgi_json_done(ngx_xcgi_json_t *js);
+
+ngx_xcgi_task_t *ngx_xcgi_task_alloc(ngx_http_request_t *r, size_t size);
+
+ngx_int_t ngx_xcgi_task_post(ngx_http_request_t *r, ngx_buf_t *b,
+                             ngx_xcgi_task_t *task);
+
 void  ngx_xcgi_register_handlers(ngx_xcgi_handler_t *handlers, int n);
 
 /*
  * The end user should implement ngx_xcgi_register_user_handlers to register
  * all handlers for your web application based on nginx_http_xcgi_module.
  * Please reference ngx_xcgi_example_handlers.c
+ *
+ * The same function exported from a shared object is called for each
+ * "xcgi_library", and its handlers replace the built in ones of the same
+ * name.  The handlers and their table should be static there, so that a
+ * new version of the library does not bind to the old one on reload.
  */
 
 void  ngx_xcgi_register_user_handlers(void);
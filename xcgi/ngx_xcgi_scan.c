@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) lurenfu@qq.com
+ */
+
+#include "ngx_xcgi_private.h"
+
+#if (NGX_XCGI_HAVE_AVX2)
+#include <immintrin.h>
+#elif (NGX_XCGI_HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
+
+/*
+ * Plain HTML has a '<' every few dozens of bytes, so the template scan
+ * looks for the "<%" pair instead, 16 or 32 bytes at a time where SSE2
+ * or AVX2 is available.  A '<' in the last byte of the buffer is always
+ * returned, as the '%' may start the next buffer.
+ */
+
+static u_char *ngx_xcgi_scan_tag_scalar(u_char *p, u_char *last);
+#if (NGX_XCGI_HAVE_SSE2)
+static u_char *ngx_xcgi_scan_tag_sse2(u_char *p, u_char *last);
+#endif
+#if (NGX_XCGI_HAVE_AVX2)
+static u_char *ngx_xcgi_scan_tag_avx2(u_char *p, u_char *last);
+#endif
+
+
+u_char *(*ngx_xcgi_scan_tag)(u_char *p, u_char *last)
+    = ngx_xcgi_scan_tag_scalar;
+
+
+void
+ngx_xcgi_scan_init(ngx_log_t *log)
+{
+#if (NGX_XCGI_HAVE_AVX2)
+
+    if (__builtin_cpu_supports("avx2")) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "xcgi tag scan: avx2");
+        ngx_xcgi_scan_tag = ngx_xcgi_scan_tag_avx2;
+        return;
+    }
+
+#endif
+
+#if (NGX_XCGI_HAVE_SSE2)
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "xcgi tag scan: sse2");
+    ngx_xcgi_scan_tag = ngx_xcgi_scan_tag_sse2;
+
+#endif
+}
+
+
+static u_char *
+ngx_xcgi_scan_tag_scalar(u_char *p, u_char *last)
+{
+    while (p < last) {
+        if (*p++ != '<') {
+            continue;
+        }
+
+        if (p == last || *p == '%') {
+            return p - 1;
+        }
+    }
+
+    return last;
+}
+
+
+#if (NGX_XCGI_HAVE_SSE2)
+
+static u_char *
+ngx_xcgi_scan_tag_sse2(u_char *p, u_char *last)
+{
+    int      mask;
+    __m128i  lt, pc, a, b;
+
+    lt = _mm_set1_epi8('<');
+    pc = _mm_set1_epi8('%');
+
+    /* the second load reads up to p[16] */
+
+    while (last - p > 16) {
+        a = _mm_loadu_si128((__m128i *) p);
+        b = _mm_loadu_si128((__m128i *) (p + 1));
+
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, lt),
+                                               _mm_cmpeq_epi8(b, pc)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return ngx_xcgi_scan_tag_scalar(p, last);
+}
+
+#endif
+
+
+#if (NGX_XCGI_HAVE_AVX2)
+
+__attribute__ ((target ("avx2"))) static u_char *
+ngx_xcgi_scan_tag_avx2(u_char *p, u_char *last)
+{
+    int      mask;
+    __m256i  lt, pc, a, b;
+
+    lt = _mm256_set1_epi8('<');
+    pc = _mm256_set1_epi8('%');
+
+    while (last - p > 32) {
+        a = _mm256_loadu_si256((__m256i *) p);
+        b = _mm256_loadu_si256((__m256i *) (p + 1));
+
+        mask = _mm256_movemask_epi8(_mm256_and_si256(
+                                        _mm256_cmpeq_epi8(a, lt),
+                                        _mm256_cmpeq_epi8(b, pc)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+
+    return ngx_xcgi_scan_tag_sse2(p, last);
+}
+
+#endif
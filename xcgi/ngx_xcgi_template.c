@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) lurenfu@qq.com
+ */
+
+#include "ngx_xcgi_private.h"
+
+
+/*
+ * Per-worker cache of compiled templates, keyed by file name and
+ * validated against the file identity reported by ngx_open_cached_file().
+ * Templates are referenced by the responses still being sent, so an
+ * evicted template is freed only after the last such response finished.
+ */
+
+typedef struct {
+    ngx_rbtree_t             rbtree;
+    ngx_rbtree_node_t        sentinel;
+    ngx_queue_t              queue;
+    ngx_uint_t               current;
+} ngx_xcgi_template_cache_t;
+
+
+static void ngx_xcgi_template_cleanup(void *data);
+static void ngx_xcgi_template_evict(ngx_xcgi_template_t *tpl);
+
+
+static ngx_xcgi_template_cache_t  ngx_xcgi_template_cache;
+
+
+void
+ngx_xcgi_template_init(void)
+{
+    ngx_rbtree_init(&ngx_xcgi_template_cache.rbtree,
+                    &ngx_xcgi_template_cache.sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&ngx_xcgi_template_cache.queue);
+
+    ngx_xcgi_template_cache.current = 0;
+}
+
+
+ngx_xcgi_template_t *
+ngx_xcgi_template_lookup(ngx_str_t *name, ngx_open_file_info_t *of,
+    ngx_pool_t *pool)
+{
+    uint32_t              hash;
+    ngx_str_node_t       *sn;
+    ngx_pool_cleanup_t   *cln;
+    ngx_xcgi_template_t  *tpl;
+
+    hash = ngx_crc32_long(name->data, name->len);
+
+    sn = ngx_str_rbtree_lookup(&ngx_xcgi_template_cache.rbtree, name, hash);
+    if (sn == NULL) {
+        return NULL;
+    }
+
+    tpl = (ngx_xcgi_template_t *) sn;
+
+    if (tpl->uniq != of->uniq
+        || tpl->mtime != of->mtime
+        || tpl->size != of->size)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pool->log, 0,
+                       "xcgi template \"%V\" is stale", name);
+
+        ngx_xcgi_template_evict(tpl);
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    cln->handler = ngx_xcgi_template_cleanup;
+    cln->data = tpl;
+
+    tpl->count++;
+
+    ngx_queue_remove(&tpl->queue);
+    ngx_queue_insert_head(&ngx_xcgi_template_cache.queue, &tpl->queue);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pool->log, 0,
+                   "xcgi template \"%V\" hit, %ui nodes", name, tpl->nnodes);
+
+    return tpl;
+}
+
+
+ngx_xcgi_tpl_builder_t *
+ngx_xcgi_template_builder(ngx_str_t *name, ngx_open_file_info_t *of,
+    ngx_pool_t *pool)
+{
+    ngx_xcgi_tpl_builder_t  *tb;
+
+    if (of->size > NGX_XCGI_TEMPLATE_MAX_SIZE) {
+        return NULL;
+    }
+
+    tb = ngx_palloc(pool, sizeof(ngx_xcgi_tpl_builder_t));
+    if (tb == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&tb->nodes, pool, 16, sizeof(ngx_xcgi_tpl_node_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&tb->data, pool, (ngx_uint_t) of->size + 1, 1)
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    tb->name = *name;
+    tb->uniq = of->uniq;
+    tb->mtime = of->mtime;
+    tb->size = of->size;
+
+    return tb;
+}
+
+
+ngx_int_t
+ngx_xcgi_template_add_literal(ngx_xcgi_tpl_builder_t *tb, u_char *start,
+    u_char *end, off_t offset)
+{
+    size_t                len;
+    u_char               *p;
+    ngx_xcgi_tpl_node_t  *node;
+
+    len = end - start;
+
+    if (len == 0) {
+        return NGX_OK;
+    }
+
+    node = tb->nodes.nelts ? (ngx_xcgi_tpl_node_t *) tb->nodes.elts
+                             + tb->nodes.nelts - 1
+                           : NULL;
+
+    /* a literal node is also a single range of the file */
+
+    if (node == NULL
+        || node->call
+        || node->offset + (off_t) node->text.len != offset)
+    {
+        node = ngx_array_push(&tb->nodes);
+        if (node == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(node, sizeof(ngx_xcgi_tpl_node_t));
+
+        node->offset = offset;
+    }
+
+    p = ngx_array_push_n(&tb->data, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(p, start, len);
+
+    node->text.len += len;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_xcgi_template_add_call(ngx_xcgi_tpl_builder_t *tb, ngx_str_t *name,
+    ngx_xcgi_handler_t *handler, int argc, char **argv)
+{
+    int                   i;
+    size_t                len;
+    u_char               *p;
+    ngx_xcgi_tpl_node_t  *node;
+
+    node = ngx_array_push(&tb->nodes);
+    if (node == NULL) {
+        return NGX_ERROR;
+    }
+
+    node->text.len = name->len;
+    node->text.data = NULL;
+    node->offset = 0;
+    node->handler = handler;
+    node->argc = argc;
+    node->argv = NULL;
+    node->call = 1;
+
+    p = ngx_array_push_n(&tb->data, name->len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(p, name->data, name->len);
+
+    for (i = 0; i < argc; i++) {
+        len = ngx_strlen(argv[i]) + 1;
+
+        p = ngx_array_push_n(&tb->data, len);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(p, argv[i], len);
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_xcgi_template_insert(ngx_xcgi_tpl_builder_t *tb, ngx_log_t *log)
+{
+    int                   i;
+    size_t                size, nargs, len;
+    u_char               *p;
+    char                **argv;
+    uint32_t              hash;
+    ngx_uint_t            n, nnodes, ncalls;
+    ngx_queue_t          *q;
+    ngx_str_node_t       *sn;
+    ngx_xcgi_tpl_node_t  *node;
+    ngx_xcgi_template_t  *tpl;
+
+    hash = ngx_crc32_long(tb->name.data, tb->name.len);
+
+    sn = ngx_str_rbtree_lookup(&ngx_xcgi_template_cache.rbtree, &tb->name,
+                               hash);
+    if (sn) {
+        /* compiled concurrently by another response */
+        return NGX_OK;
+    }
+
+    node = tb->nodes.elts;
+    nargs = 0;
+    ncalls = 0;
+
+    for (n = 0; n < tb->nodes.nelts; n++) {
+        nargs += node[n].argc;
+        ncalls += node[n].call;
+    }
+
+    /* a page without calls is sent as is, only its identity is kept */
+
+    nnodes = ncalls ? tb->nodes.nelts : 0;
+    len = ncalls ? tb->data.nelts : 0;
+
+    size = sizeof(ngx_xcgi_template_t)
+           + nnodes * sizeof(ngx_xcgi_tpl_node_t)
+           + nargs * sizeof(char *)
+           + len
+           + tb->name.len;
+
+    tpl = ngx_alloc(size, log);
+    if (tpl == NULL) {
+        return NGX_ERROR;
+    }
+
+    tpl->nodes = (ngx_xcgi_tpl_node_t *) (tpl + 1);
+    tpl->nnodes = nnodes;
+
+    ngx_memcpy(tpl->nodes, node, nnodes * sizeof(ngx_xcgi_tpl_node_t));
+
+    argv = (char **) (tpl->nodes + tpl->nnodes);
+    p = (u_char *) (argv + nargs);
+
+    ngx_memcpy(p, tb->data.elts, len);
+
+    node = tpl->nodes;
+
+    for (n = 0; n < tpl->nnodes; n++) {
+        node[n].text.data = p;
+        p += node[n].text.len;
+
+        if (!node[n].call) {
+            continue;
+        }
+
+        node[n].argv = argv;
+
+        for (i = 0; i < node[n].argc; i++) {
+            *argv++ = (char *) p;
+            p += ngx_strlen(p) + 1;
+        }
+    }
+
+    tpl->sn.str.data = ngx_cpymem(p, tb->name.data, tb->name.len)
+                       - tb->name.len;
+    tpl->sn.str.len = tb->name.len;
+    tpl->sn.node.key = hash;
+
+    tpl->uniq = tb->uniq;
+    tpl->mtime = tb->mtime;
+    tpl->size = tb->size;
+    tpl->count = 0;
+    tpl->evicted = 0;
+    tpl->plain = (ncalls == 0);
+
+    if (ngx_xcgi_template_cache.current >= NGX_XCGI_TEMPLATE_CACHE_MAX) {
+        q = ngx_queue_last(&ngx_xcgi_template_cache.queue);
+        ngx_xcgi_template_evict(ngx_queue_data(q, ngx_xcgi_template_t,
+                                               queue));
+    }
+
+    ngx_rbtree_insert(&ngx_xcgi_template_cache.rbtree, &tpl->sn.node);
+    ngx_queue_insert_head(&ngx_xcgi_template_cache.queue, &tpl->queue);
+    ngx_xcgi_template_cache.current++;
+
+    ngx_xcgi_stats.templates++;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "xcgi template \"%V\" compiled, %ui nodes, %uz bytes",
+                   &tpl->sn.str, tpl->nnodes, size);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_xcgi_template_evict(ngx_xcgi_template_t *tpl)
+{
+    ngx_rbtree_delete(&ngx_xcgi_template_cache.rbtree, &tpl->sn.node);
+    ngx_queue_remove(&tpl->queue);
+    ngx_xcgi_template_cache.current--;
+
+    if (tpl->count) {
+        tpl->evicted = 1;
+        return;
+    }
+
+    ngx_free(tpl);
+}
+
+
+static void
+ngx_xcgi_template_cleanup(void *data)
+{
+    ngx_xcgi_template_t  *tpl = data;
+
+    if (--tpl->count == 0 && tpl->evicted) {
+        ngx_free(tpl);
+    }
+}
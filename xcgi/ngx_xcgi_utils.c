@@ -4,252 +4,561 @@
 
 #include "ngx_xcgi_private.h"
 
-static ngx_xcgi_handler_t
-                g_xcgi_handler_hash_table[NGX_XCGI_HANDLER_HASH_TABLE_SIZE];
+/*
+ * Handlers are collected while the configuration is parsed and frozen
+ * into the handlers hash of the main configuration afterwards.  Each
+ * configuration gets its own copies, as directives may change them.
+ */
+static ngx_array_t  *ngx_xcgi_handler_keys;
+static ngx_pool_t   *ngx_xcgi_handler_pool;
+
+static int ngx_xcgi_stats_handler(ngx_http_request_t *r, ngx_buf_t *b,
+    int argc, char **argv);
+
+static ngx_xcgi_handler_t  ngx_xcgi_builtin_handlers[] = {
+    {
+        .name = ngx_string("XCGI_Stats"),
+        .data.func = ngx_xcgi_stats_handler,
+        .flags = NGX_XCGI_NO_FORM,
+    },
+};
 
-static ngx_uint_t ngx_xcgi_hash(ngx_str_t *str)
+ngx_xcgi_stats_t  ngx_xcgi_stats;
+
+void ngx_xcgi_register_handlers(ngx_xcgi_handler_t *h, int n)
 {
-    ngx_uint_t hash = 0;
+    int                  i;
+    ngx_uint_t           k;
+    ngx_hash_key_t      *hk;
+    ngx_xcgi_handler_t  *copy;
+
+    if (ngx_xcgi_handler_keys == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "xcgi handlers registered outside of configuration");
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (h[i].name.len == 0 || h[i].name.len > NGX_XCGI_HANDLER_NAME_LEN) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "xcgi handler name \"%V\" is invalid", &h[i].name);
+            continue;
+        }
 
-    for (size_t i=0; i < str->len; i++) {
-        if (!(i&1)) {
-            hash ^= ((hash << 7) ^ (str->data[i]) ^ (hash >> 3));
-        } else {
-            hash ^= (~((hash << 11) ^ (str->data[i]) ^ (hash >> 5)));
+        copy = ngx_palloc(ngx_xcgi_handler_pool, sizeof(ngx_xcgi_handler_t));
+        if (copy == NULL) {
+            return;
+        }
+
+        *copy = h[i];
+
+        /* a handler of a library replaces the one built in */
+
+        hk = ngx_xcgi_handler_keys->elts;
+
+        for (k = 0; k < ngx_xcgi_handler_keys->nelts; k++) {
+            if (hk[k].key.len == h[i].name.len
+                && ngx_strncmp(hk[k].key.data, h[i].name.data,
+                               h[i].name.len)
+                   == 0)
+            {
+                break;
+            }
         }
-    }
 
-    return (hash & (NGX_XCGI_HANDLER_HASH_TABLE_SIZE-1));
+        if (k < ngx_xcgi_handler_keys->nelts) {
+            hk[k].value = copy;
+            continue;
+        }
+
+        hk = ngx_array_push(ngx_xcgi_handler_keys);
+        if (hk == NULL) {
+            return;
+        }
+
+        hk->key = h[i].name;
+        hk->key_hash = ngx_hash_key(h[i].name.data, h[i].name.len);
+        hk->value = copy;
+    }
 }
 
-static ngx_uint_t ngx_xcgi_hash_str(char *str)
+/*
+ * Request variables live in a small open addressing table which starts
+ * inline in the store and doubles on demand.  Values may reference the
+ * request body in place; they are URL-decoded in place on first read.
+ */
+
+static ngx_xcgi_var_t *ngx_xcgi_vars_find(ngx_xcgi_vars_t *vars,
+    u_char *name, size_t len, ngx_uint_t hash);
+static ngx_int_t ngx_xcgi_vars_grow(ngx_http_request_t *r,
+    ngx_xcgi_vars_t *vars);
+static size_t ngx_xcgi_unescape_value(u_char *value, size_t len);
+
+static ngx_xcgi_var_t *ngx_xcgi_vars_find(ngx_xcgi_vars_t *vars,
+    u_char *name, size_t len, ngx_uint_t hash)
 {
-    ngx_str_t   ngxstr;
+    ngx_uint_t       i, mask;
+    ngx_xcgi_var_t  *var;
+
+    mask = vars->size - 1;
 
-    ngxstr.data = (u_char *)str;
-    ngxstr.len = strlen(str);
-    return ngx_xcgi_hash(&ngxstr);
+    for (i = hash & mask; /* void */ ; i = (i + 1) & mask) {
+        var = &vars->slots[i];
+
+        if (var->name.data == NULL) {
+            return var;
+        }
+
+        if (var->hash == hash
+            && var->name.len == len
+            && ngx_strncmp(var->name.data, name, len) == 0)
+        {
+            return var;
+        }
+    }
 }
 
-void ngx_xcgi_register_handlers(ngx_xcgi_handler_t *h, int n)
+static ngx_int_t ngx_xcgi_vars_grow(ngx_http_request_t *r,
+    ngx_xcgi_vars_t *vars)
 {
-    int             i;
-    ngx_uint_t      key;
+    ngx_uint_t       i, size;
+    ngx_xcgi_var_t  *old, *var;
 
-    for (i = 0; i < n; i++) {
-        key = ngx_xcgi_hash(&h[i].name);
-        h[i].next = &g_xcgi_handler_hash_table[key];
-        h[i].prev = g_xcgi_handler_hash_table[key].prev;
-        g_xcgi_handler_hash_table[key].prev->next = h+i;
-        g_xcgi_handler_hash_table[key].prev = h+i;
+    old = vars->slots;
+    size = vars->size;
+
+    vars->slots = ngx_pcalloc(r->pool, 2 * size * sizeof(ngx_xcgi_var_t));
+    if (vars->slots == NULL) {
+        vars->slots = old;
+        return NGX_ERROR;
     }
+
+    vars->size = 2 * size;
+
+    for (i = 0; i < size; i++) {
+        if (old[i].name.data == NULL) {
+            continue;
+        }
+
+        var = ngx_xcgi_vars_find(vars, old[i].name.data, old[i].name.len,
+                                 old[i].hash);
+        *var = old[i];
+    }
+
+    if (old != vars->inline_slots) {
+        ngx_pfree(r->pool, old);
+    }
+
+    return NGX_OK;
 }
 
-static void ngx_xcgi_unescape_value(ngx_http_request_t *r, char *value)
+static size_t ngx_xcgi_unescape_value(u_char *value, size_t len)
 {
-    int     i, j, len;
-    char    *str, c1, c2, ch;
+    u_char  *src, *dst, *last, c1, c2;
 
-    if ((!strchr(value, '%') )&&( !strchr(value, '+'))) {
-        return;
-    }
+    src = value;
+    dst = value;
+    last = value + len;
 
-    len = (int)strlen(value);
-    str = ngx_palloc(r->pool, len+1);
-    memcpy(str, value, len);
-    str[len] = 0;
+    while (src < last) {
 
-    i = j = 0;
-    while (str[i] != 0) {
-        if (str[i] != '%') {
-            if(str[i] == '+') {
-                value[j++] = ' ';
-                i++;
-            } else {
-                value[j++] = str[i++];
-            }
-        } else {
-            c1 = str[i+1];
-            c2 = str[i+2];
-            if (c1 >= '0' && c1 <= '9') {
-                c1 -= '0';
-            } else if (c1 >= 'a' && c1 <= 'f') {
-                c1 = c1 - 'a' + 10;
-            } else if (c1 >= 'A' && c1 <= 'F') {
-                c1 = c1 - 'A' + 10;
-            }
+        if (*src == '+') {
+            *dst++ = ' ';
+            src++;
+            continue;
+        }
 
-            if (c2 >= '0' && c2 <= '9') {
-                c2 -= '0';
-            } else if (c2 >= 'a' && c2 <= 'f') {
-                c2 = c2 - 'a' + 10;
-            } else if (c2 >= 'A' && c2 <= 'F') {
-                c2 = c2 - 'A' + 10;
-            }
+        if (*src != '%' || last - src < 3) {
+            *dst++ = *src++;
+            continue;
+        }
 
-            ch = ((c1&0xf)<<4)|(c2&0xf);
-            value[j++] = ch;
-            i += 3;
+        c1 = (u_char) (src[1] | 0x20);
+        c2 = (u_char) (src[2] | 0x20);
+
+        if (!((c1 >= '0' && c1 <= '9') || (c1 >= 'a' && c1 <= 'f'))
+            || !((c2 >= '0' && c2 <= '9') || (c2 >= 'a' && c2 <= 'f')))
+        {
+            *dst++ = *src++;
+            continue;
         }
+
+        c1 = (c1 <= '9') ? c1 - '0' : c1 - 'a' + 10;
+        c2 = (c2 <= '9') ? c2 - '0' : c2 - 'a' + 10;
+
+        *dst++ = (u_char) ((c1 << 4) | c2);
+        src += 3;
     }
-    value[j] = 0;
-    ngx_pfree(r->pool, str);
+
+    return dst - value;
 }
 
-int ngx_xcgi_set_var_internal(ngx_http_request_t *r, ngx_xcgi_handler_t *var)
+ngx_int_t ngx_xcgi_set_var_internal(ngx_http_request_t *r, ngx_str_t *name,
+                                    ngx_str_t *value, ngx_uint_t flags)
 {
-    ngx_xcgi_handler_t *p = (ngx_xcgi_handler_t *)r->xcgi_var;
-    ngx_uint_t          key = ngx_xcgi_hash(&var->name);;
+    ngx_uint_t        hash;
+    ngx_xcgi_var_t   *var;
+    ngx_xcgi_vars_t  *vars;
 
-    if (!p) {
-        return -1;
+    vars = r->xcgi_var;
+
+    if (vars == NULL) {
+        vars = ngx_palloc(r->pool, sizeof(ngx_xcgi_vars_t));
+        if (vars == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(vars->inline_slots, sizeof(vars->inline_slots));
+
+        vars->slots = vars->inline_slots;
+        vars->size = NGX_XCGI_VARS_INLINE;
+        vars->nelts = 0;
+
+        r->xcgi_var = vars;
     }
 
-    ngx_xcgi_unescape_value(r, var->data.value);
+    if (4 * (vars->nelts + 1) > 3 * vars->size
+        && ngx_xcgi_vars_grow(r, vars) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
-    var->prev = &p[key];
-    var->next = p[key].next;
-    p[key].next->prev = var;
-    p[key].next = var;
+    hash = ngx_hash_key(name->data, name->len);
 
-    return 0;
+    var = ngx_xcgi_vars_find(vars, name->data, name->len, hash);
+
+    if (var->name.data == NULL) {
+        vars->nelts++;
+    }
+
+    var->name = *name;
+    var->value = *value;
+    var->hash = hash;
+    var->decoded = (flags & NGX_XCGI_VAR_RAW) ? 1 : 0;
+    var->spare = (flags & NGX_XCGI_VAR_SPARE) ? 1 : 0;
+
+    return NGX_OK;
 }
 
 int ngx_xcgi_set_var(ngx_http_request_t *r, const char *name, const char *value)
 {
-    ngx_xcgi_handler_t  *var;
+    u_char     *p;
+    ngx_str_t   n, v;
 
     if (!r || !name || !value) {
         return -1;
     }
 
-    var = ngx_pcalloc(r->pool, sizeof(ngx_xcgi_handler_t));
-    if (!var) {
+    n.len = ngx_strlen(name);
+    v.len = ngx_strlen(value);
+
+    p = ngx_pnalloc(r->pool, n.len + v.len + 1);
+    if (p == NULL) {
         return -1;
     }
 
-    var->name.len = strlen(name);
-    var->name.data = ngx_pcalloc(r->pool, var->name.len);
-    if (!var->name.data) {
+    n.data = p;
+    v.data = ngx_cpymem(p, name, n.len);
+    ngx_memcpy(v.data, value, v.len);
+
+    if (ngx_xcgi_set_var_internal(r, &n, &v, NGX_XCGI_VAR_SPARE) != NGX_OK) {
         return -1;
     }
-    memcpy(var->name.data, name, var->name.len);
 
-    var->data.value = ngx_pcalloc(r->pool, strlen(value)+1);
-    if (!var->data.value) {
-        return -1;
+    return 0;
+}
+
+static ngx_xcgi_var_t *ngx_xcgi_lookup_var(ngx_http_request_t *r,
+    u_char *name, size_t len)
+{
+    ngx_xcgi_var_t   *var;
+    ngx_xcgi_vars_t  *vars;
+
+    vars = r->xcgi_var;
+
+    if (vars == NULL) {
+        return NULL;
+    }
+
+    var = ngx_xcgi_vars_find(vars, name, len, ngx_hash_key(name, len));
+
+    if (var->name.data == NULL) {
+        return NULL;
+    }
+
+    if (!var->decoded) {
+        var->value.len = ngx_xcgi_unescape_value(var->value.data,
+                                                 var->value.len);
+        var->decoded = 1;
+    }
+
+    return var;
+}
+
+ngx_int_t ngx_xcgi_get_var_str(ngx_http_request_t *r, ngx_str_t *name,
+                               ngx_str_t *value)
+{
+    ngx_xcgi_var_t  *var;
+
+    var = ngx_xcgi_lookup_var(r, name->data, name->len);
+
+    if (var == NULL) {
+        return NGX_DECLINED;
     }
-    strcpy(var->data.value, value);
 
-    return ngx_xcgi_set_var_internal(r, var);
+    *value = var->value;
+
+    return NGX_OK;
 }
 
 char *ngx_xcgi_get_var(ngx_http_request_t *r, char *name, char *default_value)
 {
-    if (r->xcgi_var)
-    {
-        ngx_uint_t      key = ngx_xcgi_hash_str(name);
-        ngx_xcgi_handler_t   *h = ((ngx_xcgi_handler_t *)r->xcgi_var) + key;
-        ngx_xcgi_handler_t   *p = h->next;
+    u_char          *p;
+    ngx_xcgi_var_t  *var;
 
-        while(p != h) {
-            if (p->name.len == strlen(name) &&
-                !ngx_strncmp(p->name.data, name, p->name.len))
-            {
-                return p->data.value;
-            }
-            p = p->next;
+    var = ngx_xcgi_lookup_var(r, (u_char *) name, ngx_strlen(name));
+
+    if (var == NULL) {
+        return default_value;
+    }
+
+    if (!var->spare) {
+        p = ngx_pnalloc(r->pool, var->value.len + 1);
+        if (p == NULL) {
+            return default_value;
         }
+
+        ngx_memcpy(p, var->value.data, var->value.len);
+
+        var->value.data = p;
+        var->spare = 1;
     }
 
-    return default_value;
+    var->value.data[var->value.len] = '\0';
+
+    return (char *) var->value.data;
+}
+
+/*
+ * Handler names are matched exactly: the keys are hashed case included,
+ * and as ngx_hash_init() lowercases the names it stores, the bucket is
+ * walked comparing the names of the handlers themselves.
+ */
+
+ngx_xcgi_handler_t *ngx_xcgi_find_handler(ngx_http_request_t *r,
+                                          ngx_str_t *name)
+{
+    ngx_hash_t                 *hash;
+    ngx_hash_elt_t             *elt;
+    ngx_xcgi_handler_t         *h;
+    ngx_http_xcgi_main_conf_t  *xmcf;
+
+    xmcf = ngx_http_get_module_main_conf(r, ngx_http_xcgi_filter_module);
+
+    hash = &xmcf->handlers_hash;
+
+    elt = hash->buckets[ngx_hash_key(name->data, name->len) % hash->size];
+
+    if (elt == NULL) {
+        return NULL;
+    }
+
+    while (elt->value) {
+        h = elt->value;
+
+        if (h->name.len == name->len
+            && ngx_strncmp(h->name.data, name->data, name->len) == 0)
+        {
+            return h;
+        }
+
+        elt = (ngx_hash_elt_t *) ngx_align_ptr(&elt->name[0] + elt->len,
+                                               sizeof(void *));
+    }
+
+    return NULL;
 }
 
 ngx_int_t ngx_xcgi_call_handler(ngx_str_t *name, ngx_http_request_t *r,
                                 ngx_buf_t *b, int argc, char **argv)
 {
-    ngx_uint_t      key = ngx_xcgi_hash(name);
-    ngx_xcgi_handler_t   *p = g_xcgi_handler_hash_table[key].next;
+    ngx_xcgi_handler_t  *h;
+
+    h = ngx_xcgi_find_handler(r, name);
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "ngx_xcgi_call_handler key=%d, name=\"%V\"", key, name);
+                   "ngx_xcgi_call_handler name=\"%V\" found=%d",
+                   name, h != NULL);
 
-    while (p != &g_xcgi_handler_hash_table[key]) {
-        if (p->name.len == name->len &&
-            !ngx_strncmp(p->name.data, name->data, name->len))
-        {
-            if (p->data.func) {
-                return (*p->data.func)(r, b, argc, argv);
-            }
-            return NGX_OK;
-        }
-        p = p->next;
+    if (h == NULL || h->data.func == NULL) {
+        return NGX_ERROR;
     }
 
-    return NGX_ERROR;
+    return h->data.func(r, b, argc, argv);
 }
 
-int ngx_xcgi_write(ngx_http_request_t *r, ngx_buf_t *b, char *fmt, ...)
+ngx_int_t ngx_xcgi_private_init(ngx_conf_t *cf)
 {
-    va_list     args;
-    char        str[4096];
-    int         slen, bleft, blen, bsize;
-
-    va_start(args, fmt);
-    slen = vsnprintf(str, sizeof(str)-1, fmt, args);
-    va_end(args);
-    blen = b->last - b->start;
-    bleft = b->end - b->last;
-    bsize = b->end - b->start;
-    if (slen > bleft) {
-        void    *nbuf = ngx_palloc(r->pool, bsize<<1);
-        if (nbuf) {
-            ngx_memcpy(nbuf, b->start, blen);
-            ngx_pfree(r->pool, b->start);
-            b->start = nbuf;
-            b->pos = b->start;
-            b->last = b->start + blen;
-            b->end = b->start + (bsize<<1);
-            bleft += bsize;
-        }
-    }
-
-    if (slen > bleft) {
-        slen = bleft;
-    }
-
-    b->last = ngx_cpymem(b->last, str, slen);
-    return slen;
+    ngx_http_xcgi_main_conf_t  *xmcf;
+
+    xmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_xcgi_filter_module);
+
+    ngx_xcgi_template_init();
+
+    ngx_xcgi_scan_init(cf->log);
+
+    ngx_xcgi_handler_keys = &xmcf->handlers;
+    ngx_xcgi_handler_pool = cf->pool;
+
+    ngx_xcgi_register_handlers(ngx_xcgi_builtin_handlers,
+                               sizeof(ngx_xcgi_builtin_handlers)
+                               / sizeof(ngx_xcgi_builtin_handlers[0]));
+
+    ngx_xcgi_register_user_handlers();
+
+    return NGX_OK;
 }
 
-void ngx_xcgi_init_xcgi_variable(ngx_http_request_t *r)
+ngx_int_t ngx_xcgi_handlers_init(ngx_conf_t *cf)
 {
-    if (NULL == r->xcgi_var) {
-        r->xcgi_var = ngx_pcalloc(r->pool,
-                NGX_XCGI_HANDLER_HASH_TABLE_SIZE*sizeof(ngx_xcgi_handler_t));
+    size_t                      len;
+    ngx_uint_t                  i, n;
+    ngx_hash_key_t             *hk;
+    ngx_hash_init_t             hash;
+    ngx_xcgi_handler_t         *h;
+    ngx_xcgi_cache_valid_t     *cv;
+    ngx_http_xcgi_main_conf_t  *xmcf;
+
+    xmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_xcgi_filter_module);
+
+    ngx_xcgi_handler_keys = NULL;
+    ngx_xcgi_handler_pool = NULL;
 
-        if (r->xcgi_var) {
-            int              i;
-            ngx_xcgi_handler_t  *var = (ngx_xcgi_handler_t *)r->xcgi_var;
+    /* "xcgi_cache_valid" applies to the handlers registered so far */
 
-            for (i = 0; i < NGX_XCGI_HANDLER_HASH_TABLE_SIZE; i++) {
-                var[i].prev = var[i].next = &var[i];
+    cv = xmcf->cache_valid ? xmcf->cache_valid->elts : NULL;
+    n = xmcf->cache_valid ? xmcf->cache_valid->nelts : 0;
+
+    for (i = 0; i < n; i++) {
+        h = NULL;
+
+        for (hk = xmcf->handlers.elts;
+             hk < (ngx_hash_key_t *) xmcf->handlers.elts
+                  + xmcf->handlers.nelts;
+             hk++)
+        {
+            if (hk->key.len == cv[i].name.len
+                && ngx_strncmp(hk->key.data, cv[i].name.data,
+                               cv[i].name.len)
+                   == 0)
+            {
+                h = hk->value;
+                break;
             }
         }
+
+        if (h == NULL || !(h->flags & NGX_XCGI_CACHEABLE)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "xcgi handler \"%V\" is %s", &cv[i].name,
+                               h ? "not cacheable" : "unknown");
+            return NGX_ERROR;
+        }
+
+        h->valid = cv[i].valid;
     }
 
+    /* a bucket holds at least the longest name, as ngx_hash_elt_t */
+
+    len = 0;
+    hk = xmcf->handlers.elts;
+
+    for (i = 0; i < xmcf->handlers.nelts; i++) {
+        len = ngx_max(len, hk[i].key.len);
+    }
+
+    len = 2 * sizeof(void *) + ngx_align(len + 2, sizeof(void *));
+
+    hash.hash = &xmcf->handlers_hash;
+    hash.key = ngx_hash_key;
+    hash.max_size = NGX_XCGI_HANDLERS_HASH_MAX_SIZE;
+    hash.bucket_size = ngx_align(ngx_max(64, len), ngx_cacheline_size);
+    hash.name = "xcgi_handlers_hash";
+    hash.pool = cf->pool;
+    hash.temp_pool = NULL;
+
+    return ngx_hash_init(&hash, xmcf->handlers.elts, xmcf->handlers.nelts);
 }
 
-void ngx_xcgi_private_init(void)
+/*
+ * The counters are those of the worker serving the request; comparing
+ * them before and after a load run gives e.g. the bytes parsed and the
+ * output blocks allocated per page.  The pool block cache of the worker
+ * is reported as well.
+ */
+
+static int ngx_xcgi_stats_handler(ngx_http_request_t *r, ngx_buf_t *b,
+    int argc, char **argv)
 {
-    for (int i = 0; i < NGX_XCGI_HANDLER_HASH_TABLE_SIZE; i++) {
-        g_xcgi_handler_hash_table[i].data.func = NULL;
-        g_xcgi_handler_hash_table[i].name.data = NULL;
-        g_xcgi_handler_hash_table[i].name.len = 0;
-        g_xcgi_handler_hash_table[i].next = &g_xcgi_handler_hash_table[i];
-        g_xcgi_handler_hash_table[i].prev = &g_xcgi_handler_hash_table[i];
+    ngx_xcgi_json_t             js;
+    ngx_xcgi_cache_t           *cache;
+    ngx_xcgi_stats_t           *st = &ngx_xcgi_stats;
+    ngx_http_xcgi_main_conf_t  *xmcf;
+
+    ngx_xcgi_json_init(&js, r, b);
+    ngx_xcgi_json_object(&js);
+
+    ngx_xcgi_json_key(&js, "pid");
+    ngx_xcgi_json_int(&js, ngx_pid);
+    ngx_xcgi_json_key(&js, "pages");
+    ngx_xcgi_json_uint(&js, st->pages);
+    ngx_xcgi_json_key(&js, "template_hits");
+    ngx_xcgi_json_uint(&js, st->template_hits);
+    ngx_xcgi_json_key(&js, "templates");
+    ngx_xcgi_json_uint(&js, st->templates);
+    ngx_xcgi_json_key(&js, "parsed");
+    ngx_xcgi_json_int(&js, st->parsed);
+    ngx_xcgi_json_key(&js, "tags");
+    ngx_xcgi_json_uint(&js, st->tags);
+    ngx_xcgi_json_key(&js, "tags_copied");
+    ngx_xcgi_json_uint(&js, st->tags_copied);
+    ngx_xcgi_json_key(&js, "calls");
+    ngx_xcgi_json_uint(&js, st->calls);
+    ngx_xcgi_json_key(&js, "cache_hits");
+    ngx_xcgi_json_uint(&js, st->cache_hits);
+    ngx_xcgi_json_key(&js, "blocks");
+    ngx_xcgi_json_uint(&js, st->blocks);
+    ngx_xcgi_json_key(&js, "blocks_reused");
+    ngx_xcgi_json_uint(&js, st->blocks_reused);
+    ngx_xcgi_json_key(&js, "forms");
+    ngx_xcgi_json_uint(&js, st->forms);
+    ngx_xcgi_json_key(&js, "form_bytes");
+    ngx_xcgi_json_int(&js, st->form_bytes);
+
+    xmcf = ngx_http_get_module_main_conf(r, ngx_http_xcgi_filter_module);
+
+    if (xmcf->cache_zone) {
+        cache = xmcf->cache_zone->data;
+
+        /* counted by all workers */
+        ngx_xcgi_json_key(&js, "cache_contended");
+        ngx_xcgi_json_uint(&js, cache->shpool->contended);
     }
 
-    ngx_xcgi_register_user_handlers();
+    ngx_xcgi_json_key(&js, "pool_cache");
+    ngx_xcgi_json_object(&js);
+    ngx_xcgi_json_key(&js, "hits");
+    ngx_xcgi_json_uint(&js, ngx_pool_cache_stat.hits);
+    ngx_xcgi_json_key(&js, "misses");
+    ngx_xcgi_json_uint(&js, ngx_pool_cache_stat.misses);
+    ngx_xcgi_json_key(&js, "cached");
+    ngx_xcgi_json_uint(&js, ngx_pool_cache_stat.cached);
+    ngx_xcgi_json_key(&js, "dropped");
+    ngx_xcgi_json_uint(&js, ngx_pool_cache_stat.dropped);
+    ngx_xcgi_json_key(&js, "size");
+    ngx_xcgi_json_uint(&js, ngx_pool_cache_stat.size);
+    ngx_xcgi_json_object_end(&js);
+
+    ngx_xcgi_json_object_end(&js);
+
+    return ngx_xcgi_json_done(&js);
 }
-
@@ -0,0 +1,459 @@
+/*
+ * Copyright (C) lurenfu@qq.com
+ */
+
+#include "ngx_xcgi_private.h"
+
+
+/*
+ * Handler output is formatted directly into blocks of "xcgi_buffer_size"
+ * bytes which are linked into a chain as the output grows, so nothing is
+ * ever copied twice.  The blocks are taken from a per-worker free list and
+ * returned to it when the request is finished.  Strings and buffers owned
+ * by the handler may be linked into the chain as is.
+ *
+ * The buffer handed to a handler is the head of its chain and is embedded
+ * in the writer, so the ngx_xcgi_write*() functions find the writer by
+ * the buffer tag.
+ */
+
+struct ngx_xcgi_block_s {
+    ngx_xcgi_block_t        *next;
+    size_t                   size;
+};
+
+
+/* the free list keeps blocks of a single size, the most recently used */
+
+typedef struct {
+    ngx_xcgi_block_t        *free;
+    ngx_uint_t               nfree;
+    size_t                   size;
+} ngx_xcgi_writer_cache_t;
+
+
+static u_char *ngx_xcgi_writer_block(ngx_xcgi_writer_t *w);
+static ngx_buf_t *ngx_xcgi_writer_tail(ngx_xcgi_writer_t *w, size_t size);
+static ngx_int_t ngx_xcgi_writer_link(ngx_xcgi_writer_t *w, ngx_buf_t *b);
+static void ngx_xcgi_writer_close(ngx_xcgi_writer_t *w);
+static void ngx_xcgi_writer_cleanup(void *data);
+
+
+static ngx_xcgi_writer_cache_t  ngx_xcgi_writer_cache;
+
+#define ngx_xcgi_writer_tag     ((ngx_buf_tag_t) &ngx_xcgi_writer_cache)
+
+
+ngx_int_t
+ngx_xcgi_writer_init(ngx_http_request_t *r, ngx_xcgi_writer_t *w, size_t size)
+{
+    ngx_pool_cleanup_t  *cln;
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_xcgi_writer_cleanup;
+    cln->data = w;
+
+    ngx_memzero(w, sizeof(ngx_xcgi_writer_t));
+
+    w->request = r;
+    w->block_size = size;
+
+    return NGX_OK;
+}
+
+
+ngx_buf_t *
+ngx_xcgi_writer_begin(ngx_xcgi_writer_t *w)
+{
+    ngx_buf_t  *b;
+
+    if (w->end - w->pos < NGX_XCGI_WRITE_MIN
+        && ngx_xcgi_writer_block(w) == NULL)
+    {
+        return NULL;
+    }
+
+    b = &w->buf;
+
+    ngx_memzero(b, sizeof(ngx_buf_t));
+
+    b->start = w->pos;
+    b->pos = w->pos;
+    b->last = w->pos;
+    b->end = w->end;
+    b->temporary = 1;
+    b->tag = ngx_xcgi_writer_tag;
+
+    w->tail = b;
+    w->out = NULL;
+    w->last = &w->out;
+
+    return b;
+}
+
+
+ngx_int_t
+ngx_xcgi_writer_end(ngx_xcgi_writer_t *w, ngx_chain_t ***last)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl, *next;
+
+    ngx_xcgi_writer_close(w);
+
+    if (w->buf.last != w->buf.pos) {
+        b = ngx_alloc_buf(w->request->pool);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        *b = w->buf;
+        b->tag = (ngx_buf_tag_t) &ngx_http_xcgi_filter_module;
+
+        cl = ngx_alloc_chain_link(w->request->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl->buf = b;
+        cl->next = w->out;
+        w->out = cl;
+    }
+
+    /* skip tails left empty, the writer filter does not expect them */
+
+    for (cl = w->out; cl; cl = next) {
+        next = cl->next;
+
+        if (ngx_buf_size(cl->buf) == 0 && !ngx_buf_special(cl->buf)) {
+            continue;
+        }
+
+        cl->next = NULL;
+        **last = cl;
+        *last = &cl->next;
+    }
+
+    w->tail = NULL;
+    w->out = NULL;
+    w->last = &w->out;
+
+    return NGX_OK;
+}
+
+
+int
+ngx_xcgi_write(ngx_http_request_t *r, ngx_buf_t *b, char *fmt, ...)
+{
+    int                 n;
+    size_t              size;
+    va_list             args;
+    ngx_buf_t          *t;
+    ngx_xcgi_writer_t  *w;
+
+    if (b->tag != ngx_xcgi_writer_tag) {
+
+        /* a buffer not created by the writer, the output is truncated */
+
+        size = b->end - b->last;
+
+        if (size == 0) {
+            return 0;
+        }
+
+        va_start(args, fmt);
+        n = vsnprintf((char *) b->last, size, fmt, args);
+        va_end(args);
+
+        if (n < 0) {
+            return n;
+        }
+
+        if ((size_t) n >= size) {
+            n = size - 1;
+        }
+
+        b->last += n;
+
+        return n;
+    }
+
+    w = (ngx_xcgi_writer_t *) b;
+    t = w->tail;
+
+    size = t ? (size_t) (t->end - t->last) : 0;
+
+    va_start(args, fmt);
+    n = vsnprintf(size ? (char *) t->last : NULL, size, fmt, args);
+    va_end(args);
+
+    if (n < 0) {
+        return n;
+    }
+
+    if ((size_t) n < size) {
+        t->last += n;
+        return n;
+    }
+
+    /* vsnprintf() also writes the terminating null */
+
+    t = ngx_xcgi_writer_tail(w, n + 1);
+    if (t == NULL) {
+        return -1;
+    }
+
+    va_start(args, fmt);
+    (void) vsnprintf((char *) t->last, n + 1, fmt, args);
+    va_end(args);
+
+    t->last += n;
+
+    return n;
+}
+
+
+int
+ngx_xcgi_write_str(ngx_http_request_t *r, ngx_buf_t *b, u_char *data,
+    size_t len)
+{
+    ngx_buf_t          *t;
+    ngx_xcgi_writer_t  *w;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    if (b->tag != ngx_xcgi_writer_tag) {
+        len = ngx_min(len, (size_t) (b->end - b->last));
+        b->last = ngx_cpymem(b->last, data, len);
+        return len;
+    }
+
+    w = (ngx_xcgi_writer_t *) b;
+    t = w->tail;
+
+    if (len <= NGX_XCGI_WRITE_COPY_MAX
+        && t && len <= (size_t) (t->end - t->last))
+    {
+        t->last = ngx_cpymem(t->last, data, len);
+        return len;
+    }
+
+    t = ngx_calloc_buf(r->pool);
+    if (t == NULL) {
+        return -1;
+    }
+
+    t->start = data;
+    t->pos = data;
+    t->last = data + len;
+    t->end = data + len;
+    t->memory = 1;
+
+    if (ngx_xcgi_writer_link(w, t) != NGX_OK) {
+        return -1;
+    }
+
+    return len;
+}
+
+
+int
+ngx_xcgi_write_buf(ngx_http_request_t *r, ngx_buf_t *b, ngx_buf_t *buf)
+{
+    off_t               size;
+    ngx_xcgi_writer_t  *w;
+
+    size = ngx_buf_size(buf);
+
+    if (b->tag != ngx_xcgi_writer_tag) {
+        if (!ngx_buf_in_memory(buf)) {
+            return -1;
+        }
+
+        return ngx_xcgi_write_str(r, b, buf->pos, size);
+    }
+
+    w = (ngx_xcgi_writer_t *) b;
+
+    if (ngx_xcgi_writer_link(w, buf) != NGX_OK) {
+        return -1;
+    }
+
+    return size;
+}
+
+
+/*
+ * Returns the buffer to write at least size bytes to at its last, or
+ * NULL if a buffer not created by the writer is full.
+ */
+
+ngx_buf_t *
+ngx_xcgi_write_reserve(ngx_http_request_t *r, ngx_buf_t *b, size_t size)
+{
+    ngx_buf_t          *t;
+    ngx_xcgi_writer_t  *w;
+
+    if (b->tag != ngx_xcgi_writer_tag) {
+        return (size_t) (b->end - b->last) >= size ? b : NULL;
+    }
+
+    w = (ngx_xcgi_writer_t *) b;
+    t = w->tail;
+
+    if (t && (size_t) (t->end - t->last) >= size) {
+        return t;
+    }
+
+    return ngx_xcgi_writer_tail(w, size);
+}
+
+
+static u_char *
+ngx_xcgi_writer_block(ngx_xcgi_writer_t *w)
+{
+    ngx_xcgi_block_t  *blk;
+
+    blk = ngx_xcgi_writer_cache.free;
+
+    if (blk && ngx_xcgi_writer_cache.size == w->block_size) {
+        ngx_xcgi_writer_cache.free = blk->next;
+        ngx_xcgi_writer_cache.nfree--;
+        ngx_xcgi_stats.blocks_reused++;
+
+    } else {
+        blk = ngx_alloc(sizeof(ngx_xcgi_block_t) + w->block_size,
+                        w->request->connection->log);
+        if (blk == NULL) {
+            return NULL;
+        }
+
+        blk->size = w->block_size;
+        ngx_xcgi_stats.blocks++;
+    }
+
+    blk->next = w->blocks;
+    w->blocks = blk;
+
+    w->pos = (u_char *) (blk + 1);
+    w->end = w->pos + w->block_size;
+
+    return w->pos;
+}
+
+
+static ngx_buf_t *
+ngx_xcgi_writer_tail(ngx_xcgi_writer_t *w, size_t size)
+{
+    ngx_buf_t  *b;
+
+    ngx_xcgi_writer_close(w);
+
+    if (size > w->block_size) {
+        b = ngx_create_temp_buf(w->request->pool, size);
+        if (b == NULL) {
+            return NULL;
+        }
+
+    } else {
+        if ((size_t) (w->end - w->pos) < size
+            && ngx_xcgi_writer_block(w) == NULL)
+        {
+            return NULL;
+        }
+
+        b = ngx_calloc_buf(w->request->pool);
+        if (b == NULL) {
+            return NULL;
+        }
+
+        b->start = w->pos;
+        b->pos = w->pos;
+        b->last = w->pos;
+        b->end = w->end;
+        b->temporary = 1;
+    }
+
+    b->tag = (ngx_buf_tag_t) &ngx_http_xcgi_filter_module;
+
+    if (ngx_xcgi_writer_link(w, b) != NGX_OK) {
+        return NULL;
+    }
+
+    w->tail = b;
+
+    return b;
+}
+
+
+static ngx_int_t
+ngx_xcgi_writer_link(ngx_xcgi_writer_t *w, ngx_buf_t *b)
+{
+    ngx_chain_t  *cl;
+
+    ngx_xcgi_writer_close(w);
+
+    cl = ngx_alloc_chain_link(w->request->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+    *w->last = cl;
+    w->last = &cl->next;
+
+    /* the next write starts a new tail */
+
+    w->tail = NULL;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_xcgi_writer_close(ngx_xcgi_writer_t *w)
+{
+    ngx_buf_t  *t;
+
+    t = w->tail;
+
+    if (t && t->temporary && t->end == w->end) {
+        w->pos = t->last;
+    }
+}
+
+
+static void
+ngx_xcgi_writer_cleanup(void *data)
+{
+    ngx_xcgi_writer_t  *w = data;
+
+    ngx_xcgi_block_t  *blk, *next;
+
+    for (blk = w->blocks; blk; blk = next) {
+        next = blk->next;
+
+        if (ngx_xcgi_writer_cache.nfree == 0) {
+            ngx_xcgi_writer_cache.size = blk->size;
+        }
+
+        if (ngx_xcgi_writer_cache.nfree >= NGX_XCGI_WRITE_FREE_MAX
+            || ngx_xcgi_writer_cache.size != blk->size)
+        {
+            ngx_free(blk);
+            continue;
+        }
+
+        blk->next = ngx_xcgi_writer_cache.free;
+        ngx_xcgi_writer_cache.free = blk;
+        ngx_xcgi_writer_cache.nfree++;
+    }
+
+    w->blocks = NULL;
+}